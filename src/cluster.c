@@ -0,0 +1,310 @@
+// cluster.c
+
+#include "mt_log.h"
+#include "public.h"
+#include "timer_set.h"
+#include "pathops.h"
+#include "cluster.h"
+
+extern timer_set_t * timer_sets[MAX_WORKERS+1];
+extern char connect_ip[MAX_IP_LEN+1];
+extern uint16_t connect_port;
+
+struct vnode
+{
+    uint32_t hash;
+    uint16_t node; // nodes[] 的下标
+};
+
+struct cluster_map
+{
+    int refs;      // curr_map 一个，正在查表的线程各一个
+    int self;      // 本节点在 nodes[] 中的下标，不在表中时为 -1
+    int nr_nodes;
+    int nr_vnodes;
+    cluster_node_t nodes[MAX_CLUSTER_NODES];
+    struct vnode vnodes[0]; // 按 hash 从小到大排列
+};
+
+// 分布表只由主线程加载和替换，工作线程只读。查表时在锁内取得当前的表并增加引用
+// 计数，替换下来的表由最后一个使用它的线程释放
+static struct cluster_map * curr_map = NULL;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char * map_path = NULL;
+static struct stat map_stat;
+
+// crc32 的低位分布不够均匀，再混合一次
+static uint32_t mix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t hash_key(const char * s, int len)
+{
+    return mix32(crc32(s, len));
+}
+
+static int compare_vnode(const void * a, const void * b)
+{
+    const struct vnode * x = (const struct vnode *)a;
+    const struct vnode * y = (const struct vnode *)b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return (int)x->node - (int)y->node;
+}
+
+static int is_self_addr(uint32_t ip, uint16_t port)
+{
+    struct in_addr addr;
+    if (port == local_port && inet_aton(local_ip, &addr) == 1 && addr.s_addr == ip) {
+        return 1;
+    }
+    if (port == connect_port && inet_aton(connect_ip, &addr) == 1 && addr.s_addr == ip) {
+        return 1;
+    }
+    return 0;
+}
+
+// 解析一行 "id ip:port [weight]"，空行和注释行返回 0，成功返回 1，出错返回 -1
+static int parse_node(char * line, cluster_node_t * node)
+{
+    char * comment = strchr(line, '#');
+    if (comment) {
+        *comment = '\0';
+    }
+
+    char id[32], addr[64];
+    int weight = 1;
+    int n = sscanf(line, "%31s %63s %d", id, addr, &weight);
+    if (n <= 0) {
+        return 0;
+    }
+    if (n < 2 || weight < 1 || weight > 16) {
+        return -1;
+    }
+
+    char * colon = strchr(addr, ':');
+    if (!colon) {
+        return -1;
+    }
+    *colon = '\0';
+    char * end = NULL;
+    unsigned long port = strtoul(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || port == 0 || port > 65535) {
+        return -1;
+    }
+    struct in_addr ip;
+    if (inet_pton(AF_INET, addr, &ip) != 1) {
+        return -1;
+    }
+    unsigned long node_id = strtoul(id, &end, 0);
+    if (*end != '\0') {
+        return -1;
+    }
+
+    node->id = (uint32_t)node_id;
+    node->ip = ip.s_addr;
+    node->port = (uint16_t)port;
+    node->weight = (uint16_t)weight;
+    return 1;
+}
+
+static struct cluster_map * load_cluster_map(const char * path)
+{
+    FILE * fp = fopen(path, "r");
+    if (!fp) {
+        log_error("open cluster map %s failed: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    cluster_node_t nodes[MAX_CLUSTER_NODES];
+    int nr_nodes = 0;
+    int nr_vnodes = 0;
+    int lineno = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        lineno = lineno + 1;
+        cluster_node_t node;
+        int ret = parse_node(line, &node);
+        if (ret == 0) {
+            continue;
+        }
+        if (ret < 0) {
+            log_error("cluster map %s line %d: invalid node", path, lineno);
+            fclose(fp);
+            return NULL;
+        }
+        int i;
+        for (i = 0; i < nr_nodes; i++) {
+            if (nodes[i].ip == node.ip && nodes[i].port == node.port) {
+                break;
+            }
+        }
+        if (i < nr_nodes) {
+            log_error("cluster map %s line %d: duplicate node", path, lineno);
+            fclose(fp);
+            return NULL;
+        }
+        if (nr_nodes == MAX_CLUSTER_NODES) {
+            log_error("cluster map %s: too many nodes, max %d", path, MAX_CLUSTER_NODES);
+            fclose(fp);
+            return NULL;
+        }
+        nodes[nr_nodes] = node;
+        nr_nodes = nr_nodes + 1;
+        nr_vnodes = nr_vnodes + node.weight * CLUSTER_VNODES;
+    }
+    fclose(fp);
+
+    if (nr_nodes == 0) {
+        log_error("cluster map %s: no node", path);
+        return NULL;
+    }
+
+    struct cluster_map * m = (struct cluster_map *)malloc(
+        sizeof(struct cluster_map) + nr_vnodes * sizeof(struct vnode));
+    if (!m) {
+        log_error("malloc cluster map with %d vnodes failed", nr_vnodes);
+        return NULL;
+    }
+    m->refs = 1;
+    m->self = -1;
+    m->nr_nodes = nr_nodes;
+    m->nr_vnodes = 0;
+    memcpy(m->nodes, nodes, nr_nodes * sizeof(cluster_node_t));
+
+    // 虚拟节点的位置只由地址决定，增删一个 sgw 只影响它自己负责的那部分 studyid
+    int i, j;
+    for (i = 0; i < nr_nodes; i++) {
+        cluster_node_t * node = &m->nodes[i];
+        char ip_str[MAX_IP_LEN+1];
+        inet_ntop(AF_INET, &node->ip, ip_str, sizeof(ip_str));
+        for (j = 0; j < node->weight * CLUSTER_VNODES; j++) {
+            char key[64];
+            int len = snprintf(key, sizeof(key), "%s:%u#%d", ip_str, node->port, j);
+            m->vnodes[m->nr_vnodes].hash = hash_key(key, len);
+            m->vnodes[m->nr_vnodes].node = (uint16_t)i;
+            m->nr_vnodes = m->nr_vnodes + 1;
+        }
+        if (is_self_addr(node->ip, node->port)) {
+            m->self = i;
+        }
+    }
+    qsort(m->vnodes, m->nr_vnodes, sizeof(struct vnode), compare_vnode);
+
+    if (m->self < 0) {
+        log_warning("cluster map %s: this sgw %s:%u is not in the map",
+                    path, local_ip, local_port);
+    }
+    log_info("cluster map %s loaded: %d nodes, %d vnodes", path, nr_nodes, m->nr_vnodes);
+    return m;
+}
+
+static void put_cluster_map(struct cluster_map * m)
+{
+    if (m && __sync_sub_and_fetch(&m->refs, 1) == 0) {
+        free(m);
+    }
+}
+
+static void publish_cluster_map(struct cluster_map * m)
+{
+    pthread_mutex_lock(&map_lock);
+    struct cluster_map * old = curr_map;
+    curr_map = m;
+    pthread_mutex_unlock(&map_lock);
+    put_cluster_map(old);
+}
+
+static int is_same_file(const struct stat * a, const struct stat * b)
+{
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// 文件被修改或者替换（rename）后重新加载，加载失败时继续使用原来的表
+static int on_check_cluster_map(void * timer)
+{
+    (void) timer;
+
+    struct stat st;
+    if (stat(map_path, &st) != 0 || is_same_file(&st, &map_stat)) {
+        return 0;
+    }
+    map_stat = st;
+
+    struct cluster_map * m = load_cluster_map(map_path);
+    if (m) {
+        publish_cluster_map(m);
+    } else {
+        log_error("reload cluster map %s failed, keep the old one", map_path);
+    }
+    return 0;
+}
+
+int init_cluster_map(const char * path)
+{
+    map_path = path;
+    if (stat(path, &map_stat) != 0) {
+        log_error("stat cluster map %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+    struct cluster_map * m = load_cluster_map(path);
+    if (!m) {
+        return -1;
+    }
+    publish_cluster_map(m);
+
+    user_timer_t t;
+    memset(&t, 0, sizeof(user_timer_t));
+    t.loop_cnt = 0xFFFFFFFF;
+    t.hold_time = CLUSTER_CHECK_INTERVAL;
+    t.call_back = on_check_cluster_map;
+    if (create_one_timer(timer_sets[0], &t) <= 0) {
+        log_error("create cluster map timer failed");
+        return -1;
+    }
+    return 0;
+}
+
+int lookup_cluster_node(const char * studyid, cluster_node_t * owner)
+{
+    pthread_mutex_lock(&map_lock);
+    struct cluster_map * m = curr_map;
+    if (m) {
+        __sync_fetch_and_add(&m->refs, 1);
+    }
+    pthread_mutex_unlock(&map_lock);
+    if (!m) {
+        return -1;
+    }
+
+    // 找到第一个 hash 不小于 key 的虚拟节点，超过最大值时回到环的起点
+    uint32_t h = hash_key(studyid, strlen(studyid));
+    int lo = 0, hi = m->nr_vnodes;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (m->vnodes[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == m->nr_vnodes) {
+        lo = 0;
+    }
+
+    int index = m->vnodes[lo].node;
+    *owner = m->nodes[index];
+    int ret = index == m->self ? 1 : 0;
+    put_cluster_map(m);
+    return ret;
+}
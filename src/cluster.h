@@ -0,0 +1,45 @@
+// cluster.h
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdint.h>
+
+// 集群分布表中最多的 sgw 个数
+#ifndef MAX_CLUSTER_NODES
+#define MAX_CLUSTER_NODES (64)
+#endif
+
+// 权重为 1 的 sgw 在一致性哈希环上的虚拟节点个数
+#ifndef CLUSTER_VNODES
+#define CLUSTER_VNODES (160)
+#endif
+
+// 检查分布表文件是否更新的间隔，单位是毫秒
+#ifndef CLUSTER_CHECK_INTERVAL
+#define CLUSTER_CHECK_INTERVAL (5000)
+#endif
+
+// 开始上传、下载的请求不应该由本节点处理时，应答中的响应码，task_info 中填写负
+// 责的 sgw。只有协议次版本号不小于 CLUSTER_REDIRECT_MINOR 的客户端能够处理重
+// 定向，其它客户端仍然由本节点转发。
+#define CLUSTER_REDIRECT_CODE  (302)
+#define CLUSTER_REDIRECT_MINOR (1)
+
+typedef struct cluster_node_
+{
+    uint32_t id;     // sgw 的 ID
+    uint32_t ip;     // 网络字节序
+    uint16_t port;   // 主机字节序
+    uint16_t weight; // 权重，决定虚拟节点的个数
+} cluster_node_t;
+
+// 加载分布表文件，并在主线程创建定时器，文件更新（例如由 asm 推送）后自动重新
+// 加载。文件每行一个 sgw：id ip:port [weight]，# 之后是注释。
+int init_cluster_map(const char * path);
+
+// 按一致性哈希找到负责 studyid 的 sgw，复制到 owner 中。返回 1 表示就是本节点，
+// 0 表示其它节点，-1 表示没有加载分布表。可以在任意线程调用。
+int lookup_cluster_node(const char * studyid, cluster_node_t * owner);
+
+#endif // CLUSTER_H
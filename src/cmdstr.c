@@ -32,6 +32,9 @@ const char * command_string(uint32_t c)
     case CMD_MIGRATION_FINISHED_RSP: return "CMD_MIGRATION_FINISHED_RSP";
     case CMD_MIGRATION_CANCEL_REQ: return "CMD_MIGRATION_CANCEL_REQ";
     case CMD_MIGRATION_CANCEL_RSP: return "CMD_MIGRATION_CANCEL_RSP";
+    case CMD_TRUNK_OPEN_REQ: return "CMD_TRUNK_OPEN_REQ";
+    case CMD_TRUNK_OPEN_RSP: return "CMD_TRUNK_OPEN_RSP";
+    case CMD_TRUNK_RESET_REQ: return "CMD_TRUNK_RESET_REQ";
     default: return "UNKNOWN";
     }
 }
@@ -15,6 +15,13 @@
 #define USE_TLS "off"
 #endif
 
+#define IO_URING
+#ifdef IO_URING
+#define USE_IO_URING "on"
+#else
+#define USE_IO_URING "off"
+#endif
+
 #ifndef MS_PER_TICK
 #define MS_PER_TICK (1000) /* 单位是毫秒 */
 #endif
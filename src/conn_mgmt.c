@@ -8,11 +8,19 @@ extern SSL_CTX *ssl_ctx;
 #endif
 #include "mt_log.h"
 #include "public.h"
+#include "timer_set.h"
 #include "conn_mgmt.h"
+#include "conn_pool.h"
+#include "relay.h"
+#include "trunk.h"
+#include "stats.h"
+#include "iopool.h"
+#include "prefetch.h"
+
+extern timer_set_t * timer_sets[MAX_WORKERS+1];
+extern int get_thread_id(void);
 
 
-extern int backend_cnt;
-
 static int setrcvbuf(int s, int v)
 {
     socklen_t len = sizeof(v);
@@ -39,6 +47,254 @@ static int setsndbuf(int s, int v)
     }
 }
 
+static int on_connect_timeout(void * timer)
+{
+    user_timer_t * t = (user_timer_t *)timer;
+    events_poll_t * events_poll = (events_poll_t *)t->pv_param1;
+    int sock_fd = (int)(intptr_t)t->pv_param2;
+    conn_info_t * conn_info = &conns_info[sock_fd];
+
+    if (conn_info->sock_fd == sock_fd &&
+        conn_info->timer_id == t->timer_id &&
+        conn_info->status == CONN_STATUS_CONNECTING)
+    {
+        log_error("sock_fd:%d connect to peer{%s:%u} timeout after %dms",
+                  sock_fd, conn_info->peer_ip, conn_info->peer_port, CONNECT_TIMEOUT);
+        // 定时器运行结束后由定时器集合自己释放，这里不能再销毁
+        conn_info->timer_id = 0;
+        close_tcp_conn(events_poll, sock_fd);
+    }
+    return 0;
+}
+
+// 连接建立和 TLS 握手共用一个定时器，两者不会同时进行
+static int start_conn_timer(events_poll_t * events_poll, conn_info_t * conn_info,
+                            uint64_t hold_time, call_back_t call_back)
+{
+    user_timer_t t;
+    memset(&t, 0, sizeof(user_timer_t));
+    t.loop_cnt = 1;
+    t.hold_time = hold_time;
+    t.call_back = call_back;
+    t.pv_param1 = events_poll;
+    t.pv_param2 = (void *)(intptr_t)conn_info->sock_fd;
+    int timer_id = create_one_timer(timer_sets[conn_info->thread_id], &t);
+    if (timer_id > 0)
+    {
+        conn_info->timer_id = timer_id;
+        return 0;
+    }
+    else
+    {
+        log_error("create timer for sock_fd:%d failed", conn_info->sock_fd);
+        return -1;
+    }
+}
+
+static void stop_conn_timer(conn_info_t * conn_info)
+{
+    if (conn_info->timer_id > 0)
+    {
+        destroy_one_timer(timer_sets[conn_info->thread_id], conn_info->timer_id);
+        conn_info->timer_id = 0;
+    }
+}
+
+#ifdef TLS
+static int on_handshake_timeout(void * timer)
+{
+    user_timer_t * t = (user_timer_t *)timer;
+    events_poll_t * events_poll = (events_poll_t *)t->pv_param1;
+    int sock_fd = (int)(intptr_t)t->pv_param2;
+    conn_info_t * conn_info = &conns_info[sock_fd];
+
+    if (conn_info->sock_fd == sock_fd &&
+        conn_info->timer_id == t->timer_id &&
+        conn_info->status == CONN_STATUS_HANDSHAKING)
+    {
+        log_error("sock_fd:%d tls handshake with peer{%s:%u} timeout after %dms",
+                  sock_fd, conn_info->peer_ip, conn_info->peer_port, TLS_HANDSHAKE_TIMEOUT);
+        conn_info->timer_id = 0;
+        my_stats()->tls_failures += 1;
+        close_tcp_conn(events_poll, sock_fd);
+    }
+    return 0;
+}
+
+int start_tls_handshake(events_poll_t * events_poll, conn_info_t * conn_info)
+{
+    return start_conn_timer(events_poll, conn_info, TLS_HANDSHAKE_TIMEOUT,
+                            on_handshake_timeout);
+}
+
+int on_tls_handshake(events_poll_t * events_poll, conn_info_t * conn_info)
+{
+    int sock_fd = conn_info->sock_fd;
+
+    ERR_clear_error();
+    int ret = SSL_do_handshake(conn_info->ssl);
+    if (ret == 1)
+    {
+        stop_conn_timer(conn_info);
+        conn_info->status = CONN_STATUS_CONNECTED;
+        if (SSL_session_reused(conn_info->ssl))
+        {
+            my_stats()->tls_resumed += 1;
+        }
+        else
+        {
+            my_stats()->tls_full += 1;
+        }
+#ifdef SSL_OP_ENABLE_KTLS
+        // 内核接管了哪个方向的加解密，由协商的算法和内核的 tls 模块决定
+        if (BIO_get_ktls_send(SSL_get_wbio(conn_info->ssl)))
+        {
+            conn_info->flags |= CONN_FLAG_KTLS_TX;
+            my_stats()->tls_ktls += 1;
+        }
+        if (BIO_get_ktls_recv(SSL_get_rbio(conn_info->ssl)))
+        {
+            conn_info->flags |= CONN_FLAG_KTLS_RX;
+        }
+#endif
+        if (get_ring_data_size(conn_info->send) == 0)
+        {
+            stop_monitoring_send(events_poll, sock_fd);
+        }
+        return 1;
+    }
+
+    int err = SSL_get_error(conn_info->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ)
+    {
+        stop_monitoring_send(events_poll, sock_fd);
+        return 0;
+    }
+    else if (err == SSL_ERROR_WANT_WRITE)
+    {
+        start_monitoring_send(events_poll, sock_fd);
+        return 0;
+    }
+    else
+    {
+        unsigned long e = ERR_get_error();
+        log_error("sock_fd:%d tls handshake with peer{%s:%u} failed: %s",
+                  sock_fd, conn_info->peer_ip, conn_info->peer_port,
+                  e ? ERR_reason_error_string(e) : strerror(errno));
+        my_stats()->tls_failures += 1;
+        close_tcp_conn(events_poll, sock_fd);
+        return -1;
+    }
+}
+
+// 把 SSL_write()/SSL_read() 的结果转换成和 send()/recv() 一样的返回值和 errno
+static int ssl_result(conn_info_t * conn_info, int ret)
+{
+    if (ret > 0)
+    {
+        return ret;
+    }
+    int err = SSL_get_error(conn_info->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    else if (err == SSL_ERROR_ZERO_RETURN)
+    {
+        return 0;
+    }
+    else if (err == SSL_ERROR_SYSCALL)
+    {
+        if (errno == 0)
+        {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+    else
+    {
+        unsigned long e = ERR_get_error();
+        log_error("sock_fd:%d ssl error: %s", conn_info->sock_fd,
+                  e ? ERR_reason_error_string(e) : "unknown");
+        errno = EPROTO;
+        return -1;
+    }
+}
+#endif
+
+// 只有客户端连接使用 TLS，本节点主动建立的连接（asm、下一跳 sgw）都是明文的
+int conn_send(conn_info_t * conn_info, uint8_t * data, int len)
+{
+#ifdef TLS
+    if (conn_info->ssl)
+    {
+        ERR_clear_error();
+        return ssl_result(conn_info, SSL_write(conn_info->ssl, data, len));
+    }
+#endif
+    return send(conn_info->sock_fd, data, len, 0);
+}
+
+ssize_t conn_sendfile(conn_info_t * conn_info, int in_fd, off_t offset, size_t len)
+{
+#ifdef TLS
+#ifdef SSL_OP_ENABLE_KTLS
+    if (conn_info->ssl && (conn_info->flags & CONN_FLAG_KTLS_TX))
+    {
+        ERR_clear_error();
+        ossl_ssize_t n = SSL_sendfile(conn_info->ssl, in_fd, offset, len, 0);
+        return n >= 0 ? n : ssl_result(conn_info, (int)n);
+    }
+#endif
+    if (conn_info->ssl)
+    {
+        // 没有发送成功的部分下次从同一个位置重新读出，内容不变，满足 SSL_write()
+        // 重试的要求
+        uint8_t buffer[MAX_TCP_BUF];
+        if (len > sizeof(buffer))
+        {
+            len = sizeof(buffer);
+        }
+        ssize_t n = pread(in_fd, buffer, len, offset);
+        if (n <= 0)
+        {
+            if (n == 0)
+            {
+                errno = EIO; // 文件在下载期间被截短
+            }
+            return -1;
+        }
+        return conn_send(conn_info, buffer, (int)n);
+    }
+#endif
+    return sendfile(conn_info->sock_fd, in_fd, &offset, len);
+}
+
+static int conn_recv(conn_info_t * conn_info, uint8_t * buffer, int len)
+{
+#ifdef TLS
+    if (conn_info->ssl)
+    {
+        // SSL 内部可能还缓存着已经解密的数据，套接字不会再触发可读事件，这里
+        // 一并读出
+        ERR_clear_error();
+        int n = ssl_result(conn_info, SSL_read(conn_info->ssl, buffer, len));
+        while (n > 0 && n < len && SSL_pending(conn_info->ssl) > 0)
+        {
+            int more = SSL_read(conn_info->ssl, buffer + n, len - n);
+            if (more <= 0)
+            {
+                break;
+            }
+            n = n + more;
+        }
+        return n;
+    }
+#endif
+    return recv(conn_info->sock_fd, buffer, len, 0);
+}
+
 void tcp_setnonblock(int fd)
 {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -164,60 +420,92 @@ label_reconnect:
         }
     }
 
-    memset(conn_info, 0, sizeof(conn_info_t));
+    clear_conn_info(conn_info);
+    conn_info->sock_fd = sock_fd;
+    conn_info->thread_id = get_thread_id();
+    strcpy(conn_info->peer_ip, peer_ip);
+    conn_info->peer_port = peer_port;
 
     conn_info->recv = create_ring(MAX_RING_DATA_LEN);
     if (conn_info->recv == NULL)
     {
         log_error("create recv ring for sock_fd:%d failed, %s", sock_fd, strerror(errno_cached));
-        close_tcp_conn(events_poll, sock_fd);
+        close_tcp_conn(NULL, sock_fd);
         return -1;
     }
     conn_info->send = create_ring(MAX_RING_DATA_LEN);
     if (conn_info->send == NULL)
     {
         log_error("create send ring for sock_fd:%d failed, %s", sock_fd, strerror(errno_cached));
-        close_tcp_conn(events_poll, sock_fd);
+        close_tcp_conn(NULL, sock_fd);
         return -1;
     }
 
     if (add_to_events_poll(events_poll, sock_fd, EPOLLIN|EPOLLOUT) != 1)
 	{
 		log_error("add sock_fd:%d to events_poll fail, peer{%s:%u}", sock_fd, peer_ip, peer_port);
-        close(sock_fd);
-        log_error("> closed sock_fd:%d", sock_fd);
+        close_tcp_conn(NULL, sock_fd);
 		return -1;
 	}
 
-    if (noblock == 1)
+    if (noblock == 1 && ret_val < 0)
     {
+        // 连接正在建立，完成时套接字可写，由 on_connect_completed() 处理。在此
+        // 之前发送的消息暂存在发送缓冲区中，连接建立后再发送。
         conn_info->status = CONN_STATUS_CONNECTING;
+        if (start_conn_timer(events_poll, conn_info, CONNECT_TIMEOUT,
+                             on_connect_timeout) < 0)
+        {
+            close_tcp_conn(events_poll, sock_fd);
+            return -1;
+        }
     }
     else
     {
         conn_info->status = CONN_STATUS_CONNECTED;
     }
 
-    conn_info->sock_fd = sock_fd;
-    strcpy(conn_info->peer_ip, peer_ip);
-    conn_info->peer_port = peer_port;
-
     // log_info("> open sock_fd:%d, peer %s:%d", sock_fd, peer_ip, peer_port);
     return sock_fd;
 }
 
+// 非阻塞连接的套接字可写（或者出错）时调用，检查连接是否建立成功。失败时关闭
+// 连接，返回 -1
+int on_connect_completed(events_poll_t * events_poll, conn_info_t * conn_info)
+{
+    int sock_fd = conn_info->sock_fd;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    {
+        err = errno;
+    }
+
+    stop_conn_timer(conn_info);
+    if (err == 0)
+    {
+        conn_info->status = CONN_STATUS_CONNECTED;
+        return 0;
+    }
+    else
+    {
+        log_error("sock_fd:%d connect to peer{%s:%u} failed : %s ",
+                  sock_fd, conn_info->peer_ip, conn_info->peer_port, strerror(err));
+        close_tcp_conn(events_poll, sock_fd);
+        return -1;
+    }
+}
+
 extern uint64_t accepts;
 extern uint64_t connections;
 extern uint64_t concurrents[MAX_WORKERS+1];
 
-extern int get_thread_id(void);
-
 void close_tcp_conn(events_poll_t * events_poll, int sock_fd)
 {
     conn_info_t * conn_info = NULL;
     conn_info_t * next_conn_info = NULL;
     int next_sock_fd = -1;
-    int i = 0;
     int tid;
 
     if (sock_fd < 3 || sock_fd >= MAX_CONNS_CNT)
@@ -244,11 +532,34 @@ void close_tcp_conn(events_poll_t * events_poll, int sock_fd)
     conn_info->debug_fd = sock_fd;
     conn_info->close_thread_id = tid;
 
-    if (events_poll != NULL && (conn_info->status == CONN_STATUS_CONNECTING || conn_info->status == CONN_STATUS_CONNECTED))
+    if (events_poll != NULL && (conn_info->status == CONN_STATUS_CONNECTING ||
+                                conn_info->status == CONN_STATUS_HANDSHAKING ||
+                                conn_info->status == CONN_STATUS_CONNECTED))
     {
         delete_from_events_poll(events_poll, sock_fd);
     }
 
+    stop_conn_timer(conn_info);
+    if (conn_info->flags & CONN_FLAG_POOLED)
+    {
+        forget_sgw_conn(sock_fd);
+    }
+
+    if (conn_info->io != NULL)
+    {
+        // I/O 线程还在使用接收缓冲区中的消息和传输状态，交给请求释放
+        cancel_io_job(conn_info);
+    }
+    if (conn_info->pipeline != NULL)
+    {
+        // 还在写入的上传数据使用着传输状态中打开的后端文件
+        cancel_pipelined_io_jobs(conn_info);
+    }
+    if (conn_info->prefetch != NULL)
+    {
+        cancel_prefetch(conn_info);
+    }
+
     if (conn_info->recv != NULL)
     {
         destroy_ring(conn_info->recv);
@@ -265,6 +576,16 @@ void close_tcp_conn(events_poll_t * events_poll, int sock_fd)
         connections = connections - 1;
     }
 
+    if (conn_info->flags & CONN_FLAG_TRUNK)
+    {
+        close_trunk_sessions(events_poll, conn_info);
+    }
+    if (conn_info->sess != NULL)
+    {
+        // 中继连接由其他会话共用，只放弃这个会话
+        detach_trunk_session(events_poll, conn_info);
+    }
+
     if (conn_info->use_proxy == 1)
     {
         next_sock_fd = conn_info->next_sock_fd;
@@ -278,16 +599,29 @@ void close_tcp_conn(events_poll_t * events_poll, int sock_fd)
             close_tcp_conn(events_poll, next_sock_fd);
         }
     }
-    else
+
+    free_relay(conn_info);
+
+#ifdef TLS
+    if (conn_info->ssl != NULL)
     {
-        for (i=0; i<backend_cnt; i++)
+        // 没有发送 close_notify 就释放时，OpenSSL 会把会话从服务端缓存中删除，
+        // 不使用票据的客户端就无法恢复会话。这里只尝试发送一次，不等待对端。
+        if (SSL_is_init_finished(conn_info->ssl))
         {
-            if (conn_info->befiles[i].fd >= 3)
-            {
-                close(conn_info->befiles[i].fd);
-                // log_info("> close backend_fd %d in connection %d", conn_info->befiles [i].fd, conn_info->sock_fd);
-            }
+            (void) SSL_shutdown(conn_info->ssl);
+            ERR_clear_error();
         }
+        SSL_free(conn_info->ssl);
+        conn_info->ssl = NULL;
+    }
+#endif
+
+    if (conn_info->xfer != NULL)
+    {
+        // 关闭传输中打开的后端文件，归还传输状态
+        free_transfer(conn_info->xfer);
+        conn_info->xfer = NULL;
     }
 
     // 设置清空标志，主要是将 sock_fd 设置为 -1，主要是为了在定时器中删除不合法
@@ -413,14 +747,7 @@ int send_message_internal(events_poll_t * events_poll, conn_info_t * conn_info)
     data = &(send_ring->data[send_ring->read]);
 
 label_send:
-#ifdef TLS
-    if(conn_info->peer_type == NODE_TYPE_ASM)
-        send_len = send(conn_info->sock_fd, data, len, 0);
-    else
-        send_len = SSL_write(conn_info->ssl, data, len);
-#else
-    send_len = send(conn_info->sock_fd, data, len, 0);
-#endif
+    send_len = conn_send(conn_info, data, len);
     errno_cached = errno;
 
     //    log_debug("sock_fd:%d len:%d send_len:%d ", conn_info->sock_fd, len, send_len);
@@ -467,9 +794,6 @@ label_send:
 int recv_message_internal(conn_info_t * conn_info, uint8_t * buffer, int want_len)
 {
     int sock_fd = -1;
-#ifdef TLS
-    SSL *ssl;
-#endif
     int recv_len = 0;
     int recv_times = 0;
     int errno_cached = 0;
@@ -482,12 +806,7 @@ int recv_message_internal(conn_info_t * conn_info, uint8_t * buffer, int want_le
     sock_fd = conn_info->sock_fd;
 
 label_recv:
-#ifdef TLS
-    ssl = conn_info->ssl;
-    recv_len = SSL_read(ssl, buffer, want_len);
-#else
-    recv_len = recv(sock_fd, buffer, want_len, 0);
-#endif
+    recv_len = conn_recv(conn_info, buffer, want_len);
     errno_cached = errno;
     if (recv_len > 0) {
         return recv_len;
@@ -532,15 +851,6 @@ int on_new_conn_arrived(int server_fd)
     while (1)
     {
         sock_fd = accept(server_fd, (struct sockaddr *)&peer_address, &address_len);
-#ifdef TLS
-        SSL *ssl;
-        ssl = SSL_new(ssl_ctx);              /* get new SSL state with context */
-        SSL_set_fd(ssl, sock_fd);
-        if (SSL_accept(ssl) == -1){   /* do SSL-protocol accept */
-            log_error("ssl accept failed");
-            ERR_print_errors_fp(stderr);
-        }
-#endif
         errno_cached = errno;
         if (sock_fd < 0)
         {
@@ -591,7 +901,16 @@ int on_new_conn_arrived(int server_fd)
             conn_info->status = CONN_STATUS_CONNECTED;
             conn_info->sock_fd = sock_fd;
 #ifdef TLS
-            conn_info->ssl = ssl;
+            // TLS 握手由接管连接的工作线程以非阻塞方式完成，不占用主线程
+            conn_info->ssl = SSL_new(ssl_ctx);
+            if (conn_info->ssl == NULL || SSL_set_fd(conn_info->ssl, sock_fd) != 1)
+            {
+                log_error("create ssl for sock_fd:%d failed", sock_fd);
+                close_tcp_conn(NULL, sock_fd);
+                return -1;
+            }
+            SSL_set_accept_state(conn_info->ssl);
+            conn_info->status = CONN_STATUS_HANDSHAKING;
 #endif
             conn_info->recv = create_ring(MAX_RING_DATA_LEN);
             if (conn_info->recv == NULL)
@@ -632,6 +951,55 @@ int on_new_conn_arrived(int server_fd)
     }
 }
 
+static void pause_recv(events_poll_t * e, conn_info_t * c)
+{
+    stop_monitoring_recv(e, c->sock_fd);
+    c->flags |= CONN_FLAG_PAUSED;
+    c->paused_at = (uint32_t)get_curr_time();
+    my_stats()->flow_pauses += 1;
+}
+
+static int handle_incoming_message(events_poll_t * e, conn_info_t * c);
+
+void resume_recv(events_poll_t * e, conn_info_t * c)
+{
+    if (c->flags & CONN_FLAG_SESSION) {
+        resume_session(e, c);
+        return;
+    }
+    c->flags &= ~CONN_FLAG_PAUSED;
+    my_stats()->flow_paused_ms += (uint32_t)get_curr_time() - c->paused_at;
+    start_monitoring_recv(e, c->sock_fd);
+
+    // 接收缓冲区中可能还有完整的消息，不会再有 EPOLLIN 触发处理，这里立即处理
+    if (handle_incoming_message(e, c) < 0) {
+        log_error("sock_fd:%d: handle buffered messages failed", c->sock_fd);
+        close_tcp_conn(e, c->sock_fd);
+    }
+}
+
+void on_proxy_send_drained(events_poll_t * e, conn_info_t * out)
+{
+    if (out->flags & CONN_FLAG_TRUNK) {
+        on_trunk_send_drained(e, out);
+        return;
+    }
+    if (out->sess) {
+        // 通过中继连接转发的客户端，暂停接收是为了给应答留出发送缓冲区
+        if ((out->flags & CONN_FLAG_PAUSED) && is_trunk_session_ready(out)) {
+            resume_recv(e, out);
+        }
+        return;
+    }
+    if (out->use_proxy != 1 || out->next_sock_fd < 3 || out->next_sock_fd >= MAX_CONNS_CNT) {
+        return;
+    }
+    conn_info_t * in = &conns_info[out->next_sock_fd];
+    if ((in->flags & CONN_FLAG_PAUSED) && get_ring_data_size(out->send) < SEND_LOW_WATER) {
+        resume_recv(e, in);
+    }
+}
+
 static int handle_incoming_message(events_poll_t * e, conn_info_t * c)
 {
     ring_t * ring = c->recv;
@@ -641,12 +1009,33 @@ static int handle_incoming_message(events_poll_t * e, conn_info_t * c)
         msg_t * msg = (msg_t *)(&ring->data[offset]);
         uint32_t msglen = ntohl(msg->length);
         if (msglen <= MAX_MESSAGE_LEN) {
+            if (c->use_proxy == 1 && recvtotal < msglen) {
+                // 转发大的数据消息时，不等待整个消息到达，剩下的部分直接从套
+                // 接字转移到下一跳
+                int ret = try_start_relay(e, c, msg, recvtotal);
+                if (ret < 0) {
+                    return -1;
+                } else if (ret == 1) {
+                    offset = offset + recvtotal;
+                    recvtotal = 0;
+                    break;
+                }
+            }
             if (recvtotal >= msglen) {
                 decode_msg(msg);
                 int command = msg->command;
                 int64_t seq = msg->sequence;
                 int ret = deal_message(e, c, msg);
-                if (ret < 0) {
+                if (ret == MSG_IO_PENDING) {
+                    // 消息还在使用，接收缓冲区保持不动，完成后由
+                    // consume_io_message() 删除并继续处理
+                    return 0;
+                } else if (ret == MSG_PAUSED) {
+                    // 消息还没有处理，恢复为网络字节序，留在接收缓冲区中
+                    encode_msg(msg);
+                    pause_recv(e, c);
+                    break;
+                } else if (ret < 0) {
                     log_error("%s:%lu: handle_incoming_message failed",
                               command_string(command), seq);
                     return -1;
@@ -682,10 +1071,48 @@ static int handle_incoming_message(events_poll_t * e, conn_info_t * c)
     return 0;
 }
 
+void requeue_io_message(events_poll_t * e, conn_info_t * c, msg_t * msg)
+{
+    // 前面已经处理的消息不能再处理一次
+    ring_t * ring = c->recv;
+    uint32_t start = (uint8_t *)msg - ring->data;
+    encode_msg(msg);
+    memmove(ring->data, &ring->data[start], ring->write - start);
+    ring->write = ring->write - start;
+    ring->len = ring->write;
+    ring->read = 0;
+    pause_recv(e, c);
+}
+
+int consume_io_message(events_poll_t * e, conn_info_t * c, msg_t * msg, uint32_t msglen)
+{
+    if (c->flags & CONN_FLAG_SESSION) {
+        return consume_session_message(e, c, msg, msglen);
+    }
+    ring_t * ring = c->recv;
+    uint32_t end = (uint8_t *)msg - ring->data + msglen;
+    uint32_t left = ring->write - end;
+    memmove(ring->data, &ring->data[end], left);
+    ring->len = left;
+    ring->write = left;
+    ring->read = 0;
+    if (c->flags & CONN_FLAG_PAUSED) {
+        return 0;
+    }
+    return handle_incoming_message(e, c);
+}
+
 // 这个函数不关闭套接字
 int on_can_recv(events_poll_t * events_poll, conn_info_t * conn_info)
 {
     ring_t * ring = conn_info->recv;
+    if (conn_info->flags & CONN_FLAG_RELAY) {
+        return on_relay_recv(events_poll, conn_info);
+    }
+    if (conn_info->flags & (CONN_FLAG_PAUSED | CONN_FLAG_IO_WAIT)) {
+        // 同一批事件中已经暂停接收
+        return 0;
+    }
     if (!ring) {
         log_error("conn_info receive buffer is NULL: sock_fd:%d, close_thread_id:%d",
                   conn_info->debug_fd, conn_info->close_thread_id);
@@ -9,6 +9,7 @@
 #include <openssl/ssl.h>
 #endif
 #include "ring.h"
+#include "transfer.h"
 #include "events_poll.h"
 
 #ifndef MAX_TCP_BUF
@@ -23,60 +24,99 @@
 #define MAX_SO_RCVBUF (128*1024) // 128KB
 #endif
 
+// 非阻塞连接的超时时间，单位是毫秒
+#ifndef CONNECT_TIMEOUT
+#define CONNECT_TIMEOUT (3000)
+#endif
+
+// TLS 握手的超时时间，单位是毫秒
+#ifndef TLS_HANDSHAKE_TIMEOUT
+#define TLS_HANDSHAKE_TIMEOUT (5000)
+#endif
+
 #define CONN_STATUS_IDLE		0
 #define CONN_STATUS_CONNECTING	1
 #define CONN_STATUS_CONNECTED  	2
 #define CONN_STATUS_CLOSING  	3
+#define CONN_STATUS_HANDSHAKING 4 // 客户端连接正在进行 TLS 握手
+
+// conn_info_t.flags
+#define CONN_FLAG_POOLED    0x0001 // 空闲连接，在连接池中等待复用
+#define CONN_FLAG_NEXT_HOP  0x0002 // 本节点主动建立的、到下一跳 sgw 的转发连接
+#define CONN_FLAG_RELAY     0x0004 // 正在零拷贝转发一个数据消息
+#define CONN_FLAG_PAUSED    0x0008 // 下一跳的发送缓冲区已满，暂停接收
+#define CONN_FLAG_TRUNK     0x0010 // sgw 之间的中继连接，承载多个会话
+#define CONN_FLAG_WAITERS   0x0020 // 有会话在等待中继连接的发送缓冲区
+#define CONN_FLAG_KTLS_TX   0x0040 // TLS 连接的发送由内核加密，可以 sendfile()/splice() 写入
+#define CONN_FLAG_KTLS_RX   0x0080 // TLS 连接的接收由内核解密，可以 splice() 读出
+#define CONN_FLAG_IO_WAIT   0x0100 // 等待 I/O 线程完成请求的文件操作，暂停接收
+#define CONN_FLAG_SESSION   0x0200 // 目标端中继连接上的会话的虚拟连接，没有自己的套接字
+
+// 处理消息的返回值：转发的下一跳发送缓冲区已满，消息保留在接收缓冲区中，等下一
+// 跳发送到低水位以下时重新处理
+#define MSG_PAUSED (-2)
+
+// 处理消息的返回值：文件操作交给了 I/O 线程，消息保留在接收缓冲区中，完成后继续
+// 处理，然后再删除
+#define MSG_IO_PENDING (-3)
+
+// 暂停接收的连接，在下一跳的发送缓冲区中的数据少于这个值时恢复接收
+#ifndef SEND_LOW_WATER
+#define SEND_LOW_WATER (MAX_RING_DATA_LEN / 4)
+#endif
 
-struct backend_file
-{
-    int fd; // 文件描述符
-    int sndstate; // 发送状态
-    // filesize, fileleft, filedone 主要用于 sendfile() 的文件顺序下载
-    int64_t filesize; // 文件大小
-    int64_t fileleft; // 文件需要传输的大小
-    int64_t filedone; // 文件已经传输的大小
-    char md5[MD5_LEN + 1]; // 经过 hash 处理后生成的散列值作为文件名
-    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
-};
+struct relay;
+struct trunk_session;
+struct io_job_;
 
 typedef struct conn_info_
 {
+    // 收发数据时每次都要访问的字段放在前面，占用同一个缓存行
+    int sock_fd;
+    int status;
+    int thread_id;
+    int peer_type;
     uint32_t flags;
-    
     int use_proxy;
     int next_sock_fd;
-    
-    int sock_fd;
+    int is_sequence; // 是否使用文件的顺序传输
+
+    ring_t * recv;
+    ring_t * send;
 #ifdef TLS
     SSL *ssl;
 #endif
-    int status;
-    int thread_id;
-    int peer_type;
+    transfer_t * xfer; // 正在进行的文件传输，没有传输时为 NULL
+
+    // 以下字段只在建立连接、开始传输或者出错时访问
     char peer_ip[MAX_IP_LEN+1];
     uint16_t peer_port;
     uint32_t peer_id;
 
-    struct backend_file befiles[MAX_BACK_END];
-    
     uint64_t trans_id;
     uint64_t sequence;
-    
-    ring_t * recv;
-    ring_t * send;
-    
-    void * priv;
+
+    struct relay * relay; // 零拷贝转发的管道，没有使用过时为 NULL
+    struct trunk_session * sess; // 通过中继连接转发时客户端的会话，否则为 NULL
+    uint32_t reserved; // 目标端的中继连接：为会话还没有发送的应答预留的发送缓冲区
+    struct io_job_ * io; // 正在 I/O 线程中执行的请求，没有时为 NULL
+    // 已经从接收缓冲区复制出去、还在写入的上传数据请求，或者下载时预读的数据
+    // 块，按提交的顺序排列
+    struct io_job_ * pipeline;
+    struct io_job_ * pipeline_tail;
+    int pipeline_len;
+    struct prefetch_task * prefetch; // 发送文件列表之后预取的文件，没有时为 NULL
+
+    int timer_id; // 连接超时定时器，没有时为 0
+    uint32_t paused_at; // 暂停接收的时间，毫秒，只保留低 32 位
 
     int debug_fd;
     int close_thread_id;
-    int is_sequence; // 是否使用文件的顺序传输
-    
-} conn_info_t;
+
+} __attribute__((aligned(CACHE_LINE_SIZE))) conn_info_t;
 
 static inline void clear_conn_info(conn_info_t * conn_info)
 {
-    int i = 0;
     int close_thread_id;
 
     close_thread_id = conn_info->close_thread_id;
@@ -86,13 +126,6 @@ static inline void clear_conn_info(conn_info_t * conn_info)
     
     conn_info->next_sock_fd = -1;
     conn_info->sock_fd = -1;
-    for (i = 0; i < MAX_BACK_END; i++) {
-        conn_info->befiles[i].fd = -1;
-        conn_info->befiles[i].sndstate = -1;
-        conn_info->befiles[i].filesize = 0;
-        conn_info->befiles[i].fileleft = 0;
-        conn_info->befiles[i].filedone = 0;
-    }
 }
 
 
@@ -112,8 +145,42 @@ int on_new_conn_arrived(int server_fd);
 
 int on_can_recv(events_poll_t * events_poll, conn_info_t * conn_info);
 
+int on_connect_completed(events_poll_t * events_poll, conn_info_t * conn_info);
+
+#ifdef TLS
+// 工作线程接管客户端连接时调用，开始握手超时计时
+int start_tls_handshake(events_poll_t * events_poll, conn_info_t * conn_info);
+
+// 握手期间套接字可读或可写时调用，按 SSL 的需要切换监听的事件。返回 1 表示握
+// 手完成，0 表示还需要等待，-1 表示失败，此时已经关闭了连接。
+int on_tls_handshake(events_poll_t * events_poll, conn_info_t * conn_info);
+#endif
+
 int send_message(events_poll_t * events_poll, conn_info_t * conn_info, uint8_t * data, int len);
 
+// 交给 I/O 线程的请求完成后，done 返回 MSG_PAUSED（例如转发时下一跳的发送缓冲区
+// 已满）时调用：请求消息恢复为网络字节序留在接收缓冲区中，暂停接收，恢复后重新处理
+void requeue_io_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg);
+
+// 交给 I/O 线程的请求完成后调用，从接收缓冲区中删除请求消息，继续处理后面已经
+// 接收的消息。返回 -1 时由调用者关闭连接。中继连接上的会话交给中继模块处理
+int consume_io_message(events_poll_t * events_poll, conn_info_t * conn_info,
+                       msg_t * msg, uint32_t msglen);
+
+// 把文件从 offset 开始的 len 字节发送到连接，返回值和 errno 同 sendfile()。TLS
+// 连接由内核加密时仍然使用 sendfile()，否则先读到用户态再加密发送。
+ssize_t conn_sendfile(conn_info_t * conn_info, int in_fd, off_t offset, size_t len);
+
+// 直接发送内存中的数据，不经过发送缓冲区，返回值和 errno 同 send()
+int conn_send(conn_info_t * conn_info, uint8_t * data, int len);
+
 int send_message_internal(events_poll_t * events_poll, conn_info_t * conn_info);
 
+// 恢复暂停的接收，并立即处理接收缓冲区中已有的消息。出错时关闭连接。中继连接上
+// 的会话交给中继模块处理
+void resume_recv(events_poll_t * events_poll, conn_info_t * conn_info);
+
+// 转发连接的发送缓冲区有数据发出以后调用，发送到低水位以下时恢复对端连接的接收
+void on_proxy_send_drained(events_poll_t * events_poll, conn_info_t * out);
+
 #endif // CONN_MGMT_H
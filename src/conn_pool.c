@@ -0,0 +1,184 @@
+// conn_pool.c
+
+#include "mt_log.h"
+#include "public.h"
+#include "timer_set.h"
+#include "conn_mgmt.h"
+#include "conn_pool.h"
+#include "stats.h"
+
+extern timer_set_t * timer_sets[MAX_WORKERS+1];
+extern int get_thread_id(void);
+
+struct pooled_conn
+{
+    int sock_fd;
+    uint32_t sgw_ip;     // 网络字节序
+    uint16_t sgw_port;   // 主机字节序
+    uint64_t idle_since; // 放回连接池的时间，毫秒
+};
+
+// 按放回的先后顺序排列，最早放回的在最前面。只由所属的工作线程访问。
+struct sgw_pool
+{
+    int nr_idle;
+    struct pooled_conn idle[MAX_POOL_IDLE];
+};
+
+static struct sgw_pool sgw_pools[MAX_WORKERS+1];
+
+static void remove_idle(struct sgw_pool * pool, int index)
+{
+    int nr_move = pool->nr_idle - index - 1;
+    if (nr_move > 0) {
+        memmove(&pool->idle[index], &pool->idle[index+1],
+                nr_move * sizeof(struct pooled_conn));
+    }
+    pool->nr_idle = pool->nr_idle - 1;
+}
+
+// 空闲连接上不应该有任何数据。对端关闭或者有残留的数据，都不能再复用。
+static int is_idle_conn_healthy(conn_info_t * c)
+{
+    if (c->status != CONN_STATUS_CONNECTED ||
+        get_ring_data_size(c->recv) > 0 ||
+        get_ring_data_size(c->send) > 0) {
+        return 0;
+    }
+
+    char byte;
+    ssize_t n = recv(c->sock_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+// 关闭连接池中的连接。close_tcp_conn() 会调用 forget_sgw_conn()，所以先清除标
+// 志，避免重复移除。
+static void evict_idle_conn(events_poll_t * e, int sock_fd)
+{
+    conns_info[sock_fd].flags &= ~CONN_FLAG_POOLED;
+    close_tcp_conn(e, sock_fd);
+    my_stats()->pool_evictions += 1;
+}
+
+int lease_sgw_conn(events_poll_t * e, uint32_t sgw_ip, uint16_t sgw_port)
+{
+    struct sgw_pool * pool = &sgw_pools[get_thread_id()];
+    int i;
+
+    // 从最近放回的连接开始找，它们最可能仍然有效
+    for (i = pool->nr_idle - 1; i >= 0; i--) {
+        struct pooled_conn * p = &pool->idle[i];
+        if (p->sgw_ip == sgw_ip && p->sgw_port == sgw_port) {
+            int sock_fd = p->sock_fd;
+            remove_idle(pool, i);
+            conn_info_t * c = &conns_info[sock_fd];
+            if (is_idle_conn_healthy(c)) {
+                c->flags &= ~CONN_FLAG_POOLED;
+                my_stats()->pool_hits += 1;
+                return sock_fd;
+            } else {
+                log_warning("drop stale pooled sock_fd:%d peer %s:%u",
+                            sock_fd, c->peer_ip, c->peer_port);
+                evict_idle_conn(e, sock_fd);
+            }
+        }
+    }
+
+    my_stats()->pool_misses += 1;
+
+    char ip[MAX_IP_LEN+1];
+    if (!inet_ntop(AF_INET, &sgw_ip, ip, sizeof(ip))) {
+        log_error("inet_ntop failed: convert 32 bit ip 0x%x failed", sgw_ip);
+        return -1;
+    }
+    // 非阻塞连接，转发的消息先放在发送缓冲区中，连接建立后再发送
+    return open_tcp_conn(e, ip, sgw_port, NULL, 0, 1);
+}
+
+void release_sgw_conn(events_poll_t * e, int sock_fd)
+{
+    struct sgw_pool * pool = &sgw_pools[get_thread_id()];
+    conn_info_t * c = &conns_info[sock_fd];
+
+    // 调用者正在处理这个连接上收到的消息，这里不能关闭它。不适合复用的连接保
+    // 持原样，由对端关闭。
+    if (c->status != CONN_STATUS_CONNECTED || c->xfer != NULL) {
+        return;
+    }
+
+    if (pool->nr_idle == MAX_POOL_IDLE) {
+        // 连接池已满，关闭最早放回的连接
+        int oldest = pool->idle[0].sock_fd;
+        remove_idle(pool, 0);
+        evict_idle_conn(e, oldest);
+    }
+
+    c->use_proxy = 0;
+    c->next_sock_fd = -1;
+    c->flags |= CONN_FLAG_POOLED;
+
+    struct pooled_conn * p = &pool->idle[pool->nr_idle];
+    p->sock_fd = sock_fd;
+    p->sgw_ip = inet_addr(c->peer_ip);
+    p->sgw_port = c->peer_port;
+    p->idle_since = get_curr_time();
+    pool->nr_idle = pool->nr_idle + 1;
+}
+
+void forget_sgw_conn(int sock_fd)
+{
+    struct sgw_pool * pool = &sgw_pools[get_thread_id()];
+    int i;
+
+    for (i = 0; i < pool->nr_idle; i++) {
+        if (pool->idle[i].sock_fd == sock_fd) {
+            remove_idle(pool, i);
+            conns_info[sock_fd].flags &= ~CONN_FLAG_POOLED;
+            return;
+        }
+    }
+}
+
+// 关闭空闲超时的连接，同时检查剩下的连接是否仍然有效
+static int on_check_sgw_pool(void * timer)
+{
+    user_timer_t * t = (user_timer_t *)timer;
+    events_poll_t * e = (events_poll_t *)t->pv_param1;
+    struct sgw_pool * pool = &sgw_pools[get_thread_id()];
+    uint64_t now = get_curr_time();
+    int i = 0;
+
+    while (i < pool->nr_idle) {
+        struct pooled_conn * p = &pool->idle[i];
+        conn_info_t * c = &conns_info[p->sock_fd];
+        if (now - p->idle_since >= POOL_IDLE_TIMEOUT || !is_idle_conn_healthy(c)) {
+            int sock_fd = p->sock_fd;
+            remove_idle(pool, i);
+            evict_idle_conn(e, sock_fd);
+        } else {
+            i = i + 1;
+        }
+    }
+    return 0;
+}
+
+int init_sgw_pool(events_poll_t * events_poll, int thread_id)
+{
+    user_timer_t t;
+    memset(&t, 0, sizeof(user_timer_t));
+    t.loop_cnt = 0xFFFFFFFF;
+    t.hold_time = POOL_CHECK_INTERVAL;
+    t.call_back = on_check_sgw_pool;
+    t.pv_param1 = events_poll;
+    int timer_id = create_one_timer(timer_sets[thread_id], &t);
+    if (timer_id > 0) {
+        return 0;
+    } else {
+        log_crit("create sgw pool timer for worker:%d failed", thread_id);
+        return -1;
+    }
+}
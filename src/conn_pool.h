@@ -0,0 +1,37 @@
+// conn_pool.h
+
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include <stdint.h>
+#include "events_poll.h"
+
+// 每个工作线程最多保持的到下一跳 sgw 的空闲连接数
+#ifndef MAX_POOL_IDLE
+#define MAX_POOL_IDLE (32)
+#endif
+
+// 空闲连接的最长保持时间，单位是毫秒
+#ifndef POOL_IDLE_TIMEOUT
+#define POOL_IDLE_TIMEOUT (30000)
+#endif
+
+// 检查空闲连接的间隔，单位是毫秒
+#ifndef POOL_CHECK_INTERVAL
+#define POOL_CHECK_INTERVAL (5000)
+#endif
+
+// 为当前工作线程的连接池创建空闲连接检查定时器
+int init_sgw_pool(events_poll_t * events_poll, int thread_id);
+
+// 取得一个到 sgw_ip:sgw_port 的连接。优先复用连接池中检查有效的空闲连接，没有
+// 则新建一个非阻塞连接。sgw_ip 是网络字节序，sgw_port 是主机字节序。
+int lease_sgw_conn(events_poll_t * events_poll, uint32_t sgw_ip, uint16_t sgw_port);
+
+// 一次转发结束，把到下一跳 sgw 的连接放回连接池。连接状态不适合复用时直接关闭。
+void release_sgw_conn(events_poll_t * events_poll, int sock_fd);
+
+// 连接关闭时从连接池中移除，由 close_tcp_conn() 调用
+void forget_sgw_conn(int sock_fd);
+
+#endif // CONN_POOL_H
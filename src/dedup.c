@@ -0,0 +1,258 @@
+// dedup.c
+
+#include <pthread.h>
+#include <openssl/evp.h>
+#include "mt_log.h"
+#include "public.h"
+#include "options.h"
+#include "pathops.h"
+#include "durable.h"
+#include "resync.h"
+#include "dedup.h"
+
+extern int open_path(char *path);
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+#define DEDUP_PATH_LEN (MAX_NAME_LEN + MAX_NAME_LEN + 16)
+
+struct dedup_entry
+{
+    char md5[MD5_LEN + 1];
+    char name[MAX_NAME_LEN + 1];
+};
+
+// 索引只是提示，使用之前总是重新校验文件内容，文件被删除或者覆盖时不需要更新
+static struct dedup_entry * dedup_index = NULL;
+static pthread_mutex_t dedup_lock;
+
+static uint64_t dedup_present = 0;
+static uint64_t dedup_linked = 0;
+static uint64_t dedup_bytes = 0;
+
+int init_dedup(void)
+{
+    if (sgw_options.dedup == 0) {
+        return 0;
+    }
+    if (sgw_options.parity > 0) {
+        // 条带模式下后端文件只是分片，不能直接校验和硬链接
+        log_warning("dedup is not supported in stripe mode, disabled");
+        sgw_options.dedup = 0;
+        return 0;
+    }
+    dedup_index = (struct dedup_entry *)calloc(DEDUP_INDEX_SLOTS, sizeof(*dedup_index));
+    if (!dedup_index) {
+        log_error("malloc %lu bytes for dedup index failed",
+                  (unsigned long)(DEDUP_INDEX_SLOTS * sizeof(*dedup_index)));
+        return -1;
+    }
+    pthread_mutex_init(&dedup_lock, NULL);
+    log_info("upload dedup by md5, %d index slots", DEDUP_INDEX_SLOTS);
+    return 0;
+}
+
+int dedup_enabled(void)
+{
+    return dedup_index != NULL;
+}
+
+// 小写的 32 个十六进制字符
+static int valid_md5(const char * md5)
+{
+    int i;
+    for (i = 0; i < MD5_LEN; i++) {
+        char c = md5[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return 0;
+        }
+    }
+    return md5[MD5_LEN] == '\0';
+}
+
+// md5 本身是均匀分布的，直接用前 8 个十六进制字符
+static struct dedup_entry * slot_of(const char * md5)
+{
+    uint32_t h = 0;
+    int i;
+    for (i = 0; i < 8; i++) {
+        h = (h << 4) | (md5[i] <= '9' ? md5[i] - '0' : md5[i] - 'a' + 10);
+    }
+    return &dedup_index[h % DEDUP_INDEX_SLOTS];
+}
+
+// 文件大小是 size 并且内容的 md5 相同时返回 0
+static int verify_file(const char * path, int64_t size, const char * md5)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat s;
+    if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_size != size) {
+        close(fd);
+        return -1;
+    }
+    EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+    char * buf = (char *)malloc(DEDUP_CHUNK);
+    int ret = -1;
+    if (!ctx || !buf) {
+        log_error("malloc for verifying %s failed", path);
+        goto out;
+    }
+    EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+    int64_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buf, DEDUP_CHUNK, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            log_warning("read %s for dedup failed: %s", path, n < 0 ? strerror(errno) : "short file");
+            goto out;
+        }
+        EVP_DigestUpdate(ctx, buf, n);
+        done = done + n;
+    }
+    char filemd5[MD5_LEN + 1];
+    md5_hex(ctx, filemd5);
+    ret = strcmp(filemd5, md5) == 0 ? 0 : -1;
+out:
+    EVP_MD_CTX_free(ctx);
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+// 文件在每个后端目录中都存在，大小都是 size，并且内容的 md5 都相同时返回 0。写入
+// 失败或者异步复制时其它后端目录的副本可能还没有补写，大小相同也不能说明内容相同，
+// 所以每个副本都要校验
+static int verify_replicas(const char * name, int64_t size, const char * md5)
+{
+    char path[DEDUP_PATH_LEN];
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct stat s;
+        join_path(path, sizeof(path), backend_dirs[i], name);
+        if (stat(path, &s) < 0 || s.st_size != size) {
+            return -1;
+        }
+    }
+    for (i = 0; i < backend_cnt; i++) {
+        join_path(path, sizeof(path), backend_dirs[i], name);
+        if (verify_file(path, size, md5) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 在后端目录中把 src 硬链接为 dst：先链接到临时文件再改名，原来的 dst 被原子地替换
+static int link_one(const char * src, const char * dst)
+{
+    char tmp[DEDUP_PATH_LEN + 8];
+    const char * base = strrchr(dst, '/') + 1;
+    snprintf(tmp, sizeof(tmp), "%.*s.%s.dedup", (int)(base - dst), dst, base);
+    (void) unlink(tmp);
+    int ret = link(src, tmp);
+    if (ret < 0 && errno == ENOENT) {
+        // 目标目录还不存在，创建之后再链接
+        int fd = open_path(tmp);
+        if (fd >= 0) {
+            close(fd);
+            (void) unlink(tmp);
+        }
+        ret = link(src, tmp);
+    }
+    if (ret < 0) {
+        log_warning("link %s to %s failed: %s", src, tmp, strerror(errno));
+        return -1;
+    }
+    if (rename(tmp, dst) < 0) {
+        log_warning("rename %s to %s failed: %s", tmp, dst, strerror(errno));
+        (void) unlink(tmp);
+        return -1;
+    }
+    if (sgw_options.durability != DURABILITY_NONE) {
+        (void) sync_parent_dir(dst);
+    }
+    return 0;
+}
+
+int dedup_upload(msg_t * msg)
+{
+    task_info_t * t = (task_info_t *)msg->data;
+    const char * md5 = t->file_md5;
+    int64_t size = msg->total;
+    if (!valid_md5(md5)) {
+        return 0;
+    }
+    if (verify_replicas(t->file_name, size, md5) == 0) {
+        log_info("%s already present, skip upload", t->file_name);
+        __sync_fetch_and_add(&dedup_present, 1);
+        __sync_fetch_and_add(&dedup_bytes, size);
+        return 1;
+    }
+
+    char src_name[MAX_NAME_LEN + 1];
+    struct dedup_entry * e = slot_of(md5);
+    pthread_mutex_lock(&dedup_lock);
+    int found = strcmp(e->md5, md5) == 0 && strcmp(e->name, t->file_name) != 0;
+    if (found) {
+        memcpy(src_name, e->name, sizeof(src_name));
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    if (!found) {
+        return 0;
+    }
+    if (verify_replicas(src_name, size, md5) < 0) {
+        // 内容相同的文件已经被删除或者覆盖
+        pthread_mutex_lock(&dedup_lock);
+        if (strcmp(e->md5, md5) == 0 && strcmp(e->name, src_name) == 0) {
+            e->md5[0] = '\0';
+        }
+        pthread_mutex_unlock(&dedup_lock);
+        return 0;
+    }
+
+    // 链接到一半失败时，已经链接的文件名内容也是对的，之后的上传会先删除再写入
+    char src[DEDUP_PATH_LEN];
+    char dst[DEDUP_PATH_LEN];
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        join_path(src, sizeof(src), backend_dirs[i], src_name);
+        join_path(dst, sizeof(dst), backend_dirs[i], t->file_name);
+        if (link_one(src, dst) < 0) {
+            return 0;
+        }
+    }
+#ifdef MD5
+    for (i = 0; i < backend_cnt; i++) {
+        join_path(dst, sizeof(dst), backend_dirs[i], t->file_name);
+        append_md5(dst, md5);
+    }
+#endif
+    log_info("%s linked to %s with the same md5, skip upload", t->file_name, src_name);
+    __sync_fetch_and_add(&dedup_linked, 1);
+    __sync_fetch_and_add(&dedup_bytes, size);
+    return 1;
+}
+
+void dedup_remember(const char * name, const char * md5)
+{
+    if (!valid_md5(md5) || strlen(name) > MAX_NAME_LEN) {
+        return;
+    }
+    struct dedup_entry * e = slot_of(md5);
+    pthread_mutex_lock(&dedup_lock);
+    memcpy(e->md5, md5, sizeof(e->md5));
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    pthread_mutex_unlock(&dedup_lock);
+}
+
+void get_dedup_stats(uint64_t * present, uint64_t * linked, uint64_t * bytes)
+{
+    *present = __atomic_load_n(&dedup_present, __ATOMIC_RELAXED);
+    *linked = __atomic_load_n(&dedup_linked, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&dedup_bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,37 @@
+// dedup.h
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "public.h"
+
+// 记住最近上传的文件的 md5 和文件名，按 md5 直接映射，冲突时替换
+#ifndef DEDUP_INDEX_SLOTS
+#define DEDUP_INDEX_SLOTS (16384)
+#endif
+
+// 校验已经存在的文件时每次读取的数据量
+#ifndef DEDUP_CHUNK
+#define DEDUP_CHUNK (1 << 20)
+#endif
+
+// 开始上传的应答码：文件已经存在，客户端不需要上传数据，也不发送上传完成请求
+#define ACK_ALREADY_PRESENT (208)
+
+// 打开了 -o dedup 时分配索引，在创建工作线程之前调用
+int init_dedup(void);
+
+int dedup_enabled(void);
+
+// 在 I/O 线程中开始上传时调用。请求的文件在每个后端目录中都已经存在并且内容的 md5
+// 和请求中的相同，或者最近上传过 md5 相同的文件、已经在每个后端目录中硬链接到请求的
+// 文件名时返回 1，这时不需要上传数据。其它情况返回 0，按普通的上传处理
+int dedup_upload(msg_t * msg);
+
+// 在 I/O 线程中上传成功之后调用，记住文件的 md5
+void dedup_remember(const char * name, const char * md5);
+
+// 累计已经存在的上传次数，硬链接的上传次数，没有上传的数据量（字节）
+void get_dedup_stats(uint64_t * present, uint64_t * linked, uint64_t * bytes);
+
+#endif // DEDUP_H
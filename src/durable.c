@@ -0,0 +1,232 @@
+// durable.c
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include "mt_log.h"
+#include "public.h"
+#include "pathops.h"
+#include "options.h"
+#include "durable.h"
+
+extern void init_mt_cntt(int thread_id);
+extern int backend_cnt;
+
+// 每个后端目录一个提交队列。I/O 线程放入请求，提交线程每次取走整个队列作为一组，
+// 同步期间到达的请求组成下一组
+struct commit_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    io_job_t * head;
+    io_job_t * tail;
+    int backend;
+};
+
+static struct commit_queue commit_queues[MAX_BACK_END];
+
+// 由提交线程和 I/O 线程累加，原子操作
+static uint64_t commit_groups = 0;
+static uint64_t commit_files = 0;
+static uint64_t commit_sync_us = 0;
+
+static uint64_t get_curr_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 新创建的文件要同步所在的目录，否则掉电后目录项可能丢失
+int sync_parent_dir(const char * path)
+{
+    char dir[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    get_path_head((char *)path, dir);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        log_error("open dir %s failed: %s", dir, strerror(errno));
+        return -1;
+    }
+    int ret = fsync(fd);
+    if (ret < 0) {
+        log_error("fsync dir %s failed: %s", dir, strerror(errno));
+    }
+    close(fd);
+    return ret;
+}
+
+static int is_same_dir(const char * a, const char * b)
+{
+    const char * pa = strrchr(a, '/');
+    const char * pb = strrchr(b, '/');
+    return pa && pb && pa - a == pb - b && memcmp(a, b, pa - a) == 0;
+}
+
+int sync_transfer_files(transfer_t * x)
+{
+    uint64_t start_us = get_curr_us();
+    int ret = 0;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct backend_file * f = &x->befiles[i];
+        if (f->fd < 0) {
+            continue;
+        }
+        if (fdatasync(f->fd) < 0) {
+            log_error("fdatasync %s failed: %s", f->abs_file_name, strerror(errno));
+            ret = -1;
+        } else if (sync_parent_dir(f->abs_file_name) < 0) {
+            ret = -1;
+        }
+        close(f->fd);
+        f->fd = -1;
+        __sync_fetch_and_add(&commit_files, 1);
+    }
+    __sync_fetch_and_add(&commit_sync_us, get_curr_us() - start_us);
+    return ret;
+}
+
+// 同步完成，成功时先执行请求的后续操作，再交回工作线程
+static void finish_commit(io_job_t * job)
+{
+    if (job->committed && job->result >= 0) {
+        job->committed(job);
+    }
+    complete_io_job(job);
+}
+
+static void commit_group(int b, io_job_t * list)
+{
+    uint64_t start_us = get_curr_us();
+    io_job_t * job;
+    uint64_t n = 0;
+
+    // 先让所有文件同时开始写回，再逐个等待，磁盘可以合并和排序这些写入
+    for (job = list; job; job = job->commit_next[b]) {
+        struct backend_file * f = &job->xfer->befiles[b];
+        (void) sync_file_range(f->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        n = n + 1;
+    }
+    for (job = list; job; job = job->commit_next[b]) {
+        struct backend_file * f = &job->xfer->befiles[b];
+        if (fdatasync(f->fd) < 0) {
+            log_error("fdatasync %s failed: %s", f->abs_file_name, strerror(errno));
+            __atomic_store_n(&job->result, -1, __ATOMIC_RELAXED);
+        }
+    }
+    // 同一组中的多个文件在同一个目录下时（例如同一个 series），目录只同步一次
+    for (job = list; job; job = job->commit_next[b]) {
+        const char * path = job->xfer->befiles[b].abs_file_name;
+        io_job_t * prev;
+        for (prev = list; prev != job; prev = prev->commit_next[b]) {
+            if (is_same_dir(prev->xfer->befiles[b].abs_file_name, path)) {
+                break;
+            }
+        }
+        if (prev == job && sync_parent_dir(path) < 0) {
+            __atomic_store_n(&job->result, -1, __ATOMIC_RELAXED);
+        }
+    }
+
+    __sync_fetch_and_add(&commit_groups, 1);
+    __sync_fetch_and_add(&commit_files, n);
+    __sync_fetch_and_add(&commit_sync_us, get_curr_us() - start_us);
+
+    // 最后一个完成同步的后端把请求交回工作线程，之后不能再访问请求
+    job = list;
+    while (job) {
+        io_job_t * next = job->commit_next[b];
+        struct backend_file * f = &job->xfer->befiles[b];
+        close(f->fd);
+        f->fd = -1;
+        if (__sync_sub_and_fetch(&job->commit_pending, 1) == 0) {
+            finish_commit(job);
+        }
+        job = next;
+    }
+}
+
+static void * commit_thread(void * argv)
+{
+    struct commit_queue * q = (struct commit_queue *)argv;
+    init_mt_cntt(COMMIT_THREAD_ID_BASE + q->backend);
+
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        while (q->head == NULL) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        io_job_t * list = q->head;
+        q->head = NULL;
+        q->tail = NULL;
+        pthread_mutex_unlock(&q->lock);
+
+        commit_group(q->backend, list);
+    }
+    return NULL;
+}
+
+int init_group_commit(int nr_backends)
+{
+    if (sgw_options.durability != DURABILITY_GROUP) {
+        return 0;
+    }
+    int i;
+    for (i = 0; i < nr_backends; i++) {
+        struct commit_queue * q = &commit_queues[i];
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->cond, NULL);
+        q->head = NULL;
+        q->tail = NULL;
+        q->backend = i;
+
+        pthread_t tid;
+        int ret = pthread_create(&tid, NULL, commit_thread, q);
+        if (ret != 0) {
+            log_error("create commit thread %d failed: %s", i, strerror(ret));
+            return -1;
+        }
+    }
+    log_info("group commit enabled, %d commit threads", nr_backends);
+    return 0;
+}
+
+void group_commit_io_job(io_job_t * job)
+{
+    int i;
+    int pending = 0;
+    for (i = 0; i < backend_cnt; i++) {
+        if (job->xfer->befiles[i].fd >= 0) {
+            pending = pending + 1;
+        }
+    }
+    if (pending == 0) {
+        finish_commit(job);
+        return;
+    }
+
+    // 先设置计数，放入第一个队列之后请求就可能被完成
+    job->commit_pending = pending;
+    for (i = 0; i < backend_cnt; i++) {
+        if (job->xfer->befiles[i].fd < 0) {
+            continue;
+        }
+        struct commit_queue * q = &commit_queues[i];
+        job->commit_next[i] = NULL;
+        pthread_mutex_lock(&q->lock);
+        if (q->tail) {
+            q->tail->commit_next[i] = job;
+        } else {
+            q->head = job;
+        }
+        q->tail = job;
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+void get_group_commit_stats(uint64_t * groups, uint64_t * files, uint64_t * sync_us)
+{
+    *groups = __sync_fetch_and_add(&commit_groups, 0);
+    *files = __sync_fetch_and_add(&commit_files, 0);
+    *sync_us = __sync_fetch_and_add(&commit_sync_us, 0);
+}
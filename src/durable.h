@@ -0,0 +1,35 @@
+// durable.h
+
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include "public.h"
+#include "transfer.h"
+#include "iopool.h"
+
+// 上传完成时后端文件的持久化方式，用 -o durability=N 选择
+#define DURABILITY_NONE  0 // 只关闭文件，由内核在之后写回磁盘
+#define DURABILITY_FILE  1 // 每个文件在应答之前 fdatasync，并同步所在的目录
+#define DURABILITY_GROUP 2 // 同时结束的上传由每个后端的提交线程一起同步
+
+// 提交线程的线程标识从这里开始，每个后端目录一个
+#define COMMIT_THREAD_ID_BASE (IO_THREAD_ID_BASE + MAX_IO_THREADS)
+
+// 组提交模式下为每个后端目录启动一个提交线程，在创建工作线程之前调用
+int init_group_commit(int nr_backends);
+
+// 同步 path 所在的目录，新创建或者改名的文件掉电后目录项才不会丢失
+int sync_parent_dir(const char * path);
+
+// 在当前线程中同步传输的所有后端文件和所在的目录，然后关闭文件。失败返回 -1
+int sync_transfer_files(transfer_t * x);
+
+// 把请求交给各个后端的提交线程，所有后端的文件都同步并关闭之后再交回提交请求的
+// 工作线程。同步成功时在最后完成的提交线程中先调用 job->committed（不为 NULL 时），
+// 同步失败时 result 为 -1
+void group_commit_io_job(io_job_t * job);
+
+// 累计的组提交次数、同步的文件个数和同步耗时（微秒）
+void get_group_commit_stats(uint64_t * groups, uint64_t * files, uint64_t * sync_us);
+
+#endif // DURABLE_H
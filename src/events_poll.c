@@ -6,6 +6,12 @@
 #include "public.h"
 #include "conn_mgmt.h"
 #include "events_poll.h"
+#include "relay.h"
+#include "iopool.h"
+#include "uring.h"
+#include "pagecache.h"
+#include "filecache.h"
+#include "mirror.h"
 
 #ifndef EPOLLRDHUP
 #define EPOLLRDHUP 0x2000
@@ -338,9 +344,8 @@ static void on_data_socket_error(
     }
 }
 
-static int send_file_blob(int sd, struct backend_file *f)
+static int send_file_blob(conn_info_t *c, struct backend_file *f)
 {
-    off_t offset;
     while (f->fileleft > 0) {
         size_t blocksize;
         if (f->fileleft < MAX_TCP_BUF) {
@@ -348,8 +353,13 @@ static int send_file_blob(int sd, struct backend_file *f)
         } else {
             blocksize = MAX_TCP_BUF;
         }
-        offset = f->filedone;
-        ssize_t sendlen = sendfile(sd, f->fd, &offset, blocksize);
+        ssize_t sendlen;
+        if (c->xfer->cached) {
+            // 文件在内存缓存中，不读磁盘
+            sendlen = conn_send(c, (uint8_t *)c->xfer->cached->data + f->filedone, blocksize);
+        } else {
+            sendlen = conn_sendfile(c, f->fd, f->filedone, blocksize);
+        }
         if (sendlen >= 0) {
             f->fileleft = f->fileleft - sendlen;
             f->filedone = f->filedone + sendlen;
@@ -357,9 +367,12 @@ static int send_file_blob(int sd, struct backend_file *f)
             int ec = errno;
             if (ec == EAGAIN) {
                 return 0;
+            } else if (ec == EIO && !c->xfer->cached && reopen_on_mirror(f) == 0) {
+                // 后端文件读取失败，换一个镜像继续发送
+                continue;
             } else {
                 log_error("sendfile failed: %s: out(%d) <- in(%d)",
-                          strerror(ec), sd, f->fd);
+                          strerror(ec), c->sock_fd, f->fd);
                 return -1;
             }
         }
@@ -386,7 +399,15 @@ static int deal_data_socket_epollout(
         } else {
             if (c->is_sequence == 0) {
                 int write_len = send_message_internal(e, c);
+                if (write_len >= 0 && c->use_proxy == 1 &&
+                    on_relay_send(e, c) < 0) {
+                    log_error("on_relay_send failed");
+                    close_tcp_conn(e, sock_fd);
+                    return -1;
+                }
                 if (write_len >= 0) {
+                    // 可能关闭这个连接，之后不能再访问 c
+                    on_proxy_send_drained(e, c);
                     return write_len;
                 } else {
                     log_error("send_message_internal failed");
@@ -398,15 +419,15 @@ static int deal_data_socket_epollout(
                 struct backend_file *f;
                 int i;
                 f = NULL;
-                for (i = 0; i < MAX_BACK_END; i++) {
-                    f = &c->befiles[i];
-                    if (f->fd >= 0) {
+                for (i = 0; c->xfer && i < MAX_BACK_END; i++) {
+                    f = &c->xfer->befiles[i];
+                    if (f->fd >= 0 || c->xfer->cached) {
                         break;
                     } else {
                         // 继续查找下一个文件
                     }
                 }
-                if (f && f->fd >= 0) {
+                if (f && (f->fd >= 0 || c->xfer->cached)) {
                     if (f->sndstate == 0) {
                         // 获取文件上传时的 md5
                         char md5[32];
@@ -417,11 +438,10 @@ static int deal_data_socket_epollout(
                         memmove(buffer+8, md5, 32);
                         int sendlen;
 #ifdef TLS
-                        conn_info_t conn_info = conns_info[sock_fd];
-                        if(conn_info.peer_type == NODE_TYPE_ASM)
+                        if (c->ssl == NULL)
                             sendlen = send(sock_fd, buffer, 40, MSG_MORE);
                         else
-                            sendlen = SSL_write(conn_info.ssl, buffer, 40);
+                            sendlen = SSL_write(c->ssl, buffer, 40);
 #else
                         sendlen = send(sock_fd, buffer, 40, MSG_MORE);
 #endif
@@ -438,7 +458,7 @@ static int deal_data_socket_epollout(
                         int rc3;
                     send_blob:
                         // 可以发送文件内容
-                        rc3 = send_file_blob(sock_fd, f);
+                        rc3 = send_file_blob(c, f);
                         if (rc3 == 0) {
                             // 连接暂时不可写，等待下次继续发送
                             return 0;
@@ -448,9 +468,12 @@ static int deal_data_socket_epollout(
                             log_debug("%s successfully downloaded (%lld bytes)",
                                       f->abs_file_name,
                                       (long long int)f->filedone);
-                            close(f->fd);
-                            f->fd = -1;
-                            f->sndstate = 2;
+                            // 传输结束，关闭文件并归还传输状态
+                            if (f->cache_drop) {
+                                drop_file_cache(f->fd);
+                            }
+                            free_transfer(c->xfer);
+                            c->xfer = NULL;
                             c->is_sequence = 0;
                             start_monitoring_recv(e, sock_fd);
                             start_monitoring_send(e, sock_fd);
@@ -508,6 +531,14 @@ static int receive_client_fd(
         if (ret == 1)
         {
             // log_info("add client_fd:%d to EPOLLIN events poll success", client_fd);
+#ifdef TLS
+            if (c->status == CONN_STATUS_HANDSHAKING &&
+                start_tls_handshake(e, c) < 0)
+            {
+                close_tcp_conn(e, client_fd);
+                return -1;
+            }
+#endif
             return 0;
         }
         else
@@ -565,6 +596,17 @@ static int deal_data_socket_epollin(
                 return 0;
             }
         }
+        else if (c->peer_type == NODE_TYPE_EVENT)
+        {
+            // I/O 线程完成了本线程提交的文件操作
+            on_io_completion(e);
+            return 0;
+        }
+        else if (c->peer_type == NODE_TYPE_URING)
+        {
+            // io_uring 的完成队列在 run_events_poll() 中统一处理
+            return 0;
+        }
         else
         {
             // 工作者线程从客户端接收数据，然后进行处理
@@ -594,6 +636,24 @@ static void deal_data_socket_events(
     if (current_thread_id == conn_info->thread_id &&
                   sock_fd == conn_info->sock_fd)
     {
+        if (conn_info->status == CONN_STATUS_CONNECTING) {
+            // 非阻塞连接完成时（无论成功失败）套接字可写。连接成功后继续处理
+            // EPOLLOUT，发送连接期间暂存在发送缓冲区中的消息
+            if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                if (on_connect_completed(events_poll, conn_info) < 0) {
+                    return;
+                }
+            } else {
+                return;
+            }
+        }
+#ifdef TLS
+        if (conn_info->status == CONN_STATUS_HANDSHAKING) {
+            // 握手期间的读写都由 SSL 完成，握手完成后客户端的数据再触发可读事件
+            (void) on_tls_handshake(events_poll, conn_info);
+            return;
+        }
+#endif
         if ((events & EPOLLIN) || (events & EPOLLOUT)) {
             if (events & EPOLLOUT) {
                 int wlen = deal_data_socket_epollout(
@@ -671,5 +731,7 @@ int run_events_poll(events_poll_t * events_poll, uint32_t wait_time) // wait_tim
             handle_one_event(events_poll, i);
         }
     }
+    // 提交本轮产生的 io_uring 文件操作，处理已经完成的操作
+    poll_io_uring(events_poll);
     return events_cnt;
 }
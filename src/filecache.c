@@ -0,0 +1,264 @@
+// filecache.c
+
+#include "mt_log.h"
+#include "public.h"
+#include "options.h"
+#include "filecache.h"
+
+struct cache_shard
+{
+    pthread_mutex_t lock;
+    cached_file_t * buckets[FILE_CACHE_BUCKETS];
+    cached_file_t * head;
+    cached_file_t * tail;
+    int64_t used;
+    uint64_t gen;  // 失效的次数
+};
+
+static struct cache_shard cache_shards[FILE_CACHE_SHARDS];
+
+// 由多个工作线程和 I/O 线程累加，原子操作
+static uint64_t cache_hits = 0;
+static uint64_t cache_misses = 0;
+static uint64_t cache_fills = 0;
+static uint64_t cache_evictions = 0;
+static uint64_t cache_invalidations = 0;
+static int64_t cache_bytes = 0;
+
+// 上传和下载请求中的文件名可能以 '/' 开头，也可能没有，指向同一个文件
+static const char * key_of(const char * name)
+{
+    while (*name == '/') {
+        name++;
+    }
+    return name;
+}
+
+// FNV-1a
+static uint64_t hash_name(const char * name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    while (*name) {
+        h = (h ^ (uint8_t)*name) * 1099511628211ULL;
+        name++;
+    }
+    return h;
+}
+
+static struct cache_shard * shard_of(uint64_t hash)
+{
+    return &cache_shards[hash % FILE_CACHE_SHARDS];
+}
+
+static cached_file_t ** bucket_of(struct cache_shard * s, uint64_t hash)
+{
+    return &s->buckets[(hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+}
+
+static int64_t charge_of(const cached_file_t * f)
+{
+    return sizeof(*f) + f->size + strlen(f->name) + 1;
+}
+
+static void lru_unlink(struct cache_shard * s, cached_file_t * f)
+{
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        s->head = f->next;
+    }
+    if (f->next) {
+        f->next->prev = f->prev;
+    } else {
+        s->tail = f->prev;
+    }
+    f->prev = NULL;
+    f->next = NULL;
+}
+
+static void lru_push(struct cache_shard * s, cached_file_t * f)
+{
+    f->prev = NULL;
+    f->next = s->head;
+    if (s->head) {
+        s->head->prev = f;
+    } else {
+        s->tail = f;
+    }
+    s->head = f;
+}
+
+static cached_file_t * find_locked(struct cache_shard * s, uint64_t hash, const char * key)
+{
+    cached_file_t * f;
+    for (f = *bucket_of(s, hash); f; f = f->hnext) {
+        if (f->hash == hash && strcmp(f->name, key) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// 从缓存中去掉，返回之后由调用者在锁外释放缓存的引用
+static void remove_locked(struct cache_shard * s, cached_file_t * f)
+{
+    cached_file_t ** pp = bucket_of(s, f->hash);
+    while (*pp != f) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = f->hnext;
+    f->hnext = NULL;
+    lru_unlink(s, f);
+    f->cached = 0;
+    int64_t charge = charge_of(f);
+    s->used = s->used - charge;
+    __sync_fetch_and_sub(&cache_bytes, charge);
+}
+
+void init_file_cache(void)
+{
+    int i;
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        memset(&cache_shards[i], 0, sizeof(cache_shards[i]));
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+    }
+}
+
+int file_cache_wanted(int64_t size)
+{
+    return sgw_options.file_cache > 0 && size > 0 && size <= FILE_CACHE_MAX_FILE;
+}
+
+cached_file_t * lookup_cached_file(const char * name)
+{
+    if (sgw_options.file_cache == 0) {
+        return NULL;
+    }
+    const char * key = key_of(name);
+    uint64_t hash = hash_name(key);
+    struct cache_shard * s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    cached_file_t * f = find_locked(s, hash, key);
+    if (f) {
+        lru_unlink(s, f);
+        lru_push(s, f);
+        __sync_fetch_and_add(&f->refs, 1);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    __sync_fetch_and_add(f ? &cache_hits : &cache_misses, 1);
+    return f;
+}
+
+cached_file_t * alloc_cached_file(const char * name, int64_t size)
+{
+    const char * key = key_of(name);
+    int keylen = strlen(key);
+    cached_file_t * f = (cached_file_t *)malloc(sizeof(*f) + size + keylen + 1);
+    if (f == NULL) {
+        log_error("malloc %ld bytes for cached file %s failed", (long)size, key);
+        return NULL;
+    }
+    memset(f, 0, sizeof(*f));
+    f->refs = 1;
+    f->hash = hash_name(key);
+    f->size = size;
+    f->name = f->data + size;
+    memcpy(f->name, key, keylen + 1);
+
+    struct cache_shard * s = shard_of(f->hash);
+    pthread_mutex_lock(&s->lock);
+    f->gen = s->gen;
+    pthread_mutex_unlock(&s->lock);
+    return f;
+}
+
+int insert_cached_file(cached_file_t * f, int force)
+{
+    struct cache_shard * s = shard_of(f->hash);
+    int64_t budget = ((int64_t)sgw_options.file_cache << 20) / FILE_CACHE_SHARDS;
+    int64_t charge = charge_of(f);
+    cached_file_t * old = NULL;
+    cached_file_t * evicted = NULL;
+    int ret = -1;
+
+    pthread_mutex_lock(&s->lock);
+    if (!f->cached && charge <= budget && (force || f->gen == s->gen)) {
+        old = find_locked(s, f->hash, f->name);
+        if (old) {
+            remove_locked(s, old);
+        }
+        // 淘汰最久没有使用的文件，淘汰的文件用 hnext 串起来在锁外释放
+        while (s->used + charge > budget && s->tail) {
+            cached_file_t * victim = s->tail;
+            remove_locked(s, victim);
+            victim->hnext = evicted;
+            evicted = victim;
+            __sync_fetch_and_add(&cache_evictions, 1);
+        }
+        cached_file_t ** bucket = bucket_of(s, f->hash);
+        f->hnext = *bucket;
+        *bucket = f;
+        lru_push(s, f);
+        f->cached = 1;
+        __sync_fetch_and_add(&f->refs, 1);
+        s->used = s->used + charge;
+        __sync_fetch_and_add(&cache_bytes, charge);
+        __sync_fetch_and_add(&cache_fills, 1);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (old) {
+        put_cached_file(old);
+    }
+    while (evicted) {
+        cached_file_t * next = evicted->hnext;
+        put_cached_file(evicted);
+        evicted = next;
+    }
+    return ret;
+}
+
+void invalidate_cached_file(const char * name)
+{
+    if (sgw_options.file_cache == 0) {
+        return;
+    }
+    const char * key = key_of(name);
+    uint64_t hash = hash_name(key);
+    struct cache_shard * s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    // 正在从磁盘读入的文件可能是旧的内容，读完之后不再放入缓存
+    s->gen = s->gen + 1;
+    cached_file_t * f = find_locked(s, hash, key);
+    if (f) {
+        remove_locked(s, f);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (f) {
+        __sync_fetch_and_add(&cache_invalidations, 1);
+        put_cached_file(f);
+    }
+}
+
+void put_cached_file(cached_file_t * f)
+{
+    if (__sync_sub_and_fetch(&f->refs, 1) == 0) {
+        free(f);
+    }
+}
+
+void get_file_cache_stats(uint64_t * hits, uint64_t * misses, uint64_t * fills,
+                          uint64_t * evictions, uint64_t * invalidations, uint64_t * bytes)
+{
+    *hits = __sync_fetch_and_add(&cache_hits, 0);
+    *misses = __sync_fetch_and_add(&cache_misses, 0);
+    *fills = __sync_fetch_and_add(&cache_fills, 0);
+    *evictions = __sync_fetch_and_add(&cache_evictions, 0);
+    *invalidations = __sync_fetch_and_add(&cache_invalidations, 0);
+    *bytes = __sync_fetch_and_add(&cache_bytes, 0);
+}
@@ -0,0 +1,64 @@
+// filecache.h
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include "public.h"
+
+// 不大于这个大小的文件整个缓存在内存中，大部分 DICOM 实例都小于 1MB
+#ifndef FILE_CACHE_MAX_FILE
+#define FILE_CACHE_MAX_FILE (1 << 20)
+#endif
+
+// 按文件名的 hash 分成多个分片，每个分片一把锁、一个 LRU 链表，内存预算平分
+#ifndef FILE_CACHE_SHARDS
+#define FILE_CACHE_SHARDS (16)
+#endif
+
+#ifndef FILE_CACHE_BUCKETS
+#define FILE_CACHE_BUCKETS (1024)
+#endif
+
+// 缓存的一个文件。缓存和正在使用它的传输各持有一个引用，失效或者淘汰之后，正在
+// 下载的传输仍然可以用完
+typedef struct cached_file_
+{
+    struct cached_file_ * hnext; // 同一个 hash 桶
+    struct cached_file_ * prev;  // LRU 链表，最近使用的在前面
+    struct cached_file_ * next;
+    int refs;
+    int cached;                  // 在缓存中
+    uint64_t hash;
+    uint64_t gen;                // 分配时分片的失效计数，见 insert_cached_file
+    int64_t size;
+    char * name;                 // 相对于后端目录的文件名
+    char data[];
+} cached_file_t;
+
+// 初始化各个分片，在创建工作线程之前调用
+void init_file_cache(void);
+
+// 打开了 -o file_cache 并且文件不超过 FILE_CACHE_MAX_FILE 时返回 1
+int file_cache_wanted(int64_t size);
+
+// 查找文件，找到时增加引用，用完后调用 put_cached_file
+cached_file_t * lookup_cached_file(const char * name);
+
+// 分配一个还不在缓存中的文件，由调用者读入或者复制数据之后调用 insert_cached_file
+cached_file_t * alloc_cached_file(const char * name, int64_t size);
+
+// 把数据已经填好的文件放入缓存，替换同名的文件，调用者仍然持有自己的引用。分配之
+// 后这个分片有文件失效过时，读入的数据可能是旧的，不放入缓存；force 为 1 时（上传
+// 完成）总是放入。放入时返回 0
+int insert_cached_file(cached_file_t * f, int force);
+
+// 删除或者重新上传时让缓存的文件失效
+void invalidate_cached_file(const char * name);
+
+void put_cached_file(cached_file_t * f);
+
+// 累计的命中、未命中、放入、淘汰和失效的次数，以及当前缓存的字节数
+void get_file_cache_stats(uint64_t * hits, uint64_t * misses, uint64_t * fills,
+                          uint64_t * evictions, uint64_t * invalidations, uint64_t * bytes);
+
+#endif // FILECACHE_H
@@ -13,7 +13,23 @@
 #include "timer_set.h"
 #include "events_poll.h"
 #include "conn_mgmt.h"
+#include "conn_pool.h"
+#include "stats.h"
+#include "options.h"
+#include "trunk.h"
+#include "cluster.h"
 #include "pathops.h"
+#include "iopool.h"
+#include "uring.h"
+#include "durable.h"
+#include "pagecache.h"
+#include "prefetch.h"
+#include "resync.h"
+#include "stripe.h"
+#include "dedup.h"
+#include "resume.h"
+#include "filecache.h"
+#include "mirror.h"
 #include "version.h"
 #include "tls.h"
 
@@ -31,12 +47,15 @@ uint32_t asm_id = 0;
 extern char log_file[MAX_NAME_LEN+1];
 extern int is_specified_log_file;
 int backend_cnt = 0;
+// 后端文件绝对路径的最大长度
+#define BACKEND_PATH_LEN (MAX_PATH_LEN + MAX_NAME_LEN + 1)
 char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1] = {{0}};
+// 每个后端目录下的挂载检查目录，写入数据之前确认后端存储仍然挂载着
+static char stub_dirs[MAX_BACK_END][MAX_NAME_LEN + sizeof(MNTDIRNAME) + 1];
 char *default_md5sum_filename = "md5sum.txt";
 
 conn_info_t conns_info[MAX_CONNS_CNT] = {{0}};
 
-static int close_and_check_md5(conn_info_t * c);
 
 
 // 数据迁移时，存储网关内部状态
@@ -236,7 +255,7 @@ typedef struct thread_info_
     int thread_id;
 } thread_info_t;
 
-thread_info_t threads_info[MAX_WORKERS+1] = {{0}};
+thread_info_t threads_info[RESUME_THREAD_ID+1] = {{0}};
 
 pthread_key_t thread_key;
 pthread_once_t thread_once = PTHREAD_ONCE_INIT;
@@ -295,6 +314,21 @@ int forward_message(events_poll_t * events_poll, conn_info_t * curr_conn_info, m
 
     next_conn_info = &conns_info[next_sock_fd];
 
+    // 下一跳发送缓冲区放不下时暂停接收，而不是关闭连接。这时还没有改动消息。
+    if (curr_conn_info->sess != NULL)
+    {
+        // 中继连接上的会话还要受在途请求个数的限制，通过检查后 trans_id 换成
+        // 会话号
+        if (trunk_check_forward(curr_conn_info, msg) == MSG_PAUSED)
+        {
+            return MSG_PAUSED;
+        }
+    }
+    else if (get_ring_free_size(next_conn_info->send) < (uint32_t)len)
+    {
+        return MSG_PAUSED;
+    }
+
     msg->src_type = NODE_TYPE_SGW;
     msg->src_id = local_id;
     msg->dst_type = next_conn_info->peer_type;
@@ -316,7 +350,8 @@ int forward_message(events_poll_t * events_poll, conn_info_t * curr_conn_info, m
     }
 }
 
-int send_response_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, int len)
+// 填写应答的消息头并转换为网络字节序，返回请求的命令字
+static uint32_t encode_response(conn_info_t * conn_info, msg_t * msg, int len)
 {
     uint32_t command = 0;
 
@@ -330,6 +365,12 @@ int send_response_message(events_poll_t * events_poll, conn_info_t * conn_info,
     msg->command = command + 1;
 
     encode_msg(msg);
+    return command;
+}
+
+int send_response_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, int len)
+{
+    uint32_t command = encode_response(conn_info, msg, len);
 
     if (send_message(events_poll, conn_info, (uint8_t *)msg, len) != len)
     {
@@ -345,113 +386,25 @@ int send_response_message(events_poll_t * events_poll, conn_info_t * conn_info,
     }
 }
 
-static int __write_data(int file_fd, uint8_t * data, int len)
-{
-    int errno_cached;
-    int index, loop, ret;
-
-    loop = 16;
-    index = 0;
-    while (index < len && loop > 0)
-    {
-        ret = write(file_fd, &data[index], len-index);
-        errno_cached = errno;
-        if (ret < 0)
-        {
-            if (errno_cached == EINTR)
-            {
-                loop -= 1;
-            }
-            else
-            {
-                log_error("write %d bytes to fd %d failed: %s",
-                          len-index, file_fd, strerror(errno_cached));
-                return -1;
-            }
-        }
-        else
-        {
-            index += ret;
-            loop -= 1;
-        }
-    }
-
-    if (index == len)
-    {
-        return len;
-    }
-    else
-    {
-        log_error("write fd %d failed: want=%d, write=%d",
-                  file_fd, len, index);
-        return -1;
-    }
-}
-
-int write_data(int file_fd, uint64_t offset, uint8_t * data, int len)
+// 应答的消息头之后紧接着 data 的 count 字节，数据直接写入发送缓冲区，不需要先和
+// 消息头放在一起
+static int send_response_data(events_poll_t * events_poll, conn_info_t * conn_info,
+                              msg_t * msg, uint8_t * data, uint32_t count)
 {
-    off_t off = lseek(file_fd, offset, SEEK_SET);
-    int errno_cached = errno;
-    if (off == (off_t)-1)
+    int len = sizeof(msg_t) + count;
+    if (get_ring_free_size(conn_info->send) < (uint32_t)len)
     {
-        log_error("lseek(%d, %lu, SEEK_SET) failed: %s",
-                  file_fd, offset, strerror(errno_cached));
+        log_error("send buffer of sock_fd:%d is too small for %d bytes",
+                  conn_info->sock_fd, len);
         return -1;
     }
-    else
-    {
-        return __write_data(file_fd, data, len);
-    }
-}
-
-static int __read_data(int file_fd, uint8_t * data, int len)
-{
-    int errno_cached;
-    int index, max_loop, ret;
-
-    max_loop = 16;
-    index = 0;
-    while (index < len && max_loop > 0)
-    {
-        ret = read(file_fd, &data[index], len - index);
-        errno_cached = errno;
-        if (ret < 0)
-        {
-            if (errno_cached == EINTR)
-            {
-                max_loop -= 1;
-            }
-            else
-            {
-                log_error("read %d bytes from fd %d failed: %s",
-                          len - index, file_fd, strerror(errno_cached));
-                return -1;
-            }
-        }
-        else
-        {
-            index += ret;
-            max_loop -= 1;
-        }
-    }
-
-    return index;
-}
-
-int read_data(int file_fd, uint64_t offset, uint8_t * data, int len)
-{
-    off_t off = lseek(file_fd, offset, SEEK_SET);
-    int errno_cached = errno;
-    if (off == (off_t)-1)
+    encode_response(conn_info, msg, len);
+    (void) write_ring(conn_info->send, (uint8_t *)msg, sizeof(msg_t));
+    if (send_message(events_poll, conn_info, data, count) != (int)count)
     {
-        log_error("lseek(%d, %lu, SEEK_SET) failed: %s",
-                  file_fd, offset, strerror(errno_cached));
         return -1;
     }
-    else
-    {
-        return __read_data(file_fd, data, len);
-    }
+    return len;
 }
 
 int connect_to_next_sgw(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
@@ -461,11 +414,11 @@ int connect_to_next_sgw(events_poll_t * events_poll, conn_info_t * conn_info, ms
     char sgw_ip[MAX_IP_LEN+1];
     int next_sock_fd = -1;
 
-    inet_ntop(AF_INET, &(task_info->sgw_ip), sgw_ip, sizeof(sgw_ip));
-
-    next_sock_fd = open_tcp_conn(events_poll, sgw_ip, task_info->sgw_port, NULL, 0, 0);
+    // 优先复用连接池中到这个 sgw 的空闲连接
+    next_sock_fd = lease_sgw_conn(events_poll, task_info->sgw_ip, task_info->sgw_port);
     if (next_sock_fd < 3 || next_sock_fd >= MAX_CONNS_CNT)
     {
+        inet_ntop(AF_INET, &(task_info->sgw_ip), sgw_ip, sizeof(sgw_ip));
         log_error("try connecting to sgw:{%s:%d} fail",
                   sgw_ip, task_info->sgw_port);
         return -1;
@@ -475,11 +428,11 @@ int connect_to_next_sgw(events_poll_t * events_poll, conn_info_t * conn_info, ms
     conn_info->next_sock_fd = next_sock_fd;
 
     next_conn_info = &conns_info[next_sock_fd];
+    next_conn_info->flags |= CONN_FLAG_NEXT_HOP;
     next_conn_info->peer_type = NODE_TYPE_SGW;
     next_conn_info->peer_id = task_info->sgw_id;
     next_conn_info->trans_id = msg->trans_id;
     next_conn_info->sequence = msg->sequence;
-    next_conn_info->thread_id = get_thread_id();
 
     next_conn_info->use_proxy = 1;
     next_conn_info->next_sock_fd = conn_info->sock_fd;
@@ -727,11 +680,7 @@ static void setup_abs_file_name(
     msg_t *msg, char *basedir_name)
 {
     task_info_t * t = (task_info_t *)(msg->data);
-    if (t->file_name[0] == '/') {
-        snprintf(abspath, pathlen, "%s%s", basedir_name, t->file_name);
-    } else {
-        snprintf(abspath, pathlen, "%s/%s", basedir_name, t->file_name);
-    }
+    join_path(abspath, pathlen, basedir_name, t->file_name);
 }
 
 static int execute_command(const char *input)
@@ -830,6 +779,24 @@ void save_backend_file_struct(
     f->filedone = 0;
 }
 
+// 开始一次新的传输。如果连接上一次的传输没有正常结束，先关闭遗留的后端文件
+static transfer_t *begin_transfer(conn_info_t *c)
+{
+    if (c->xfer) {
+        reset_transfer(c->xfer);
+    } else {
+        c->xfer = alloc_transfer();
+    }
+    return c->xfer;
+}
+
+// 传输结束，关闭后端文件并归还传输状态
+static void end_transfer(conn_info_t *c)
+{
+    free_transfer(c->xfer);
+    c->xfer = NULL;
+}
+
 static void print_hex(const char *mem, int len)
 {
     char buffer[4096] = {'\0'};
@@ -840,28 +807,54 @@ static void print_hex(const char *mem, int len)
     // log_info("buffer: %s", buffer);
 }
 
-static int create_one_backend_fd(conn_info_t * conn_info, msg_t * msg, int index)
+// 文件大小达到 -o direct_io 的阈值时另外用 O_DIRECT 读写，不占用页缓存
+static int use_direct_io(uint64_t size)
+{
+    return sgw_options.direct_io > 0 && size >= ((uint64_t)sgw_options.direct_io << 20);
+}
+
+// 用 O_DIRECT 打开文件，失败时返回 -1，这时仍然使用页缓存
+static int open_direct_fd(char * abs_file_name, int flags)
+{
+    int fd = open(abs_file_name, flags | O_DIRECT | O_CLOEXEC);
+    if (fd < 0)
+    {
+        log_warning("open %s with O_DIRECT failed: %s, use page cache",
+                    abs_file_name, strerror(errno));
+        return -1;
+    }
+    return handle_fd_error(abs_file_name, fd, 0) == 0 ? fd : -1;
+}
+
+static int create_one_backend_fd(transfer_t * x, msg_t * msg, int index)
 {
     char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
     setup_abs_file_name(abs_file_name, sizeof(abs_file_name), msg, backend_dirs[index]);
     int errno_cached;
+    struct stat s;
+    // open_path 不截断已经存在的文件，放弃的上传只能删除自己创建的文件
+    int created = stat(abs_file_name, &s) < 0;
     int fd = open_path(abs_file_name);
+    if (fd >= 0 && fstat(fd, &s) == 0 && s.st_nlink > 1)
+    {
+        // 去重时硬链接的文件和其它文件名共享内容，不能原地覆盖，删除之后重新创建
+        close(fd);
+        (void) unlink(abs_file_name);
+        fd = open_path(abs_file_name);
+        created = 1;
+    }
     errno_cached = errno;
     int ret = handle_fd_error(abs_file_name, fd, errno_cached);
     if (ret == 0)
     {
-        save_backend_file_struct(&conn_info->befiles[index],
-                                 msg, fd, abs_file_name);
-        task_info_t *t = (task_info_t *)msg->data;
-        int md5len = 0;
-        char *p = t->file_md5;
-        while (p < t->file_md5 + 32) {
-            if (*p == '\0') {
-                break;
-            } else {
-                md5len = md5len + 1;
-            }
-            p = p + 1;
+        save_backend_file_struct(&x->befiles[index], msg, fd, abs_file_name);
+        if (created)
+        {
+            x->created = x->created | (1u << index);
+        }
+        if (use_direct_io(msg->total))
+        {
+            x->befiles[index].dfd = open_direct_fd(abs_file_name, O_WRONLY);
         }
         return 0;
     }
@@ -872,826 +865,1581 @@ static int create_one_backend_fd(conn_info_t * conn_info, msg_t * msg, int index
     }
 }
 
-static int create_backend_fds(conn_info_t * conn_info, msg_t * msg)
+// 写入成功的后端目录个数不少于 -o write_quorum 时返回 1。异步复制时只要第一个后
+// 端目录写入成功
+static int have_write_quorum(const transfer_t * x)
 {
-    int i;
-    for (i = 0; i < backend_cnt; i++)
-    {
-        int ret = create_one_backend_fd(conn_info, msg, i);
-        if (ret == -1)
-        {
-            return -1;
-        }
-    }
-
-    return 0;
+    int written = backend_cnt - __builtin_popcount(x->lost | x->deferred);
+    return written >= (x->deferred ? 1 : write_quorum());
 }
 
-/* 成功接收到一个完整的包返回 0，没有接收到完整的包返回 -1 */
-static ssize_t recv_packet(int sd, char *buf, ssize_t buflen)
+// 上传时一个后端目录创建或者写入失败，之后不再写入这个目录。文件描述符可能还在
+// 流水线请求中使用，上传结束时再关闭
+static void lose_backend(transfer_t * x, int i)
 {
-    ssize_t recvsize;
-#ifdef TLS
-    SSL *ssl;
-    ssl = conns_info[sd].ssl;
-    recvsize = SSL_read(ssl, buf, 4);
-#else
-    recvsize = recv(sd, buf, 4, MSG_WAITALL);
-#endif
-    if (recvsize == 4) {
-        // log_debug("recv msglen from sock_fd:%d finished ...", sd);
-    } else {
-        log_error("recv msglen from sock_fd:%d failed: %d recv, %d expect",
-                  sd, (int)recvsize, 4);
-        return -1;
-    }
-
-    uint32_t msglen = be32toh(*((int *)(&buf[0])));
-    if (sizeof(msg_t) <= msglen && msglen <= buflen) {
-        // log_debug("good msglen %u from sock_fd:%d", msglen, sd);
-    } else {
-        log_error("recv invalid msglen %u from sock_fd:%d!",
-                  msglen, sd);
-        return -1;
-    }
-
-    ssize_t leftsize = msglen - 4;
-    ssize_t donesize = 4;
-    while (leftsize > 0) {
-#ifdef TLS
-        recvsize = SSL_read(ssl, buf + donesize, leftsize);
-#else
-        recvsize = recv(sd, buf + donesize, leftsize, MSG_WAITALL);
-#endif
-        if (recvsize > 0) {
-            leftsize = leftsize - recvsize;
-            donesize = donesize + recvsize;
-        } else if (recvsize == 0) {
-            if (leftsize == 0) {
-                // 对端关闭了连接，也接收到完整的消息包：这种情况应该不会出现。
-                log_error("recv_packet completed, but sock_fd:%d peer closed", sd);
-            } else {
-                log_error("sock_fd:%d recv_packet uncompleted: %lld bytes left, peer closed",
-                          sd, (long long int)leftsize);
-            }
-            return -1;
-        } else {
-            int ec = errno;
-            if (ec == EINTR) {
-                /* 系统调用被中断，继续接收 */
-            } else {
-                log_error("%d want, %d recv, %d left: %s",
-                        (int)msglen, (int)donesize, (int)leftsize, strerror(ec));
-                return -1;
-            }
-        }
+    if ((x->lost & (1u << i)) == 0)
+    {
+        x->lost = x->lost | (1u << i);
+        log_warning("stop writing %s to backend %s", x->befiles[i].abs_file_name,
+                    backend_dirs[i]);
     }
-
-    return 0;
 }
 
-static int sendall(int sd, const char *buf, int len)
+// 上传时第一个没有写入失败的后端文件
+static struct backend_file * first_written_file(transfer_t * x)
 {
-    int left = len;
-    int done = 0;
-    conn_info_t conn_info;
-    int n;
-
-    conn_info = conns_info[sd];
-    while (left > 0) {
-#ifdef TLS
-        if(conn_info.peer_type == NODE_TYPE_ASM)
-            n = send(sd, buf, left, MSG_WAITALL);
-        else
-            n = SSL_write(conn_info.ssl, buf, left);
-#else
-        n = send(sd, buf, left, MSG_WAITALL);
-#endif
-        if (n > 0) {
-            left = left - n;
-            done = done + n;
-        } else if (n == 0) {
-            /* 没有发送到数据，继续重试 */
-        } else {
-            int ec = errno;
-            if (ec == EINTR) {
-                /* 系统调用被中断，继续重试 */
-            } else {
-                log_error("send %d bytes failed: %s",
-                          len, strerror(ec));
-                return -1;
-            }
+    int i;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        if (((x->lost | x->deferred) & (1u << i)) == 0)
+        {
+            return &x->befiles[i];
         }
     }
-    return done;
-}
-
-struct upctx {
-    events_poll_t *ep;
-    conn_info_t *ci;
-    msg_t *msg;
-    uint64_t filesize;
-    char buffer[MAX_MESSAGE_LEN];
-    char filename[MAX_NAME_LEN];
-};
-
-/* 处理上传开始请求（CMD_START_UPLOAD_REQ） */
-static int workrq0(struct upctx *ctx)
-{
-    assert(ctx);
-    assert(ctx->ci);
-    assert(ctx->msg);
-
-    conn_info_t *c = ctx->ci;
-    msg_t *m = ctx->msg;
-    int rc = create_backend_fds(c, m);
-    if (rc == 0) {
-        ctx->filesize = m->total;
-        m->ack_code = 200;
-        return 0;
-    } else {
-        log_error("create_backend_fds failed");
-        m->ack_code = 404;
-        return -1;
-    }
+    return &x->befiles[0];
 }
 
-static int sendrs0(struct upctx *ctx)
+// 异步复制的后端目录中删除原来的文件，复制完成之前不会从这个目录读到旧的内容
+static void remove_deferred_file(msg_t * msg, int index)
 {
-    assert(ctx);
-    assert(ctx->ci);
-    assert(ctx->msg);
-
-    msg_t *m = ctx->msg;
-    m->command = m->command + 1;
-    m->src_type = NODE_TYPE_SGW;
-    m->src_id = local_id;
-    m->dst_type = ctx->ci->peer_type;
-    m->dst_id = ctx->ci->peer_id;
-    m->length = sizeof(msg_t) + sizeof(task_info_t);
-    encode_msg(m);
-
-    task_info_t *t = (task_info_t *)(m->data);
-    encode_task_info(t);
-
-    int msglen = sizeof(msg_t) + sizeof(task_info_t);
-    int sendlen = sendall(ctx->ci->sock_fd, (const char *)m, msglen);
-    if (sendlen == msglen) {
-        return 0;
-    } else {
-        log_error("sendrs0 failed: %d send, %d want", sendlen, msglen);
-        return -1;
+    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    setup_abs_file_name(abs_file_name, sizeof(abs_file_name), msg, backend_dirs[index]);
+    if (unlink(abs_file_name) < 0 && errno != ENOENT)
+    {
+        log_warning("remove old %s failed: %s", abs_file_name, strerror(errno));
     }
 }
 
-static int __recvrq(struct upctx *ctx)
+// I/O 线程：在每个后端目录下创建文件，必要时创建所在的目录。创建失败的后端目录
+// 不超过 -o write_quorum 允许的个数时上传继续
+static void create_backend_files_work(io_job_t * job)
 {
-    assert(ctx);
-    assert(ctx->ci);
-    assert(ctx->ci->sock_fd >= 0);
-
-    int sd = ctx->ci->sock_fd;
-    char *buffer = ctx->buffer;
-    int buflen = sizeof(ctx->buffer);
-    int rc = recv_packet(sd, buffer, buflen);
-    if (rc == 0) {
-        ctx->msg = (msg_t *)(ctx->buffer);
-        return 0;
-    } else {
-        log_error("recv packet from sock_fd:%d failed!", sd);
-        return -1;
+    int i;
+    job->result = 0;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        if (job->xfer->deferred & (1u << i))
+        {
+            remove_deferred_file(job->msg, i);
+            continue;
+        }
+        if (job->xfer->lost & (1u << i))
+        {
+            // 续传时这个后端目录没有进度记录，上传完成后补写
+            continue;
+        }
+        int ret = create_one_backend_fd(job->xfer, job->msg, i);
+        if (ret == -1)
+        {
+            job->xfer->lost = job->xfer->lost | (1u << i);
+            if (!have_write_quorum(job->xfer))
+            {
+                job->result = -1;
+                return;
+            }
+        }
     }
 }
 
-static int recvrq1(struct upctx *ctx)
-{
-    return __recvrq(ctx);
-}
-
-
-int check_stub_dir(const char *dirpath)
+// 检查挂载检查目录的 statx 结果
+static int check_stub_dir(const io_op_t *op)
 {
-    struct stat s;
-    int rc = stat(dirpath, &s);
-    if (rc == 0) {
-        if (S_ISDIR(s.st_mode)) {
+    if (op->res == 0) {
+        if (S_ISDIR(op->stx.stx_mode)) {
             return 0;
         } else {
-            log_error("dirpath %s is not a directory", dirpath);
+            log_error("dirpath %s is not a directory", op->path);
             return -1;
         }
     } else {
-        if (errno == ENOENT) {
-            log_error("no %s: mount point disappear?", dirpath);
+        if (op->res == -ENOENT) {
+            log_error("no %s: mount point disappear?", op->path);
         } else {
-            log_error("check %s failed: %s", dirpath, strerror(errno));
+            log_error("check %s failed: %s", op->path, strerror(-op->res));
         }
         return -1;
     }
 }
 
-static int workrq1(struct upctx *ctx)
+#ifdef MD5
+// 上传结束时检查文件的 md5，通过后追加到文件所在目录的 .hash 文件中
+static int check_and_record_md5(transfer_t * x, msg_t * m)
 {
-    assert(ctx);
-    assert(ctx->ep);
-    assert(ctx->ci);
-    assert(ctx->msg);
-
-    conn_info_t *c = ctx->ci;
-    msg_t *m = ctx->msg;
+    char filemd5[MD5_LEN + 1];
+    FILE *hash_fp = NULL;
     int i;
+
+    md5_hex(x->md5ctx, filemd5);
+    task_info_t *ti = (task_info_t *)m->data;
+    if (strcmp(ti->file_md5, filemd5)) {
+        log_error("check md5 failed");
+        return -1;
+    }
+
+    // 条带模式下每个目录只有一个分片，每个目录都记录，缺少分片的下载仍然可以校验
     for (i = 0; i < backend_cnt; i++) {
-        char checkpoint[MAX_PATH_LEN];
-        sprintf(checkpoint, "%s/%s", backend_dirs[i], MNTDIRNAME);
-        int rc = check_stub_dir(checkpoint);
-        if (rc == 0) {
-            /* pass */
-        } else {
-            log_error("check_stub_dir failed");
+        struct backend_file *f = &x->befiles[i];
+        if (stripe_enabled() ? f->fd < 0 : f != first_written_file(x)) {
+            continue;
+        }
+        char *abs_file_name = f->abs_file_name;
+        char hash_file_path[strlen(abs_file_name) + strlen("/.hash")];
+        get_path_head(abs_file_name, hash_file_path);
+        strcat(hash_file_path, "/.hash");
+        hash_fp = fopen(hash_file_path, "a+");
+        if (hash_fp == NULL) {
+            log_error("open %s failed", hash_file_path);
             return -1;
         }
-
-        int n = write_data(
-            c->befiles[i].fd, m->offset, m->data, m->count);
-        if (n == (int)m->count) {
-            // 写入文件成功，继续写入下一个后端文件
-        } else {
-            // 写入文件失败，立刻返回，不再写入其他的后端文件
-            log_error("write %s:%lld failed: %d want, %d write",
-                      c->befiles[i].abs_file_name,
-                      (long long int)m->offset,
-                      (int)m->count, n);
+        fputs(filemd5, hash_fp);
+        fputs("\n", hash_fp);
+        if (sgw_options.durability != DURABILITY_NONE &&
+            (fflush(hash_fp) != 0 || fdatasync(fileno(hash_fp)) < 0))
+        {
+            log_error("sync %s failed: %s", hash_file_path, strerror(errno));
+            fclose(hash_fp);
             return -1;
         }
+        fclose(hash_fp);
     }
-    m->ack_code = 200;
     return 0;
 }
+#endif
 
-// 响应消息只有消息头部
-static int sendrs1(struct upctx *ctx)
-{
-    assert(ctx);
-    assert(ctx->ep);
-    assert(ctx->ci);
-    assert(ctx->ci->sock_fd >= 0);
-    assert(ctx->msg);
-
-    msg_t *m = ctx->msg;
-    m->command = m->command + 1;
-    m->src_type = NODE_TYPE_SGW;
-    m->src_id = local_id;
-    m->dst_type = ctx->ci->peer_type;
-    m->dst_id = ctx->ci->peer_id;
-    m->length = sizeof(msg_t);
-    encode_msg(m);
-
-    int msglen = sizeof(msg_t);
-    int sd = ctx->ci->sock_fd;
-    int sendlen = sendall(sd, (const char *)m, msglen);
-    if (sendlen == msglen) {
-        return 0;
-    } else {
-        log_error("sendrs1 failed: %d send, %d want", sendlen, msglen);
+#ifdef MD5
+// 续传时已经收到的数据从后端文件读出来计算 md5
+static int hash_file_prefix(transfer_t * x, int64_t len)
+{
+    struct backend_file * f = first_written_file(x);
+    char * buf = (char *)malloc(MAX_MSG_DATA_LEN);
+    if (!buf)
+    {
+        log_error("malloc %d bytes for md5 failed", MAX_MSG_DATA_LEN);
         return -1;
     }
+    int64_t done = 0;
+    while (done < len)
+    {
+        int64_t want = len - done < MAX_MSG_DATA_LEN ? len - done : MAX_MSG_DATA_LEN;
+        ssize_t n = pread(f->fd, buf, want, done);
+        if (n <= 0)
+        {
+            log_error("read %s for md5 failed: %s", f->abs_file_name,
+                      n < 0 ? strerror(errno) : "short file");
+            free(buf);
+            return -1;
+        }
+        EVP_DigestUpdate(x->md5ctx, buf, n);
+        done = done + n;
+    }
+    free(buf);
+    return 0;
 }
+#endif
 
-
-static int workrq2(struct upctx *ctx)
+// I/O 线程：打开了 -o dedup 时先检查文件是否已经存在，已经存在时不创建后端文件。
+// 客户端请求续传时找到上次的进度，没有进度记录的后端目录这次不写入
+static void start_upload_work(io_job_t * job)
 {
-    assert(ctx);
-    assert(ctx->ci);
-    assert(ctx->msg);
-
-    conn_info_t *c = ctx->ci;
-    msg_t *m = ctx->msg;
-    int rc = close_and_check_md5(c);
-    if (rc == 0) {
-        m->ack_code = 200;
-        return 0;
-    } else {
-        m->ack_code = 404;
-        log_error("close_and_check_md5 on sock_fd:%d failed", c->sock_fd);
-        return -1;
+    transfer_t * x = job->xfer;
+    if (dedup_enabled() && dedup_upload(job->msg))
+    {
+        job->result = ACK_ALREADY_PRESENT;
+        return;
+    }
+    int64_t offset = 0;
+    if (resume_enabled() && job->msg->offset == UPLOAD_RESUME_OFFSET)
+    {
+        uint32_t missing;
+        offset = find_resume_point(x, job->msg, &missing);
+        x->lost = missing;
+        if (!have_write_quorum(x))
+        {
+            x->lost = 0;
+            offset = 0;
+        }
+    }
+    create_backend_files_work(job);
+    if (job->result < 0)
+    {
+        return;
+    }
+#ifdef MD5
+    EVP_DigestInit_ex(x->md5ctx, EVP_md5(), NULL);
+    if (offset > 0 && hash_file_prefix(x, offset) < 0)
+    {
+        EVP_DigestInit_ex(x->md5ctx, EVP_md5(), NULL);
+        offset = 0;
+    }
+#endif
+    if (resume_enabled())
+    {
+        open_resume_records(x, job->msg, offset);
     }
 }
 
-static int sendrs2(struct upctx *ctx)
+static int start_upload_done(
+    events_poll_t * events_poll, conn_info_t * conn_info, io_job_t * job)
 {
-    return sendrs1(ctx);
+    msg_t * msg = job->msg;
+    if (job->result < 0)
+    {
+        log_error("create backend files failed");
+        return -1;
+    }
+    if (job->result == ACK_ALREADY_PRESENT)
+    {
+        // 不会再有上传数据和上传完成请求，传输到此结束；硬链接替换了原来的文件
+        task_info_t * t = (task_info_t *)msg->data;
+        invalidate_cached_file(t->file_name);
+        end_transfer(conn_info);
+        msg->ack_code = ACK_ALREADY_PRESENT;
+        encode_task_info((task_info_t *)msg->data);
+        return send_response_message(events_poll, conn_info, msg,
+                                     sizeof(msg_t) + sizeof(task_info_t));
+    }
+    if (msg->offset == UPLOAD_RESUME_OFFSET)
+    {
+        // 续传点，客户端从这里继续发送
+        msg->offset = conn_info->xfer->resume_committed;
+    }
+    msg->ack_code = 200;
+    encode_task_info((task_info_t *)msg->data);
+    return send_response_message(events_poll, conn_info, msg,
+                                 sizeof(msg_t) + sizeof(task_info_t));
 }
 
+// 开始上传时只创建后端文件，之后的上传数据请求和上传完成请求和其它消息一样由事
+// 件循环逐个处理，文件操作都在 I/O 线程中执行
 static int handle_start_upload_request(
     events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
 {
-    // log_debug("enter start upload request");
-
-    struct upctx ctx;
-#ifdef MD5
-    MD5_CTX md_context;
-#endif
-    unsigned char c[MD5_DIGEST_LENGTH];
-    char *filemd5 = (char*) malloc(33 * sizeof(char));
-    msg_t *m;
-    FILE *hash_fp = NULL;
-
-    ctx.ep = events_poll;
-    ctx.ci = conn_info;
-    task_info_t *t = (task_info_t *)msg->data;
-    snprintf(ctx.filename, sizeof(ctx.filename), "%s", t->file_name);
-
-    // 上传开始请求。这个消息已经接收完成，并且完成了消息检查
-    ctx.msg = msg;
-    int rc0 = workrq0(&ctx);
-    if (rc0 == 0) {
-        // 处理上传开始请求成功
-        // log_debug("workrq0 finished ...");
-    } else {
-        log_error("workrq0 failed: filename %s, retcode %d", ctx.filename, rc0);
-        goto failed;
+    transfer_t * x = begin_transfer(conn_info);
+    if (!x)
+    {
+        return -1;
     }
-    rc0 = sendrs0(&ctx);
-    if (rc0 == 0) {
-        // 发送上传开始响应结束，继续处理上传数据请求
-        // log_debug("sendrs0 finished ...");
-    } else {
-        log_error("sendrs0 failed: filename %s, retcode %d", ctx.filename, rc0);
-        goto failed;
+    // 重新上传的文件，缓存中的内容已经过时；小文件在上传的同时复制一份
+    task_info_t * t = (task_info_t *)msg->data;
+    invalidate_cached_file(t->file_name);
+    if (file_cache_wanted(msg->total))
+    {
+        x->fill = alloc_cached_file(t->file_name, msg->total);
     }
-
-    // 上传数据请求
-    tcp_setblocking(conn_info->sock_fd);
-    int64_t leftsize = ctx.filesize;
-    // log_debug("filesize: %lld", (long long int)leftsize);
-#ifdef MD5
-    MD5_Init (&md_context);
-#endif
-    while (1) {
-        int rc1 = recvrq1(&ctx);
-        if (rc1 == 0) {
-            // 因为操作逻辑多，会导致代码缩进层次增多。
-            // 临时变换为平坦模式的编码风格，阅读起来方便一点。
-            // log_debug("recvrq1 finished ...");
-        } else {
-            log_error("recvrq1 failed: %s (%lld / %lld)",
-                      ctx.filename,
-                      (long long int)leftsize,
-                      (long long int)ctx.filesize);
-            goto failed;
-        }
-
-        m = ctx.msg;
-        decode_msg(m);
-        if (m->command == CMD_UPLOAD_FINISH_REQ) {
-            break;
-        }
-#ifdef MD5
-        MD5_Update (&md_context, m->data, m->count);
-#endif
-        rc1 = workrq1(&ctx);
-        if (rc1 == 0) {
-            // 处理消息成功，继续处理
-            // log_debug("workrq1 finished ...");
-        } else {
-            log_error("workrq1 failed: %s (%lld / %lld)",
-                      ctx.filename,
-                      (long long int)leftsize,
-                      (long long int)ctx.filesize);
-            goto failed;
-        }
-
-        rc1 = sendrs1(&ctx);
-        if (rc1 == 0) {
-            // 发送响应成功，继续接收下一个上传数据的消息
-            // log_debug("sendrs1 finished ...");
-        } else {
-            log_error("sendrs1 failed: %s (%lld / %lld)",
-                      ctx.filename,
-                      (long long int)leftsize,
-                      (long long int)ctx.filesize);
-            goto failed;
-        }
-    }
-
-    // 上传结束请求
-#ifdef MD5
-//    struct stat st;
-//    int hash_file_size = 0;
-    MD5_Final (c, &md_context);
-    for(int i = 0; i < MD5_DIGEST_LENGTH; i++) {
-        sprintf(&filemd5[i * 2], "%02x", (unsigned int)c[i]);
+    if (async_mirror_wanted())
+    {
+        // 只写第一个后端目录，其它镜像在上传完成后由补写线程复制
+        x->deferred = ((1u << backend_cnt) - 1) & ~1u;
     }
-    task_info_t *ti = (task_info_t *)m->data;
-    if (!strcmp(ti->file_md5, filemd5)) {
-        conn_info_t *ci = ctx.ci;
-        char *abs_file_name = ci->befiles[0].abs_file_name;
-        char hash_file_path[strlen(abs_file_name) + strlen("/.hash")];
-        get_path_head(abs_file_name, hash_file_path);
-        strcat(hash_file_path, "/.hash");
-//        if(stat(hash_file_path, &st)==0)
-//            hash_file_size = st.st_size;
-//        if (hash_file_size >= 2 * (strlen(filemd5) + 1))
-//            hash_fp = fopen(hash_file_path, "w");
-//        else
-        hash_fp = fopen(hash_file_path, "a+");
-        if (hash_fp == NULL) {
-            log_error("open %s failed", hash_file_path);
-            free(filemd5);
-            goto failed;
+    if (stripe_enabled())
+    {
+        x->stripe_row = (uint8_t *)malloc(stripe_data_shards() * STRIPE_UNIT);
+        if (!x->stripe_row)
+        {
+            log_error("malloc %d bytes for stripe row failed", stripe_data_shards() * STRIPE_UNIT);
+            return -1;
         }
-        fputs(filemd5, hash_fp);
-        fputs("\n", hash_fp);
-        fclose(hash_fp);
-        free(filemd5);
-    } else {
-        free(filemd5);
-        log_error("check md5 failed");
-        goto failed;
-    }
-#endif
-    int rc2 = workrq2(&ctx);
-    if (rc2 == 0) {
-        // 处理上传结束请求成功
-        // log_debug("workrq2 finished ...");
-    } else {
-        log_error("workrq2 failed: filename %s", ctx.filename);
-        goto failed;
-    }
-    rc2 = sendrs2(&ctx);
-    if (rc2 == 0) {
-        // 发送上传结束响应成功
-        // log_debug("sendrs2 finished ...");
-    } else {
-        log_error("sendrs2 failed: filename %s", ctx.filename);
-        goto failed;
     }
-
-    // 处理成功，连接保留不关闭，以便可以继续使用同一个连接传输
-    tcp_setnonblock(conn_info->sock_fd);
-    return 0;
-
-failed:
-    close_tcp_conn(events_poll, conn_info->sock_fd);
-    return -1;
-}
-
-static int check_one_backend_file(msg_t * msg, char *basedir_name)
-{
-    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
-    setup_abs_file_name(abs_file_name, sizeof(abs_file_name), msg, basedir_name);
-
-    struct stat path_stat;
-    int ret = stat(abs_file_name, &path_stat);
-    int errno_cached = errno;
-    if (ret == -1)
+    io_job_t * job = alloc_io_job();
+    if (!job)
     {
-        log_error("> check file %s failed: %s",
-                  abs_file_name, strerror(errno_cached));
         return -1;
     }
-    else
-    {
-        return 0;
-    }
+    job->work = start_upload_work;
+    job->done = start_upload_done;
+    job->msg = msg;
+    job->xfer = conn_info->xfer;
+    return run_io_job(events_poll, conn_info, job);
 }
 
-/* 返回后端文件正常的数量 */
-static int check_backend_files(msg_t * msg)
+// 在请求中准备各个后端文件的路径，失败时返回 NULL
+static char * setup_backend_paths(io_job_t * job, msg_t * msg)
 {
-    int goodfiles = 0;
     int i;
+    job->data = (char *)malloc(backend_cnt * BACKEND_PATH_LEN);
+    if (!job->data)
+    {
+        log_error("malloc %d backend paths failed", backend_cnt);
+        return NULL;
+    }
     for (i = 0; i < backend_cnt; i++)
     {
-        int ret = check_one_backend_file(msg, backend_dirs[i]);
-        if (!ret)
-        {
-            goodfiles = goodfiles + 1;
-        }
+        setup_abs_file_name(job->data + i * BACKEND_PATH_LEN, BACKEND_PATH_LEN,
+                            msg, backend_dirs[i]);
     }
-    return goodfiles;
+    return job->data;
 }
 
-static int open_one_backend_fd(conn_info_t * conn_info, msg_t * msg, int index)
+static int send_start_download_response(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, uint64_t size)
 {
-    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
-    setup_abs_file_name(abs_file_name, sizeof(abs_file_name), msg, backend_dirs[index]);
-
-    int errno_cached;
-    int fd = open(abs_file_name, O_RDONLY);
-    errno_cached = errno;
+    task_info_t * task_info = (task_info_t *)(msg->data);
+    task_info->file_len = size;
+    encode_task_info(task_info);
+    msg->total = size;
+    msg->offset = 0UL;
+    msg->count = 0UL;
+    msg->ack_code = 200;
+    return send_response_message(events_poll, conn_info, msg, msg->length);
+}
 
-    int ret = handle_fd_error(abs_file_name, fd, errno_cached);
-    if (ret == 0)
+// 整个文件读入之后放入缓存，读取失败时仍然从后端文件下载
+static int fill_file_cache_done(
+    events_poll_t * events_poll, conn_info_t * conn_info, io_job_t * job)
+{
+    transfer_t * x = conn_info->xfer;
+    cached_file_t * f = (cached_file_t *)job->data;
+    job->data = NULL;
+    if (job->ops[0].res == f->size)
     {
-        save_backend_file_struct(&conn_info->befiles[index],
-                                 msg, fd, abs_file_name);
-        // log_info("> open backend_fd %d(%s) in connection %d", fd, abs_file_name, conn_info->sock_fd);
-        return 0;
+        (void) insert_cached_file(f, 0);
+        x->cached = f;
     }
     else
     {
-        return -1;
+        log_warning("read %s for file cache failed: %d want, %d read",
+                    x->befiles[job->index].abs_file_name, (int)f->size, job->ops[0].res);
+        put_cached_file(f);
     }
+    return send_start_download_response(events_poll, conn_info, job->msg, f->size);
 }
 
-static int open_backend_fds(conn_info_t * conn_info, msg_t * msg)
+// 小文件第一次下载时先把整个文件读入内存缓存，之后的下载数据请求都从内存中应答
+static int fill_file_cache(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, uint64_t size)
 {
-    int nr_opens = 0;
-    int i;
-    for (i = 0; i < backend_cnt; i++)
+    transfer_t * x = conn_info->xfer;
+    task_info_t * t = (task_info_t *)msg->data;
+    int index = 0;
+    while (index < backend_cnt && x->befiles[index].fd < 0)
     {
-        int ret = open_one_backend_fd(conn_info, msg, i);
-        if (ret == 0)
-        {
-            nr_opens = nr_opens + 1;
-        }
+        index = index + 1;
+    }
+    cached_file_t * f = alloc_cached_file(t->file_name, size);
+    if (!f)
+    {
+        return send_start_download_response(events_poll, conn_info, msg, size);
     }
-    return nr_opens;
+    io_job_t * job = alloc_io_job();
+    if (!job)
+    {
+        put_cached_file(f);
+        return -1;
+    }
+    io_op_t * op = add_io_op(job, IO_OP_READ);
+    op->fd = x->befiles[index].fd;
+    op->offset = 0;
+    op->buf = f->data;
+    op->len = size;
+    job->index = index;
+    job->data = (char *)f; // 连接在读完之前关闭时和请求一起释放
+    job->work = run_io_ops;
+    job->done = fill_file_cache_done;
+    job->msg = msg;
+    job->xfer = x;
+    return run_io_job(events_poll, conn_info, job);
 }
 
-static int setup_start_download_reponse_message(
-    conn_info_t * conn_info, msg_t * msg)
+static int route_download_to_owner(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg);
+
+// 每个后端文件有 statx 和 open 两个操作，启用 O_DIRECT 时还有一个 O_DIRECT 的
+// open，都在请求的 ops 中按后端文件的顺序排列
+static int start_download_done(
+    events_poll_t * events_poll, conn_info_t * conn_info, io_job_t * job)
 {
-    (void) conn_info;
-    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
-    struct stat file_stat;
+    msg_t * msg = job->msg;
+    const io_op_t * found = NULL;
+    int nr_files = 0;
+    int nr_opens = 0;
+    int stride = job->nr_ops / backend_cnt;
     int i;
     for (i = 0; i < backend_cnt; i++)
     {
-        setup_abs_file_name(abs_file_name, sizeof(abs_file_name),
-                            msg, backend_dirs[i]);
-        memset(&file_stat, 0, sizeof(file_stat));
-        int ret = stat(abs_file_name, &file_stat);
-        if (ret == 0)
+        const io_op_t * st = &job->ops[i * stride];
+        const io_op_t * op = &job->ops[i * stride + 1];
+        const io_op_t * dop = stride > 2 ? &job->ops[i * stride + 2] : NULL;
+        if (st->res == 0)
         {
-            task_info_t * task_info = (task_info_t *)(msg->data);
-            task_info->file_len = file_stat.st_size;
-            encode_task_info(task_info);
-            msg->total = file_stat.st_size;
-            msg->offset = 0UL;
-            msg->count = 0UL;
-            msg->ack_code = 200;
-            return 0;
+            nr_files = nr_files + 1;
+            if (!found)
+            {
+                found = st;
+            }
         }
-    }
-    return -1;
-}
-
-static int handle_start_download_request(
-    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
-{
-    int nr_files = check_backend_files(msg);
-    if (nr_files > 0)
-    {
-        int nr_opens = open_backend_fds(conn_info, msg);
-        if (nr_opens > 0)
+        else if (!conn_info->xfer->routed || st->res != -ENOENT)
         {
-            int ret = setup_start_download_reponse_message(conn_info, msg);
-            if (ret == 0)
+            log_error("> check file %s failed: %s", st->path, strerror(-st->res));
+        }
+        char * path = (char *)op->path;
+        int fd = op->res >= 0 ? op->res : -1;
+        if (conn_info->xfer->routed && op->res == -ENOENT)
+        {
+            // 文件不在本节点，之后按分布表处理
+        }
+        else if (handle_fd_error(path, fd, -op->res) == 0)
+        {
+            save_backend_file_struct(&conn_info->xfer->befiles[i], msg, fd, path);
+            conn_info->xfer->befiles[i].filesize = st->res == 0 ? (int64_t)st->stx.stx_size : 0;
+            nr_opens = nr_opens + 1;
+        }
+        if (dop && dop->res >= 0)
+        {
+            struct backend_file * f = &conn_info->xfer->befiles[i];
+            if (f->fd >= 0 && st->res == 0 && use_direct_io(st->stx.stx_size))
             {
-                return send_response_message(events_poll, conn_info,
-                                             msg, msg->length);
+                // 超过上限时 handle_fd_error 已经关闭
+                f->dfd = handle_fd_error(path, dop->res, 0) == 0 ? dop->res : -1;
             }
             else
             {
-                log_error("setup response message failed");
-                return -1;
+                close(dop->res);
             }
         }
-        else
-        {
-            log_error("open backend files failed");
-            return -1;
-        }
     }
-    else
+
+    if (nr_files == 0 && conn_info->xfer->routed)
     {
-        log_error("no backend file");
-        return -1;
+        return route_download_to_owner(events_poll, conn_info, msg);
     }
-}
-
-static int remove_one_backend_file(
-    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg,
-    char * basedir_name)
-{
-    (void) events_poll;
-    (void) conn_info;
-
-    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
-    setup_abs_file_name(abs_file_name, sizeof(abs_file_name), msg, basedir_name);
-
-    int ret = remove(abs_file_name);
-    int errno_cached = errno;
-    if (ret == 0)
+    if (nr_files == 0)
     {
-        log_info("> remove file %s ok", abs_file_name);
-        return 0;
+        log_error("no backend file");
+        return -1;
     }
-    else
+    if (nr_opens == 0 || !found)
     {
-        log_error("> remove file %s failed: %s", abs_file_name, strerror(errno_cached));
+        log_error("open backend files failed");
         return -1;
     }
-}
 
-static int remove_backend_files(
-    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
-{
-    int nr_removes = 0;
-    int i;
-    for (i = 0; i < backend_cnt; i++)
+    uint64_t size = found->stx.stx_size;
+    if (file_cache_wanted(size))
     {
-        int ret = remove_one_backend_file(events_poll, conn_info, msg, backend_dirs[i]);
-        if (ret == 0)
-        {
-            nr_removes = nr_removes + 1;
-        }
+        return fill_file_cache(events_poll, conn_info, msg, size);
     }
-    return nr_removes;
+    return send_start_download_response(events_poll, conn_info, msg, size);
 }
 
-static int handle_delete_request(
-    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+// I/O 线程：条带模式下打开各个后端目录中的分片，取得文件大小。job->index 为 1 时
+// 是顺序下载。小文件和顺序下载的文件整个恢复到内存中，之后从内存发送
+static void open_stripe_files_work(io_job_t * job)
 {
-    int ack_code;
-    int nr_files = check_backend_files(msg);
-    if (nr_files > 0)
+    transfer_t * x = job->xfer;
+    int fds[MAX_BACK_END];
+    int nr_opens = 0;
+    int i;
+    job->result = -1;
+    for (i = 0; i < backend_cnt; i++)
     {
-        int nr_removes = remove_backend_files(events_poll, conn_info, msg);
-        if (nr_removes == nr_files)
+        struct backend_file * f = &x->befiles[i];
+        char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+        setup_abs_file_name(abs_file_name, sizeof(abs_file_name), job->msg, backend_dirs[i]);
+        int fd = open(abs_file_name, O_RDONLY | O_CLOEXEC);
+        if (handle_fd_error(abs_file_name, fd, errno) == 0)
         {
-            ack_code = 200;
+            save_backend_file_struct(f, job->msg, fd, abs_file_name);
+            nr_opens = nr_opens + 1;
         }
         else
         {
-            ack_code = 404;
-            log_warning("> check %d files, but removed %d files",
-                        nr_files, nr_removes);
+            // 缺少的分片由校验恢复，日志中仍然使用它的文件名
+            snprintf(f->abs_file_name, sizeof(f->abs_file_name), "%s", abs_file_name);
         }
+        fds[i] = f->fd;
     }
-    else
+    if (nr_opens < stripe_data_shards())
     {
-        // 删除的文件不存在，效果和删除操作一样，也返回成功给客户端
-        ack_code = 200;
+        log_error("%s: %d of %d shards, need %d", x->befiles[0].abs_file_name,
+                  nr_opens, backend_cnt, stripe_data_shards());
+        return;
     }
-
-    task_info_t * task_info = (task_info_t *)(msg->data);
-    encode_task_info(task_info);
-    msg->ack_code = ack_code;
-    return send_response_message(events_poll, conn_info, msg, msg->length);
-}
-
-static int handle_common1(
-    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
-{
-    task_info_t * task_info = (task_info_t *)(msg->data);
-    int ret;
-
-    conn_info->peer_id = msg->src_id;
-    conn_info->peer_type = msg->src_type;
-
-    decode_task_info(task_info);
-
-    ret = is_listening_ip(task_info->sgw_ip);
-    if (ret == 1)
+    int64_t size = stripe_file_size(fds);
+    if (size < 0)
     {
-        if (msg->command == CMD_START_UPLOAD_REQ)
-        {
-            return handle_start_upload_request(events_poll, conn_info, msg);
-        }
-        else if (msg->command == CMD_START_DOWNLOAD_REQ)
-        {
-            return handle_start_download_request(events_poll, conn_info, msg);
-        }
-        else if (msg->command == CMD_DELETE_REQ)
+        log_error("get %s file size failed", x->befiles[0].abs_file_name);
+        return;
+    }
+    for (i = 0; i < backend_cnt; i++)
+    {
+        x->befiles[i].filesize = size;
+        x->befiles[i].fileleft = size;
+        x->befiles[i].filedone = 0;
+    }
+    if (job->index && size > STRIPE_SEQ_MAX_FILE)
+    {
+        log_error("%s: %ld bytes, too large for sequential download in stripe mode",
+                  x->befiles[0].abs_file_name, (long)size);
+        return;
+    }
+    if (job->index || file_cache_wanted(size))
+    {
+        task_info_t * t = (task_info_t *)job->msg->data;
+        cached_file_t * cf = alloc_cached_file(t->file_name, size);
+        if (!cf)
         {
-            return handle_delete_request(events_poll, conn_info, msg);
+            job->result = job->index ? -1 : 0;
+            return;
         }
-        else
+        if (stripe_read(fds, size, 0, size, (uint8_t *)cf->data) < 0)
         {
-            log_error("unknown command 0x%x", msg->command);
-            return -1;
+            log_error("read %s failed", x->befiles[0].abs_file_name);
+            put_cached_file(cf);
+            return;
         }
-    }
-    else
-    {
-        // 接收到的消息，它要连接的 sgw_ip 不是本节点的监听地址，将这个消息转发
-        // 到目标 sgw
-        int next_sock_fd = connect_to_next_sgw(events_poll, conn_info, msg);
-        if (next_sock_fd > 0)
+        if (file_cache_wanted(size))
         {
-            encode_task_info(task_info);
-            return forward_message(events_poll, conn_info, msg);
+            (void) insert_cached_file(cf, 0);
         }
-        else
+        x->cached = cf;
+        for (i = 0; job->index && i < backend_cnt; i++)
         {
-            char sgw_ip[MAX_IP_LEN + 1];
-            const char *ptr = inet_ntop(AF_INET, &(task_info->sgw_ip), sgw_ip, sizeof(sgw_ip));
-            if (ptr)
+            if (x->befiles[i].fd >= 0)
             {
-                log_error("> connect to sgw:{%s:%d} failed", sgw_ip, task_info->sgw_port);
+                close(x->befiles[i].fd);
+                x->befiles[i].fd = -1;
             }
-            return -1;
         }
     }
+    job->result = 0;
 }
 
-static void backend_file_close_fd(struct backend_file *f)
-{
-    close(f->fd);
-    // log_info("> closed fd:%d", f->fd);
-    f->fd = -1;
-}
-
+static int start_seq_send(events_poll_t *e, conn_info_t *c);
 
-static int close_and_check_md5(conn_info_t * c)
+// 条带模式下是否打开了任何一个分片
+static int has_open_backend_file(const transfer_t * x)
 {
     int i;
     for (i = 0; i < backend_cnt; i++)
     {
-        backend_file_close_fd(&c->befiles[i]);
-        log_debug("%s successfully uploaded",
-                c->befiles[i].abs_file_name);
+        if (x->befiles[i].fd >= 0)
+        {
+            return 1;
+        }
     }
     return 0;
 }
 
-static int __handle_upload_data_request(
-    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+static int open_stripe_files_done(
+    events_poll_t * events_poll, conn_info_t * conn_info, io_job_t * job)
 {
-    if (msg->length == msg->count + sizeof(msg_t))
+    if (job->result < 0 && conn_info->xfer->routed && !has_open_backend_file(conn_info->xfer))
     {
-        int i;
-        for (i = 0; i < backend_cnt; i++)
-        {
-            char checkpoint[MAX_PATH_LEN];
-            sprintf(checkpoint, "%s/%s", backend_dirs[i], MNTDIRNAME);
-            int rc = check_stub_dir(checkpoint);
-            if (rc == 0) {
-                /* pass */
-            } else {
-                log_error("check_stub_dir failed");
-                return -1;
-            }
-
-            int nwrite = write_data(conn_info->befiles[i].fd,
-                                    msg->offset, msg->data, msg->count);
-            if (nwrite != (int)msg->count)
-            {
-                log_error("> write %s failed: %d want, %d write",
-                          conn_info->befiles[i].abs_file_name,
-                          (int)msg->count, nwrite);
-                return -1;
-            }
-        }
-        msg->ack_code = 200;
-        return send_response_message(events_poll, conn_info, msg, sizeof(msg_t));
+        return route_download_to_owner(events_poll, conn_info, job->msg);
     }
-    else
+    if (job->result < 0)
     {
-        log_error("recv corrupt message payload from peer %s:%u",
-                  conn_info->peer_ip, conn_info->peer_port);
         return -1;
     }
+    if (job->index)
+    {
+        return start_seq_send(events_poll, conn_info);
+    }
+    return send_start_download_response(events_poll, conn_info, job->msg,
+                                        conn_info->xfer->befiles[0].filesize);
 }
 
-static int __handle_download_data_request(
-    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+static int open_stripe_files(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, int sequential)
 {
-    uint8_t msg_buffer[MAX_MESSAGE_LEN];
-    msg_t * new_msg = (msg_t *)msg_buffer;
-
-    *new_msg = *msg;
-    if (new_msg->count > MAX_MSG_DATA_LEN)
+    io_job_t * job = alloc_io_job();
+    if (!job)
     {
-        new_msg->count = MAX_MSG_DATA_LEN;
+        return -1;
     }
+    job->index = sequential;
+    job->work = open_stripe_files_work;
+    job->done = open_stripe_files_done;
+    job->msg = msg;
+    job->xfer = conn_info->xfer;
+    return run_io_job(events_poll, conn_info, job);
+}
 
-    // 从第一个后端文件中读取数据
+// routed 为 1 时文件按分布表属于其它节点，本节点没有这个文件时再重定向或者转发
+static int handle_start_download_request(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, int routed)
+{
+    transfer_t * x = begin_transfer(conn_info);
+    if (!x)
+    {
+        return -1;
+    }
+    x->routed = routed;
+    task_info_t * t = (task_info_t *)msg->data;
+    x->cached = lookup_cached_file(t->file_name);
+    if (x->cached)
+    {
+        // 之后的下载数据请求都从内存中应答，不打开后端文件
+        setup_abs_file_name(x->befiles[0].abs_file_name, sizeof(x->befiles[0].abs_file_name),
+                            msg, backend_dirs[0]);
+        x->befiles[0].filesize = x->cached->size;
+        return send_start_download_response(events_poll, conn_info, msg, x->cached->size);
+    }
+    if (stripe_enabled())
+    {
+        return open_stripe_files(events_poll, conn_info, msg, 0);
+    }
+    io_job_t * job = alloc_io_job();
+    if (!job)
+    {
+        return -1;
+    }
+    char * paths = setup_backend_paths(job, msg);
+    if (!paths)
+    {
+        free_io_job(job);
+        return -1;
+    }
     int i;
     for (i = 0; i < backend_cnt; i++)
     {
-        int nread = read_data(conn_info->befiles[i].fd,
-                              new_msg->offset, new_msg->data, new_msg->count);
-        if (nread > 0)
+        io_op_t * op = add_io_op(job, IO_OP_STATX);
+        op->path = paths + i * BACKEND_PATH_LEN;
+        op = add_io_op(job, IO_OP_OPEN);
+        op->path = paths + i * BACKEND_PATH_LEN;
+        op->flags = O_RDONLY;
+        if (sgw_options.direct_io > 0)
         {
-            uint32_t totallen = sizeof(msg_t) + nread;
-            new_msg->ack_code = 200;
-            return send_response_message(events_poll, conn_info,
-                                         new_msg, totallen);
+            // 这时还不知道文件大小，先打开，文件小于阈值时再关闭
+            op = add_io_op(job, IO_OP_OPEN);
+            op->path = paths + i * BACKEND_PATH_LEN;
+            op->flags = O_RDONLY | O_DIRECT;
+        }
+    }
+    job->work = run_io_ops;
+    job->done = start_download_done;
+    job->msg = msg;
+    job->xfer = conn_info->xfer;
+    return run_io_job(events_poll, conn_info, job);
+}
+
+static int delete_done(
+    events_poll_t * events_poll, conn_info_t * conn_info, io_job_t * job)
+{
+    msg_t * msg = job->msg;
+    int nr_files = 0;
+    int nr_removes = 0;
+    int i;
+    // 删除期间开始的下载可能又把文件读入了缓存
+    invalidate_cached_file(((task_info_t *)msg->data)->file_name);
+    for (i = 0; i < job->nr_ops; i++)
+    {
+        const io_op_t * op = &job->ops[i];
+        if (op->res == 0)
+        {
+            log_info("> remove file %s ok", op->path);
+            nr_files = nr_files + 1;
+            nr_removes = nr_removes + 1;
+        }
+        else if (op->res != -ENOENT)
+        {
+            log_error("> remove file %s failed: %s", op->path, strerror(-op->res));
+            nr_files = nr_files + 1;
+        }
+    }
+    if (nr_removes == nr_files)
+    {
+        // 删除的文件不存在，效果和删除操作一样，也返回成功给客户端
+        msg->ack_code = 200;
+    }
+    else
+    {
+        msg->ack_code = 404;
+        log_warning("> check %d files, but removed %d files", nr_files, nr_removes);
+    }
+
+    task_info_t * task_info = (task_info_t *)(msg->data);
+    encode_task_info(task_info);
+    return send_response_message(events_poll, conn_info, msg, msg->length);
+}
+
+static int handle_delete_request(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    task_info_t * t = (task_info_t *)msg->data;
+    invalidate_cached_file(t->file_name);
+    io_job_t * job = alloc_io_job();
+    if (!job)
+    {
+        return -1;
+    }
+    char * paths = setup_backend_paths(job, msg);
+    if (!paths)
+    {
+        free_io_job(job);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        io_op_t * op = add_io_op(job, IO_OP_UNLINK);
+        op->path = paths + i * BACKEND_PATH_LEN;
+    }
+    job->work = run_io_ops;
+    job->done = delete_done;
+    job->msg = msg;
+    return run_io_job(events_poll, conn_info, job);
+}
+
+// 按集群分布表确定负责这个文件的 sgw，不是本节点时把它填到 task_info 中。
+// 返回 1 表示由本节点处理，0 表示由其它节点处理，-1 表示没有分布表或者取不到
+// studyid，按客户端指定的 sgw_ip 处理。
+static int route_by_cluster_map(msg_t * msg)
+{
+    task_info_t * task_info = (task_info_t *)(msg->data);
+    char studyid[MAX_NAME_LEN + 1];
+    cluster_node_t owner;
+
+    task_info->file_name[MAX_NAME_LEN] = '\0';
+    if (extract_studyid(task_info->file_name, studyid, sizeof(studyid)) < 0)
+    {
+        return -1;
+    }
+    int ret = lookup_cluster_node(studyid, &owner);
+    if (ret == 0)
+    {
+        task_info->sgw_ip = owner.ip;
+        task_info->sgw_port = owner.port;
+        task_info->sgw_id = owner.id;
+    }
+    return ret;
+}
+
+// 告诉客户端直接连接负责的 sgw，数据不再经过本节点中转
+static int send_redirect_response(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    task_info_t * task_info = (task_info_t *)(msg->data);
+    char sgw_ip[MAX_IP_LEN + 1];
+    if (inet_ntop(AF_INET, &(task_info->sgw_ip), sgw_ip, sizeof(sgw_ip)))
+    {
+        log_debug("> redirect %s to sgw:{%s:%d}", task_info->file_name,
+                  sgw_ip, task_info->sgw_port);
+    }
+    my_stats()->cluster_redirects += 1;
+
+    encode_task_info(task_info);
+    msg->ack_code = CLUSTER_REDIRECT_CODE;
+    msg->total = 0UL;
+    msg->offset = 0UL;
+    msg->count = 0UL;
+    return send_response_message(events_poll, conn_info, msg, msg->length);
+}
+
+// 把开始请求转发到 task_info 中的 sgw，到同一个目标 sgw 的转发共用中继连接，不
+// 成功时使用独立的连接
+static int forward_to_next_sgw(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    task_info_t * task_info = (task_info_t *)(msg->data);
+    int next_sock_fd = -1;
+    if (sgw_options.trunk)
+    {
+        next_sock_fd = open_trunk_session(events_poll, conn_info, msg);
+    }
+    if (next_sock_fd < 0)
+    {
+        next_sock_fd = connect_to_next_sgw(events_poll, conn_info, msg);
+    }
+    if (next_sock_fd > 0)
+    {
+        encode_task_info(task_info);
+        return forward_message(events_poll, conn_info, msg);
+    }
+    else
+    {
+        char sgw_ip[MAX_IP_LEN + 1];
+        const char *ptr = inet_ntop(AF_INET, &(task_info->sgw_ip), sgw_ip, sizeof(sgw_ip));
+        if (ptr)
+        {
+            log_error("> connect to sgw:{%s:%d} failed", sgw_ip, task_info->sgw_port);
+        }
+        return -1;
+    }
+}
+
+// 按分布表由其它节点处理的请求：支持重定向的客户端直接去连接负责的节点，否则转发
+static int route_to_owner(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    if (msg->minor >= CLUSTER_REDIRECT_MINOR &&
+        (msg->command == CMD_START_UPLOAD_REQ ||
+         msg->command == CMD_START_DOWNLOAD_REQ))
+    {
+        return send_redirect_response(events_poll, conn_info, msg);
+    }
+    my_stats()->cluster_proxied += 1;
+    return forward_to_next_sgw(events_poll, conn_info, msg);
+}
+
+// 开始下载的文件操作发现本节点没有这个文件，结束本节点的传输，按分布表重定向或者
+// 转发。转发时下一跳的发送缓冲区已满返回 MSG_PAUSED，恢复后整个请求重新处理
+static int route_download_to_owner(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    end_transfer(conn_info);
+    if (route_by_cluster_map(msg) != 0)
+    {
+        // 分布表在文件操作期间重新加载，文件改由本节点负责
+        log_error("no backend file");
+        return -1;
+    }
+    return route_to_owner(events_poll, conn_info, msg);
+}
+
+static int handle_common1(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    task_info_t * task_info = (task_info_t *)(msg->data);
+    int ret;
+
+    conn_info->peer_id = msg->src_id;
+    conn_info->peer_type = msg->src_type;
+
+    decode_task_info(task_info);
+
+    // 只对客户端直接发来的请求查分布表。其它 sgw 转发过来的请求已经查过，按
+    // sgw_ip 处理，避免两个节点的分布表不一致时来回转发。
+    ret = -1;
+    if (conn_info->peer_type == NODE_TYPE_CLNT)
+    {
+        uint32_t sgw_ip = task_info->sgw_ip;
+        uint16_t sgw_port = task_info->sgw_port;
+        uint32_t sgw_id = task_info->sgw_id;
+        ret = route_by_cluster_map(msg);
+        if (ret == 0 && msg->command == CMD_START_DOWNLOAD_REQ && conn_info->use_proxy != 1)
+        {
+            // 分布表生效之前上传的文件，仍然由本节点提供下载。先按本节点开始下载，
+            // 在文件操作中发现没有这个文件时再重定向或者转发
+            task_info->sgw_ip = sgw_ip;
+            task_info->sgw_port = sgw_port;
+            task_info->sgw_id = sgw_id;
+            return handle_start_download_request(events_poll, conn_info, msg, 1);
+        }
+    }
+    if (ret == 0)
+    {
+        return route_to_owner(events_poll, conn_info, msg);
+    }
+    else if (ret < 0)
+    {
+        ret = is_listening_ip(task_info->sgw_ip);
+    }
+
+    if (ret == 1)
+    {
+        if (msg->command == CMD_START_UPLOAD_REQ)
+        {
+            return handle_start_upload_request(events_poll, conn_info, msg);
+        }
+        else if (msg->command == CMD_START_DOWNLOAD_REQ)
+        {
+            return handle_start_download_request(events_poll, conn_info, msg, 0);
+        }
+        else if (msg->command == CMD_DELETE_REQ)
+        {
+            return handle_delete_request(events_poll, conn_info, msg);
         }
         else
         {
-            log_warning("read %s failed: %d want, %d read, try next file",
-                        conn_info->befiles[i].abs_file_name,
-                        (int)new_msg->count, nread);
+            log_error("unknown command 0x%x", msg->command);
+            return -1;
         }
     }
+    else
+    {
+        // 接收到的消息，它要连接的 sgw_ip 不是本节点的监听地址，将这个消息转发
+        // 到目标 sgw
+        return forward_to_next_sgw(events_poll, conn_info, msg);
+    }
+}
 
-    log_error("read data failed: no backend file");
-    return -1;
+static void backend_file_close_fd(struct backend_file *f)
+{
+    close(f->fd);
+    // log_info("> closed fd:%d", f->fd);
+    f->fd = -1;
+}
+
+
+// 挂载检查目录对应的后端目录下标
+static int stub_dir_index(const char * path)
+{
+    int i;
+    for (i = 0; i < backend_cnt - 1; i++)
+    {
+        if (path == stub_dirs[i])
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+// 上传数据已经写入后端文件（或者放进条带模式的行缓冲），推进续传进度并应答
+static int send_upload_data_ack(
+    events_poll_t * events_poll, conn_info_t * conn_info, transfer_t * x, msg_t * msg)
+{
+    if (msg->offset <= (uint64_t)x->resume_committed &&
+        msg->offset + msg->count > (uint64_t)x->resume_committed)
+    {
+        x->resume_committed = msg->offset + msg->count;
+    }
+    msg->ack_code = 200;
+    return send_response_message(events_poll, conn_info, msg, sizeof(msg_t));
+}
+
+// 每个后端文件先检查挂载检查目录，再写入数据，操作是链接的，检查失败时不写。
+// 使用 O_DIRECT 时数据分成对齐的部分和不对齐的末尾两次写入；需要持久化时最后还
+// 有一个开始写回的操作，它的结果不影响应答。失败的后端目录之后不再写入，剩下的
+// 后端目录少于 -o write_quorum 时上传失败
+static int upload_data_done(
+    events_poll_t * events_poll, conn_info_t * conn_info, io_job_t * job)
+{
+    transfer_t * x = job->xfer;
+    int i = -1;
+    int k;
+    for (k = 0; k < job->nr_ops; k++)
+    {
+        const io_op_t * op = &job->ops[k];
+        if (job->data && op->buf == (void *)job->data)
+        {
+            // 续传进度记录的写入，失败只影响续传
+            continue;
+        }
+        if (op->opcode == IO_OP_STATX)
+        {
+            i = stub_dir_index(op->path);
+            if (check_stub_dir(op) < 0)
+            {
+                log_error("check_stub_dir failed");
+                lose_backend(x, i);
+            }
+        }
+        else if (op->opcode == IO_OP_WRITE && op->res != (int)op->len &&
+                 (x->lost & (1u << i)) == 0)
+        {
+            log_error("> write %s failed: %d want, %d write",
+                      x->befiles[i].abs_file_name, (int)op->len, op->res);
+            lose_backend(x, i);
+        }
+    }
+    if (!have_write_quorum(x))
+    {
+        log_error("%s written to %d backends, not enough for the upload",
+                  first_written_file(x)->abs_file_name,
+                  backend_cnt - __builtin_popcount(x->lost | x->deferred));
+        return -1;
+    }
+    return send_upload_data_ack(events_poll, conn_info, x, job->msg);
+}
+
+// 条带模式：上传的数据按顺序凑成整行，在工作线程中按分片排列并计算校验，各个后端
+// 目录的分片一起提交写入。不满一行的数据留到下一块，或者上传结束时补零写入。请求
+// 的数据放在 job->data 中，开头是消息头的副本
+static int submit_stripe_write(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, int pipelined)
+{
+    transfer_t * x = conn_info->xfer;
+    if (msg->offset != (uint64_t)x->stripe_size)
+    {
+        log_error("stripe upload of %s expects offset %ld, got %lu",
+                  x->befiles[0].abs_file_name, (long)x->stripe_size, msg->offset);
+        return -1;
+    }
+    int64_t nr_rows = stripe_full_rows(x->stripe_fill, msg->count);
+    if (nr_rows == 0)
+    {
+        // 不够一行，只放进行缓冲，没有文件操作
+        stripe_append(x, msg->data, msg->count, NULL, 0);
+        x->stripe_size = x->stripe_size + msg->count;
+        if (!pipelined || !conn_info->pipeline)
+        {
+            return send_upload_data_ack(events_poll, conn_info, x, msg);
+        }
+        // 应答排在前面还没有完成的流水线请求后面
+        io_job_t * job = alloc_io_job();
+        char * head = job ? get_io_job_buffer(job) : NULL;
+        if (!head)
+        {
+            if (job)
+            {
+                free_io_job(job);
+            }
+            return -1;
+        }
+        memcpy(head, msg, sizeof(msg_t));
+        job->done = upload_data_done;
+        job->msg = (msg_t *)head;
+        job->xfer = x;
+        return run_pipelined_io_done(events_poll, conn_info, job);
+    }
+    size_t span = nr_rows * STRIPE_UNIT;
+    io_job_t * job = alloc_io_job();
+    if (!job)
+    {
+        return -1;
+    }
+    job->data = (char *)malloc(sizeof(msg_t) + backend_cnt * span);
+    if (!job->data)
+    {
+        log_error("malloc %lu bytes for stripe write failed",
+                  (unsigned long)(sizeof(msg_t) + backend_cnt * span));
+        free_io_job(job);
+        return -1;
+    }
+    msg_t * head = (msg_t *)job->data;
+    *head = *msg;
+    uint8_t * out = (uint8_t *)job->data + sizeof(msg_t);
+    stripe_append(x, msg->data, msg->count, out, nr_rows);
+    x->stripe_size = x->stripe_size + msg->count;
+    int i;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        struct backend_file * f = &x->befiles[i];
+        io_op_t * op = add_io_op(job, IO_OP_STATX);
+        op->path = stub_dirs[i];
+        op->link = 1;
+        op = add_io_op(job, IO_OP_WRITE);
+        op->fd = f->fd;
+        op->offset = x->stripe_rows * STRIPE_UNIT;
+        op->buf = out + i * span;
+        op->len = span;
+        if (sgw_options.durability != DURABILITY_NONE)
+        {
+            op->link = 1;
+            op = add_io_op(job, IO_OP_SYNC_RANGE);
+            op->fd = f->fd;
+            op->offset = x->stripe_rows * STRIPE_UNIT;
+            op->len = span;
+        }
+    }
+    x->stripe_rows = x->stripe_rows + nr_rows;
+    job->work = run_io_ops;
+    job->done = upload_data_done;
+    job->msg = pipelined ? head : msg;
+    job->xfer = x;
+    if (pipelined)
+    {
+        return run_pipelined_io_job(events_poll, conn_info, job);
+    }
+    return run_io_job(events_poll, conn_info, job);
+}
+
+static int __handle_upload_data_request(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    if (!conn_info->xfer)
+    {
+        log_error("no upload in progress on sock_fd:%d", conn_info->sock_fd);
+        return -1;
+    }
+    if (msg->length == msg->count + sizeof(msg_t))
+    {
+        int pipelined = sgw_options.upload_window > 1;
+        if (pipelined && conn_info->pipeline_len >= sgw_options.upload_window)
+        {
+            // 正在写入的数据块已经达到上限，等最早的一块写完再处理
+            return MSG_PAUSED;
+        }
+#ifdef MD5
+        // 上传数据请求按顺序处理，在工作线程中计算就能保证 md5 的顺序
+        EVP_DigestUpdate(conn_info->xfer->md5ctx, msg->data, msg->count);
+#endif
+        transfer_t * x = conn_info->xfer;
+        if (x->fill && msg->offset + msg->count <= (uint64_t)x->fill->size)
+        {
+            memcpy(x->fill->data + msg->offset, msg->data, msg->count);
+            x->fill_bytes = x->fill_bytes + msg->count;
+        }
+        if (x->stripe_row)
+        {
+            return submit_stripe_write(events_poll, conn_info, msg, pipelined);
+        }
+        // 偏移对齐时，对齐的部分可以用 O_DIRECT 写入，数据要复制到对齐的缓冲区中
+        uint32_t direct_len = 0;
+        int i;
+        for (i = 0; i < backend_cnt; i++)
+        {
+            if (((x->lost | x->deferred) & (1u << i)) == 0 &&
+                x->befiles[i].dfd >= 0 && msg->offset % DIRECT_IO_ALIGN == 0)
+            {
+                direct_len = msg->count & ~(DIRECT_IO_ALIGN - 1);
+            }
+        }
+        io_job_t * job = alloc_io_job();
+        if (!job)
+        {
+            return -1;
+        }
+        uint8_t * data = msg->data;
+        if (pipelined || direct_len > 0)
+        {
+            // 复制出接收缓冲区，流水线请求写入的同时接收缓冲区继续接收下一块数据；
+            // 不是流水线请求时只用复制的数据，请求消息仍然留在接收缓冲区中
+            msg_t * copy = (msg_t *)get_io_job_buffer(job);
+            if (!copy)
+            {
+                free_io_job(job);
+                return -1;
+            }
+            memcpy(copy, msg, msg->length);
+            data = copy->data;
+            if (pipelined)
+            {
+                msg = copy;
+            }
+        }
+        // 各个后端文件的写入一起提交，跳过已经失败的和异步复制的后端目录
+        for (i = 0; i < backend_cnt; i++)
+        {
+            struct backend_file * f = &x->befiles[i];
+            if ((x->lost | x->deferred) & (1u << i))
+            {
+                continue;
+            }
+            uint32_t head = f->dfd >= 0 ? direct_len : 0;
+            io_op_t * op = add_io_op(job, IO_OP_STATX);
+            op->path = stub_dirs[i];
+            if (head > 0)
+            {
+                op->link = 1;
+                op = add_io_op(job, IO_OP_WRITE);
+                op->fd = f->dfd;
+                op->offset = msg->offset;
+                op->buf = data;
+                op->len = head;
+            }
+            if (head == msg->count)
+            {
+                continue;
+            }
+            // 不对齐的末尾经过页缓存写入
+            op->link = 1;
+            op = add_io_op(job, IO_OP_WRITE);
+            op->fd = f->fd;
+            op->offset = msg->offset + head;
+            op->buf = data + head;
+            op->len = msg->count - head;
+            if (sgw_options.durability != DURABILITY_NONE)
+            {
+                // 每写一块就开始写回，上传结束时需要同步的脏页只剩最后几块
+                op->link = 1;
+                op = add_io_op(job, IO_OP_SYNC_RANGE);
+                op->fd = f->fd;
+                op->offset = msg->offset + head;
+                op->len = msg->count - head;
+            }
+        }
+        if (resume_enabled())
+        {
+            add_resume_record_ops(job, x);
+        }
+        job->work = run_io_ops;
+        job->done = upload_data_done;
+        job->msg = msg;
+        job->xfer = x;
+        if (pipelined)
+        {
+            return run_pipelined_io_job(events_poll, conn_info, job);
+        }
+        return run_io_job(events_poll, conn_info, job);
+    }
+    else
+    {
+        log_error("recv corrupt message payload from peer %s:%u",
+                  conn_info->peer_ip, conn_info->peer_port);
+        return -1;
+    }
+}
+
+static int submit_read_backend_file(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, uint32_t tried);
+
+// 在请求中增加读取 m->offset 开始的 m->count 字节的操作，数据放在 m->data 中。
+// sequential 表示接着上一块顺序读取
+static void add_read_op(io_job_t * job, struct backend_file * f, msg_t * m, int sequential)
+{
+    io_op_t * op = add_io_op(job, IO_OP_READ);
+    op->fd = f->fd;
+    op->offset = m->offset;
+    op->buf = m->data;
+    op->len = m->count;
+    if (f->dfd >= 0 && sequential && m->offset % DIRECT_IO_ALIGN == 0)
+    {
+        // 大文件从上一次读完的位置继续顺序读取时绕过页缓存，随机读取仍然使用页缓存
+        op->fd = f->dfd;
+        op->len = (m->count + DIRECT_IO_ALIGN - 1) & ~(DIRECT_IO_ALIGN - 1);
+    }
+}
+
+// 顺序读取时，从上一块之后开始提前读取，连接的流水线中最多保持 -o readahead 块。
+// 每一块分别选择后端目录，几个镜像同时读取一个文件的不同部分
+static void fill_readahead(conn_info_t * c, int index, uint64_t offset, uint32_t count)
+{
+    transfer_t * x = c->xfer;
+    struct backend_file * f = &x->befiles[index];
+    if (c->pipeline_tail)
+    {
+        offset = c->pipeline_tail->msg->offset + c->pipeline_tail->msg->count;
+    }
+    while (c->pipeline_len < sgw_options.readahead && offset < (uint64_t)f->filesize)
+    {
+        io_job_t * job = alloc_io_job();
+        if (!job)
+        {
+            return;
+        }
+        msg_t * m = (msg_t *)get_io_job_buffer(job);
+        if (!m)
+        {
+            free_io_job(job);
+            return;
+        }
+        memset(m, 0, sizeof(msg_t));
+        m->length = sizeof(msg_t);
+        m->offset = offset;
+        m->count = count;
+        int b = pick_mirror(x, 0);
+        add_read_op(job, &x->befiles[b], m, 1);
+        job->index = b;
+        job->mirror = b;
+        job->work = run_io_ops;
+        job->done = NULL;
+        job->msg = m;
+        job->xfer = x;
+        if (run_readahead_io_job(c, job) < 0)
+        {
+            free_io_job(job);
+            return;
+        }
+        my_stats()->readahead_chunks += 1;
+        offset = offset + count;
+    }
+}
+
+// 丢弃流水线开头已经完成的预读块
+static void discard_readahead(conn_info_t * c)
+{
+    while (c->pipeline && c->pipeline->completed && c->pipeline->done == NULL)
+    {
+        free_io_job(pop_pipelined_io_job(c));
+        my_stats()->readahead_discards += 1;
+    }
+}
+
+// 记录读到的位置，各个后端文件一起更新，下一块从哪个后端文件读取都能判断是否接着
+// 上一块顺序读取
+static void set_read_position(transfer_t * x, int64_t next)
+{
+    int i;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        x->befiles[i].filedone = next;
+    }
+}
+
+// 把读取的数据作为 msg 的应答发送，O_DIRECT 读取的长度向上对齐过，只返回请求的部
+// 分。读满一块并且是接着上一块顺序读取时，开始预读后面的块
+static int send_read_data(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg,
+    io_job_t * job, int sequential)
+{
+    const io_op_t * op = &job->ops[0];
+    msg_t * new_msg = (msg_t *)get_io_job_buffer(job);
+    *new_msg = *msg;
+    if (new_msg->count > MAX_MSG_DATA_LEN)
+    {
+        new_msg->count = MAX_MSG_DATA_LEN;
+    }
+    uint32_t count = (uint32_t)op->res < new_msg->count ? (uint32_t)op->res : new_msg->count;
+    // 发送时消息头转换为网络字节序，之后不能再使用
+    uint64_t next = new_msg->offset + count;
+    int full = count == new_msg->count;
+    set_read_position(conn_info->xfer, next);
+    uint32_t totallen = sizeof(msg_t) + count;
+    new_msg->ack_code = 200;
+    int ret = send_response_message(events_poll, conn_info, new_msg, totallen);
+    if (ret >= 0 && sgw_options.readahead > 0 && sequential && full)
+    {
+        fill_readahead(conn_info, job->index, next, count);
+    }
+    return ret;
+}
+
+// 读取失败时换一个还没有试过的后端文件再读
+static int download_data_done(
+    events_poll_t * events_poll, conn_info_t * conn_info, io_job_t * job)
+{
+    const io_op_t * op = &job->ops[0];
+    if (op->res <= 0)
+    {
+        log_warning("read %s failed: %d want, %d read, try next file",
+                    conn_info->xfer->befiles[job->index].abs_file_name,
+                    (int)op->len, op->res);
+        return submit_read_backend_file(events_poll, conn_info, job->msg,
+                                        job->tried | (1u << job->index));
+    }
+    const msg_t * read_msg = (msg_t *)get_io_job_buffer(job);
+    int sequential = read_msg->offset == (uint64_t)conn_info->xfer->befiles[job->index].filedone;
+    return send_read_data(events_poll, conn_info, job->msg, job, sequential);
+}
+
+// 从 tried 以外的、打开的后端文件中选择一个读取数据，放在请求的缓冲区中的应答消
+// 息里
+static int submit_read_backend_file(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, uint32_t tried)
+{
+    transfer_t * x = conn_info->xfer;
+    int index = pick_mirror(x, tried);
+    if (index < 0)
+    {
+        log_error("read data failed: no backend file");
+        return -1;
+    }
+
+    io_job_t * job = alloc_io_job();
+    if (!job)
+    {
+        return -1;
+    }
+    msg_t * new_msg = (msg_t *)get_io_job_buffer(job);
+    if (!new_msg)
+    {
+        free_io_job(job);
+        return -1;
+    }
+    *new_msg = *msg;
+    if (new_msg->count > MAX_MSG_DATA_LEN)
+    {
+        new_msg->count = MAX_MSG_DATA_LEN;
+    }
+
+    struct backend_file * f = &x->befiles[index];
+    add_read_op(job, f, new_msg, new_msg->offset == (uint64_t)f->filedone);
+    job->index = index;
+    job->tried = tried;
+    job->mirror = index;
+    job->work = run_io_ops;
+    job->done = download_data_done;
+    job->msg = msg;
+    job->xfer = x;
+    return run_io_job(events_poll, conn_info, job);
+}
+
+// 从内存缓存中的文件应答下载数据请求
+static int send_cached_data(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    cached_file_t * f = conn_info->xfer->cached;
+    if (msg->offset >= (uint64_t)f->size)
+    {
+        log_error("read %s failed: offset %lu beyond %ld bytes",
+                  f->name, msg->offset, (long)f->size);
+        return -1;
+    }
+    uint32_t count = msg->count > MAX_MSG_DATA_LEN ? MAX_MSG_DATA_LEN : msg->count;
+    if (count > f->size - msg->offset)
+    {
+        count = f->size - msg->offset;
+    }
+    uint64_t offset = msg->offset;
+    msg->count = count;
+    msg->ack_code = 200;
+    return send_response_data(events_poll, conn_info, msg, (uint8_t *)f->data + offset, count);
+}
+
+static int submit_stripe_read(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, int degraded);
+
+// I/O 线程：读取数据分片和校验分片，恢复缺少的数据
+static void degraded_read_work(io_job_t * job)
+{
+    transfer_t * x = job->xfer;
+    msg_t * new_msg = (msg_t *)get_io_job_buffer(job);
+    int fds[MAX_BACK_END];
+    int i;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        fds[i] = x->befiles[i].fd;
+    }
+    job->result = stripe_read(fds, x->befiles[0].filesize, new_msg->offset,
+                              new_msg->count, new_msg->data);
+}
+
+// 直接读取数据分片时拼成文件数据；有分片读取失败时关闭它，改由 I/O 线程读取校验分
+// 片恢复，之后的请求也不再读这个分片
+static int stripe_read_done(
+    events_poll_t * events_poll, conn_info_t * conn_info, io_job_t * job)
+{
+    transfer_t * x = conn_info->xfer;
+    msg_t * new_msg = (msg_t *)get_io_job_buffer(job);
+    if (job->work == run_io_ops)
+    {
+        int failed = 0;
+        int i;
+        for (i = 0; i < job->nr_ops; i++)
+        {
+            const io_op_t * op = &job->ops[i];
+            if (op->res != (int)op->len)
+            {
+                log_warning("read %s failed: %d want, %d read, reconstruct from parity",
+                            x->befiles[i].abs_file_name, (int)op->len, op->res);
+                backend_file_close_fd(&x->befiles[i]);
+                failed = 1;
+            }
+        }
+        if (failed)
+        {
+            return submit_stripe_read(events_poll, conn_info, job->msg, 1);
+        }
+        int64_t first_row, nr_rows;
+        stripe_rows(new_msg->offset, new_msg->count, &first_row, &nr_rows);
+        stripe_gather((uint8_t *)job->data, first_row, nr_rows, new_msg->offset,
+                      new_msg->count, new_msg->data);
+    }
+    else if (job->result < 0)
+    {
+        log_error("read %s failed: not enough shards", x->befiles[0].abs_file_name);
+        return -1;
+    }
+    new_msg->ack_code = 200;
+    return send_response_message(events_poll, conn_info, new_msg,
+                                 sizeof(msg_t) + new_msg->count);
+}
+
+// 条带模式：请求的数据所在的行从各个数据分片一起读取，完成后在工作线程中拼起来。
+// 有数据分片没有打开或者 degraded 为 1 时，由 I/O 线程同时读取校验分片恢复
+static int submit_stripe_read(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, int degraded)
+{
+    transfer_t * x = conn_info->xfer;
+    int64_t size = x->befiles[0].filesize;
+    if (msg->offset >= (uint64_t)size)
+    {
+        log_error("read %s failed: offset %lu beyond %ld bytes",
+                  x->befiles[0].abs_file_name, msg->offset, (long)size);
+        return -1;
+    }
+    io_job_t * job = alloc_io_job();
+    if (!job)
+    {
+        return -1;
+    }
+    msg_t * new_msg = (msg_t *)get_io_job_buffer(job);
+    if (!new_msg)
+    {
+        free_io_job(job);
+        return -1;
+    }
+    *new_msg = *msg;
+    if (new_msg->count > MAX_MSG_DATA_LEN)
+    {
+        new_msg->count = MAX_MSG_DATA_LEN;
+    }
+    if (new_msg->count > size - msg->offset)
+    {
+        new_msg->count = size - msg->offset;
+    }
+    int k = stripe_data_shards();
+    int i;
+    for (i = 0; i < k; i++)
+    {
+        degraded = degraded || x->befiles[i].fd < 0;
+    }
+    if (degraded)
+    {
+        job->work = degraded_read_work;
+    }
+    else
+    {
+        int64_t first_row, nr_rows;
+        stripe_rows(new_msg->offset, new_msg->count, &first_row, &nr_rows);
+        size_t span = nr_rows * STRIPE_UNIT;
+        job->data = (char *)malloc(k * span);
+        if (!job->data)
+        {
+            log_error("malloc %lu bytes for stripe read failed", (unsigned long)(k * span));
+            free_io_job(job);
+            return -1;
+        }
+        for (i = 0; i < k; i++)
+        {
+            io_op_t * op = add_io_op(job, IO_OP_READ);
+            op->fd = x->befiles[i].fd;
+            op->offset = first_row * STRIPE_UNIT;
+            op->buf = job->data + i * span;
+            op->len = stripe_read_len(size, i, first_row, nr_rows);
+        }
+        job->work = run_io_ops;
+    }
+    job->done = stripe_read_done;
+    job->msg = msg;
+    job->xfer = x;
+    return run_io_job(events_poll, conn_info, job);
+}
+
+static int __handle_download_data_request(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    if (!conn_info->xfer)
+    {
+        log_error("no download in progress on sock_fd:%d", conn_info->sock_fd);
+        return -1;
+    }
+    if (conn_info->xfer->cached)
+    {
+        return send_cached_data(events_poll, conn_info, msg);
+    }
+    io_job_t * job = conn_info->pipeline;
+    if (job && job->done)
+    {
+        // 还有没有写完的上传数据
+        return MSG_PAUSED;
+    }
+    if (stripe_enabled())
+    {
+        return submit_stripe_read(events_poll, conn_info, msg, 0);
+    }
+    if (job)
+    {
+        uint32_t count = msg->count > MAX_MSG_DATA_LEN ? MAX_MSG_DATA_LEN : msg->count;
+        if (job->msg->offset != msg->offset || job->msg->count != count)
+        {
+            // 不再顺序读取，丢弃预读的块，还在读取的块完成后再处理这个请求
+            discard_readahead(conn_info);
+            if (conn_info->pipeline)
+            {
+                return MSG_PAUSED;
+            }
+        }
+        else if (!job->completed)
+        {
+            // 预读完成时继续处理这个请求
+            my_stats()->readahead_waits += 1;
+            return MSG_PAUSED;
+        }
+        else
+        {
+            pop_pipelined_io_job(conn_info);
+            int ret;
+            if (job->ops[0].res > 0)
+            {
+                my_stats()->readahead_hits += 1;
+                ret = send_read_data(events_poll, conn_info, msg, job, 1);
+            }
+            else
+            {
+                // 预读失败，按普通的请求从其它后端文件重新读取
+                discard_readahead(conn_info);
+                ret = conn_info->pipeline ? MSG_PAUSED :
+                      submit_read_backend_file(events_poll, conn_info, msg, 1u << job->index);
+            }
+            free_io_job(job);
+            return ret;
+        }
+    }
+    return submit_read_backend_file(events_poll, conn_info, msg, 0);
 }
 
 static int handle_common2(
@@ -1723,69 +2471,221 @@ static int handle_common2(
     }
 }
 
+// I/O 线程：写入失败的后端目录中删除不完整的文件，避免下载时读到，然后把写入失
+// 败的和异步复制的副本记录到补写日志中
+static int record_lost_backends(io_job_t * job)
+{
+    transfer_t * x = job->xfer;
+    task_info_t * ti = (task_info_t *)job->msg->data;
+    const char * md5 = NULL;
+    int i;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        struct backend_file * f = &x->befiles[i];
+        if ((x->lost & (1u << i)) == 0)
+        {
+            continue;
+        }
+        if (f->fd >= 0)
+        {
+            backend_file_close_fd(f);
+            (void) unlink(f->abs_file_name);
+        }
+        log_warning("%s missing on backend %s, recorded for resync",
+                    ti->file_name, backend_dirs[i]);
+    }
+#ifdef MD5
+    md5 = ti->file_md5;
+#endif
+    return record_missing_replicas(x->lost | x->deferred, ti->file_name, md5);
+}
+
+// 提交线程：组提交同步成功之后删除上传的进度记录
+static void remove_resume_records(io_job_t * job)
+{
+    finish_resume_records(job->xfer, job->msg);
+}
+
+// I/O 线程：上传结束，检查 md5，按持久化方式同步并关闭后端文件。result 是应答
+// 码，-1 表示 md5 校验、记录缺少的副本或者同步失败
+static void finish_upload_work(io_job_t * job)
+{
+#ifdef MD5
+    if (check_and_record_md5(job->xfer, job->msg) < 0)
+    {
+        job->result = -1;
+        return;
+    }
+#endif
+    if (job->xfer->stripe_row && stripe_finish_upload(job->xfer) < 0)
+    {
+        job->result = -1;
+        return;
+    }
+    int i;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        // O_DIRECT 写入的部分不在页缓存中，同步普通的文件描述符时一起刷到磁盘
+        if (job->xfer->befiles[i].dfd >= 0)
+        {
+            close(job->xfer->befiles[i].dfd);
+            job->xfer->befiles[i].dfd = -1;
+        }
+    }
+    if ((job->xfer->lost | job->xfer->deferred) && record_lost_backends(job) < 0)
+    {
+        job->result = -1;
+        return;
+    }
+    job->result = 200;
+    if (dedup_enabled())
+    {
+        task_info_t * ti = (task_info_t *)job->msg->data;
+        dedup_remember(ti->file_name, ti->file_md5);
+    }
+    if (sgw_options.durability == DURABILITY_GROUP)
+    {
+        // 由提交线程和同时结束的其它上传一起同步，然后关闭文件。进度记录在同步成
+        // 功之后再删除，之前掉电时仍然可以续传
+        job->commit = 1;
+        if (resume_enabled())
+        {
+            job->committed = remove_resume_records;
+        }
+        return;
+    }
+    if (sgw_options.durability == DURABILITY_FILE &&
+        sync_transfer_files(job->xfer) < 0)
+    {
+        job->result = -1;
+        return;
+    }
+    for (i = 0; i < backend_cnt; i++)
+    {
+        backend_file_close_fd(&job->xfer->befiles[i]);
+        log_debug("%s successfully uploaded",
+                  job->xfer->befiles[i].abs_file_name);
+    }
+    if (resume_enabled())
+    {
+        finish_resume_records(job->xfer, job->msg);
+    }
+}
+
+// I/O 线程：下载结束，关闭后端文件，按 .hash 文件检查客户端的 md5。result 是应
+// 答码
+static void finish_download_work(io_job_t * job)
+{
+    char *abs_file_name;
+    bool md5_match = false;
+
+    // 用第一个打开的后端文件所在目录的 .hash 文件校验
+    abs_file_name = NULL;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct backend_file *f = &job->xfer->befiles[i];
+        if (f->fd >= 0) {
+            advise_file_done(f->fd, f->abs_file_name, f->filesize);
+            if (!abs_file_name) {
+                abs_file_name = f->abs_file_name;
+            }
+        }
+        backend_file_close_fd(f);
+    }
+    if (!abs_file_name) {
+        abs_file_name = job->xfer->befiles[0].abs_file_name;
+    }
+#ifdef MD5
+    char *file_md5;
+    task_info_t *ti = (task_info_t *)job->msg->data;
+    file_md5 = ti->file_md5;
+    if (strlen(file_md5) != 0){
+        FILE *hash_fp = NULL;
+        char buff[MD5_LEN + 2];
+        char hash_file_path[strlen(abs_file_name) + strlen("/.hash")];
+        get_path_head(abs_file_name, hash_file_path);
+        strcat(hash_file_path, "/.hash");
+        hash_fp = fopen(hash_file_path, "r");
+        if (hash_fp != NULL) {
+            while (fgets(buff, sizeof(buff), hash_fp) != NULL) {
+                buff[MD5_LEN] = '\0';
+                if (!strcmp(file_md5, buff)) {
+                    md5_match = true;
+                    break;
+                }
+            }
+            fclose(hash_fp);
+        } else {
+            log_error("open %s failed", hash_file_path);
+            md5_match = false;
+        }
+    } else {
+        md5_match = true;  // 不须校验md5时，相当md5匹配
+    }
+
+#else
+    md5_match = true;
+#endif
+    if (md5_match){
+        log_info("%s successfully downloaded", abs_file_name);
+        job->result = 200;
+    } else {
+        log_info("%s downloaded failed", abs_file_name);
+        job->result = 404;
+    }
+}
+
+static int finish_transfer_done(
+    events_poll_t * events_poll, conn_info_t * conn_info, io_job_t * job)
+{
+    transfer_t * x = conn_info->xfer;
+    if (job->msg->command == CMD_UPLOAD_FINISH_REQ)
+    {
+        // 上传期间开始的下载可能缓存了写了一半的文件，先失效，上传成功并且收齐了
+        // 数据时再放入
+        task_info_t * t = (task_info_t *)job->msg->data;
+        invalidate_cached_file(t->file_name);
+        if (job->result == 200 && x->fill && x->fill_bytes == x->fill->size)
+        {
+            (void) insert_cached_file(x->fill, 1);
+        }
+    }
+    if (job->result < 0)
+    {
+        return -1;
+    }
+    end_transfer(conn_info);
+    job->msg->ack_code = job->result;
+    return send_response_message(events_poll, conn_info, job->msg, sizeof(msg_t));
+}
+
 static int __handle_upload_or_download_finish_request(
     events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
 {
-    char *abs_file_name;
-    bool md5_match = false;
-
-    if (msg->command == CMD_UPLOAD_FINISH_REQ) {
-        int ret = close_and_check_md5(conn_info);
-        if (ret == 0) {
-            msg->ack_code = 200;
-        } else {
+    if (!conn_info->xfer) {
+        if (msg->command == CMD_UPLOAD_FINISH_REQ) {
+            log_error("no upload in progress on sock_fd:%d", conn_info->sock_fd);
             msg->ack_code = 404;
-            log_error("close_and_check_md5 on sock_fd:%d failed", conn_info->sock_fd);
-        }
-    } else {
-        int i;
-        for (i = 0; i < backend_cnt; i++) {
-            struct backend_file *f = &conn_info->befiles[i];
-            backend_file_close_fd(f);
-        }
-        abs_file_name = conn_info->befiles[0].abs_file_name;
-#ifdef MD5
-        char *file_md5;
-        task_info_t *ti = (task_info_t *)msg->data;
-        file_md5 = ti->file_md5;
-        if (strlen(file_md5) != 0){
-            FILE *hash_fp = NULL;
-            char buff[33];
-            char hash_file_path[strlen(abs_file_name) + strlen("/.hash")];
-            get_path_head(abs_file_name, hash_file_path);
-            strcat(hash_file_path, "/.hash");
-            hash_fp = fopen(hash_file_path, "r");
-            if (hash_fp != NULL) {
-                while (fgets(buff, 34, hash_fp) != NULL) {
-                    buff[32] = '\0';
-                    if (!strcmp(file_md5, buff)) {
-                        md5_match = true;
-                        break;
-                    }
-                }
-                fclose(hash_fp);
-            } else {
-                log_error("open %s failed", hash_file_path);
-                md5_match = false;
-            }
-        } else {
-            md5_match = true;  // 不须校验md5时，相当md5匹配
-        }
-
-#else
-        md5_match = true;
-#endif
-        if (md5_match){
-            log_info("%s successfully downloaded", abs_file_name);
-            msg->ack_code = 200;
+            return send_response_message(events_poll, conn_info, msg, sizeof(msg_t));
         } else {
-            log_info("%s downloaded failed", abs_file_name);
-            msg->ack_code = 404;
+            log_error("no download in progress on sock_fd:%d", conn_info->sock_fd);
+            return -1;
         }
     }
 
-    int len = sizeof(msg_t);
-    return send_response_message(events_poll, conn_info, msg, len);
+    io_job_t * job = alloc_io_job();
+    if (!job) {
+        return -1;
+    }
+    if (msg->command == CMD_UPLOAD_FINISH_REQ) {
+        job->work = finish_upload_work;
+    } else {
+        job->work = finish_download_work;
+    }
+    job->done = finish_transfer_done;
+    job->msg = msg;
+    job->xfer = conn_info->xfer;
+    return run_io_job(events_poll, conn_info, job);
 }
 
 static int handle_upload_or_download_finish_request(
@@ -1793,7 +2693,7 @@ static int handle_upload_or_download_finish_request(
 {
     if (msg->command == CMD_UPLOAD_FINISH_REQ)
     {
-        // log_info("%s uploading: 3/4", conn_info->befiles[0].md5);
+        // log_info("%s uploading: 3/4", conn_info->xfer->befiles[0].md5);
     }
 
     if (conn_info->use_proxy == 0)
@@ -1823,7 +2723,11 @@ static int handle_common3(
     events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
 {
     int ret = forward_message(events_poll, conn_info, msg);
-    if (ret < 0)
+    if (ret == MSG_PAUSED)
+    {
+        return ret;
+    }
+    else if (ret < 0)
     {
         log_error("%s: forward_message failed", command_string(msg->command));
         return -1;
@@ -1837,47 +2741,99 @@ static int handle_common3(
         conn_info->use_proxy = 0;
         conn_info->next_sock_fd = -1;
 
+        // 应答来自下一跳 sgw，这次转发结束，把到下一跳的连接放回连接池
+        if (conn_info->flags & CONN_FLAG_NEXT_HOP)
+        {
+            release_sgw_conn(events_poll, conn_info->sock_fd);
+        }
+
         return ret;
     }
 }
 
-static void advise_sequential(int fd)
+// I/O 线程：打开顺序下载的文件，取得文件大小
+static void open_seq_file_work(io_job_t * job)
 {
-    int rc1 = posix_fadvise(
-        fd, 0/*偏移*/, 0/*文件的所有内容*/, POSIX_FADV_SEQUENTIAL);
-    assert(rc1 == 0);
-}
+    struct backend_file *f = &job->xfer->befiles[0];
 
-#ifdef CONFIG_WILLNEED
-static void advise_willneed(int fd)
-{
-    int rc1 = posix_fadvise(
-        fd, 0/*偏移*/, 0/*文件的所有内容*/, POSIX_FADV_WILLNEED);
-    assert(rc1 == 0);
+    // task_info_t *t = (task_info_t *)m->data;
+    // log_info("message: %d bytes length, file_name: %s", m->length, t->file_name);
+
+    // 从工作线程选择的后端目录开始，打开失败时换下一个
+    int bfd = -1;
+    int k;
+    for (k = 0; k < backend_cnt && bfd < 0; k++) {
+        int b = (job->index + k) % backend_cnt;
+        setup_abs_file_name(f->abs_file_name, sizeof(f->abs_file_name),
+                            job->msg, backend_dirs[b]);
+        bfd = open(f->abs_file_name, O_RDWR);
+        if (bfd >= 0) {
+            f->backend = b;
+        } else {
+            log_error("open %s failed: %s",
+                      f->abs_file_name, strerror(errno));
+            if (errno != ENOENT) {
+                mirror_failed(b);
+            }
+        }
+    }
+    if (bfd >= 0) {
+        struct stat s;
+        int rc1 = fstat(bfd, &s);
+        if (rc1 == 0 && file_cache_wanted(s.st_size)) {
+            // 小文件整个读入内存缓存，之后由内存发送
+            task_info_t *t = (task_info_t *)job->msg->data;
+            cached_file_t *cf = alloc_cached_file(t->file_name, s.st_size);
+            if (cf && pread(bfd, cf->data, s.st_size, 0) == s.st_size) {
+                (void) insert_cached_file(cf, 0);
+                job->xfer->cached = cf;
+                close(bfd);
+                bfd = -1;
+            } else if (cf) {
+                log_warning("read %s for file cache failed", f->abs_file_name);
+                put_cached_file(cf);
+            }
+        }
+        if (rc1 == 0 && bfd < 0) {
+            f->filesize = s.st_size;
+            f->fileleft = s.st_size;
+            f->filedone = 0;
+            job->result = 0;
+        } else if (rc1 == 0) {
+            // 提前告知内核文件的访问方式，只读一次的大文件发送完后从页缓存中丢弃
+            f->cache_drop = advise_file_open(bfd, f->abs_file_name, s.st_size);
+            f->fd = bfd;
+            f->filesize = s.st_size;
+            f->fileleft = s.st_size;
+            f->filedone = 0;
+            job->result = 0;
+        } else {
+            log_error("get %s file size failed: %s",
+                      f->abs_file_name, strerror(errno));
+            close(bfd);
+            job->result = -1;
+        }
+    } else {
+        job->result = -1;
+    }
 }
-#endif
 
-#ifdef CONFIG_DONTNEED
-static void advise_dontneed(int fd)
+static int start_seq_send(events_poll_t *e, conn_info_t *c)
 {
-    int rc1 = posix_fadvise(
-        fd, 0/*偏移*/, 0/*文件的所有内容*/, POSIX_FADV_DONTNEED);
-    assert(rc1 == 0);
+    c->is_sequence = 1;
+    c->xfer->befiles[0].sndstate = 0; // 可以发送顺序文件消息的长度
+    // 暂时停止接收消息事件，开始处理发送事件
+    stop_monitoring_recv(e, c->sock_fd);
+    start_monitoring_send(e, c->sock_fd);
+    return 0;
 }
-#endif
 
-static void advise_fitness(int fd)
+static int seq_download_done(events_poll_t *e, conn_info_t *c, io_job_t *job)
 {
-#if defined(CONFIG_WILLNEED)
-    // log_info("CONFIG_WILLNEED");
-    advise_willneed(fd);
-#elif defined(CONFIG_DONTNEED)
-    // log_info("CONFIG_DONTNEED");
-    advise_dontneed(fd);
-#else
-    // log_info("SEQUENTIAL");
-    advise_sequential(fd);
-#endif
+    if (job->result < 0) {
+        return -1;
+    }
+    return start_seq_send(e, c);
 }
 
 /*
@@ -1898,57 +2854,46 @@ static void advise_fitness(int fd)
 static int handle_seq_download_request(
     events_poll_t *e, conn_info_t *c, msg_t *m)
 {
-    char abs_file_name[4096];
-    setup_abs_file_name(abs_file_name, sizeof(abs_file_name), m, backend_dirs[0]);
-
-    // task_info_t *t = (task_info_t *)m->data;
-    // log_info("message: %d bytes length, file_name: %s", m->length, t->file_name);
-
-    int bfd = open(abs_file_name, O_RDWR);
-    if (bfd >= 0) {
-        struct stat s;
-        int rc1 = fstat(bfd, &s);
-        if (rc1 == 0) {
-            advise_fitness(bfd); // 提前告知内核文件的访问方式
-            c->is_sequence = 1;
-            struct backend_file *f;
-            f = &c->befiles[0];
-            f->fd = bfd;
-            f->sndstate = 0; // 可以发送顺序文件消息的长度
-            f->filesize = s.st_size;
-            f->fileleft = s.st_size;
-            f->filedone = 0;
-            snprintf(f->abs_file_name, sizeof(f->abs_file_name), "%s", abs_file_name);
-            // 暂时停止接收消息事件，开始处理发送事件
-            stop_monitoring_recv(e, c->sock_fd);
-            start_monitoring_send(e, c->sock_fd);
-            return 0;
-        } else {
-            log_error("get %s file size failed: %s",
-                      abs_file_name, strerror(errno));
-            return -1;
-        }
-    } else {
-        log_error("open %s failed: %s",
-                  abs_file_name, strerror(errno));
+    transfer_t *x = begin_transfer(c);
+    if (!x) {
+        return -1;
+    }
+    task_info_t *t = (task_info_t *)m->data;
+    x->cached = lookup_cached_file(t->file_name);
+    if (x->cached) {
+        // 文件在内存缓存中，不打开后端文件，直接开始发送
+        struct backend_file *f = &x->befiles[0];
+        setup_abs_file_name(f->abs_file_name, sizeof(f->abs_file_name), m, backend_dirs[0]);
+        f->filesize = x->cached->size;
+        f->fileleft = x->cached->size;
+        f->filedone = 0;
+        return start_seq_send(e, c);
+    }
+    if (stripe_enabled()) {
+        return open_stripe_files(e, c, m, 1);
+    }
+    io_job_t *job = alloc_io_job();
+    if (!job) {
         return -1;
     }
+    job->index = pick_mirror(NULL, 0);
+    job->work = open_seq_file_work;
+    job->done = seq_download_done;
+    job->msg = m;
+    job->xfer = c->xfer;
+    return run_io_job(e, c, job);
 }
 
-/*
- * 消息包中的 filename 字段包含了 studyid/serial，根据 studyid 计算出路径名，然
- * 后遍历所有的可能的盘符路径目录，每一个目录路径名都获取一次文件列表。最后将获
- * 取的文件列表发送回客户端
- */
-static int handle_get_file_list_request(
-    events_poll_t *e, conn_info_t *c, msg_t *m)
+// I/O 线程：扫描目录，生成文件列表的消息
+static void fill_file_list_work(io_job_t *job)
 {
     /* 分割 studyid/serial */
     char *studyid, *serial;
-    task_info_t *t = (task_info_t *)(m->data);
+    task_info_t *t = (task_info_t *)(job->msg->data);
     // log_info("filename: %s", t->file_name);
     split_serial(t->file_name, &studyid, &serial);
 
+    job->result = -1;
     int i, j;
     j = 0;
     for (i = 0; i < backend_cnt; i++) {
@@ -1972,33 +2917,57 @@ static int handle_get_file_list_request(
                 leftsize = leftsize - n - 1;
                 next = next + n + 1;
             }
-            int k;
-            for (k = 0; k < j; k++) {
-                // log_info("dirpath: %s", dirs[k]);
-            }
 
             struct file_list_result res;
             char *file_list_buffer = fill_many_dir_list(mountpoint, dirs, j, &res);
             if (file_list_buffer) {
-                int rc = send_message(e, c, (uint8_t *)file_list_buffer, res.used_buflen);
-                if (rc != res.used_buflen) {
-                    log_error("send_message failed: sendlen %d", rc);
-                } else {
-                    // 发送缓冲区完成，继续处理
-                }
-                free(file_list_buffer);
-                return rc;
+                job->data = file_list_buffer;
+                job->datalen = res.used_buflen;
+                job->index = i;
+                job->result = 0;
             } else {
                 log_error("fill_many_dir_list failed: file_list_buffer is NULL!");
-                return -1;
             }
+            return;
         } else {
             log_warning("skip %s: not exists", backend_dirs[i]);
         }
     }
     /* 如果后端目录都不存在了，就是严重的错误 */
     log_error("no backend directory!");
-    return -1;
+}
+
+static int file_list_done(events_poll_t *e, conn_info_t *c, io_job_t *job)
+{
+    if (job->result < 0) {
+        return -1;
+    }
+    int rc = send_message(e, c, (uint8_t *)job->data, job->datalen);
+    if (rc != job->datalen) {
+        log_error("send_message failed: sendlen %d", rc);
+    } else {
+        // 客户端接着会下载列表中的文件，在后台先读入页缓存
+        start_prefetch(c, backend_dirs[job->index], job->data, job->datalen);
+    }
+    return rc;
+}
+
+/*
+ * 消息包中的 filename 字段包含了 studyid/serial，根据 studyid 计算出路径名，然
+ * 后遍历所有的可能的盘符路径目录，每一个目录路径名都获取一次文件列表。最后将获
+ * 取的文件列表发送回客户端。扫描目录树可能很慢，在 I/O 线程中执行
+ */
+static int handle_get_file_list_request(
+    events_poll_t *e, conn_info_t *c, msg_t *m)
+{
+    io_job_t *job = alloc_io_job();
+    if (!job) {
+        return -1;
+    }
+    job->work = fill_file_list_work;
+    job->done = file_list_done;
+    job->msg = m;
+    return run_io_job(e, c, job);
 }
 
 struct migoption
@@ -2181,13 +3150,80 @@ static int handle_common4(
     }
 }
 
+int deal_session_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    conn_info->peer_id = msg->src_id;
+    conn_info->peer_type = msg->src_type;
+
+    if (conn_info->pipeline && msg->command != CMD_UPLOAD_DATA_REQ &&
+        msg->command != CMD_DOWNLOAD_DATA_REQ)
+    {
+        // 和客户端连接一样，等会话的流水线请求全部完成再处理
+        discard_readahead(conn_info);
+        if (conn_info->pipeline)
+        {
+            return MSG_PAUSED;
+        }
+    }
+
+    switch (msg->command) {
+    case CMD_START_UPLOAD_REQ:
+    case CMD_START_DOWNLOAD_REQ:
+    case CMD_DELETE_REQ:
+    {
+        task_info_t * task_info = (task_info_t *)(msg->data);
+        decode_task_info(task_info);
+        if (is_listening_ip(task_info->sgw_ip) != 1)
+        {
+            // 中继连接只到达目标 sgw，不再继续转发
+            log_error("%s: session target is not this sgw",
+                      command_string(msg->command));
+            return -1;
+        }
+        if (msg->command == CMD_START_UPLOAD_REQ)
+        {
+            return handle_start_upload_request(events_poll, conn_info, msg);
+        }
+        else if (msg->command == CMD_START_DOWNLOAD_REQ)
+        {
+            return handle_start_download_request(events_poll, conn_info, msg, 0);
+        }
+        else
+        {
+            return handle_delete_request(events_poll, conn_info, msg);
+        }
+    }
+    case CMD_UPLOAD_DATA_REQ:
+        return __handle_upload_data_request(events_poll, conn_info, msg);
+    case CMD_UPLOAD_FINISH_REQ:
+        return __handle_upload_or_download_finish_request(events_poll, conn_info, msg);
+    case CMD_DOWNLOAD_DATA_REQ:
+        return __handle_download_data_request(events_poll, conn_info, msg);
+    case CMD_DOWNLOAD_FINISH_REQ:
+        return __handle_upload_or_download_finish_request(events_poll, conn_info, msg);
+    default:
+        log_warning("unexpected %s in trunk session", command_string(msg->command));
+        return -1;
+    }
+}
+
 int deal_client_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
 {
     // pr_msg_unpack(msg);
 
+    if (conn_info->pipeline && msg->command != CMD_UPLOAD_DATA_REQ &&
+        msg->command != CMD_DOWNLOAD_DATA_REQ)
+    {
+        // 其它请求（例如上传完成）等已经接收的数据全部写完、预读全部结束再处理
+        discard_readahead(conn_info);
+        if (conn_info->pipeline)
+        {
+            return MSG_PAUSED;
+        }
+    }
+
     switch (msg->command) {
-        // 上传请求中处理一个文件的完整上传，包括开始上传请求，上传数据请求，上
-        // 传完成请求
+        // 开始上传请求只创建后端文件，上传数据请求和上传完成请求逐个处理
     case CMD_START_UPLOAD_REQ:
         return handle_common1(events_poll, conn_info, msg);
         break;
@@ -2197,9 +3233,12 @@ int deal_client_message(events_poll_t * events_poll, conn_info_t * conn_info, ms
     case CMD_DELETE_REQ:
         return handle_common1(events_poll, conn_info, msg);
         break;
+        // 本节点处理的请求读写后端文件，否则转发到下一跳
+    case CMD_UPLOAD_DATA_REQ:
     case CMD_DOWNLOAD_DATA_REQ:
         return handle_common2(events_poll, conn_info, msg);
         break;
+    case CMD_UPLOAD_FINISH_REQ:
     case CMD_DOWNLOAD_FINISH_REQ:
         return handle_upload_or_download_finish_request(
             events_poll, conn_info, msg);
@@ -2219,6 +3258,10 @@ int deal_client_message(events_poll_t * events_poll, conn_info_t * conn_info, ms
             return handle_common3(events_poll, conn_info, msg);
             break;
         }
+        case CMD_TRUNK_OPEN_REQ:
+        {
+            return accept_trunk(events_poll, conn_info, msg);
+        }
         case CMD_MIGRATION_START_REQ:
         case CMD_MIGRATION_STOP_REQ:
         case CMD_MIGRATION_FINISHED_REQ:
@@ -2242,6 +3285,19 @@ int deal_client_message(events_poll_t * events_poll, conn_info_t * conn_info, ms
     }
 }
 
+// 中继连接上的消息属于其中的某个会话，由中继模块分发
+static int dispatch_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    if (conn_info->flags & CONN_FLAG_TRUNK)
+    {
+        return deal_trunk_message(events_poll, conn_info, msg);
+    }
+    else
+    {
+        return deal_client_message(events_poll, conn_info, msg);
+    }
+}
+
 int deal_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
 {
     conn_info->peer_id = msg->src_id;
@@ -2254,7 +3310,7 @@ int deal_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * m
 
         if (state == S_NORMAL)
         {
-            return deal_client_message(events_poll, conn_info, msg);
+            return dispatch_message(events_poll, conn_info, msg);
         }
         else if (state == S_MIGRATING || state == S_MIGRATED)
         {
@@ -2265,7 +3321,7 @@ int deal_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * m
                 c == CMD_MIGRATION_STOP_REQ ||
                 c == CMD_MIGRATION_FINISHED_REQ)
             {
-                return deal_client_message(events_poll, conn_info, msg);
+                return dispatch_message(events_poll, conn_info, msg);
             }
             else
             {
@@ -2323,6 +3379,24 @@ void * worker_thread(void * argv)
 	}
     log_info("add_to_events_poll success");
 
+    if (init_io_completion(&events_polls[thread_id], thread_id) < 0)
+    {
+        log_crit("thread:%d init io completion fail ", thread_id);
+        return NULL;
+    }
+    log_info("init_io_completion success");
+
+    if (sgw_options.io_uring && init_io_uring(&events_polls[thread_id], thread_id) < 0)
+    {
+        log_error("thread:%d io_uring unavailable, use io threads", thread_id);
+    }
+
+    if (init_sgw_pool(&events_polls[thread_id], thread_id) < 0)
+    {
+        return NULL;
+    }
+    log_info("init_sgw_pool success");
+
     run_events_loop(thread_id);
 
     return NULL;
@@ -2443,6 +3517,8 @@ static inline int split_back_end(char * src)
 
         memcpy(backend_dirs[backend_cnt], prev, len);
         backend_dirs[backend_cnt][len] = 0;
+        snprintf(stub_dirs[backend_cnt], sizeof(stub_dirs[backend_cnt]),
+                 "%s/%s", backend_dirs[backend_cnt], MNTDIRNAME);
 
         backend_cnt++;
 
@@ -2479,6 +3555,8 @@ static void signal_init_daemon(void)
 // -a asm_ip:asm_port:asm_id
 // -b backend_dirs_list
 // -w workers
+// -p log_file
+// -o name=value[,name=value...]
 // -d
 //
 // 这里还没有初始化日志模块，所以不能使用日志模块来打印日志到文件中。所以，使用
@@ -2486,7 +3564,7 @@ static void signal_init_daemon(void)
 
 static int global_init(int argc, char ** argv)
 {
-    char * option = (char *)"r:s:g:l:c:a:b:w:p:d";
+    char * option = (char *)"r:s:g:l:c:a:b:w:p:o:d";
     int result = 0;
     int noerror = 1;
     int rc;
@@ -2559,6 +3637,14 @@ static int global_init(int argc, char ** argv)
                 noerror = 0;
             }
         }
+        else if (result == 'o')
+        {
+            rc = parse_options(optarg);
+            if (rc == -1)
+            {
+                noerror = 0;
+            }
+        }
         else if (result == 'p')
         {
             snprintf(log_file, MAX_NAME_LEN, "%s", optarg);
@@ -2639,7 +3725,8 @@ static void asm_init_conn_info(int fd)
 // 在连接关闭时，也需要设置 to_asm_fd 为 -1
 static int to_asm_fd = -1;
 
-// 向 asm 发送心跳消息，如果和 asm 没有建立连接，首先建立连接。
+// 向 asm 发送心跳消息，如果和 asm 没有建立连接，首先建立连接。连接是非阻塞的，
+// asm 不可达时不会阻塞主线程接受新的连接。
 static int on_hb_to_asm(void * timer)
 {
     (void) timer;
@@ -2647,7 +3734,7 @@ static int on_hb_to_asm(void * timer)
     if (to_asm_fd == -1) {
         to_asm_fd = open_tcp_conn(
             &events_polls[0], asm_ip, asm_port,
-            NULL/*local_ip*/, 0/*local_port*/, 0/*noblock*/);
+            NULL/*local_ip*/, 0/*local_port*/, 1/*noblock*/);
         if (to_asm_fd >= 3) {
             asm_init_conn_info(to_asm_fd);
         }
@@ -2655,7 +3742,18 @@ static int on_hb_to_asm(void * timer)
 
     if (to_asm_fd >= 3) {
         conn_info_t * c = &conns_info[to_asm_fd];
-        if (c->sock_fd >= 3 && c->sock_fd == to_asm_fd) {
+        if (c->sock_fd != to_asm_fd || c->peer_type != NODE_TYPE_ASM) {
+            // 到 asm 的连接已经关闭（例如连接超时），描述符可能已经分配给了新接
+            // 受的客户端连接，不能再使用，也不能关闭
+            log_info("asm connection %d disconnect, try reconnect on next time",
+                     to_asm_fd);
+            to_asm_fd = -1;
+            return -1;
+        } else if (c->status == CONN_STATUS_CONNECTING &&
+                   get_ring_data_size(c->send) > 0) {
+            // 连接还没有建立，已经有一个心跳在等待发送，不再重复堆积
+            return 0;
+        } else {
             int ret = send_hb_to_asm(c);
             if (ret == 0) {
                 return 0;
@@ -2663,17 +3761,6 @@ static int on_hb_to_asm(void * timer)
                 to_asm_fd = -1;
                 return -1;
             }
-        } else {
-            if (c->sock_fd == -1) {
-                log_info("asm connection %d disconnect, try reconnect on next time",
-                         to_asm_fd);
-                to_asm_fd = -1;
-                return -1;
-            } else {
-                log_warning("invalid sock_fd:%d", c->sock_fd);
-                close_tcp_conn(&events_polls[0], c->sock_fd);
-                return -1;
-            }
         }
     } else /* to_asm_fd < 3 */ {
         if (to_asm_fd >= 0) {
@@ -2711,6 +3798,28 @@ static int asm_init_timer(void)
     }
 }
 
+static int on_dump_stats(void * timer)
+{
+    dump_stats();
+    return 0;
+}
+
+static int stats_init_timer(void)
+{
+    user_timer_t t;
+    memset(&t, 0, sizeof(user_timer_t));
+    t.loop_cnt = 0xFFFFFFFF;
+    t.hold_time = STATS_INTERVAL;
+    t.call_back = on_dump_stats;
+    int stats_timer_id = create_one_timer(timer_sets[0], &t);
+    if (stats_timer_id > 0) {
+        return 0;
+    } else {
+        log_crit("create stats timer failed");
+        return -1;
+    }
+}
+
 static int asm_init(void)
 {
     return asm_init_timer();
@@ -2727,7 +3836,8 @@ static void usage(const char *progname)
 #endif
     printf("BUILD_TIME: %s\n", BUILD_TIME);
     printf("MD5:        %s\n", CHECK_MD5);
-    printf("TLS:        %s\n\n", USE_TLS);
+    printf("TLS:        %s\n", USE_TLS);
+    printf("IO_URING:   %s\n\n", USE_IO_URING);
     printf("please input like this: \r\n");
     printf("    %s -r 10001 -s 100001 -g 1 -l 192.168.120.70:7788:0x90000001 -c 212.77.88.99:55555 -a 192.168.120.80:8899:0x80000001 -b /back_end_ufs1,/back_end_ufs2,/back_end_ufs3 -w 4 -d \r\n", progname);
     printf("      -r : region id \r\n");
@@ -2738,6 +3848,7 @@ static void usage(const char *progname)
     printf("      -a : asm server address \r\n");
     printf("      -b : back_end dirs list \r\n");
     printf("      -w : workers count \r\n");
+    printf("      -o : options, name=value[,name=value...], e.g. trunk=1,cluster_map=./cluster.map \r\n");
     printf("      -d : daemon \r\n\r\n");
 }
 
@@ -2812,11 +3923,11 @@ static void init1(char *progpath)
     else
     {
 #ifdef VER
-        log_info("-------- Storage Gateway start (version:medical_sgw_v%s build:%s md5:%s tls:%s) --------",
-                VERSION, BUILD_TIME, CHECK_MD5, USE_TLS);
+        log_info("-------- Storage Gateway start (version:medical_sgw_v%s build:%s md5:%s tls:%s io_uring:%s) --------",
+                VERSION, BUILD_TIME, CHECK_MD5, USE_TLS, USE_IO_URING);
 #else
-        log_info("-------- Storage Gateway start (version:medical_sgw build:%s md5:%s tls:%s) --------",
-                BUILD_TIME, CHECK_MD5, USE_TLS);
+        log_info("-------- Storage Gateway start (version:medical_sgw build:%s md5:%s tls:%s io_uring:%s) --------",
+                BUILD_TIME, CHECK_MD5, USE_TLS, USE_IO_URING);
 #endif
     }
 }
@@ -2877,6 +3988,64 @@ static void init3(void)
         // workers remains
     }
 
+    if (init_io_pool(sgw_options.io_threads) < 0)
+    {
+        printf("init io pool fail \r\n");
+        log_crit("init io pool fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (init_stripe() < 0)
+    {
+        printf("init stripe fail \r\n");
+        log_crit("init stripe fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (init_dedup() < 0)
+    {
+        printf("init dedup fail \r\n");
+        log_crit("init dedup fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (init_resume() < 0)
+    {
+        printf("init resume fail \r\n");
+        log_crit("init resume fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (init_group_commit(backend_cnt) < 0)
+    {
+        printf("init group commit fail \r\n");
+        log_crit("init group commit fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
+    init_file_cache();
+
+    if (init_prefetch() < 0)
+    {
+        printf("init prefetch fail \r\n");
+        log_crit("init prefetch fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (init_resync() < 0)
+    {
+        printf("init resync fail \r\n");
+        log_crit("init resync fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
     int i;
     for (i = 1; i <= workers; i++)
     {
@@ -2903,6 +4072,20 @@ static void init4(void)
     } else {
         log_info("asm_init success");
     }
+
+    ret = stats_init_timer();
+    if (ret < 0) {
+        log_error("stats_init_timer failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sgw_options.cluster_map) {
+        ret = init_cluster_map(sgw_options.cluster_map);
+        if (ret < 0) {
+            log_error("init_cluster_map failed");
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
 static void init_or_die(int argc, char **argv)
@@ -0,0 +1,678 @@
+// iopool.c
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "mt_log.h"
+#include "public.h"
+#include "conn_mgmt.h"
+#include "stats.h"
+#include "iopool.h"
+#include "trunk.h"
+#include "uring.h"
+#include "durable.h"
+#include "mirror.h"
+
+extern void init_mt_cntt(int thread_id);
+extern int get_thread_id(void);
+
+// 所有工作线程共用一个请求队列
+struct io_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    io_job_t * head;
+    io_job_t * tail;
+    int depth;
+    int max_depth;
+};
+
+static struct io_queue io_queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0
+};
+
+// 每个工作线程一个完成队列。I/O 线程放入请求时，如果队列原来是空的，就写
+// eventfd 唤醒工作线程，工作线程每次取走整个队列
+struct io_completion
+{
+    pthread_mutex_t lock;
+    io_job_t * head;
+    io_job_t * tail;
+    int event_fd;
+};
+
+static struct io_completion io_completions[MAX_WORKERS+1];
+
+// 空闲请求的池，每个工作线程一个，只由所属的线程访问
+struct io_job_pool
+{
+    io_job_t * free_list;
+    int nr_free;
+};
+
+static struct io_job_pool io_job_pools[MAX_WORKERS+1];
+
+static int nr_io_threads = 0;
+
+static uint64_t get_curr_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void complete_io_job(io_job_t * job)
+{
+    struct io_completion * q = &io_completions[job->thread_id];
+    job->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    int was_empty = q->head == NULL;
+    if (q->tail) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+    pthread_mutex_unlock(&q->lock);
+
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(q->event_fd, &one, sizeof(one)) != sizeof(one)) {
+            log_error("notify worker:%d on eventfd %d failed: %s",
+                      job->thread_id, q->event_fd, strerror(errno));
+        }
+    }
+}
+
+static void * io_thread(void * argv)
+{
+    init_mt_cntt((int)(uint64_t)argv);
+
+    while (1) {
+        pthread_mutex_lock(&io_queue.lock);
+        while (io_queue.head == NULL) {
+            pthread_cond_wait(&io_queue.cond, &io_queue.lock);
+        }
+        io_job_t * job = io_queue.head;
+        io_queue.head = job->next;
+        if (io_queue.head == NULL) {
+            io_queue.tail = NULL;
+        }
+        io_queue.depth = io_queue.depth - 1;
+        pthread_mutex_unlock(&io_queue.lock);
+
+        job->start_us = get_curr_us();
+        job->work(job);
+        job->end_us = get_curr_us();
+        if (job->commit) {
+            group_commit_io_job(job);
+        } else {
+            complete_io_job(job);
+        }
+    }
+    return NULL;
+}
+
+int init_io_pool(int nr_threads)
+{
+    int i;
+    for (i = 0; i <= MAX_WORKERS; i++) {
+        pthread_mutex_init(&io_completions[i].lock, NULL);
+        io_completions[i].event_fd = -1;
+    }
+
+    if (nr_threads > MAX_IO_THREADS) {
+        nr_threads = MAX_IO_THREADS;
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_t tid;
+        int ret = pthread_create(&tid, NULL, io_thread,
+                                 (void *)(uint64_t)(IO_THREAD_ID_BASE + i));
+        if (ret != 0) {
+            log_error("create io thread %d failed: %s", i, strerror(ret));
+            return -1;
+        }
+    }
+    nr_io_threads = nr_threads;
+    log_info("%d io threads started, queue depth %d", nr_threads, IO_QUEUE_DEPTH);
+    return 0;
+}
+
+int init_io_completion(events_poll_t * e, int thread_id)
+{
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        log_error("worker:%d create eventfd failed: %s", thread_id, strerror(errno));
+        return -1;
+    }
+    if (efd >= MAX_CONNS_CNT) {
+        log_error("worker:%d eventfd %d reach limits %d", thread_id, efd, MAX_CONNS_CNT);
+        close(efd);
+        return -1;
+    }
+    conns_info[efd].peer_type = NODE_TYPE_EVENT;
+    conns_info[efd].sock_fd = efd;
+    conns_info[efd].thread_id = thread_id;
+    if (add_to_events_poll(e, efd, EPOLLIN) != 1) {
+        log_error("worker:%d add eventfd %d to events poll failed", thread_id, efd);
+        close(efd);
+        return -1;
+    }
+    io_completions[thread_id].event_fd = efd;
+    return 0;
+}
+
+io_job_t * alloc_io_job(void)
+{
+    struct io_job_pool * pool = &io_job_pools[get_thread_id()];
+    io_job_t * job = pool->free_list;
+    if (job) {
+        pool->free_list = job->next;
+        pool->nr_free = pool->nr_free - 1;
+    } else {
+        job = (io_job_t *)malloc(sizeof(io_job_t));
+        if (!job) {
+            log_error("malloc %d bytes for io job failed", (int)sizeof(io_job_t));
+            return NULL;
+        }
+        job->buf = NULL;
+    }
+    char * buf = job->buf;
+    memset(job, 0, offsetof(io_job_t, ops)); // 文件操作由 add_io_op 逐个清零
+    job->buf = buf;
+    job->sock_fd = -1;
+    job->mirror = -1;
+    return job;
+}
+
+void free_io_job(io_job_t * job)
+{
+    if (!job) {
+        return;
+    }
+    free(job->data);
+    job->data = NULL;
+
+    struct io_job_pool * pool = &io_job_pools[get_thread_id()];
+    if (pool->nr_free < IO_JOB_CACHE) {
+        job->next = pool->free_list;
+        pool->free_list = job;
+        pool->nr_free = pool->nr_free + 1;
+    } else {
+        free(job->buf);
+        free(job);
+    }
+}
+
+// 消息头放在第一个对齐块的末尾，数据从第二个对齐块开始
+#define IO_BUF_HEAD (DIRECT_IO_ALIGN - sizeof(msg_t))
+#define IO_BUF_SIZE (DIRECT_IO_ALIGN + MAX_MSG_DATA_LEN)
+
+char * get_io_job_buffer(io_job_t * job)
+{
+    if (!job->buf) {
+        void * p = NULL;
+        if (posix_memalign(&p, DIRECT_IO_ALIGN, IO_BUF_SIZE) != 0) {
+            log_error("malloc %lu bytes for io job failed", (unsigned long)IO_BUF_SIZE);
+            return NULL;
+        }
+        job->buf = (char *)p;
+    }
+    return job->buf + IO_BUF_HEAD;
+}
+
+io_op_t * add_io_op(io_job_t * job, int opcode)
+{
+    io_op_t * op = &job->ops[job->nr_ops];
+    memset(op, 0, sizeof(io_op_t));
+    op->opcode = opcode;
+    op->fd = -1;
+    op->job = job;
+    job->nr_ops = job->nr_ops + 1;
+    return op;
+}
+
+static int do_io_op(io_op_t * op)
+{
+    uint32_t done = 0;
+    ssize_t n;
+    switch (op->opcode) {
+    case IO_OP_READ:
+        while (done < op->len) {
+            n = pread(op->fd, (char *)op->buf + done, op->len - done, op->offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return -errno;
+            }
+            if (n == 0) {
+                break;
+            }
+            done = done + n;
+        }
+        return done;
+    case IO_OP_WRITE:
+        while (done < op->len) {
+            n = pwrite(op->fd, (char *)op->buf + done, op->len - done, op->offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return -errno;
+            }
+            done = done + n;
+        }
+        return done;
+    case IO_OP_FSYNC:
+        n = (op->flags & IO_OP_DATASYNC) ? fdatasync(op->fd) : fsync(op->fd);
+        break;
+    case IO_OP_OPEN:
+        n = open(op->path, op->flags, 0644);
+        break;
+    case IO_OP_UNLINK:
+        n = unlink(op->path);
+        break;
+    case IO_OP_STATX:
+        n = statx(AT_FDCWD, op->path, 0, STATX_BASIC_STATS, &op->stx);
+        break;
+    case IO_OP_SYNC_RANGE:
+        n = sync_file_range(op->fd, op->offset, op->len, SYNC_FILE_RANGE_WRITE);
+        break;
+    default:
+        return -EINVAL;
+    }
+    return n < 0 ? -errno : (int)n;
+}
+
+void run_io_ops(io_job_t * job)
+{
+    int i;
+    for (i = 0; i < job->nr_ops; i++) {
+        io_op_t * prev = i > 0 ? &job->ops[i-1] : NULL;
+        if (prev && prev->link && prev->res < 0) {
+            job->ops[i].res = -ECANCELED;
+        } else {
+            job->ops[i].res = do_io_op(&job->ops[i]);
+        }
+    }
+}
+
+// 读取后端文件的请求在提交和完成时更新所读的后端目录的统计，下载时据此选择后端目录
+static void begin_mirror_read(io_job_t * job)
+{
+    if (job->mirror >= 0) {
+        mirror_read_begin(job->mirror);
+    }
+}
+
+static void end_mirror_read(io_job_t * job)
+{
+    if (job->mirror < 0) {
+        return;
+    }
+    int ok = 1;
+    int i;
+    for (i = 0; i < job->nr_ops; i++) {
+        if (job->ops[i].res < 0) {
+            ok = 0;
+        }
+    }
+    mirror_read_end(job->mirror, job->end_us - job->submit_us, ok);
+    job->mirror = -1;
+}
+
+static void append_pipelined_io_job(conn_info_t * c, io_job_t * job)
+{
+    job->xfer->io_refs += 1;
+    job->pipe_next = NULL;
+    if (c->pipeline_tail) {
+        c->pipeline_tail->pipe_next = job;
+    } else {
+        c->pipeline = job;
+    }
+    c->pipeline_tail = job;
+    c->pipeline_len = c->pipeline_len + 1;
+}
+
+// 在工作线程中执行完文件操作、需要组提交的请求：同步仍然交给提交线程，完成后和
+// 异步请求一样交回工作线程调用 done，工作线程不等待磁盘
+static int defer_io_job_commit(events_poll_t * e, conn_info_t * c, io_job_t * job)
+{
+    job->thread_id = get_thread_id();
+    job->sock_fd = c->sock_fd;
+    job->session = (c->flags & CONN_FLAG_SESSION) ? c : NULL;
+    job->msglen = job->msg->length;
+    job->next = NULL;
+    my_stats()->io_inline += 1;
+    group_commit_io_job(job);
+    if (job->pipelined) {
+        append_pipelined_io_job(c, job);
+        return 0;
+    }
+    c->io = job;
+    c->flags |= CONN_FLAG_IO_WAIT;
+    if (!job->session) {
+        stop_monitoring_recv(e, c->sock_fd);
+    }
+    return MSG_IO_PENDING;
+}
+
+static int run_io_job_inline(events_poll_t * e, conn_info_t * c, io_job_t * job)
+{
+    job->submit_us = get_curr_us();
+    job->start_us = job->submit_us;
+    begin_mirror_read(job);
+    job->work(job);
+    job->end_us = get_curr_us();
+    end_mirror_read(job);
+    if (job->commit) {
+        int tid = get_thread_id();
+        if (tid <= MAX_WORKERS && io_completions[tid].event_fd >= 0) {
+            return defer_io_job_commit(e, c, job);
+        }
+        // 没有完成通知的线程只能直接同步
+        if (sync_transfer_files(job->xfer) < 0) {
+            job->result = -1;
+        } else if (job->committed) {
+            job->committed(job);
+        }
+    }
+    int ret = job->done(e, c, job);
+    free_io_job(job);
+    my_stats()->io_inline += 1;
+    return ret;
+}
+
+// 只有工作线程自己的连接可以异步执行。中继连接上的会话的请求消息已经复制到会话
+// 自己的接收缓冲区中，完成之前只暂停这个会话
+static int can_submit_io_job(conn_info_t * c, int tid)
+{
+    return tid <= MAX_WORKERS && io_completions[tid].event_fd >= 0 &&
+           (c == &conns_info[c->sock_fd] || (c->flags & CONN_FLAG_SESSION));
+}
+
+// 提交请求的连接，会话的虚拟连接不在 conns_info 中
+static conn_info_t * job_conn(io_job_t * job)
+{
+    return job->session ? job->session : &conns_info[job->sock_fd];
+}
+
+// 请求完成后处理失败：关闭连接，会话只放弃这个会话
+static void close_job_conn(events_poll_t * e, conn_info_t * c)
+{
+    if (c->flags & CONN_FLAG_SESSION) {
+        reset_trunk_session(e, c);
+    } else {
+        close_tcp_conn(e, c->sock_fd);
+    }
+}
+
+// 交给 io_uring 或者 I/O 线程，返回 -1 表示只能在工作线程中直接执行
+static int submit_io_job(conn_info_t * c, io_job_t * job)
+{
+    job->thread_id = get_thread_id();
+    job->sock_fd = c->sock_fd;
+    job->session = (c->flags & CONN_FLAG_SESSION) ? c : NULL;
+    job->msglen = job->msg->length;
+    job->submit_us = get_curr_us();
+    job->next = NULL;
+
+    if (job->nr_ops > 0 && submit_io_uring_job(job) == 0) {
+        begin_mirror_read(job);
+        return 0;
+    }
+    if (nr_io_threads == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&io_queue.lock);
+    if (io_queue.depth >= IO_QUEUE_DEPTH) {
+        pthread_mutex_unlock(&io_queue.lock);
+        my_stats()->io_overflows += 1;
+        return -1;
+    }
+    if (io_queue.tail) {
+        io_queue.tail->next = job;
+    } else {
+        io_queue.head = job;
+    }
+    io_queue.tail = job;
+    io_queue.depth = io_queue.depth + 1;
+    if (io_queue.depth > io_queue.max_depth) {
+        io_queue.max_depth = io_queue.depth;
+    }
+    begin_mirror_read(job);
+    pthread_cond_signal(&io_queue.cond);
+    pthread_mutex_unlock(&io_queue.lock);
+    return 0;
+}
+
+int run_io_job(events_poll_t * e, conn_info_t * c, io_job_t * job)
+{
+    if (!can_submit_io_job(c, get_thread_id()) || submit_io_job(c, job) < 0) {
+        return run_io_job_inline(e, c, job);
+    }
+
+    // 完成之前不再处理这个连接上的消息，后面的消息留在接收缓冲区中
+    c->io = job;
+    c->flags |= CONN_FLAG_IO_WAIT;
+    if (!job->session) {
+        stop_monitoring_recv(e, c->sock_fd);
+    }
+    return MSG_IO_PENDING;
+}
+
+int run_pipelined_io_job(events_poll_t * e, conn_info_t * c, io_job_t * job)
+{
+    job->pipelined = 1;
+    if (!can_submit_io_job(c, get_thread_id())) {
+        return run_io_job_inline(e, c, job);
+    }
+    if (submit_io_job(c, job) < 0) {
+        if (!c->pipeline) {
+            return run_io_job_inline(e, c, job);
+        }
+        // 前面还有没有完成的请求，应答要按顺序发送，等前面的请求完成后一起处理
+        job->work(job);
+        job->completed = 1;
+        my_stats()->io_inline += 1;
+    }
+
+    append_pipelined_io_job(c, job);
+    return 0;
+}
+
+int run_pipelined_io_done(events_poll_t * e, conn_info_t * c, io_job_t * job)
+{
+    job->pipelined = 1;
+    if (!c->pipeline) {
+        int ret = job->done(e, c, job);
+        free_io_job(job);
+        return ret;
+    }
+    job->completed = 1;
+    append_pipelined_io_job(c, job);
+    return 0;
+}
+
+int run_readahead_io_job(conn_info_t * c, io_job_t * job)
+{
+    if (!can_submit_io_job(c, get_thread_id()) || submit_io_job(c, job) < 0) {
+        return -1;
+    }
+    job->pipelined = 1;
+    append_pipelined_io_job(c, job);
+    return 0;
+}
+
+io_job_t * pop_pipelined_io_job(conn_info_t * c)
+{
+    io_job_t * first = c->pipeline;
+    c->pipeline = first->pipe_next;
+    if (!c->pipeline) {
+        c->pipeline_tail = NULL;
+    }
+    c->pipeline_len = c->pipeline_len - 1;
+    first->xfer->io_refs = first->xfer->io_refs - 1;
+    return first;
+}
+
+static void account_io_job(io_job_t * job)
+{
+    sgw_stats_t * s = my_stats();
+    uint64_t wait_us = job->start_us - job->submit_us;
+    s->io_jobs += 1;
+    s->io_wait_us += wait_us;
+    s->io_busy_us += job->end_us - job->start_us;
+    if (wait_us > s->io_wait_max_us) {
+        s->io_wait_max_us = wait_us;
+    }
+}
+
+static void finish_pipelined_io_job(events_poll_t * e, io_job_t * job)
+{
+    if (job->sock_fd < 0) {
+        // 连接已经关闭，最后一个完成的请求释放传输状态
+        transfer_t * x = job->xfer;
+        x->io_refs = x->io_refs - 1;
+        if (x->io_refs == 0) {
+            free_transfer(x);
+        }
+        free_io_job(job);
+        return;
+    }
+
+    // 从最早提交的请求开始，按顺序处理已经完成的请求。预读请求留在流水线中，由
+    // 处理下载数据请求的函数取走
+    conn_info_t * c = job_conn(job);
+    job->completed = 1;
+    while (c->pipeline && c->pipeline->completed && c->pipeline->done) {
+        io_job_t * first = pop_pipelined_io_job(c);
+        int ret = first->done(e, c, first);
+        free_io_job(first);
+        if (ret < 0) {
+            log_error("sock_fd:%d: finish pipelined io request failed", c->sock_fd);
+            close_job_conn(e, c);
+            return;
+        }
+    }
+
+    // 因为流水线已满或者等待流水线清空而暂停的连接，继续处理接收缓冲区中的消息。
+    // 会话还要释放为完成的请求预留的发送缓冲区
+    if (c->flags & (CONN_FLAG_PAUSED | CONN_FLAG_SESSION)) {
+        resume_recv(e, c);
+    }
+}
+
+void finish_io_job(events_poll_t * e, io_job_t * job)
+{
+    end_mirror_read(job);
+    if (job->pipelined) {
+        finish_pipelined_io_job(e, job);
+        return;
+    }
+    if (job->sock_fd < 0) {
+        // 连接已经关闭，释放交给请求的接收缓冲区和传输状态，以及打开的文件
+        int i;
+        for (i = 0; i < job->nr_ops; i++) {
+            if (job->ops[i].opcode == IO_OP_OPEN && job->ops[i].res >= 0) {
+                close(job->ops[i].res);
+            }
+        }
+        if (job->orphan_recv) {
+            destroy_ring(job->orphan_recv);
+        }
+        free_transfer(job->orphan_xfer);
+        free_io_job(job);
+        return;
+    }
+
+    conn_info_t * c = job_conn(job);
+    c->io = NULL;
+    c->flags &= ~CONN_FLAG_IO_WAIT;
+    // 先恢复接收，done 可以再次暂停（例如开始顺序下载）
+    if (!job->session) {
+        start_monitoring_recv(e, c->sock_fd);
+    }
+    msg_t * msg = job->msg;
+    uint32_t msglen = job->msglen;
+    int ret = job->done(e, c, job);
+    free_io_job(job);
+    if (ret == MSG_IO_PENDING) {
+        // done 提交了新的请求，请求消息留到新的请求完成后再删除
+        return;
+    }
+    if (ret == MSG_PAUSED && !(c->flags & CONN_FLAG_SESSION)) {
+        requeue_io_message(e, c, msg);
+        return;
+    }
+    if (ret < 0 || consume_io_message(e, c, msg, msglen) < 0) {
+        log_error("sock_fd:%d: finish io request failed", c->sock_fd);
+        close_job_conn(e, c);
+    }
+}
+
+void on_io_completion(events_poll_t * e)
+{
+    struct io_completion * q = &io_completions[get_thread_id()];
+    uint64_t n;
+    if (read(q->event_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        log_error("read eventfd %d failed: %s", q->event_fd, strerror(errno));
+    }
+
+    pthread_mutex_lock(&q->lock);
+    io_job_t * list = q->head;
+    q->head = NULL;
+    q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+
+    while (list) {
+        io_job_t * job = list;
+        list = job->next;
+        account_io_job(job);
+        finish_io_job(e, job);
+    }
+}
+
+void cancel_io_job(conn_info_t * c)
+{
+    io_job_t * job = c->io;
+    job->sock_fd = -1;
+    job->orphan_recv = c->recv;
+    job->orphan_xfer = c->xfer;
+    c->recv = NULL;
+    c->xfer = NULL;
+    c->io = NULL;
+}
+
+void cancel_pipelined_io_jobs(conn_info_t * c)
+{
+    io_job_t * job = c->pipeline;
+    while (job) {
+        io_job_t * next = job->pipe_next;
+        if (job->completed) {
+            // 已经直接执行完，只是在等待前面的请求
+            job->xfer->io_refs = job->xfer->io_refs - 1;
+            free_io_job(job);
+        } else {
+            job->sock_fd = -1;
+        }
+        job = next;
+    }
+    c->pipeline = NULL;
+    c->pipeline_tail = NULL;
+    c->pipeline_len = 0;
+    if (c->xfer && c->xfer->io_refs > 0) {
+        c->xfer = NULL;
+    }
+}
+
+void get_io_queue_depth(int * depth, int * max_depth)
+{
+    pthread_mutex_lock(&io_queue.lock);
+    *depth = io_queue.depth;
+    *max_depth = io_queue.max_depth;
+    io_queue.max_depth = io_queue.depth;
+    pthread_mutex_unlock(&io_queue.lock);
+}
@@ -0,0 +1,202 @@
+// iopool.h
+
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <linux/stat.h>
+#include "public.h"
+#include "ring.h"
+#include "transfer.h"
+#include "events_poll.h"
+
+// 默认的 I/O 线程个数，可以用 -o io_threads=N 修改，0 表示不使用 I/O 线程
+#ifndef IO_THREADS
+#define IO_THREADS (8)
+#endif
+
+#ifndef MAX_IO_THREADS
+#define MAX_IO_THREADS (64)
+#endif
+
+// 等待 I/O 线程执行的请求个数上限。队列满时说明磁盘已经跟不上，新的请求直接在
+// 工作线程中执行，不再继续积压
+#ifndef IO_QUEUE_DEPTH
+#define IO_QUEUE_DEPTH (1024)
+#endif
+
+// 每个上传连接默认最多同时写入的上传数据请求个数，可以用 -o upload_window=N 修改。
+// 每个请求占用一块 MAX_MESSAGE_LEN 的缓冲区
+#ifndef UPLOAD_WINDOW
+#define UPLOAD_WINDOW (2)
+#endif
+
+#ifndef MAX_UPLOAD_WINDOW
+#define MAX_UPLOAD_WINDOW (8)
+#endif
+
+// 每个下载连接默认预读的数据块个数，可以用 -o readahead=N 修改，0 表示不预读。
+// 每个预读块占用一块 MAX_MESSAGE_LEN 的缓冲区
+#ifndef READAHEAD_WINDOW
+#define READAHEAD_WINDOW (2)
+#endif
+
+#ifndef MAX_READAHEAD_WINDOW
+#define MAX_READAHEAD_WINDOW (8)
+#endif
+
+// 每个工作线程最多缓存的空闲请求个数
+#ifndef IO_JOB_CACHE
+#define IO_JOB_CACHE (8)
+#endif
+
+// O_DIRECT 读写的内存地址、文件偏移和长度都要按这个大小对齐
+#ifndef DIRECT_IO_ALIGN
+#define DIRECT_IO_ALIGN (4096)
+#endif
+
+// 一个请求最多包含的文件操作个数，每个后端文件最多五个（上传数据的四个和续传进度
+// 记录的写入）
+#define MAX_IO_OPS (MAX_BACK_END * 5)
+
+// I/O 线程的线程标识从这里开始，只用于日志，不能用来访问按工作线程划分的数据
+#define IO_THREAD_ID_BASE (MAX_WORKERS + 1)
+
+struct conn_info_;
+typedef struct io_job_ io_job_t;
+
+// 在 I/O 线程中执行阻塞的文件操作，只能访问请求中的数据，不能访问连接
+typedef void (*io_work_t)(io_job_t * job);
+
+// 在提交请求的工作线程中继续处理，返回值和处理消息的返回值相同。连接在请求完成
+// 之前关闭时不会调用
+typedef int (*io_done_t)(events_poll_t * e, struct conn_info_ * c, io_job_t * job);
+
+// 可以交给 io_uring 执行的文件操作
+#define IO_OP_READ   1 // 从 offset 读取 len 字节到 buf
+#define IO_OP_WRITE  2 // 把 buf 的 len 字节写到 offset
+#define IO_OP_FSYNC  3 // flags 为 IO_OP_DATASYNC 时只同步数据
+#define IO_OP_OPEN   4 // 用 flags 和 0644 打开 path，res 是文件描述符
+#define IO_OP_UNLINK 5 // 删除 path
+#define IO_OP_STATX  6 // 取得 path 的属性，放在 stx 中
+#define IO_OP_SYNC_RANGE 7 // 开始写回 offset 开始的 len 字节，不等待写回完成
+
+#define IO_OP_DATASYNC 1
+
+typedef struct io_op_
+{
+    int opcode;
+    int fd;             // READ、WRITE、FSYNC 操作的文件
+    const char * path;  // OPEN、UNLINK、STATX 操作的路径，完成之前不能释放
+    int flags;
+    int link;           // 为 1 时本操作失败则取消下一个操作，下一个操作的 res 为 -ECANCELED
+    uint64_t offset;
+    void * buf;
+    uint32_t len;
+    int res;            // 和系统调用的返回值相同，失败时为 -errno
+    io_job_t * job;     // 所属的请求
+    struct statx stx;
+} io_op_t;
+
+struct io_job_
+{
+    io_job_t * next;
+    io_work_t work;
+    io_done_t done;
+    int thread_id;       // 提交请求的工作线程
+    int sock_fd;         // 提交请求的连接，连接在完成之前关闭时为 -1
+    struct conn_info_ * session; // 中继连接上的会话提交的请求：会话的虚拟连接，否则为 NULL
+    msg_t * msg;         // 请求消息，留在连接的接收缓冲区中，完成之前不会移动
+    uint32_t msglen;     // 请求消息的长度，完成后从接收缓冲区中删除
+    transfer_t * xfer;   // 请求操作的后端文件
+    int result;          // 文件操作的结果，由 done 解释
+    char * data;         // 文件操作生成的数据（例如文件列表），释放请求时一起释放
+    int datalen;
+    char * buf;          // 消息缓冲区，第一次使用时分配，随请求缓存，用 get_io_job_buffer 访问
+    int index;           // 由处理函数使用，例如读取的后端文件下标
+    uint32_t tried;      // 由处理函数使用，例如已经读取失败的后端文件，按位表示
+    int mirror;          // 读取的后端目录，提交和完成时更新它的读取统计，-1 表示不统计
+    int pipelined;       // 由 run_pipelined_io_job 提交，不占用连接
+    int completed;       // 流水线请求的文件操作已经完成，等待前面的请求完成
+    io_job_t * pipe_next;
+    int commit;          // 由 work 设置，文件操作完成后交给提交线程同步后端文件
+    io_work_t committed; // 由 work 和 commit 一起设置，所有后端文件同步成功之后、交回工作线程之前调用
+    int commit_pending;  // 还没有完成同步的后端个数
+    io_job_t * commit_next[MAX_BACK_END];
+    // 用 add_io_op 描述的文件操作。有文件操作的请求可以交给 io_uring 执行，这时
+    // 不调用 work，work 应该是 run_io_ops
+    int nr_ops;
+    int nr_pending;      // io_uring 中还没有完成的操作个数
+    io_op_t ops[MAX_IO_OPS];
+    // 连接在请求完成之前关闭时，接收缓冲区和传输状态由请求在完成后释放
+    ring_t * orphan_recv;
+    transfer_t * orphan_xfer;
+    uint64_t submit_us;  // 以下用于统计排队和执行的时间
+    uint64_t start_us;
+    uint64_t end_us;
+};
+
+// 启动 I/O 线程，在创建工作线程之前调用
+int init_io_pool(int nr_threads);
+
+// 工作线程创建接收完成通知的 eventfd，加入线程的事件循环
+int init_io_completion(events_poll_t * e, int thread_id);
+
+io_job_t * alloc_io_job(void);
+
+void free_io_job(io_job_t * job);
+
+// 返回请求中可以放一个 MAX_MESSAGE_LEN 消息的缓冲区，失败时返回 NULL。消息的数据
+// 部分按 DIRECT_IO_ALIGN 对齐，可以直接用于 O_DIRECT 读写。缓冲区随请求缓存在工
+// 作线程中，不需要每次分配
+char * get_io_job_buffer(io_job_t * job);
+
+// 在请求中增加一个文件操作，返回的操作除了 opcode 以外都是 0
+io_op_t * add_io_op(io_job_t * job, int opcode);
+
+// 按顺序同步执行请求的文件操作，作为有文件操作的请求的 work
+void run_io_ops(io_job_t * job);
+
+// 把请求交给 io_uring 或者 I/O 线程，返回 MSG_IO_PENDING，这时连接暂停接收，请求
+// 消息保留在接收缓冲区中，完成后调用 done 继续处理。done 可以再次提交请求并返回
+// MSG_IO_PENDING。有文件操作并且本线程启用了 io_uring 时交给 io_uring，否则交给
+// I/O 线程。没有 I/O 线程或者队列已满时直接执行 work 和 done，返回 done 的结果；
+// 其中需要组提交的请求仍然交给提交线程同步，返回 MSG_IO_PENDING。
+// 中继连接上的会话只暂停这个会话，请求消息在会话自己的接收缓冲区中
+int run_io_job(events_poll_t * e, struct conn_info_ * c, io_job_t * job);
+
+// 提交流水线请求：请求使用的数据已经复制到请求中，连接继续接收和处理后面的消息。
+// 同一个连接的流水线请求按提交的顺序调用 done，done 失败时关闭连接。不能异步执
+// 行并且连接没有其它流水线请求时直接执行，返回 done 的结果，否则返回 0
+int run_pipelined_io_job(events_poll_t * e, struct conn_info_ * c, io_job_t * job);
+
+// 没有文件操作的流水线请求，只是应答要按顺序发送：连接没有其它流水线请求时直接
+// 调用 done，返回 done 的结果，否则排在前面的请求后面，返回 0
+int run_pipelined_io_done(events_poll_t * e, struct conn_info_ * c, io_job_t * job);
+
+// 在任意线程中调用，把完成的请求交回提交请求的工作线程
+void complete_io_job(io_job_t * job);
+
+// 提交预读请求：done 为 NULL，请求完成后留在连接的流水线中，由处理函数用
+// pop_pipelined_io_job 取走；完成时连接因为等待预读而暂停的话继续处理接收缓冲区
+// 中的消息。不能异步执行时返回 -1，由调用者释放请求
+int run_readahead_io_job(struct conn_info_ * c, io_job_t * job);
+
+// 从连接的流水线中取出最早提交的请求
+io_job_t * pop_pipelined_io_job(struct conn_info_ * c);
+
+// 请求的文件操作已经完成，在提交请求的工作线程中调用 done 继续处理
+void finish_io_job(events_poll_t * e, io_job_t * job);
+
+// eventfd 可读时调用，处理本线程完成的请求
+void on_io_completion(events_poll_t * e);
+
+// 关闭连接时调用，连接的请求还没有完成时，接收缓冲区和传输状态交给请求释放
+void cancel_io_job(struct conn_info_ * c);
+
+// 关闭连接时调用，传输状态交给还没有完成的流水线请求，最后一个完成时释放
+void cancel_pipelined_io_jobs(struct conn_info_ * c);
+
+// 队列中等待的请求个数，以及上次调用以来的最大值
+void get_io_queue_depth(int * depth, int * max_depth);
+
+#endif // IOPOOL_H
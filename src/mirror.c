@@ -0,0 +1,128 @@
+// mirror.c
+
+#include "mt_log.h"
+#include "public.h"
+#include "mirror.h"
+
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+// 由多个工作线程更新，原子操作
+struct mirror_state
+{
+    int outstanding;      // 正在读取的请求数
+    uint64_t latency_us;  // 读取延迟的指数平均
+    time_t down_until;    // 读取失败之后到这个时间之前不优先选择
+    uint64_t reads;
+    uint64_t failures;
+};
+
+static struct mirror_state mirrors[MAX_BACK_END];
+static uint32_t next_pick = 0;
+
+static int is_healthy(int b, time_t now)
+{
+    return __atomic_load_n(&mirrors[b].down_until, __ATOMIC_RELAXED) <= now;
+}
+
+int pick_mirror(const transfer_t * x, uint32_t tried)
+{
+    time_t now = time(NULL);
+    uint32_t start = __sync_fetch_and_add(&next_pick, 1);
+    int best = -1;
+    int best_healthy = 0;
+    uint64_t best_score = 0;
+    int k;
+    for (k = 0; k < backend_cnt; k++) {
+        int b = (start + k) % backend_cnt;
+        if ((tried & (1u << b)) || (x && x->befiles[b].fd < 0)) {
+            continue;
+        }
+        struct mirror_state * m = &mirrors[b];
+        int healthy = is_healthy(b, now);
+        uint64_t score = (uint64_t)(__atomic_load_n(&m->outstanding, __ATOMIC_RELAXED) + 1) *
+                         (__atomic_load_n(&m->latency_us, __ATOMIC_RELAXED) + 1);
+        if (best < 0 || healthy > best_healthy ||
+            (healthy == best_healthy && score < best_score)) {
+            best = b;
+            best_healthy = healthy;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+void mirror_read_begin(int b)
+{
+    __sync_fetch_and_add(&mirrors[b].outstanding, 1);
+}
+
+void mirror_read_end(int b, uint64_t us, int ok)
+{
+    struct mirror_state * m = &mirrors[b];
+    __sync_fetch_and_sub(&m->outstanding, 1);
+    __sync_fetch_and_add(&m->reads, 1);
+    if (!ok) {
+        mirror_failed(b);
+        return;
+    }
+    // 多个线程同时更新时丢掉其中一次，只影响平均值
+    uint64_t old = __atomic_load_n(&m->latency_us, __ATOMIC_RELAXED);
+    uint64_t ewma = old - (old >> MIRROR_EWMA_SHIFT) + (us >> MIRROR_EWMA_SHIFT);
+    __atomic_store_n(&m->latency_us, ewma, __ATOMIC_RELAXED);
+}
+
+void mirror_failed(int b)
+{
+    struct mirror_state * m = &mirrors[b];
+    __sync_fetch_and_add(&m->failures, 1);
+    if (is_healthy(b, time(NULL))) {
+        log_warning("backend %s failed, avoid it for %d seconds",
+                    backend_dirs[b], MIRROR_DOWN_SECONDS);
+    }
+    __atomic_store_n(&m->down_until, time(NULL) + MIRROR_DOWN_SECONDS, __ATOMIC_RELAXED);
+}
+
+int reopen_on_mirror(struct backend_file * f)
+{
+    // 各个后端目录下的路径只有开头的后端目录不同
+    const char * rest = f->abs_file_name + strlen(backend_dirs[f->backend]);
+    char path[sizeof(f->abs_file_name)];
+    int b;
+    f->failed |= 1u << f->backend;
+    mirror_failed(f->backend);
+    for (b = 0; b < backend_cnt; b++) {
+        if (f->failed & (1u << b)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s%s", backend_dirs[b], rest);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        struct stat s;
+        if (fstat(fd, &s) < 0 || s.st_size != f->filesize) {
+            log_warning("%s differs from %s, skip it", path, f->abs_file_name);
+            close(fd);
+            f->failed |= 1u << b;
+            continue;
+        }
+        log_warning("continue sending %s from %s", f->abs_file_name, path);
+        close(f->fd);
+        f->fd = fd;
+        f->backend = b;
+        memcpy(f->abs_file_name, path, sizeof(path));
+        return 0;
+    }
+    return -1;
+}
+
+void get_mirror_stats(int b, uint64_t * reads, uint64_t * failures,
+                      uint64_t * latency_us, int * healthy)
+{
+    struct mirror_state * m = &mirrors[b];
+    *reads = __sync_fetch_and_add(&m->reads, 0);
+    *failures = __sync_fetch_and_add(&m->failures, 0);
+    *latency_us = __atomic_load_n(&m->latency_us, __ATOMIC_RELAXED);
+    *healthy = is_healthy(b, time(NULL));
+}
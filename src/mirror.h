@@ -0,0 +1,40 @@
+// mirror.h
+
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include "public.h"
+#include "transfer.h"
+
+// 读取失败的后端目录在这段时间（秒）内不再优先选择，所有后端目录都失败过时仍然
+// 从中选择
+#ifndef MIRROR_DOWN_SECONDS
+#define MIRROR_DOWN_SECONDS (10)
+#endif
+
+// 读取延迟的指数平均，新的一次占 1/2^MIRROR_EWMA_SHIFT
+#ifndef MIRROR_EWMA_SHIFT
+#define MIRROR_EWMA_SHIFT (3)
+#endif
+
+// 选择读取的后端目录：x 不为 NULL 时在已经打开的后端文件中选择，否则在所有后端
+// 目录中选择。tried 中按位表示的后端目录不选。优先选择正常的后端目录中正在读取的
+// 请求数乘以平均延迟最小的，相同时轮流选择。没有可选的返回 -1
+int pick_mirror(const transfer_t * x, uint32_t tried);
+
+// 开始和完成一次读取，us 是读取的耗时，ok 为 0 表示读取失败
+void mirror_read_begin(int b);
+void mirror_read_end(int b, uint64_t us, int ok);
+
+// 打开或者发送文件失败，这段时间内不再优先选择
+void mirror_failed(int b);
+
+// 顺序下载时发送文件失败，在其它没有失败过的后端目录中打开同一个文件，大小相同时
+// 替换 f 中的文件描述符，从原来的位置继续发送。成功返回 0
+int reopen_on_mirror(struct backend_file * f);
+
+// 累计的读取次数、失败次数，平均延迟，以及当前是否正常
+void get_mirror_stats(int b, uint64_t * reads, uint64_t * failures,
+                      uint64_t * latency_us, int * healthy);
+
+#endif // MIRROR_H
@@ -0,0 +1,119 @@
+// options.c
+
+#include "public.h"
+#include "options.h"
+#include "iopool.h"
+#include "durable.h"
+#include "pagecache.h"
+#include "resync.h"
+
+sgw_options_t sgw_options = {
+    .trunk = 0,
+    .trunk_window = 2,
+    .cluster_map = NULL,
+    .ktls = 1,
+    .io_threads = IO_THREADS,
+    .io_uring = 0,
+    .upload_window = UPLOAD_WINDOW,
+    .durability = DURABILITY_NONE,
+    .direct_io = 0,
+    .cache_policy = CACHE_POLICY_ADAPTIVE,
+    .readahead = READAHEAD_WINDOW,
+    .prefetch = 0,
+    .file_cache = 0,
+    .write_quorum = 0,
+    .resync_rate = RESYNC_RATE,
+    .resync_journal = NULL,
+    .async_mirror = 0,
+    .replication_backlog = REPLICATION_BACKLOG,
+    .parity = 0,
+    .dedup = 0,
+    .resume = 0,
+};
+
+// 整数参数使用 value 和取值范围，字符串参数使用 str。字符串直接指向命令行参数
+// 本身，在整个进程运行期间都有效，不需要复制。
+struct option_desc
+{
+    const char * name;
+    int * value;
+    int min;
+    int max;
+    const char ** str;
+};
+
+static struct option_desc option_descs[] = {
+    { "trunk",        &sgw_options.trunk,        0, 1,  NULL },
+    { "trunk_window", &sgw_options.trunk_window, 1, 64, NULL },
+    { "cluster_map",  NULL,                      0, 0,  &sgw_options.cluster_map },
+    { "ktls",         &sgw_options.ktls,         0, 1,  NULL },
+    { "io_threads",   &sgw_options.io_threads,   0, MAX_IO_THREADS, NULL },
+    { "io_uring",     &sgw_options.io_uring,     0, 1,  NULL },
+    { "upload_window", &sgw_options.upload_window, 1, MAX_UPLOAD_WINDOW, NULL },
+    { "durability",   &sgw_options.durability,   DURABILITY_NONE, DURABILITY_GROUP, NULL },
+    { "direct_io",    &sgw_options.direct_io,    0, 1 << 20, NULL },
+    { "cache_policy", &sgw_options.cache_policy, CACHE_POLICY_SEQUENTIAL, CACHE_POLICY_ADAPTIVE, NULL },
+    { "readahead",    &sgw_options.readahead,    0, MAX_READAHEAD_WINDOW, NULL },
+    { "prefetch",     &sgw_options.prefetch,     0, 1 << 20, NULL },
+    { "file_cache",   &sgw_options.file_cache,   0, 1 << 20, NULL },
+    { "write_quorum", &sgw_options.write_quorum, 0, MAX_BACK_END, NULL },
+    { "resync_rate",  &sgw_options.resync_rate,  1, 1 << 20, NULL },
+    { "resync_journal", NULL,                    0, 0,  &sgw_options.resync_journal },
+    { "async_mirror", &sgw_options.async_mirror, 0, 1,  NULL },
+    { "replication_backlog", &sgw_options.replication_backlog, 1, 1 << 24, NULL },
+    { "parity",       &sgw_options.parity,       0, MAX_BACK_END - 2, NULL },
+    { "dedup",        &sgw_options.dedup,        0, 1,  NULL },
+    { "resume",       &sgw_options.resume,       0, 7 * 24 * 3600, NULL },
+};
+
+static int set_option(char * item)
+{
+    char * eq = strchr(item, '=');
+    if (eq == NULL) {
+        printf("invalid option %s: expect name=value\n", item);
+        return -1;
+    }
+    *eq = '\0';
+
+    const char * name = item;
+    const char * value = eq + 1;
+    size_t i;
+    for (i = 0; i < sizeof(option_descs) / sizeof(option_descs[0]); i++) {
+        struct option_desc * d = &option_descs[i];
+        if (strcmp(d->name, name) == 0) {
+            if (d->str) {
+                if (*value == '\0') {
+                    printf("empty value for option %s\n", name);
+                    return -1;
+                }
+                *d->str = value;
+                return 0;
+            }
+            char * end = NULL;
+            long v = strtol(value, &end, 0);
+            if (end == value || *end != '\0' || v < d->min || v > d->max) {
+                printf("invalid value %s for option %s: expect %d ~ %d\n",
+                       value, name, d->min, d->max);
+                return -1;
+            }
+            *d->value = (int)v;
+            return 0;
+        }
+    }
+
+    printf("unknown option %s\n", name);
+    return -1;
+}
+
+int parse_options(char * arg)
+{
+    char * saveptr = NULL;
+    char * item = strtok_r(arg, ",", &saveptr);
+    while (item) {
+        if (set_option(item) < 0) {
+            return -1;
+        }
+        item = strtok_r(NULL, ",", &saveptr);
+    }
+    return 0;
+}
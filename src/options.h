@@ -0,0 +1,76 @@
+// options.h
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+// 通过 -o name=value[,name=value...] 设置的运行参数。参数较多、又都有合理的默认
+// 值，所以不再为每个参数单独占用一个命令行选项。
+typedef struct sgw_options_
+{
+    // 到同一个目标 sgw 的转发共用中继连接（每个工作线程一个），0 表示每个转发
+    // 的客户端使用独立的连接
+    int trunk;
+    // 中继连接上每个会话最多同时在途的请求个数
+    int trunk_window;
+    // 集群分布表文件，按 studyid 把文件分配到各个 sgw，NULL 表示不使用
+    const char * cluster_map;
+    // 客户端连接握手完成后由内核负责 TLS 记录的加解密（kTLS），这样加密的连接
+    // 也可以用 sendfile() 下载和零拷贝转发。内核或者 OpenSSL 不支持时自动使用
+    // 用户态的加解密
+    int ktls;
+    // 执行阻塞的文件操作（创建、读写、删除文件，扫描目录）的线程个数，0 表示
+    // 在工作线程中直接执行
+    int io_threads;
+    // 后端文件的读写、打开、删除由工作线程通过 io_uring 异步执行，不占用 I/O
+    // 线程。创建目录、计算 md5、扫描目录等仍然由 I/O 线程执行。内核不支持时
+    // 自动使用 I/O 线程
+    int io_uring;
+    // 每个上传连接最多同时写入后端文件的上传数据请求个数。大于 1 时数据复制出
+    // 接收缓冲区，写入的同时继续接收下一块数据；1 表示写完一块再接收下一块
+    int upload_window;
+    // 上传完成时后端文件的持久化方式，取值见 durable.h 中的 DURABILITY_*
+    int durability;
+    // 大小不小于这个值（MB）的文件上传和顺序下载时用 O_DIRECT 读写，不占用页缓
+    // 存，0 表示都使用页缓存
+    int direct_io;
+    // 顺序下载和分块下载的文件使用页缓存的方式，取值见 pagecache.h 中的
+    // CACHE_POLICY_*
+    int cache_policy;
+    // 每个下载连接顺序读取时提前读取的数据块个数，0 表示不预读
+    int readahead;
+    // 发送文件列表之后在后台把列表中的文件读入页缓存，每个工作线程还没有预取完
+    // 的数据不超过这个值（MB），0 表示不预取
+    int prefetch;
+    // 不大于 FILE_CACHE_MAX_FILE 的文件整个缓存在内存中，这是所有工作线程共用的
+    // 内存预算（MB），0 表示不缓存
+    int file_cache;
+    // 上传时至少要写入成功的后端目录个数，其余的后端目录失败时上传仍然成功，缺少
+    // 的副本记录在日志中由补写线程在后台补齐。0 表示所有的后端目录都要写入成功
+    int write_quorum;
+    // 补写线程复制文件的速度上限（MB/s），不影响正在进行的上传和下载
+    int resync_rate;
+    // 记录缺少的副本的日志文件，NULL 表示使用 RESYNC_JOURNAL
+    const char * resync_journal;
+    // 异步复制：上传只写入第一个后端目录就应答，其它后端目录（镜像）由补写线程
+    // 在后台从第一个后端目录复制，适合有一个镜像是较慢的远程存储的情况
+    int async_mirror;
+    // 异步复制时最多排队的副本个数，超过时新的上传仍然同步写入所有后端目录
+    int replication_backlog;
+    // 条带模式的校验分片个数：不为 0 时文件按条带切开，最后这么多个后端目录保存
+    // Reed-Solomon 校验分片，其余的后端目录保存数据分片，代替完整的镜像。0 表示
+    // 每个后端目录保存一份完整的文件
+    int parity;
+    // 按 md5 去重：开始上传时文件已经存在并且内容相同，或者最近上传过内容相同的文件
+    // （在每个后端目录中硬链接过来），直接应答，不再上传数据。0 表示不去重
+    int dedup;
+    // 续传：连接断开之后不完整的上传保留这么多秒，客户端可以在开始上传请求中请求续传
+    // 点，从那里继续上传；超过时间的由清理线程删除。0 表示不续传
+    int resume;
+} sgw_options_t;
+
+extern sgw_options_t sgw_options;
+
+// 解析 -o 的参数，出错时打印错误并返回 -1。这时日志模块还没有初始化。
+int parse_options(char * arg);
+
+#endif // OPTIONS_H
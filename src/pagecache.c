@@ -0,0 +1,151 @@
+// pagecache.c
+
+#include <sys/mman.h>
+#include "mt_log.h"
+#include "public.h"
+#include "options.h"
+#include "pagecache.h"
+
+// 最近读取过的文件。只需要判断冷热，hash 冲突时覆盖，不处理
+struct file_heat
+{
+    uint64_t key;
+    uint32_t reads;
+    time_t last;
+};
+
+static struct file_heat file_heats[PAGECACHE_TRACK_SLOTS];
+static pthread_mutex_t heat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 由多个 I/O 线程累加，原子操作
+static uint64_t cache_opens = 0;
+static uint64_t cache_sampled = 0;
+static uint64_t cache_resident = 0;
+static uint64_t cache_willneed = 0;
+static uint64_t cache_dontneed = 0;
+
+// FNV-1a
+static uint64_t hash_path(const char * path)
+{
+    uint64_t h = 14695981039346656037ULL;
+    while (*path) {
+        h = (h ^ (uint8_t)*path) * 1099511628211ULL;
+        path++;
+    }
+    return h;
+}
+
+// 记录一次读取，返回这段时间内包括这一次的读取次数
+static uint32_t record_read(const char * path)
+{
+    uint64_t key = hash_path(path);
+    struct file_heat * h = &file_heats[key % PAGECACHE_TRACK_SLOTS];
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&heat_lock);
+    if (h->key != key || now - h->last > PAGECACHE_HOT_SECONDS) {
+        h->key = key;
+        h->reads = 0;
+    }
+    h->reads = h->reads + 1;
+    h->last = now;
+    uint32_t reads = h->reads;
+    pthread_mutex_unlock(&heat_lock);
+    return reads;
+}
+
+// 用 mincore 检查文件在页缓存中的页数。大文件均匀地检查若干段，每段 16 页
+static void sample_residency(int fd, int64_t size, uint64_t * sampled, uint64_t * resident)
+{
+    static long page_size = 0;
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    *sampled = 0;
+    *resident = 0;
+    if (size <= 0) {
+        return;
+    }
+    char * p = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        log_warning("mmap fd:%d for mincore failed: %s", fd, strerror(errno));
+        return;
+    }
+
+    unsigned char vec[PAGECACHE_SAMPLE_PAGES];
+    uint64_t pages = (size + page_size - 1) / page_size;
+    uint64_t win = pages <= PAGECACHE_SAMPLE_PAGES ? pages : 16;
+    uint64_t windows = pages <= PAGECACHE_SAMPLE_PAGES ? 1 : PAGECACHE_SAMPLE_PAGES / 16;
+    uint64_t stride = windows > 1 ? (pages - win) / (windows - 1) : 0;
+    uint64_t i, j;
+    for (i = 0; i < windows; i++) {
+        if (mincore(p + i * stride * page_size, win * page_size, vec) < 0) {
+            log_warning("mincore fd:%d failed: %s", fd, strerror(errno));
+            break;
+        }
+        for (j = 0; j < win; j++) {
+            *resident += vec[j] & 1;
+        }
+        *sampled += win;
+    }
+    munmap(p, size);
+}
+
+static void advise(int fd, int advice)
+{
+    int rc = posix_fadvise(fd, 0/*偏移*/, 0/*文件的所有内容*/, advice);
+    if (rc != 0) {
+        log_warning("posix_fadvise fd:%d advice %d failed: %s", fd, advice, strerror(rc));
+    }
+}
+
+int advise_file_open(int fd, const char * path, int64_t size)
+{
+    advise(fd, POSIX_FADV_SEQUENTIAL);
+    if (sgw_options.cache_policy != CACHE_POLICY_ADAPTIVE) {
+        return 0;
+    }
+
+    uint32_t reads = record_read(path);
+    uint64_t sampled, resident;
+    sample_residency(fd, size, &sampled, &resident);
+    __sync_fetch_and_add(&cache_opens, 1);
+    __sync_fetch_and_add(&cache_sampled, sampled);
+    __sync_fetch_and_add(&cache_resident, resident);
+
+    // 已经有一半以上在页缓存中，说明最近有其它连接读过，也当作热点文件
+    int hot = reads >= PAGECACHE_HOT_READS || (sampled > 0 && resident * 2 >= sampled);
+    if (hot && size <= PAGECACHE_SMALL_FILE) {
+        advise(fd, POSIX_FADV_WILLNEED);
+        __sync_fetch_and_add(&cache_willneed, 1);
+        return 0;
+    }
+    return !hot && size >= PAGECACHE_HUGE_FILE;
+}
+
+void drop_file_cache(int fd)
+{
+    advise(fd, POSIX_FADV_DONTNEED);
+    __sync_fetch_and_add(&cache_dontneed, 1);
+}
+
+void advise_file_done(int fd, const char * path, int64_t size)
+{
+    if (sgw_options.cache_policy != CACHE_POLICY_ADAPTIVE) {
+        return;
+    }
+    uint32_t reads = record_read(path);
+    if (reads < PAGECACHE_HOT_READS && size >= PAGECACHE_HUGE_FILE) {
+        drop_file_cache(fd);
+    }
+}
+
+void get_pagecache_stats(uint64_t * opens, uint64_t * sampled, uint64_t * resident,
+                         uint64_t * willneed, uint64_t * dontneed)
+{
+    *opens = __sync_fetch_and_add(&cache_opens, 0);
+    *sampled = __sync_fetch_and_add(&cache_sampled, 0);
+    *resident = __sync_fetch_and_add(&cache_resident, 0);
+    *willneed = __sync_fetch_and_add(&cache_willneed, 0);
+    *dontneed = __sync_fetch_and_add(&cache_dontneed, 0);
+}
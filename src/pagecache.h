@@ -0,0 +1,57 @@
+// pagecache.h
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "public.h"
+
+// 不大于这个大小、经常读取的文件用 WILLNEED 留在页缓存中
+#ifndef PAGECACHE_SMALL_FILE
+#define PAGECACHE_SMALL_FILE (64LL << 20)
+#endif
+
+// 不小于这个大小、只读取一次的文件读完之后用 DONTNEED 从页缓存中丢弃
+#ifndef PAGECACHE_HUGE_FILE
+#define PAGECACHE_HUGE_FILE (256LL << 20)
+#endif
+
+// 在这段时间（秒）内读取了这么多次的文件是热点文件
+#ifndef PAGECACHE_HOT_READS
+#define PAGECACHE_HOT_READS (2)
+#endif
+
+#ifndef PAGECACHE_HOT_SECONDS
+#define PAGECACHE_HOT_SECONDS (3600)
+#endif
+
+// 记录读取次数的文件个数，按路径的 hash 分配，冲突时覆盖原来的记录
+#ifndef PAGECACHE_TRACK_SLOTS
+#define PAGECACHE_TRACK_SLOTS (4096)
+#endif
+
+// 每个文件用 mincore 检查的最多页数，大文件均匀地检查其中的一部分
+#ifndef PAGECACHE_SAMPLE_PAGES
+#define PAGECACHE_SAMPLE_PAGES (4096)
+#endif
+
+// 页缓存的使用方式，用 -o cache_policy=N 选择
+#define CACHE_POLICY_SEQUENTIAL 0 // 所有顺序下载的文件都只用 SEQUENTIAL
+#define CACHE_POLICY_ADAPTIVE   1 // 按文件大小和读取次数选择
+
+// 在 I/O 线程中打开要顺序读取的文件之后调用：记录读取次数，用 mincore 采样文件
+// 在页缓存中的比例，按文件大小和读取次数设置 fadvise。返回 1 表示文件读完之后应
+// 当调用 drop_file_cache
+int advise_file_open(int fd, const char * path, int64_t size);
+
+// 文件读完之后从页缓存中丢弃
+void drop_file_cache(int fd);
+
+// 在 I/O 线程中分块下载结束、关闭文件之前调用：记录读取次数，只读取一次的大文
+// 件从页缓存中丢弃
+void advise_file_done(int fd, const char * path, int64_t size);
+
+// 累计的打开次数、采样的页数和其中在页缓存中的页数、WILLNEED 和 DONTNEED 的次数
+void get_pagecache_stats(uint64_t * opens, uint64_t * sampled, uint64_t * resident,
+                         uint64_t * willneed, uint64_t * dontneed);
+
+#endif // PAGECACHE_H
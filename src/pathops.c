@@ -18,6 +18,7 @@
 
 #include "pathops.h"
 #include "mt_log.h"
+#include "stripe.h"
 
 extern char *default_md5sum_filename;
 
@@ -213,6 +214,31 @@ void split_serial(char *s, char **studyid, char **serial)
     }
 }
 
+/*
+ * 从上传、下载的文件名（形如 "studyid/serial/xxx"，允许以 '/' 开头）中取出
+ * studyid，复制到 studyid 缓冲区中。不修改原来的文件名。
+ *
+ * 成功时返回 studyid 的长度；文件名为空或者缓冲区不够时返回 -1。
+ */
+int extract_studyid(const char *file_name, char *studyid, int len)
+{
+    const char *s = file_name;
+    while (*s == '/') {
+        s = s + 1;
+    }
+    const char *e = s;
+    while (*e != '\0' && *e != '/') {
+        e = e + 1;
+    }
+    int n = e - s;
+    if (n == 0 || n + 1 > len) {
+        return -1;
+    }
+    memcpy(studyid, s, n);
+    studyid[n] = '\0';
+    return n;
+}
+
 /* 从绝对路径 abspath 中剪除挂载点路径 mountpoint */
 void cut_mount_path(char *abspath, const char *mountpoint)
 {
@@ -319,8 +345,14 @@ int get_dir_list(
                                 nr_files = nr_files + 1;
                                 // log_info("get_dir_list: %d: %s %lld", nr_files, filepath, (long long int)s.st_size);
                                 cut_mount_path(filepath, mountpath);
+                                /* 条带模式下后端文件只是一个分片，按分片记录的大小；.hash 等隐藏文件不分片 */
+                                int64_t size = s.st_size;
+                                if (stripe_enabled() && entry.d_name[0] != '.') {
+                                    int64_t n = stripe_file_size_by_name(filepath);
+                                    size = n >= 0 ? n : size;
+                                }
                                 int filllen = fill_file_list(
-                                    out, end, filepath, s.st_size);
+                                    out, end, filepath, size);
                                 if (filllen > 0) {
                                     /* 缓冲区内容有填充，更新缓冲区指针 */
                                     out = out + filllen;
@@ -538,4 +570,47 @@ char *get_path_head(char *str, char *head)
         }
     }
     return head;
-}
\ No newline at end of file
+}
+void join_path(char *buf, size_t len, const char *dir, const char *name)
+{
+    if (name[0] == '/') {
+        snprintf(buf, len, "%s%s", dir, name);
+    } else {
+        snprintf(buf, len, "%s/%s", dir, name);
+    }
+}
+
+ssize_t pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char *)buf + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done = done + n;
+    }
+    return done;
+}
+
+int pwrite_full(int fd, const void *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const char *)buf + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done = done + n;
+    }
+    return 0;
+}
@@ -16,6 +16,7 @@ extern int calcpath(
     char *resultpath, int *resultlen);
 
 extern void split_serial(char *s, char **studyid, char **serial);
+extern int extract_studyid(const char *file_name, char *studyid, int len);
 extern void cut_mount_path(char *abspath, const char *mountpoint);
 
 struct file_list_result {
@@ -34,4 +35,13 @@ extern char *fill_many_dir_list(
 
 extern char *get_path_head(char *str, char *head);
 
+/* 后端目录和文件名拼成完整路径，文件名以 '/' 开头时直接接在目录后面 */
+extern void join_path(char *buf, size_t len, const char *dir, const char *name);
+
+/* 从 offset 读取 len 字节，返回读到的字节数，到文件末尾时少于 len，出错返回 -1 */
+extern ssize_t pread_full(int fd, void *buf, size_t len, off_t offset);
+
+/* 从 offset 写入全部 len 字节，成功返回 0，出错返回 -1 */
+extern int pwrite_full(int fd, const void *buf, size_t len, off_t offset);
+
 #endif /* PATHOPS_H */
@@ -0,0 +1,244 @@
+// prefetch.c
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+#include "mt_log.h"
+#include "public.h"
+#include "options.h"
+#include "conn_mgmt.h"
+#include "prefetch.h"
+
+#ifndef IOPRIO_PRIO_VALUE
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#endif
+
+extern void init_mt_cntt(int thread_id);
+extern int get_thread_id(void);
+
+struct prefetch_file
+{
+    int64_t size;
+    char * path;
+};
+
+// 一个文件列表中要预取的文件。连接和预取线程各持有一个引用，最后释放引用的一方
+// 释放内存，所以连接关闭时不需要等待预取线程
+struct prefetch_task
+{
+    struct prefetch_task * next;
+    int refs;
+    int cancelled;
+    int thread_id;   // 提交的工作线程，预取结束后归还这个线程的预算
+    int64_t bytes;   // 占用的预算
+    int nr_files;
+    char * paths;
+    struct prefetch_file files[];
+};
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static struct prefetch_task * prefetch_head = NULL;
+static struct prefetch_task * prefetch_tail = NULL;
+
+// 每个工作线程提交的、还没有预取完的字节数，由预取线程减少，原子操作
+static int64_t prefetch_inflight[MAX_WORKERS+1];
+
+// 由工作线程和预取线程累加，原子操作
+static uint64_t prefetch_lists = 0;
+static uint64_t prefetch_files = 0;
+static uint64_t prefetch_bytes = 0;
+static uint64_t prefetch_cancelled = 0;
+
+static void put_task(struct prefetch_task * t)
+{
+    if (__sync_sub_and_fetch(&t->refs, 1) == 0) {
+        free(t->paths);
+        free(t);
+    }
+}
+
+static void prefetch_one(struct prefetch_file * f)
+{
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // 列表发送之后文件可能已经被删除
+        log_warning("open %s for prefetch failed: %s", f->path, strerror(errno));
+        return;
+    }
+    if (readahead(fd, 0, f->size) < 0) {
+        log_warning("readahead %s failed: %s", f->path, strerror(errno));
+    } else {
+        __sync_fetch_and_add(&prefetch_files, 1);
+        __sync_fetch_and_add(&prefetch_bytes, f->size);
+    }
+    close(fd);
+}
+
+static void run_task(struct prefetch_task * t)
+{
+    int i;
+    for (i = 0; i < t->nr_files; i++) {
+        if (__atomic_load_n(&t->cancelled, __ATOMIC_RELAXED)) {
+            __sync_fetch_and_add(&prefetch_cancelled, t->nr_files - i);
+            break;
+        }
+        prefetch_one(&t->files[i]);
+    }
+    __sync_fetch_and_sub(&prefetch_inflight[t->thread_id], t->bytes);
+}
+
+static void * prefetch_thread(void * argv)
+{
+    (void) argv;
+    init_mt_cntt(PREFETCH_THREAD_ID);
+
+    // 空闲的 I/O 优先级：磁盘上有其它读写时不预取，不影响正在进行的上传和下载
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) < 0) {
+        log_warning("set idle io priority failed: %s", strerror(errno));
+    }
+
+    while (1) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (prefetch_head == NULL) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        }
+        struct prefetch_task * t = prefetch_head;
+        prefetch_head = t->next;
+        if (prefetch_head == NULL) {
+            prefetch_tail = NULL;
+        }
+        pthread_mutex_unlock(&prefetch_lock);
+
+        run_task(t);
+        put_task(t);
+    }
+    return NULL;
+}
+
+int init_prefetch(void)
+{
+    if (sgw_options.prefetch == 0) {
+        return 0;
+    }
+    pthread_t tid;
+    int ret = pthread_create(&tid, NULL, prefetch_thread, NULL);
+    if (ret != 0) {
+        log_error("create prefetch thread failed: %s", strerror(ret));
+        return -1;
+    }
+    log_info("prefetch enabled, budget %d MB per worker", sgw_options.prefetch);
+    return 0;
+}
+
+void start_prefetch(conn_info_t * c, const char * mountpoint, const char * list, int len)
+{
+    if (sgw_options.prefetch == 0) {
+        return;
+    }
+    // 同一个连接上一次的列表还没有预取完，客户端已经在看下一个序列了
+    cancel_prefetch(c);
+
+    if (len < 12) {
+        return;
+    }
+    int tid = get_thread_id();
+    int64_t avail = ((int64_t)sgw_options.prefetch << 20) -
+                    __sync_fetch_and_add(&prefetch_inflight[tid], 0);
+    uint32_t nr = be32toh(*(uint32_t *)(list + 8));
+    // 每个文件在列表中至少占 10 字节
+    if (nr > (uint32_t)(len - 12) / 10) {
+        nr = (len - 12) / 10;
+    }
+    if (avail <= 0 || nr == 0) {
+        return;
+    }
+
+    int mountlen = strlen(mountpoint);
+    struct prefetch_task * t = malloc(sizeof(*t) + nr * sizeof(t->files[0]));
+    char * paths = malloc((size_t)nr * (mountlen + 1) + len);
+    if (t == NULL || paths == NULL) {
+        log_error("alloc prefetch task failed");
+        free(t);
+        free(paths);
+        return;
+    }
+
+    // 客户端一般按列表的顺序下载，预算用完时不再预取后面的文件
+    const char * p = list + 12;
+    const char * end = list + len;
+    char * out = paths;
+    int64_t bytes = 0;
+    int n = 0;
+    uint32_t i;
+    for (i = 0; i < nr && p + 2 <= end; i++) {
+        int namelen = be16toh(*(uint16_t *)p);
+        if (p + 2 + namelen + 8 > end) {
+            break;
+        }
+        int64_t size = be64toh(*(int64_t *)(p + 2 + namelen));
+        if (size > 0 && size <= PREFETCH_MAX_FILE) {
+            if (bytes + size > avail) {
+                break;
+            }
+            memcpy(out, mountpoint, mountlen);
+            memcpy(out + mountlen, p + 2, namelen);
+            out[mountlen + namelen] = '\0';
+            t->files[n].path = out;
+            t->files[n].size = size;
+            out = out + mountlen + namelen + 1;
+            bytes = bytes + size;
+            n = n + 1;
+        }
+        p = p + 2 + namelen + 8;
+    }
+    if (n == 0) {
+        free(t);
+        free(paths);
+        return;
+    }
+
+    t->next = NULL;
+    t->refs = 2;
+    t->cancelled = 0;
+    t->thread_id = tid;
+    t->bytes = bytes;
+    t->nr_files = n;
+    t->paths = paths;
+    __sync_fetch_and_add(&prefetch_inflight[tid], bytes);
+    __sync_fetch_and_add(&prefetch_lists, 1);
+    c->prefetch = t;
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (prefetch_tail) {
+        prefetch_tail->next = t;
+    } else {
+        prefetch_head = t;
+    }
+    prefetch_tail = t;
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+void cancel_prefetch(conn_info_t * c)
+{
+    struct prefetch_task * t = c->prefetch;
+    if (t == NULL) {
+        return;
+    }
+    __atomic_store_n(&t->cancelled, 1, __ATOMIC_RELAXED);
+    c->prefetch = NULL;
+    put_task(t);
+}
+
+void get_prefetch_stats(uint64_t * lists, uint64_t * files, uint64_t * bytes,
+                        uint64_t * cancelled)
+{
+    *lists = __sync_fetch_and_add(&prefetch_lists, 0);
+    *files = __sync_fetch_and_add(&prefetch_files, 0);
+    *bytes = __sync_fetch_and_add(&prefetch_bytes, 0);
+    *cancelled = __sync_fetch_and_add(&prefetch_cancelled, 0);
+}
@@ -0,0 +1,36 @@
+// prefetch.h
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "public.h"
+#include "durable.h"
+#include "pagecache.h"
+
+// 预取线程的线程标识，只用于日志
+#define PREFETCH_THREAD_ID (COMMIT_THREAD_ID_BASE + MAX_BACK_END)
+
+// 大于这个大小的文件不预取，避免把阅片时反复读取的小文件挤出页缓存
+#ifndef PREFETCH_MAX_FILE
+#define PREFETCH_MAX_FILE PAGECACHE_SMALL_FILE
+#endif
+
+struct conn_info_;
+
+// 打开预取时启动预取线程，在创建工作线程之前调用
+int init_prefetch(void);
+
+// 在工作线程中发送文件列表之后调用：按列表的顺序把文件交给预取线程读入页缓存，
+// 每个工作线程还没有预取完的字节数不超过 -o prefetch 的预算。mountpoint 是生成
+// 列表的后端目录，list 是 fill_many_dir_list 生成的文件列表消息
+void start_prefetch(struct conn_info_ * c, const char * mountpoint,
+                    const char * list, int len);
+
+// 连接关闭或者请求下一个文件列表时取消还没有预取的文件
+void cancel_prefetch(struct conn_info_ * c);
+
+// 累计的文件列表个数、预取的文件个数和字节数、取消的文件个数
+void get_prefetch_stats(uint64_t * lists, uint64_t * files, uint64_t * bytes,
+                        uint64_t * cancelled);
+
+#endif // PREFETCH_H
@@ -36,6 +36,8 @@
 #define NODE_TYPE_ASM   6
 
 #define NODE_TYPE_PIPE  200
+#define NODE_TYPE_EVENT 201 // 工作线程接收 I/O 完成通知的 eventfd
+#define NODE_TYPE_URING 202 // 工作线程的 io_uring，有完成的操作时可读
 
 #define MAX_IP_LEN 15
 
@@ -98,6 +100,14 @@ extern uint32_t local_id;
 #define CMD_MIGRATION_CANCEL_REQ 0x00030007
 #define CMD_MIGRATION_CANCEL_RSP 0x00030008
 
+// sgw 之间的中继连接。打开中继连接后，消息的 trans_id 是代理端分配的会话号，
+// 同一个连接上可以同时进行多个客户端的传输。
+#define CMD_TRUNK_OPEN_REQ  0x00040001
+#define CMD_TRUNK_OPEN_RSP  0x00040002
+
+// 任意一端放弃一个会话，只有消息头，没有响应
+#define CMD_TRUNK_RESET_REQ 0x00040003
+
 extern const char * command_string(uint32_t c);
 
 typedef struct msg_
@@ -0,0 +1,211 @@
+// relay.c
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include "mt_log.h"
+#include "public.h"
+#include "ring.h"
+#include "conn_mgmt.h"
+#include "relay.h"
+#include "stats.h"
+
+static int is_relay_command(uint32_t command)
+{
+    // 只有上传数据请求和下载数据应答携带大块的文件数据
+    return command == CMD_UPLOAD_DATA_REQ || command == CMD_DOWNLOAD_DATA_RSP;
+}
+
+static struct relay * create_relay(void)
+{
+    struct relay * r = (struct relay *)malloc(sizeof(struct relay));
+    if (!r) {
+        log_error("malloc %d bytes for relay failed", (int)sizeof(struct relay));
+        return NULL;
+    }
+    if (pipe2(r->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_error("pipe2 for relay failed: %s", strerror(errno));
+        free(r);
+        return NULL;
+    }
+
+    // 设置失败时使用管道的默认容量
+    (void) fcntl(r->pipe_fd[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    int size = fcntl(r->pipe_fd[1], F_GETPIPE_SZ);
+    if (size <= 0) {
+        log_error("F_GETPIPE_SZ failed: %s", strerror(errno));
+        close(r->pipe_fd[0]);
+        close(r->pipe_fd[1]);
+        free(r);
+        return NULL;
+    }
+    r->pipe_size = size;
+    r->inpipe = 0;
+    r->left = 0;
+    return r;
+}
+
+void free_relay(conn_info_t * c)
+{
+    struct relay * r = c->relay;
+    if (r) {
+        close(r->pipe_fd[0]);
+        close(r->pipe_fd[1]);
+        free(r);
+        c->relay = NULL;
+    }
+    c->flags &= ~CONN_FLAG_RELAY;
+}
+
+static conn_info_t * get_relay_peer(conn_info_t * c)
+{
+    if (c->use_proxy != 1 || c->next_sock_fd < 3 || c->next_sock_fd >= MAX_CONNS_CNT) {
+        return NULL;
+    }
+    return &conns_info[c->next_sock_fd];
+}
+
+// 管道中的数据只能在出站连接的发送缓冲区清空以后发送，这样才能保证消息头和已经
+// 缓冲的数据先于管道中的数据发出
+static int flush_relay(events_poll_t * e, conn_info_t * c, conn_info_t * out)
+{
+    struct relay * r = c->relay;
+
+    if (get_ring_data_size(out->send) > 0) {
+        start_monitoring_send(e, out->sock_fd);
+        return 0;
+    }
+
+    while (r->inpipe > 0) {
+        ssize_t n = splice(r->pipe_fd[0], NULL, out->sock_fd, NULL, r->inpipe,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            r->inpipe = r->inpipe - n;
+            my_stats()->relay_bytes += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            // 出站套接字暂时不可写，等待 EPOLLOUT
+            start_monitoring_send(e, out->sock_fd);
+            break;
+        } else {
+            log_error("splice %u bytes to sock_fd:%d failed: %s",
+                      r->inpipe, out->sock_fd, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (r->left == 0 && r->inpipe == 0) {
+        // 消息转发完毕，恢复按消息处理入站连接
+        c->flags &= ~CONN_FLAG_RELAY;
+        start_monitoring_recv(e, c->sock_fd);
+    } else if (r->left > 0 && r->inpipe < r->pipe_size) {
+        start_monitoring_recv(e, c->sock_fd);
+    }
+    return 0;
+}
+
+int try_start_relay(events_poll_t * e, conn_info_t * c, msg_t * msg, uint32_t buffered)
+{
+    conn_info_t * out = get_relay_peer(c);
+    if (!out || out->status != CONN_STATUS_CONNECTED) {
+        return 0;
+    }
+    if (out->flags & CONN_FLAG_TRUNK) {
+        // 中继连接上的消息来自多个会话，不能被一个消息长时间独占
+        return 0;
+    }
+#ifdef TLS
+    // 用户态 TLS 的数据不能在内核中直接转移，由内核加解密的方向可以。SSL 中还有
+    // 已经解密的数据时，套接字里的内容在它之后，也不能直接转移。
+    if (c->ssl && (!(c->flags & CONN_FLAG_KTLS_RX) || SSL_pending(c->ssl) > 0)) {
+        return 0;
+    }
+    if (out->ssl && !(out->flags & CONN_FLAG_KTLS_TX)) {
+        return 0;
+    }
+#endif
+
+    msg_t h;
+    memcpy(&h, msg, sizeof(msg_t));
+    decode_msg(&h);
+    if (!is_relay_command(h.command) || h.length - buffered < RELAY_MIN_LEN) {
+        return 0;
+    }
+    if (get_ring_free_size(out->send) < buffered) {
+        return 0;
+    }
+
+    if (!c->relay) {
+        c->relay = create_relay();
+        if (!c->relay) {
+            return 0;
+        }
+    }
+
+    uint64_t left = h.length - buffered;
+
+    // 和 forward_message() 一样改写消息头
+    h.src_type = NODE_TYPE_SGW;
+    h.src_id = local_id;
+    h.dst_type = out->peer_type;
+    h.dst_id = out->peer_id;
+    encode_msg(&h);
+
+    write_ring(out->send, (uint8_t *)&h, sizeof(msg_t));
+    write_ring(out->send, msg->data, buffered - sizeof(msg_t));
+    start_monitoring_send(e, out->sock_fd);
+
+    c->relay->left = left;
+    c->flags |= CONN_FLAG_RELAY;
+    my_stats()->relay_messages += 1;
+    return 1;
+}
+
+int on_relay_recv(events_poll_t * e, conn_info_t * c)
+{
+    struct relay * r = c->relay;
+    conn_info_t * out = get_relay_peer(c);
+    if (!out) {
+        log_error("sock_fd:%d lost its relay peer", c->sock_fd);
+        return -1;
+    }
+
+    uint32_t room = r->pipe_size - r->inpipe;
+    if (r->left == 0 || room == 0) {
+        // 管道已满，出站连接跟不上，暂停接收
+        stop_monitoring_recv(e, c->sock_fd);
+        return 0;
+    }
+
+    size_t want = r->left < room ? r->left : room;
+    ssize_t n = splice(c->sock_fd, NULL, r->pipe_fd[1], NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        r->inpipe = r->inpipe + n;
+        r->left = r->left - n;
+    } else if (n == 0) {
+        close_tcp_conn(e, c->sock_fd);
+        return 0;
+    } else if (errno == EAGAIN || errno == EINTR) {
+        return 0;
+    } else {
+        log_error("splice %zu bytes from sock_fd:%d failed: %s",
+                  want, c->sock_fd, strerror(errno));
+        return -1;
+    }
+
+    if (r->left == 0 || r->inpipe == r->pipe_size) {
+        stop_monitoring_recv(e, c->sock_fd);
+    }
+    return flush_relay(e, c, out);
+}
+
+int on_relay_send(events_poll_t * e, conn_info_t * out)
+{
+    conn_info_t * c = get_relay_peer(out);
+    if (c && (c->flags & CONN_FLAG_RELAY)) {
+        return flush_relay(e, c, out);
+    } else {
+        return 0;
+    }
+}
@@ -0,0 +1,49 @@
+// relay.h
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+#include "events_poll.h"
+#include "public.h"
+#include "conn_mgmt.h"
+
+// 转发的数据消息中，尚未收到的部分至少有这么长时才使用零拷贝转发。更短的消息
+// 照常在接收缓冲区中组装完整后转发。
+#ifndef RELAY_MIN_LEN
+#define RELAY_MIN_LEN (64 * 1024)
+#endif
+
+// 零拷贝转发使用的管道容量，也就是一个方向上在途数据量的上限
+#ifndef RELAY_PIPE_SIZE
+#define RELAY_PIPE_SIZE (1024 * 1024)
+#endif
+
+// 零拷贝转发的状态，第一次转发时创建，连接关闭时释放
+struct relay
+{
+    int pipe_fd[2];     // 入站套接字 -> pipe_fd[1]，pipe_fd[0] -> 出站套接字
+    uint32_t pipe_size; // 管道的实际容量
+    uint32_t inpipe;    // 已经进入管道、尚未发送到出站套接字的字节数
+    uint64_t left;      // 当前消息还没有从入站套接字读取的字节数
+};
+
+// 接收缓冲区中是一个需要转发的数据消息的开头部分时，改写消息头，把已经收到的
+// 部分放到下一跳的发送缓冲区中，剩下的部分通过管道从入站套接字直接转移到出站
+// 套接字。buffered 是接收缓冲区中这个消息已经收到的字节数。
+//
+// 返回 1 表示开始零拷贝转发，接收缓冲区中的 buffered 个字节已经处理；返回 0 表示
+// 不适合零拷贝转发，按普通方式处理；返回 -1 表示出错。
+int try_start_relay(events_poll_t * e, conn_info_t * c, msg_t * msg, uint32_t buffered);
+
+// 入站套接字可读，把数据移动到管道中。和 on_can_recv() 一样，对端关闭时关闭连
+// 接并返回 0，出错时返回 -1 由调用者关闭连接。
+int on_relay_recv(events_poll_t * e, conn_info_t * c);
+
+// 出站套接字的发送缓冲区已经清空，继续发送管道中的数据。出错时返回 -1。
+int on_relay_send(events_poll_t * e, conn_info_t * out);
+
+// 释放连接的零拷贝转发状态，由 close_tcp_conn() 调用
+void free_relay(conn_info_t * c);
+
+#endif // RELAY_H
@@ -0,0 +1,313 @@
+// resume.c
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include "mt_log.h"
+#include "public.h"
+#include "options.h"
+#include "pathops.h"
+#include "resume.h"
+
+extern void init_mt_cntt(int thread_id);
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+#define RESUME_PATH_LEN (MAX_NAME_LEN + MAX_NAME_LEN + 64)
+
+// 进度记录的第一行是已经应答的连续数据量，固定长度，更新时只覆盖这一行；第二行是
+// 1 或者 0，表示后端文件是不是这个上传创建的，清理时只删除上传自己创建的文件；第
+// 三行是 "trans_id 文件大小 md5 文件名"，创建时写入，续传时用来确认是同一个上传
+#define RESUME_PROGRESS_LEN (21)
+#define RESUME_CREATED_LEN (2)
+#define RESUME_SESSION_OFFSET (RESUME_PROGRESS_LEN + RESUME_CREATED_LEN)
+#define RESUME_RECORD_MAX (RESUME_SESSION_OFFSET + 64 + MD5_LEN + MAX_NAME_LEN)
+
+static int resume_on = 0;
+
+static uint64_t resume_resumed = 0;
+static uint64_t resume_skipped = 0;
+static uint64_t resume_removed = 0;
+
+// 进度记录的文件名：trans_id 和文件名的 64 位 FNV-1a hash，同时上传同一个文件名的
+// 不同传输使用各自的记录
+static void record_path(char * buf, int b, msg_t * msg)
+{
+    task_info_t * t = (task_info_t *)msg->data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t id = msg->trans_id;
+    const unsigned char * p;
+    int k;
+    for (k = 0; k < 8; k++) {
+        h = (h ^ ((id >> (k * 8)) & 0xff)) * 0x100000001b3ULL;
+    }
+    for (p = (const unsigned char *)t->file_name; *p; p++) {
+        h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    snprintf(buf, RESUME_PATH_LEN, "%s/%s/%016lx", backend_dirs[b], RESUME_DIR, (unsigned long)h);
+}
+
+static int session_line(char * buf, size_t len, msg_t * msg)
+{
+    task_info_t * t = (task_info_t *)msg->data;
+    return snprintf(buf, len, "%lu %lu %s %s\n", (unsigned long)msg->trans_id,
+                    (unsigned long)msg->total, t->file_md5, t->file_name);
+}
+
+int64_t find_resume_point(transfer_t * x, msg_t * msg, uint32_t * missing)
+{
+    task_info_t * t = (task_info_t *)msg->data;
+    char want[RESUME_RECORD_MAX];
+    int wantlen = session_line(want, sizeof(want), msg);
+    int64_t point = -1;
+    int i;
+    *missing = 0;
+    for (i = 0; i < backend_cnt; i++) {
+        if (x->deferred & (1u << i)) {
+            continue;
+        }
+        char path[RESUME_PATH_LEN];
+        char buf[RESUME_RECORD_MAX + 1];
+        struct stat s;
+        record_path(path, i, msg);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t n = fd >= 0 ? pread(fd, buf, sizeof(buf), 0) : -1;
+        if (fd >= 0) {
+            close(fd);
+        }
+        int64_t committed = -1;
+        if (n == RESUME_SESSION_OFFSET + wantlen && buf[RESUME_PROGRESS_LEN - 1] == '\n' &&
+            memcmp(buf + RESUME_SESSION_OFFSET, want, wantlen) == 0) {
+            committed = strtoll(buf, NULL, 10);
+            // 后端文件比记录的短时（例如被替换过）不能从这里续传
+            join_path(path, sizeof(path), backend_dirs[i], t->file_name);
+            if (stat(path, &s) < 0 || s.st_size < committed) {
+                committed = -1;
+            }
+        }
+        if (committed < 0) {
+            *missing = *missing | (1u << i);
+        } else if (point < 0 || committed < point) {
+            point = committed;
+        }
+    }
+    if (point <= 0) {
+        *missing = 0;
+        return 0;
+    }
+    return point;
+}
+
+void open_resume_records(transfer_t * x, msg_t * msg, int64_t offset)
+{
+    task_info_t * t = (task_info_t *)msg->data;
+    char record[RESUME_RECORD_MAX + 1];
+    int len = snprintf(record, RESUME_PROGRESS_LEN + 1, "%020ld\n", (long)offset);
+    len = len + snprintf(record + len, RESUME_CREATED_LEN + 1, "0\n");
+    len = len + session_line(record + len, sizeof(record) - len, msg);
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct backend_file * f = &x->befiles[i];
+        if (f->fd < 0) {
+            continue;
+        }
+        char path[RESUME_PATH_LEN];
+        record_path(path, i, msg);
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0 && errno == ENOENT) {
+            // 后端目录是启动之后才挂载的
+            char dir[RESUME_PATH_LEN];
+            join_path(dir, sizeof(dir), backend_dirs[i], RESUME_DIR);
+            (void) mkdir(dir, 0755);
+            fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        }
+        // 同一个传输上次没有完成的上传创建了后端文件时，这次打开的是那个文件，仍然
+        // 算作这个上传创建的
+        char created = '0';
+        if (fd >= 0 && pread(fd, &created, 1, RESUME_PROGRESS_LEN) == 1 && created == '1') {
+            x->created = x->created | (1u << i);
+        }
+        record[RESUME_PROGRESS_LEN] = (x->created & (1u << i)) ? '1' : '0';
+        if (fd < 0 || pwrite(fd, record, len, 0) != len || ftruncate(fd, len) < 0) {
+            log_warning("create upload record %s for %s failed: %s",
+                        path, f->abs_file_name, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        f->rfd = fd;
+    }
+    x->resume_committed = offset;
+    x->resume_recorded = offset;
+    if (offset > 0) {
+        log_info("resume upload of %s at %ld of %lu bytes", t->file_name, (long)offset,
+                 (unsigned long)msg->total);
+        __sync_fetch_and_add(&resume_resumed, 1);
+        __sync_fetch_and_add(&resume_skipped, offset);
+    }
+}
+
+void add_resume_record_ops(io_job_t * job, transfer_t * x)
+{
+    if (x->resume_committed - x->resume_recorded < RESUME_RECORD_BYTES || job->data) {
+        return;
+    }
+    job->data = (char *)malloc(RESUME_PROGRESS_LEN + 1);
+    if (!job->data) {
+        return;
+    }
+    snprintf(job->data, RESUME_PROGRESS_LEN + 1, "%020ld\n", (long)x->resume_committed);
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct backend_file * f = &x->befiles[i];
+        if (f->rfd < 0 || ((x->lost | x->deferred) & (1u << i))) {
+            continue;
+        }
+        // 记录的数据先同步到磁盘，掉电后记录不会超过磁盘上实际有的数据
+        io_op_t * op = add_io_op(job, IO_OP_FSYNC);
+        op->fd = f->fd;
+        op->flags = IO_OP_DATASYNC;
+        op->link = 1;
+        op = add_io_op(job, IO_OP_WRITE);
+        op->fd = f->rfd;
+        op->offset = 0;
+        op->buf = job->data;
+        op->len = RESUME_PROGRESS_LEN;
+    }
+    x->resume_recorded = x->resume_committed;
+}
+
+void finish_resume_records(transfer_t * x, msg_t * msg)
+{
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct backend_file * f = &x->befiles[i];
+        if (f->rfd >= 0) {
+            close(f->rfd);
+            f->rfd = -1;
+        }
+        // 失败过的后端目录中上次留下的记录也删除
+        char path[RESUME_PATH_LEN];
+        record_path(path, i, msg);
+        (void) unlink(path);
+    }
+}
+
+// 删除后端目录 b 中超过 -o resume 秒没有更新的上传：进度记录，以及上传创建的不完整
+// 的后端文件。写入已经存在的文件的上传只删除记录，不能删除原来的文件
+static void remove_stale_uploads(int b, time_t now)
+{
+    char dir[RESUME_PATH_LEN];
+    join_path(dir, sizeof(dir), backend_dirs[b], RESUME_DIR);
+    DIR * dp = opendir(dir);
+    if (!dp) {
+        return;
+    }
+    struct dirent * e;
+    while ((e = readdir(dp)) != NULL) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        char path[RESUME_PATH_LEN];
+        char buf[RESUME_RECORD_MAX + 1];
+        struct stat s;
+        join_path(path, sizeof(path), dir, e->d_name);
+        if (stat(path, &s) < 0 || now - s.st_mtime < sgw_options.resume) {
+            continue;
+        }
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t n = fd >= 0 ? pread(fd, buf, RESUME_RECORD_MAX, 0) : -1;
+        if (fd >= 0) {
+            close(fd);
+        }
+        // 第三行的最后一项是文件名
+        char * name = NULL;
+        if (n > RESUME_SESSION_OFFSET && buf[n - 1] == '\n') {
+            buf[n - 1] = '\0';
+            int k;
+            name = buf + RESUME_SESSION_OFFSET;
+            for (k = 0; k < 3 && name; k++) {
+                name = strchr(name, ' ');
+                name = name ? name + 1 : NULL;
+            }
+        }
+        if (name && *name) {
+            char data[RESUME_PATH_LEN];
+            join_path(data, sizeof(data), backend_dirs[b], name);
+            if (stat(data, &s) == 0 && now - s.st_mtime < sgw_options.resume) {
+                // 上传还在进行，只是很久没有更新记录
+                continue;
+            }
+            if (buf[RESUME_PROGRESS_LEN] != '1') {
+                log_info("abandoned upload over existing %s, keep the file", data);
+            } else if (unlink(data) < 0 && errno != ENOENT) {
+                log_warning("remove stale upload %s failed: %s", data, strerror(errno));
+                continue;
+            } else {
+                log_info("removed stale upload %s", data);
+            }
+        }
+        (void) unlink(path);
+        __sync_fetch_and_add(&resume_removed, 1);
+    }
+    closedir(dp);
+}
+
+static void * resume_thread(void * argv)
+{
+    (void) argv;
+    init_mt_cntt(RESUME_THREAD_ID);
+    while (1) {
+        sleep(RESUME_GC_INTERVAL);
+        time_t now = time(NULL);
+        int b;
+        for (b = 0; b < backend_cnt; b++) {
+            remove_stale_uploads(b, now);
+        }
+    }
+    return NULL;
+}
+
+int init_resume(void)
+{
+    if (sgw_options.resume == 0) {
+        return 0;
+    }
+    if (sgw_options.parity > 0) {
+        // 条带模式下上传的数据要整行编码，不能从任意位置继续
+        log_warning("resume is not supported in stripe mode, disabled");
+        sgw_options.resume = 0;
+        return 0;
+    }
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        char dir[RESUME_PATH_LEN];
+        join_path(dir, sizeof(dir), backend_dirs[b], RESUME_DIR);
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            log_warning("create %s failed: %s", dir, strerror(errno));
+        }
+    }
+    pthread_t tid;
+    int ret = pthread_create(&tid, NULL, resume_thread, NULL);
+    if (ret != 0) {
+        log_error("create resume thread failed: %s", strerror(ret));
+        return -1;
+    }
+    resume_on = 1;
+    log_info("resumable uploads, partial uploads kept for %d seconds", sgw_options.resume);
+    return 0;
+}
+
+int resume_enabled(void)
+{
+    return resume_on;
+}
+
+void get_resume_stats(uint64_t * resumed, uint64_t * skipped, uint64_t * removed)
+{
+    *resumed = __atomic_load_n(&resume_resumed, __ATOMIC_RELAXED);
+    *skipped = __atomic_load_n(&resume_skipped, __ATOMIC_RELAXED);
+    *removed = __atomic_load_n(&resume_removed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,58 @@
+// resume.h
+
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "public.h"
+#include "transfer.h"
+#include "iopool.h"
+#include "resync.h"
+
+// 清理线程的线程标识，只用于日志
+#define RESUME_THREAD_ID (RESYNC_THREAD_ID + 1)
+
+// 开始上传请求的 offset 为这个值时，客户端请求续传：应答的 offset 是续传点，客户端
+// 从这里继续发送上传数据。没有可以续传的上传时续传点为 0
+#define UPLOAD_RESUME_OFFSET (~0UL)
+
+// 进度记录放在每个后端目录下的这个目录中，文件名是上传的 trans_id 和文件名的 hash
+#ifndef RESUME_DIR
+#define RESUME_DIR ".sgw_uploads"
+#endif
+
+// 已经应答的连续数据每增加这么多更新一次进度记录
+#ifndef RESUME_RECORD_BYTES
+#define RESUME_RECORD_BYTES (16 << 20)
+#endif
+
+// 清理线程检查过期的上传的间隔（秒）
+#ifndef RESUME_GC_INTERVAL
+#define RESUME_GC_INTERVAL (60)
+#endif
+
+// 打开了 -o resume 时创建进度记录的目录，启动清理线程，在创建工作线程之前调用
+int init_resume(void);
+
+int resume_enabled(void);
+
+// 在 I/O 线程中开始上传时调用：找到 trans_id、md5、文件大小和文件名都相同的没有完
+// 成的上传，返回各个后端目录中进度记录的最小值，没有时返回 0。missing 按位返回没有
+// 这个上传的进度记录的后端目录（上次写入失败），不包括 x->deferred 中的
+int64_t find_resume_point(transfer_t * x, msg_t * msg, uint32_t * missing);
+
+// 在 I/O 线程中创建后端文件之后调用：在每个写入的后端目录中创建这次上传的进度记录，
+// 已经应答的连续数据是 offset。失败时不能续传，上传本身继续
+void open_resume_records(transfer_t * x, msg_t * msg, int64_t offset);
+
+// 在工作线程中提交上传数据时调用：已经应答的连续数据比上次记录的多了
+// RESUME_RECORD_BYTES 时，在请求中加入同步各个后端文件、然后更新进度记录的操作。
+// 同步失败时不更新记录。写入记录的操作的 buf 是 job->data，结果不影响上传
+void add_resume_record_ops(io_job_t * job, transfer_t * x);
+
+// 上传成功、后端文件按持久化方式同步之后在 I/O 线程或者提交线程中调用，删除进度记录
+void finish_resume_records(transfer_t * x, msg_t * msg);
+
+// 累计续传的上传个数、续传时跳过的数据量、清理的过期上传个数
+void get_resume_stats(uint64_t * resumed, uint64_t * skipped, uint64_t * removed);
+
+#endif // RESUME_H
@@ -0,0 +1,641 @@
+// resync.c
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+#include "mt_log.h"
+#include "public.h"
+#include "options.h"
+#include "pathops.h"
+#include "durable.h"
+#include "resync.h"
+
+#ifndef IOPRIO_PRIO_VALUE
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#endif
+
+extern void init_mt_cntt(int thread_id);
+extern int open_path(char *path);
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+#define RESYNC_PATH_LEN (MAX_NAME_LEN + MAX_NAME_LEN + 16)
+
+// 一个缺少的副本，name 是请求中的文件名
+struct resync_item
+{
+    struct resync_item * next;
+    uint64_t queued_us;    // 记录或者读入日志的时间
+    char md5[MD5_LEN + 1]; // 补写之后追加到 .hash 文件中，不需要时为空
+    char name[];
+};
+
+// 每个后端目录一个队列，按记录的顺序补写
+struct resync_queue
+{
+    struct resync_item * head;
+    struct resync_item * tail;
+    uint64_t down_until; // 目录不可用，在这个时间（微秒）之前不补写
+};
+
+// 保护队列和日志文件：日志中的记录和队列中的副本总是一致的
+static pthread_mutex_t resync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resync_cond = PTHREAD_COND_INITIALIZER;
+static struct resync_queue resync_queues[MAX_BACK_END];
+static int64_t resync_pending = 0;
+static int journal_fd = -1;
+static const char * journal_path = NULL;
+static uint64_t resync_current_us = 0; // 正在补写的副本的 queued_us，没有时为 0
+
+// 由 I/O 线程和补写线程累加，原子操作
+static uint64_t resync_recorded = 0;
+static uint64_t resync_repaired = 0;
+static uint64_t resync_bytes = 0;
+static uint64_t resync_retries = 0;
+static uint64_t resync_fallbacks = 0;
+
+static uint64_t get_curr_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int write_quorum(void)
+{
+    int q = sgw_options.write_quorum;
+    return (q == 0 || q > backend_cnt) ? backend_cnt : q;
+}
+
+int async_mirror_wanted(void)
+{
+    if (sgw_options.async_mirror == 0 || backend_cnt < 2) {
+        return 0;
+    }
+    if (__atomic_load_n(&resync_pending, __ATOMIC_RELAXED) >= sgw_options.replication_backlog) {
+        __sync_fetch_and_add(&resync_fallbacks, 1);
+        return 0;
+    }
+    return 1;
+}
+
+int resync_enabled(void)
+{
+    return journal_fd >= 0;
+}
+
+static int write_full(int fd, const char * buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = buf + n;
+        len = len - n;
+    }
+    return 0;
+}
+
+// 日志每行一个副本：目标后端目录、md5（没有时为 -）和文件名，用 tab 分隔
+static int format_item(char * buf, int size, int b, const struct resync_item * it)
+{
+    return snprintf(buf, size, "%s\t%s\t%s\n", backend_dirs[b],
+                    it->md5[0] ? it->md5 : "-", it->name);
+}
+
+static struct resync_item * new_item(const char * name, const char * md5)
+{
+    int len = strlen(name);
+    struct resync_item * it = malloc(sizeof(*it) + len + 1);
+    if (it == NULL) {
+        log_error("malloc resync item for %s failed", name);
+        return NULL;
+    }
+    it->next = NULL;
+    it->queued_us = get_curr_us();
+    it->md5[0] = '\0';
+    if (md5 && strlen(md5) == MD5_LEN) {
+        memcpy(it->md5, md5, MD5_LEN + 1);
+    }
+    memcpy(it->name, name, len + 1);
+    return it;
+}
+
+static void push_item_locked(int b, struct resync_item * it)
+{
+    struct resync_queue * q = &resync_queues[b];
+    it->next = NULL;
+    if (q->tail) {
+        q->tail->next = it;
+    } else {
+        q->head = it;
+    }
+    q->tail = it;
+    resync_pending = resync_pending + 1;
+}
+
+static void sync_journal_dir(void)
+{
+    if (strchr(journal_path, '/')) {
+        (void) sync_parent_dir(journal_path);
+        return;
+    }
+    int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        (void) fsync(fd);
+        close(fd);
+    }
+}
+
+// 在锁内调用：把队列中的副本写到临时文件，同步之后替换日志。没有副本时直接截断
+static int rewrite_journal_locked(void)
+{
+    if (resync_pending == 0) {
+        if (ftruncate(journal_fd, 0) < 0 || fdatasync(journal_fd) < 0) {
+            log_error("truncate %s failed: %s", journal_path, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    char tmp[MAX_PATH_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", journal_path);
+    FILE * fp = fopen(tmp, "we");
+    if (fp == NULL) {
+        log_error("open %s failed: %s", tmp, strerror(errno));
+        return -1;
+    }
+    char line[RESYNC_PATH_LEN + MD5_LEN + 4];
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        struct resync_item * it;
+        for (it = resync_queues[b].head; it; it = it->next) {
+            format_item(line, sizeof(line), b, it);
+            fputs(line, fp);
+        }
+    }
+    if (fflush(fp) != 0 || fdatasync(fileno(fp)) < 0) {
+        log_error("write %s failed: %s", tmp, strerror(errno));
+        fclose(fp);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(fp);
+    if (rename(tmp, journal_path) < 0) {
+        log_error("rename %s to %s failed: %s", tmp, journal_path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    sync_journal_dir();
+
+    int fd = open(journal_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        // 仍然使用原来的描述符，追加到改名之前的文件中，重启后会少补写这些副本
+        log_error("reopen %s failed: %s", journal_path, strerror(errno));
+        return -1;
+    }
+    close(journal_fd);
+    journal_fd = fd;
+    return 0;
+}
+
+int record_missing_replicas(uint32_t lost, const char * name, const char * md5)
+{
+    struct resync_item * items[MAX_BACK_END] = {NULL};
+    char buf[MAX_BACK_END * (RESYNC_PATH_LEN + MD5_LEN + 4)];
+    int len = 0;
+    int n = 0;
+    int b;
+
+    if (journal_fd < 0) {
+        log_error("no resync journal to record missing replicas of %s", name);
+        return -1;
+    }
+    for (b = 0; b < backend_cnt; b++) {
+        if ((lost & (1u << b)) == 0) {
+            continue;
+        }
+        items[b] = new_item(name, md5);
+        if (items[b] == NULL) {
+            goto failed;
+        }
+        len = len + format_item(buf + len, sizeof(buf) - len, b, items[b]);
+        n = n + 1;
+    }
+
+    pthread_mutex_lock(&resync_lock);
+    // 写入一半失败时截断到原来的长度，不留下不完整的行
+    off_t end = lseek(journal_fd, 0, SEEK_END);
+    if (write_full(journal_fd, buf, len) < 0 || fdatasync(journal_fd) < 0) {
+        log_error("append %s failed: %s", journal_path, strerror(errno));
+        if (end >= 0) {
+            (void) ftruncate(journal_fd, end);
+        }
+        pthread_mutex_unlock(&resync_lock);
+        goto failed;
+    }
+    for (b = 0; b < backend_cnt; b++) {
+        if (items[b]) {
+            push_item_locked(b, items[b]);
+        }
+    }
+    pthread_cond_signal(&resync_cond);
+    pthread_mutex_unlock(&resync_lock);
+
+    __sync_fetch_and_add(&resync_recorded, n);
+    log_debug("%s missing on %d backends, recorded for resync", name, n);
+    return 0;
+
+failed:
+    for (b = 0; b < backend_cnt; b++) {
+        free(items[b]);
+    }
+    return -1;
+}
+
+// 补写线程的复制速度不超过 -o resync_rate，不累积空闲时的额度
+static void throttle(int64_t bytes)
+{
+    static uint64_t next_us = 0;
+    uint64_t now = get_curr_us();
+    if (next_us < now) {
+        next_us = now;
+    }
+    next_us = next_us + bytes * 1000000 / ((int64_t)sgw_options.resync_rate << 20);
+    if (next_us > now) {
+        usleep(next_us - now);
+    }
+}
+
+// 优先用 copy_file_range，在同一个文件系统上不经过用户态，有的文件系统还可以直
+// 接在服务端复制；跨文件系统或者不支持时改用读写
+static int copy_data(int in, int out, int64_t size, const char * src)
+{
+    char * buf = NULL;
+    int64_t done = 0;
+    int ret = 0;
+    while (done < size) {
+        size_t len = size - done < RESYNC_CHUNK ? size - done : RESYNC_CHUNK;
+        ssize_t n;
+        if (buf == NULL) {
+            loff_t off_in = done;
+            loff_t off_out = done;
+            n = copy_file_range(in, &off_in, out, &off_out, len, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS ||
+                          errno == EINVAL || errno == EOPNOTSUPP)) {
+                buf = malloc(RESYNC_CHUNK);
+                if (buf == NULL) {
+                    log_error("malloc %d bytes for resync failed", RESYNC_CHUNK);
+                    return -1;
+                }
+                continue;
+            }
+        } else {
+            n = pread_full(in, buf, len, done);
+            if (n > 0 && pwrite_full(out, buf, n, done) < 0) {
+                n = -1;
+            }
+        }
+        if (n <= 0) {
+            // n 为 0 说明源文件在复制期间变小了
+            log_error("copy %s at offset %ld failed: %s", src, (long)done,
+                      n < 0 ? strerror(errno) : "unexpected end of file");
+            ret = -1;
+            break;
+        }
+        done = done + n;
+        __sync_fetch_and_add(&resync_bytes, n);
+        throttle(n);
+    }
+    free(buf);
+    return ret;
+}
+
+void append_md5(const char * path, const char * md5)
+{
+    char hash_file_path[RESYNC_PATH_LEN + 8];
+    snprintf(hash_file_path, sizeof(hash_file_path), "%s", path);
+    char * slash = strrchr(hash_file_path, '/');
+    if (slash == NULL) {
+        return;
+    }
+    strcpy(slash, "/.hash");
+    FILE * fp = fopen(hash_file_path, "a");
+    if (fp == NULL) {
+        log_error("open %s failed", hash_file_path);
+        return;
+    }
+    fprintf(fp, "%s\n", md5);
+    if (sgw_options.durability != DURABILITY_NONE) {
+        (void) fflush(fp);
+        (void) fdatasync(fileno(fp));
+    }
+    fclose(fp);
+}
+
+// 从其它后端目录复制一个副本到后端目录 b。返回 0 表示补写完成或者不再需要补写，
+// -1 表示稍后重试
+static int repair_one(int b, const struct resync_item * it)
+{
+    char stub[RESYNC_PATH_LEN];
+    char src[RESYNC_PATH_LEN];
+    char dst[RESYNC_PATH_LEN];
+    char tmp[RESYNC_PATH_LEN + 8];
+    struct stat st;
+
+    snprintf(stub, sizeof(stub), "%s/%s", backend_dirs[b], MNTDIRNAME);
+    if (stat(stub, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        log_warning("backend %s still unavailable, resync again in %d seconds",
+                    backend_dirs[b], RESYNC_RETRY_SECONDS);
+        return -1;
+    }
+
+    int missing = 0;
+    int in = -1;
+    int s;
+    for (s = 0; s < backend_cnt && in < 0; s++) {
+        if (s == b) {
+            continue;
+        }
+        join_path(src, sizeof(src), backend_dirs[s], it->name);
+        in = open(src, O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+            if (errno == ENOENT) {
+                missing = missing + 1;
+            } else {
+                log_warning("open %s for resync failed: %s", src, strerror(errno));
+            }
+        }
+    }
+    if (in < 0) {
+        if (missing == backend_cnt - 1) {
+            // 记录之后文件已经被删除
+            log_info("%s no longer exists, skip resync", it->name);
+            return 0;
+        }
+        return -1;
+    }
+
+    // 临时文件以 '.' 开头，和 .hash 一样不出现在文件列表中
+    join_path(dst, sizeof(dst), backend_dirs[b], it->name);
+    char * base = strrchr(dst, '/') + 1;
+    snprintf(tmp, sizeof(tmp), "%.*s.%s.resync", (int)(base - dst), dst, base);
+    int ret = -1;
+    int out = -1;
+    if (fstat(in, &st) < 0) {
+        log_error("stat %s failed: %s", src, strerror(errno));
+        goto out;
+    }
+    // 先复制到临时文件，复制完成再改名，补写中途失败时不留下不完整的文件
+    out = open_path(tmp);
+    if (out < 0 || ftruncate(out, 0) < 0) {
+        log_error("create %s failed: %s", tmp, strerror(errno));
+        goto out;
+    }
+    if (copy_data(in, out, st.st_size, src) < 0) {
+        goto out;
+    }
+    if (sgw_options.durability != DURABILITY_NONE && fdatasync(out) < 0) {
+        log_error("fdatasync %s failed: %s", tmp, strerror(errno));
+        goto out;
+    }
+    if (rename(tmp, dst) < 0) {
+        log_error("rename %s to %s failed: %s", tmp, dst, strerror(errno));
+        goto out;
+    }
+    if (sgw_options.durability != DURABILITY_NONE) {
+        (void) sync_parent_dir(dst);
+    }
+    // 复制期间文件被删除时，不能只在这个后端目录中重新出现
+    if (access(src, F_OK) < 0 && errno == ENOENT) {
+        log_info("%s deleted during resync, remove %s", src, dst);
+        unlink(dst);
+    } else if (it->md5[0]) {
+        append_md5(dst, it->md5);
+    }
+    log_info("resynced %s from %s, %ld bytes", dst, src, (long)st.st_size);
+    ret = 0;
+
+out:
+    if (out >= 0) {
+        close(out);
+        if (ret < 0) {
+            unlink(tmp);
+        }
+    }
+    close(in);
+    return ret;
+}
+
+// 在锁内调用：从 *b 的下一个后端目录开始轮流选择可以补写的副本。都不能补写时返回
+// NULL，*wait_us 是需要等待的时间，0 表示等待新的副本
+static struct resync_item * next_item_locked(int * b, uint64_t * wait_us)
+{
+    uint64_t now = get_curr_us();
+    int i;
+    *wait_us = 0;
+    for (i = 1; i <= backend_cnt; i++) {
+        int k = (*b + i) % backend_cnt;
+        struct resync_queue * q = &resync_queues[k];
+        if (q->head == NULL) {
+            continue;
+        }
+        if (q->down_until > now) {
+            if (*wait_us == 0 || q->down_until - now < *wait_us) {
+                *wait_us = q->down_until - now;
+            }
+            continue;
+        }
+        struct resync_item * it = q->head;
+        q->head = it->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        *b = k;
+        resync_current_us = it->queued_us;
+        return it;
+    }
+    return NULL;
+}
+
+static void * resync_thread(void * argv)
+{
+    (void) argv;
+    init_mt_cntt(RESYNC_THREAD_ID);
+
+    // 最低的普通 I/O 优先级：补写和上传、下载争用磁盘时让路，但是不会一直等待
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)) < 0) {
+        log_warning("set resync io priority failed: %s", strerror(errno));
+    }
+
+    int b = backend_cnt - 1;
+    int repaired = 0;
+    pthread_mutex_lock(&resync_lock);
+    while (1) {
+        uint64_t wait_us;
+        struct resync_item * it = next_item_locked(&b, &wait_us);
+        if (it == NULL) {
+            if (wait_us == 0) {
+                pthread_cond_wait(&resync_cond, &resync_lock);
+            } else {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec = ts.tv_sec + wait_us / 1000000 + 1;
+                pthread_cond_timedwait(&resync_cond, &resync_lock, &ts);
+            }
+            continue;
+        }
+        pthread_mutex_unlock(&resync_lock);
+
+        int ret = repair_one(b, it);
+
+        pthread_mutex_lock(&resync_lock);
+        resync_current_us = 0;
+        struct resync_queue * q = &resync_queues[b];
+        if (ret < 0) {
+            // 放回队首，这个后端目录的副本都等一段时间再补写
+            it->next = q->head;
+            q->head = it;
+            if (q->tail == NULL) {
+                q->tail = it;
+            }
+            q->down_until = get_curr_us() + RESYNC_RETRY_SECONDS * 1000000ULL;
+            __sync_fetch_and_add(&resync_retries, 1);
+            continue;
+        }
+        free(it);
+        resync_pending = resync_pending - 1;
+        repaired = repaired + 1;
+        __sync_fetch_and_add(&resync_repaired, 1);
+        if (resync_pending == 0 || repaired >= RESYNC_COMPACT_ITEMS) {
+            (void) rewrite_journal_locked();
+            repaired = 0;
+        }
+    }
+    return NULL;
+}
+
+// 读入日志中的副本，目标后端目录已经不在 -b 中的记录丢弃
+static int load_journal(void)
+{
+    FILE * fp = fopen(journal_path, "re");
+    if (fp == NULL) {
+        log_error("open %s failed: %s", journal_path, strerror(errno));
+        return -1;
+    }
+    char * line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        // 没有换行符的最后一行是写入一半的记录
+        if (line[len - 1] != '\n') {
+            break;
+        }
+        line[len - 1] = '\0';
+        char * md5 = strchr(line, '\t');
+        char * name = md5 ? strchr(md5 + 1, '\t') : NULL;
+        if (name == NULL) {
+            log_warning("invalid line in %s: %s", journal_path, line);
+            continue;
+        }
+        *md5++ = '\0';
+        *name++ = '\0';
+        int b;
+        for (b = 0; b < backend_cnt; b++) {
+            if (strcmp(backend_dirs[b], line) == 0) {
+                break;
+            }
+        }
+        if (b == backend_cnt) {
+            log_warning("backend %s of %s no longer configured, skip resync", line, name);
+            continue;
+        }
+        struct resync_item * it = new_item(name, strcmp(md5, "-") ? md5 : NULL);
+        if (it == NULL) {
+            break;
+        }
+        push_item_locked(b, it);
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+int init_resync(void)
+{
+    // 条带模式下各个后端目录的分片不同，不能互相复制，缺少的分片由校验恢复
+    if (sgw_options.parity > 0) {
+        return 0;
+    }
+    journal_path = sgw_options.resync_journal ? sgw_options.resync_journal : RESYNC_JOURNAL;
+    int degraded = write_quorum() < backend_cnt ||
+                   (sgw_options.async_mirror && backend_cnt > 1);
+
+    // 所有的后端目录都要同步写入成功时不会产生新的记录，只补写以前留下的
+    journal_fd = open(journal_path, O_RDWR | O_APPEND | O_CLOEXEC | (degraded ? O_CREAT : 0), 0644);
+    if (journal_fd < 0) {
+        if (!degraded && errno == ENOENT) {
+            return 0;
+        }
+        log_error("open %s failed: %s", journal_path, strerror(errno));
+        return -1;
+    }
+    if (load_journal() < 0) {
+        return -1;
+    }
+    if (!degraded && resync_pending == 0) {
+        close(journal_fd);
+        journal_fd = -1;
+        return 0;
+    }
+    // 去掉丢弃的和写入一半的记录
+    if (rewrite_journal_locked() < 0) {
+        return -1;
+    }
+
+    pthread_t tid;
+    int ret = pthread_create(&tid, NULL, resync_thread, NULL);
+    if (ret != 0) {
+        log_error("create resync thread failed: %s", strerror(ret));
+        return -1;
+    }
+    log_info("write quorum %d of %d backends%s, %ld replicas to resync in %s",
+             write_quorum(), backend_cnt, sgw_options.async_mirror ? ", async mirror" : "",
+             (long)resync_pending, journal_path);
+    return 0;
+}
+
+void get_resync_stats(int64_t * pending, uint64_t * lag_us, uint64_t * recorded,
+                      uint64_t * repaired, uint64_t * bytes, uint64_t * retries,
+                      uint64_t * fallbacks)
+{
+    uint64_t now = get_curr_us();
+    uint64_t oldest = now;
+    int b;
+    // 每个队列的队首是这个队列中最早记录的副本
+    pthread_mutex_lock(&resync_lock);
+    *pending = resync_pending;
+    if (resync_current_us && resync_current_us < oldest) {
+        oldest = resync_current_us;
+    }
+    for (b = 0; b < backend_cnt; b++) {
+        struct resync_item * it = resync_queues[b].head;
+        if (it && it->queued_us < oldest) {
+            oldest = it->queued_us;
+        }
+    }
+    pthread_mutex_unlock(&resync_lock);
+    *lag_us = now - oldest;
+    *recorded = __sync_fetch_and_add(&resync_recorded, 0);
+    *repaired = __sync_fetch_and_add(&resync_repaired, 0);
+    *bytes = __sync_fetch_and_add(&resync_bytes, 0);
+    *retries = __sync_fetch_and_add(&resync_retries, 0);
+    *fallbacks = __sync_fetch_and_add(&resync_fallbacks, 0);
+}
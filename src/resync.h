@@ -0,0 +1,73 @@
+// resync.h
+
+#ifndef RESYNC_H
+#define RESYNC_H
+
+#include "public.h"
+#include "prefetch.h"
+
+// 补写线程的线程标识，只用于日志
+#define RESYNC_THREAD_ID (PREFETCH_THREAD_ID + 1)
+
+// 默认的日志文件，相对于 sgw 启动时的当前目录，可以用 -o resync_journal=PATH 修改。
+// 不要放在后端目录中，后端目录的磁盘坏了时仍然要能记录
+#ifndef RESYNC_JOURNAL
+#define RESYNC_JOURNAL "sgw_resync.journal"
+#endif
+
+// 补写线程默认的复制速度上限（MB/s），可以用 -o resync_rate=N 修改
+#ifndef RESYNC_RATE
+#define RESYNC_RATE (16)
+#endif
+
+// 每次复制的数据量，也是限速的粒度
+#ifndef RESYNC_CHUNK
+#define RESYNC_CHUNK (1 << 20)
+#endif
+
+// 目标后端目录仍然不可用时，等待这段时间（秒）之后再补写这个目录的副本
+#ifndef RESYNC_RETRY_SECONDS
+#define RESYNC_RETRY_SECONDS (30)
+#endif
+
+// 补写完这么多个副本之后重写一次日志，去掉已经补写完的记录
+#ifndef RESYNC_COMPACT_ITEMS
+#define RESYNC_COMPACT_ITEMS (1024)
+#endif
+
+// 异步复制时默认最多排队的副本个数，可以用 -o replication_backlog=N 修改
+#ifndef REPLICATION_BACKLOG
+#define REPLICATION_BACKLOG (4096)
+#endif
+
+// 上传时至少要写入成功的后端目录个数
+int write_quorum(void);
+
+// 在工作线程中开始上传时调用：打开了 -o async_mirror 并且排队的副本没有超过
+// -o replication_backlog 时返回 1，这时上传只写入第一个后端目录，其它后端目录由
+// 补写线程从它复制。排队的副本太多时返回 0，上传仍然同步写入所有后端目录
+int async_mirror_wanted(void);
+
+// 记录缺少的副本时启动了补写线程
+int resync_enabled(void);
+
+// 读入日志中上次没有补写完的副本，需要时启动补写线程，在创建工作线程之前调用
+int init_resync(void);
+
+// 在 I/O 线程中调用：上传成功但是 lost 中按位表示的后端目录没有写入（写入失败或者
+// 异步复制）时，把缺少的副本追加到日志并同步，然后交给补写线程。name 是请求中的文
+// 件名，md5 不为 NULL 时补写之后追加到目标目录的 .hash 文件中。写日志失败时返回
+// -1，这时上传应该失败
+int record_missing_replicas(uint32_t lost, const char * name, const char * md5);
+
+// 把 md5 追加到 path 所在目录的 .hash 文件中，需要持久化时同步，失败时只打印日志
+void append_md5(const char * path, const char * md5);
+
+// 还没有补写的副本个数，最早记录的还没有补写完的副本已经等待的时间（微秒），累计
+// 记录、补写完成的副本个数，复制的字节数，重试次数，以及排队太多改为同步写入的上传
+// 个数
+void get_resync_stats(int64_t * pending, uint64_t * lag_us, uint64_t * recorded,
+                      uint64_t * repaired, uint64_t * bytes, uint64_t * retries,
+                      uint64_t * fallbacks);
+
+#endif // RESYNC_H
@@ -34,10 +34,13 @@ static inline ring_t * create_ring(uint32_t suggest_size)
     else if (real_size < MIN_RING_SIZE) { real_size = MIN_RING_SIZE; }
     else {} // real_size remains
 
-    ring_t * ring = (ring_t *)calloc(1, sizeof(ring_t) + real_size);
+    // 数据区不需要清零。calloc 在复用已释放的内存时要清零整个缓冲区，每个新连
+    // 接的两个 20MB 缓冲区会让接受连接的主线程花费数毫秒
+    ring_t * ring = (ring_t *)malloc(sizeof(ring_t) + real_size);
     if (ring != NULL)
     {
         ring->size = real_size;
+        ring->flags = 0;
         ring->len = 0;
         ring->read = 0;
         ring->write = 0;
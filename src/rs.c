@@ -0,0 +1,245 @@
+// rs.c
+
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RS_X86 1
+#endif
+#include "mt_log.h"
+#include "rs.h"
+
+static int rs_k = 0;
+static int rs_m = 0;
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+// 乘以常数 c 时按字节的低 4 位和高 4 位查表，两个结果异或。SIMD 实现用 pshufb 一
+// 次查 16 或者 32 个字节
+static uint8_t gf_mul_lo[256][16] __attribute__((aligned(16)));
+static uint8_t gf_mul_hi[256][16] __attribute__((aligned(16)));
+
+// 校验矩阵，parity[i] = sum(rs_matrix[i][j] * data[j])
+static uint8_t rs_matrix[RS_MAX_SHARDS][RS_MAX_SHARDS];
+
+typedef void (*mul_add_t)(uint8_t * dst, const uint8_t * src, uint8_t c, size_t len);
+static mul_add_t mul_add = NULL;
+static const char * simd_name = "scalar";
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+// dst ^= c * src
+static void mul_add_scalar(uint8_t * dst, const uint8_t * src, uint8_t c, size_t len)
+{
+    const uint8_t * lo = gf_mul_lo[c];
+    const uint8_t * hi = gf_mul_hi[c];
+    size_t i;
+    for (i = 0; i < len; i++) {
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+    }
+}
+
+#ifdef RS_X86
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(uint8_t * dst, const uint8_t * src, uint8_t c, size_t len)
+{
+    const __m128i lo = _mm_load_si128((const __m128i *)gf_mul_lo[c]);
+    const __m128i hi = _mm_load_si128((const __m128i *)gf_mul_hi[c]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_add_avx2(uint8_t * dst, const uint8_t * src, uint8_t c, size_t len)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)gf_mul_lo[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)gf_mul_hi[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+// 本原多项式 x^8 + x^4 + x^3 + x^2 + 1
+static void init_gf(void)
+{
+    int x = 1;
+    int i;
+    for (i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x = x << 1;
+        if (x & 0x100) {
+            x = x ^ 0x11d;
+        }
+    }
+    gf_exp[510] = gf_exp[0];
+    gf_exp[511] = gf_exp[1];
+    int c;
+    for (c = 0; c < 256; c++) {
+        for (i = 0; i < 16; i++) {
+            gf_mul_lo[c][i] = gf_mul(c, i);
+            gf_mul_hi[c][i] = gf_mul(c, i << 4);
+        }
+    }
+}
+
+int init_rs(int k, int m)
+{
+    if (k < 1 || m < 1 || k + m > RS_MAX_SHARDS) {
+        log_error("invalid reed-solomon code: %d data shards, %d parity shards", k, m);
+        return -1;
+    }
+    rs_k = k;
+    rs_m = m;
+    init_gf();
+
+    // Cauchy 矩阵 1 / (x_i + y_j)，x_i = k + i，y_j = j，元素互不相同，和单位矩阵
+    // 组成的生成矩阵任意 k 行都可逆
+    int i, j;
+    for (i = 0; i < m; i++) {
+        for (j = 0; j < k; j++) {
+            rs_matrix[i][j] = gf_inv((uint8_t)((k + i) ^ j));
+        }
+    }
+
+    mul_add = mul_add_scalar;
+    simd_name = "scalar";
+#ifdef RS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mul_add = mul_add_avx2;
+        simd_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        mul_add = mul_add_ssse3;
+        simd_name = "ssse3";
+    }
+#endif
+    return 0;
+}
+
+const char * rs_simd_name(void)
+{
+    return simd_name;
+}
+
+void rs_encode(const uint8_t * const data[], uint8_t * const parity[], size_t len)
+{
+    int i, j;
+    for (i = 0; i < rs_m; i++) {
+        memset(parity[i], 0, len);
+        for (j = 0; j < rs_k; j++) {
+            mul_add(parity[i], data[j], rs_matrix[i][j], len);
+        }
+    }
+}
+
+// 在 GF(2^8) 上求 n 阶矩阵的逆，a 会被修改。不可逆时返回 -1
+static int invert_matrix(uint8_t a[][RS_MAX_SHARDS], uint8_t inv[][RS_MAX_SHARDS], int n)
+{
+    int i, j, r;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            inv[i][j] = i == j;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        for (r = i; r < n && a[r][i] == 0; r++) {
+        }
+        if (r == n) {
+            return -1;
+        }
+        if (r != i) {
+            for (j = 0; j < n; j++) {
+                uint8_t t = a[i][j]; a[i][j] = a[r][j]; a[r][j] = t;
+                t = inv[i][j]; inv[i][j] = inv[r][j]; inv[r][j] = t;
+            }
+        }
+        uint8_t f = gf_inv(a[i][i]);
+        for (j = 0; j < n; j++) {
+            a[i][j] = gf_mul(a[i][j], f);
+            inv[i][j] = gf_mul(inv[i][j], f);
+        }
+        for (r = 0; r < n; r++) {
+            uint8_t g = a[r][i];
+            if (r == i || g == 0) {
+                continue;
+            }
+            for (j = 0; j < n; j++) {
+                a[r][j] ^= gf_mul(g, a[i][j]);
+                inv[r][j] ^= gf_mul(g, inv[i][j]);
+            }
+        }
+    }
+    return 0;
+}
+
+int rs_reconstruct(uint8_t * const shards[], uint32_t present, size_t len)
+{
+    uint32_t all_data = (1u << rs_k) - 1;
+    if ((present & all_data) == all_data) {
+        return 0;
+    }
+
+    // 取前 k 个完整的分片，它们在生成矩阵中对应的行组成的矩阵求逆，缺少的数据分片
+    // 是逆矩阵的对应行和这些分片的乘积
+    uint8_t a[RS_MAX_SHARDS][RS_MAX_SHARDS];
+    uint8_t inv[RS_MAX_SHARDS][RS_MAX_SHARDS];
+    int rows[RS_MAX_SHARDS];
+    int n = 0;
+    int i, j;
+    for (i = 0; i < rs_k + rs_m && n < rs_k; i++) {
+        if ((present & (1u << i)) == 0) {
+            continue;
+        }
+        for (j = 0; j < rs_k; j++) {
+            a[n][j] = i < rs_k ? (i == j) : rs_matrix[i - rs_k][j];
+        }
+        rows[n] = i;
+        n = n + 1;
+    }
+    if (n < rs_k) {
+        log_error("reconstruct failed: only %d shards, need %d", n, rs_k);
+        return -1;
+    }
+    if (invert_matrix(a, inv, rs_k) < 0) {
+        log_error("reconstruct failed: singular matrix");
+        return -1;
+    }
+    for (i = 0; i < rs_k; i++) {
+        if (present & (1u << i)) {
+            continue;
+        }
+        memset(shards[i], 0, len);
+        for (j = 0; j < rs_k; j++) {
+            mul_add(shards[i], shards[rows[j]], inv[i][j], len);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+// rs.h
+
+#ifndef RS_H
+#define RS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// GF(2^8) 上的 Reed-Solomon 编码，k 个数据分片加 m 个校验分片，任意 k 个分片可以
+// 恢复出所有数据。校验矩阵是 Cauchy 矩阵，数据分片原样保存（系统码）
+#define RS_MAX_SHARDS (32)
+
+// 初始化有限域的运算表和校验矩阵，选择可用的 SIMD 实现，在创建工作线程之前调用
+int init_rs(int k, int m);
+
+// 使用的实现："avx2"、"ssse3" 或者 "scalar"
+const char * rs_simd_name(void);
+
+// 由 k 个数据分片计算 m 个校验分片，每个分片 len 字节
+void rs_encode(const uint8_t * const data[], uint8_t * const parity[], size_t len);
+
+// shards 是 k+m 个分片，present 按位表示哪些分片的数据是完整的，至少要有 k 个。恢复
+// 缺少的数据分片（不恢复校验分片），成功返回 0
+int rs_reconstruct(uint8_t * const shards[], uint32_t present, size_t len);
+
+#endif // RS_H
@@ -0,0 +1,166 @@
+// stats.c
+
+#include "mt_log.h"
+#include "stats.h"
+#include "iopool.h"
+#include "options.h"
+#include "durable.h"
+#include "pagecache.h"
+#include "prefetch.h"
+#include "filecache.h"
+#include "mirror.h"
+#include "resync.h"
+#include "stripe.h"
+#include "dedup.h"
+#include "resume.h"
+
+extern int get_thread_id(void);
+extern int workers;
+extern int backend_cnt;
+
+sgw_stats_t sgw_stats[MAX_WORKERS+1];
+
+sgw_stats_t * my_stats(void)
+{
+    return &sgw_stats[get_thread_id()];
+}
+
+void dump_stats(void)
+{
+    sgw_stats_t sum;
+    int i;
+
+    memset(&sum, 0, sizeof(sum));
+    for (i = 0; i <= workers && i <= MAX_WORKERS; i++) {
+        sgw_stats_t * s = &sgw_stats[i];
+        sum.pool_hits += s->pool_hits;
+        sum.pool_misses += s->pool_misses;
+        sum.pool_evictions += s->pool_evictions;
+        sum.relay_messages += s->relay_messages;
+        sum.relay_bytes += s->relay_bytes;
+        sum.flow_pauses += s->flow_pauses;
+        sum.flow_paused_ms += s->flow_paused_ms;
+        sum.trunk_sessions += s->trunk_sessions;
+        sum.trunk_resets += s->trunk_resets;
+        sum.trunk_waits += s->trunk_waits;
+        sum.cluster_redirects += s->cluster_redirects;
+        sum.cluster_proxied += s->cluster_proxied;
+        sum.tls_full += s->tls_full;
+        sum.tls_resumed += s->tls_resumed;
+        sum.tls_failures += s->tls_failures;
+        sum.tls_ktls += s->tls_ktls;
+        sum.io_jobs += s->io_jobs;
+        sum.io_inline += s->io_inline;
+        sum.io_overflows += s->io_overflows;
+        sum.io_wait_us += s->io_wait_us;
+        sum.io_busy_us += s->io_busy_us;
+        if (s->io_wait_max_us > sum.io_wait_max_us) {
+            sum.io_wait_max_us = s->io_wait_max_us;
+        }
+        s->io_wait_max_us = 0;
+        sum.uring_jobs += s->uring_jobs;
+        sum.uring_ops += s->uring_ops;
+        sum.uring_submits += s->uring_submits;
+        sum.uring_busy_us += s->uring_busy_us;
+        sum.readahead_chunks += s->readahead_chunks;
+        sum.readahead_hits += s->readahead_hits;
+        sum.readahead_waits += s->readahead_waits;
+        sum.readahead_discards += s->readahead_discards;
+    }
+
+    log_info("stats: sgw pool %lu hits, %lu misses, %lu evictions",
+             sum.pool_hits, sum.pool_misses, sum.pool_evictions);
+    log_info("stats: relay %lu messages, %lu bytes spliced",
+             sum.relay_messages, sum.relay_bytes);
+    log_info("stats: flow control %lu pauses, %lu ms paused",
+             sum.flow_pauses, sum.flow_paused_ms);
+    log_info("stats: trunk %lu sessions, %lu resets, %lu waits",
+             sum.trunk_sessions, sum.trunk_resets, sum.trunk_waits);
+    log_info("stats: cluster %lu redirects, %lu proxied",
+             sum.cluster_redirects, sum.cluster_proxied);
+    log_info("stats: tls %lu full handshakes, %lu resumed, %lu failures, %lu ktls",
+             sum.tls_full, sum.tls_resumed, sum.tls_failures, sum.tls_ktls);
+
+    int depth, max_depth;
+    get_io_queue_depth(&depth, &max_depth);
+    uint64_t jobs = sum.io_jobs ? sum.io_jobs : 1;
+    log_info("stats: io %lu jobs, %lu inline, %lu queue full, "
+             "wait avg %lu us max %lu us, busy avg %lu us, queue depth %d max %d",
+             sum.io_jobs, sum.io_inline, sum.io_overflows,
+             sum.io_wait_us / jobs, sum.io_wait_max_us, sum.io_busy_us / jobs,
+             depth, max_depth);
+    if (sgw_options.io_uring) {
+        uint64_t uring_jobs = sum.uring_jobs ? sum.uring_jobs : 1;
+        log_info("stats: io_uring %lu jobs, %lu ops in %lu submits, busy avg %lu us",
+                 sum.uring_jobs, sum.uring_ops, sum.uring_submits,
+                 sum.uring_busy_us / uring_jobs);
+    }
+    if (sgw_options.readahead > 0) {
+        log_info("stats: readahead %lu chunks, %lu hits (%lu waited), %lu discarded",
+                 sum.readahead_chunks, sum.readahead_hits, sum.readahead_waits,
+                 sum.readahead_discards);
+    }
+    if (sgw_options.durability != DURABILITY_NONE) {
+        uint64_t groups, files, sync_us;
+        get_group_commit_stats(&groups, &files, &sync_us);
+        uint64_t rounds = sgw_options.durability == DURABILITY_GROUP ? groups : files;
+        log_info("stats: durability %lu groups, %lu files, sync avg %lu us",
+                 groups, files, sync_us / (rounds ? rounds : 1));
+    }
+    if (sgw_options.cache_policy == CACHE_POLICY_ADAPTIVE) {
+        uint64_t opens, sampled, resident, willneed, dontneed;
+        get_pagecache_stats(&opens, &sampled, &resident, &willneed, &dontneed);
+        log_info("stats: page cache %lu opens, hit %lu%% (%lu/%lu pages sampled), "
+                 "%lu willneed, %lu dontneed",
+                 opens, sampled ? resident * 100 / sampled : 0, resident, sampled,
+                 willneed, dontneed);
+    }
+    if (sgw_options.prefetch > 0) {
+        uint64_t lists, files, bytes, cancelled;
+        get_prefetch_stats(&lists, &files, &bytes, &cancelled);
+        log_info("stats: prefetch %lu lists, %lu files, %lu MB, %lu cancelled",
+                 lists, files, bytes >> 20, cancelled);
+    }
+    if (sgw_options.file_cache > 0) {
+        uint64_t hits, misses, fills, evictions, invalidations, bytes;
+        get_file_cache_stats(&hits, &misses, &fills, &evictions, &invalidations, &bytes);
+        log_info("stats: file cache %lu hits, %lu misses, %lu fills, %lu evictions, "
+                 "%lu invalidations, %lu MB used",
+                 hits, misses, fills, evictions, invalidations, bytes >> 20);
+    }
+    if (resync_enabled()) {
+        int64_t pending;
+        uint64_t lag_us, recorded, repaired, bytes, retries, fallbacks;
+        get_resync_stats(&pending, &lag_us, &recorded, &repaired, &bytes, &retries,
+                         &fallbacks);
+        log_info("stats: resync %ld pending, lag %lu ms, %lu recorded, %lu repaired, "
+                 "%lu MB, %lu retries, %lu sync fallbacks",
+                 (long)pending, lag_us / 1000, recorded, repaired, bytes >> 20,
+                 retries, fallbacks);
+    }
+    if (dedup_enabled()) {
+        uint64_t present, linked, bytes;
+        get_dedup_stats(&present, &linked, &bytes);
+        log_info("stats: dedup %lu present, %lu linked, %lu MB not uploaded",
+                 present, linked, bytes >> 20);
+    }
+    if (resume_enabled()) {
+        uint64_t resumed, skipped, removed;
+        get_resume_stats(&resumed, &skipped, &removed);
+        log_info("stats: resume %lu resumed, %lu MB not resent, %lu stale removed",
+                 resumed, skipped >> 20, removed);
+    }
+    if (stripe_enabled()) {
+        uint64_t encoded, degraded, reconstructed;
+        get_stripe_stats(&encoded, &degraded, &reconstructed);
+        log_info("stats: stripe %lu MB encoded, %lu degraded reads, %lu MB reconstructed",
+                 encoded >> 20, degraded, reconstructed >> 20);
+    }
+    for (i = 0; backend_cnt > 1 && !stripe_enabled() && i < backend_cnt; i++) {
+        uint64_t reads, failures, latency_us;
+        int healthy;
+        get_mirror_stats(i, &reads, &failures, &latency_us, &healthy);
+        log_info("stats: mirror %d %lu reads, %lu failures, latency avg %lu us%s",
+                 i, reads, failures, latency_us, healthy ? "" : ", down");
+    }
+}
@@ -0,0 +1,72 @@
+// stats.h
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include "public.h"
+#include "ring.h"
+
+// 统计计数器写日志的间隔，单位是毫秒
+#ifndef STATS_INTERVAL
+#define STATS_INTERVAL (60000)
+#endif
+
+// 每个线程一份计数器，只由所属的线程更新，不需要加锁。各线程的计数器分开放在不
+// 同的缓存行中，避免伪共享。汇总时读到的可能是稍旧的值，对统计来说没有影响。
+typedef struct sgw_stats_
+{
+    // 到下一跳 sgw 的连接池
+    uint64_t pool_hits;      // 复用了连接池中的空闲连接
+    uint64_t pool_misses;    // 没有可用的空闲连接，新建连接
+    uint64_t pool_evictions; // 空闲超时或者检查失效而关闭的连接
+
+    // 零拷贝转发
+    uint64_t relay_messages; // 使用零拷贝转发的数据消息
+    uint64_t relay_bytes;    // 通过管道转发的字节数
+
+    // 转发的流量控制
+    uint64_t flow_pauses;    // 因为下一跳发送缓冲区已满而暂停接收的次数
+    uint64_t flow_paused_ms; // 暂停接收的总时间，毫秒
+
+    // 中继连接
+    uint64_t trunk_sessions; // 建立的会话
+    uint64_t trunk_resets;   // 出错放弃的会话
+    uint64_t trunk_waits;    // 目标端的会话等待中继连接发送缓冲区的次数
+
+    // 集群分布表
+    uint64_t cluster_redirects; // 重定向到负责的 sgw 的请求
+    uint64_t cluster_proxied;   // 客户端不支持重定向，转发到负责的 sgw 的请求
+
+    // 客户端连接的 TLS 握手
+    uint64_t tls_full;       // 完整的握手，需要做非对称加密运算
+    uint64_t tls_resumed;    // 恢复会话的握手
+    uint64_t tls_failures;   // 失败或者超时的握手
+    uint64_t tls_ktls;       // 握手后由内核加密发送的连接
+
+    // I/O 线程
+    uint64_t io_jobs;        // 由 I/O 线程完成的文件操作
+    uint64_t io_inline;      // 在工作线程中直接执行的文件操作
+    uint64_t io_overflows;   // 因为队列已满而直接执行的文件操作
+    uint64_t io_wait_us;     // 在队列中等待的总时间，微秒
+    uint64_t io_busy_us;     // I/O 线程执行的总时间，微秒
+    uint64_t io_wait_max_us; // 在队列中等待的最长时间，每次输出后清零
+    uint64_t uring_jobs;     // 由 io_uring 完成的请求
+    uint64_t uring_ops;      // 交给 io_uring 的文件操作
+    uint64_t uring_submits;  // 调用 io_uring_enter 的次数
+    uint64_t uring_busy_us;  // 请求从提交到完成的总时间，微秒
+    uint64_t readahead_chunks;   // 提交的预读块
+    uint64_t readahead_hits;     // 由预读块应答的下载数据请求
+    uint64_t readahead_waits;    // 请求到达时预读还没有完成、需要等待的次数
+    uint64_t readahead_discards; // 不再顺序读取而丢弃的预读块
+} __attribute__((aligned(CACHE_LINE_SIZE))) sgw_stats_t;
+
+extern sgw_stats_t sgw_stats[MAX_WORKERS+1];
+
+// 当前线程的计数器
+sgw_stats_t * my_stats(void);
+
+// 汇总所有线程的计数器，写到日志中
+void dump_stats(void);
+
+#endif // STATS_H
@@ -0,0 +1,329 @@
+// stripe.c
+
+#include <endian.h>
+#include "mt_log.h"
+#include "public.h"
+#include "options.h"
+#include "pathops.h"
+#include "rs.h"
+#include "stripe.h"
+
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+#define STRIPE_PATH_LEN (MAX_NAME_LEN + MAX_NAME_LEN + 16)
+
+static int stripe_k = 0;
+static int stripe_m = 0;
+
+static uint64_t stripe_encoded = 0;
+static uint64_t stripe_degraded = 0;
+static uint64_t stripe_reconstructed = 0;
+
+int init_stripe(void)
+{
+    if (sgw_options.parity == 0) {
+        return 0;
+    }
+    stripe_m = sgw_options.parity;
+    stripe_k = backend_cnt - stripe_m;
+    if (stripe_k < 2) {
+        log_error("parity %d needs at least %d backend directories, got %d",
+                  stripe_m, stripe_m + 2, backend_cnt);
+        return -1;
+    }
+    if (init_rs(stripe_k, stripe_m) < 0) {
+        return -1;
+    }
+    // 这些功能按整个文件读写后端文件，条带模式下不能使用。所有的分片都要写入成功，
+    // 缺少的分片由校验恢复，不需要补写
+    sgw_options.direct_io = 0;
+    sgw_options.readahead = 0;
+    sgw_options.prefetch = 0;
+    sgw_options.write_quorum = 0;
+    sgw_options.async_mirror = 0;
+    log_info("stripe mode: %d data + %d parity shards, %d KB unit, %s; "
+             "direct_io, readahead, prefetch, write_quorum and async_mirror disabled",
+             stripe_k, stripe_m, STRIPE_UNIT >> 10, rs_simd_name());
+    return 0;
+}
+
+int stripe_enabled(void)
+{
+    return stripe_m > 0;
+}
+
+int stripe_data_shards(void)
+{
+    return stripe_k;
+}
+
+int64_t stripe_shard_len(int64_t size, int j)
+{
+    int64_t row = (int64_t)stripe_k * STRIPE_UNIT;
+    int64_t rem = size % row - (int64_t)j * STRIPE_UNIT;
+    if (rem < 0) {
+        rem = 0;
+    } else if (rem > STRIPE_UNIT) {
+        rem = STRIPE_UNIT;
+    }
+    return size / row * STRIPE_UNIT + rem;
+}
+
+// 校验分片末尾记录的文件大小，没有记录时返回 -1
+static int64_t read_trailer(int fd)
+{
+    struct stat s;
+    uint8_t t[STRIPE_TRAILER_LEN];
+    if (fstat(fd, &s) < 0 || s.st_size < STRIPE_TRAILER_LEN ||
+        pread_full(fd, t, sizeof(t), s.st_size - STRIPE_TRAILER_LEN) != sizeof(t) ||
+        memcmp(t, STRIPE_MAGIC, 8) != 0) {
+        return -1;
+    }
+    uint64_t size;
+    memcpy(&size, t + 8, sizeof(size));
+    return (int64_t)be64toh(size);
+}
+
+int64_t stripe_file_size(const int fds[])
+{
+    int i;
+    for (i = stripe_k; i < backend_cnt; i++) {
+        if (fds[i] >= 0) {
+            int64_t size = read_trailer(fds[i]);
+            if (size >= 0) {
+                return size;
+            }
+        }
+    }
+    int64_t size = 0;
+    for (i = 0; i < stripe_k; i++) {
+        struct stat s;
+        if (fds[i] < 0 || fstat(fds[i], &s) < 0) {
+            return -1;
+        }
+        size = size + s.st_size;
+    }
+    return size;
+}
+
+int64_t stripe_file_size_by_name(const char * name)
+{
+    int fds[MAX_BACK_END];
+    char path[STRIPE_PATH_LEN];
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        join_path(path, sizeof(path), backend_dirs[i], name);
+        fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    int64_t size = stripe_file_size(fds);
+    for (i = 0; i < backend_cnt; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    return size;
+}
+
+void stripe_rows(int64_t offset, uint32_t len, int64_t * first_row, int64_t * nr_rows)
+{
+    int64_t row = (int64_t)stripe_k * STRIPE_UNIT;
+    *first_row = offset / row;
+    *nr_rows = len == 0 ? 0 : (offset + len - 1) / row - *first_row + 1;
+}
+
+uint32_t stripe_read_len(int64_t size, int j, int64_t first_row, int64_t nr_rows)
+{
+    int64_t len = stripe_shard_len(size, j) - first_row * STRIPE_UNIT;
+    if (len < 0) {
+        len = 0;
+    } else if (len > nr_rows * STRIPE_UNIT) {
+        len = nr_rows * STRIPE_UNIT;
+    }
+    return (uint32_t)len;
+}
+
+void stripe_gather(const uint8_t * buf, int64_t first_row, int64_t nr_rows,
+                   int64_t offset, uint32_t len, uint8_t * out)
+{
+    size_t span = nr_rows * STRIPE_UNIT;
+    int64_t end = offset + len;
+    int64_t r;
+    int j;
+    for (r = first_row; r < first_row + nr_rows; r++) {
+        for (j = 0; j < stripe_k; j++) {
+            int64_t unit = (r * stripe_k + j) * STRIPE_UNIT;
+            int64_t s = unit > offset ? unit : offset;
+            int64_t e = unit + STRIPE_UNIT < end ? unit + STRIPE_UNIT : end;
+            if (s < e) {
+                memcpy(out + (s - offset),
+                       buf + j * span + (r - first_row) * STRIPE_UNIT + (s - unit), e - s);
+            }
+        }
+    }
+}
+
+int stripe_read(const int fds[], int64_t size, int64_t offset, uint32_t len, uint8_t * out)
+{
+    if (len == 0) {
+        return 0;
+    }
+    int64_t first_row, nr_rows;
+    stripe_rows(offset, len, &first_row, &nr_rows);
+    size_t span = nr_rows * STRIPE_UNIT;
+    // 分片中不存在的部分（数据分片的末尾）按零参与恢复
+    uint8_t * buf = (uint8_t *)calloc(backend_cnt, span);
+    if (!buf) {
+        log_error("malloc %lu bytes for stripe read failed", (unsigned long)(backend_cnt * span));
+        return -1;
+    }
+    uint8_t * shards[MAX_BACK_END];
+    uint32_t present = 0;
+    int i;
+    for (i = 0; i < stripe_k; i++) {
+        shards[i] = buf + i * span;
+        uint32_t want = stripe_read_len(size, i, first_row, nr_rows);
+        if (fds[i] >= 0 && pread_full(fds[i], shards[i], want, first_row * STRIPE_UNIT) == (ssize_t)want) {
+            present = present | (1u << i);
+        }
+    }
+    uint32_t all_data = (1u << stripe_k) - 1;
+    for (i = stripe_k; i < backend_cnt && present != all_data; i++) {
+        shards[i] = buf + i * span;
+        if (__builtin_popcount(present) < stripe_k && fds[i] >= 0 &&
+            pread_full(fds[i], shards[i], span, first_row * STRIPE_UNIT) == (ssize_t)span) {
+            present = present | (1u << i);
+        }
+    }
+    int ret = 0;
+    if (present != all_data) {
+        ret = rs_reconstruct(shards, present, span);
+        if (ret == 0) {
+            __sync_fetch_and_add(&stripe_degraded, 1);
+            __sync_fetch_and_add(&stripe_reconstructed, (uint64_t)len);
+            log_debug("reconstructed rows %ld-%ld from parity",
+                      (long)first_row, (long)(first_row + nr_rows - 1));
+        }
+    }
+    if (ret == 0) {
+        stripe_gather(buf, first_row, nr_rows, offset, len, out);
+    }
+    free(buf);
+    return ret;
+}
+
+int64_t stripe_full_rows(uint32_t fill, uint32_t len)
+{
+    return ((int64_t)fill + len) / ((int64_t)stripe_k * STRIPE_UNIT);
+}
+
+// 一行数据按单元分到各个数据分片的第 r 个单元
+static void scatter_row(const uint8_t * row, uint8_t * out, size_t span, int64_t r)
+{
+    int j;
+    for (j = 0; j < stripe_k; j++) {
+        memcpy(out + j * span + r * STRIPE_UNIT, row + j * STRIPE_UNIT, STRIPE_UNIT);
+    }
+}
+
+static void encode_shards(uint8_t * out, size_t span)
+{
+    const uint8_t * data[MAX_BACK_END];
+    uint8_t * parity[MAX_BACK_END];
+    int i;
+    for (i = 0; i < stripe_k; i++) {
+        data[i] = out + i * span;
+    }
+    for (i = 0; i < stripe_m; i++) {
+        parity[i] = out + (stripe_k + i) * span;
+    }
+    rs_encode(data, parity, span);
+    __sync_fetch_and_add(&stripe_encoded, (uint64_t)stripe_k * span);
+}
+
+void stripe_append(transfer_t * x, const uint8_t * data, uint32_t len,
+                   uint8_t * out, int64_t nr_rows)
+{
+    uint32_t row_len = stripe_k * STRIPE_UNIT;
+    size_t span = nr_rows * STRIPE_UNIT;
+    int64_t r;
+    for (r = 0; r < nr_rows; r++) {
+        if (x->stripe_fill > 0) {
+            // 先用上一块留下的数据凑满一行
+            uint32_t need = row_len - x->stripe_fill;
+            memcpy(x->stripe_row + x->stripe_fill, data, need);
+            scatter_row(x->stripe_row, out, span, r);
+            x->stripe_fill = 0;
+            data = data + need;
+            len = len - need;
+        } else {
+            scatter_row(data, out, span, r);
+            data = data + row_len;
+            len = len - row_len;
+        }
+    }
+    memcpy(x->stripe_row + x->stripe_fill, data, len);
+    x->stripe_fill = x->stripe_fill + len;
+    if (nr_rows > 0) {
+        encode_shards(out, span);
+    }
+}
+
+int stripe_finish_upload(transfer_t * x)
+{
+    int64_t rows = x->stripe_rows;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        if (x->befiles[i].fd < 0) {
+            log_error("finish stripe upload failed: no shard on backend %s", backend_dirs[i]);
+            return -1;
+        }
+    }
+    if (x->stripe_fill > 0) {
+        // 最后不满一行的数据补零计算校验，数据分片只写入实际的数据
+        uint8_t * out = (uint8_t *)calloc(backend_cnt, STRIPE_UNIT);
+        if (!out) {
+            log_error("malloc %d bytes for stripe tail failed", backend_cnt * STRIPE_UNIT);
+            return -1;
+        }
+        memcpy(out, x->stripe_row, x->stripe_fill);
+        encode_shards(out, STRIPE_UNIT);
+        for (i = 0; i < backend_cnt; i++) {
+            int64_t len = i < stripe_k ? (int64_t)x->stripe_fill - i * STRIPE_UNIT : STRIPE_UNIT;
+            if (len > STRIPE_UNIT) {
+                len = STRIPE_UNIT;
+            }
+            if (len > 0 &&
+                pwrite_full(x->befiles[i].fd, out + i * STRIPE_UNIT, len, rows * STRIPE_UNIT) < 0) {
+                log_error("write %s failed: %s", x->befiles[i].abs_file_name, strerror(errno));
+                free(out);
+                return -1;
+            }
+        }
+        free(out);
+        rows = rows + 1;
+    }
+
+    uint8_t t[STRIPE_TRAILER_LEN];
+    uint64_t size = htobe64((uint64_t)x->stripe_size);
+    memcpy(t, STRIPE_MAGIC, 8);
+    memcpy(t + 8, &size, sizeof(size));
+    for (i = 0; i < backend_cnt; i++) {
+        struct backend_file * f = &x->befiles[i];
+        // 重新上传时不截断打开，以前较长的文件留下的内容要去掉
+        int64_t len = i < stripe_k ? stripe_shard_len(x->stripe_size, i) : rows * STRIPE_UNIT;
+        if ((i >= stripe_k && pwrite_full(f->fd, t, sizeof(t), len) < 0) ||
+            ftruncate(f->fd, i < stripe_k ? len : len + STRIPE_TRAILER_LEN) < 0) {
+            log_error("finish %s failed: %s", f->abs_file_name, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void get_stripe_stats(uint64_t * encoded, uint64_t * degraded, uint64_t * reconstructed)
+{
+    *encoded = __atomic_load_n(&stripe_encoded, __ATOMIC_RELAXED);
+    *degraded = __atomic_load_n(&stripe_degraded, __ATOMIC_RELAXED);
+    *reconstructed = __atomic_load_n(&stripe_reconstructed, __ATOMIC_RELAXED);
+}
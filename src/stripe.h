@@ -0,0 +1,79 @@
+// stripe.h
+
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include "public.h"
+#include "transfer.h"
+
+// 条带模式（-o parity=M）：后端目录中前 k = backend_cnt - M 个保存数据分片，最后 M
+// 个保存校验分片，文件名和镜像模式相同。文件按 STRIPE_UNIT 切成条带单元，依次轮流
+// 放在 k 个数据分片中，k 个单元组成一行，每行计算 M 个单元的校验数据。数据分片不补
+// 齐，长度之和就是文件大小；校验分片的最后一行补零计算，之后是 STRIPE_TRAILER_LEN
+// 字节的文件大小记录。任意 M 个后端目录不可用时仍然可以读出文件
+
+// 条带单元的大小，数据分片中的 k 个单元可以并行读取
+#ifndef STRIPE_UNIT
+#define STRIPE_UNIT (64 * 1024)
+#endif
+
+// 顺序下载时把整个文件恢复到内存中再发送，超过这个大小的文件不能顺序下载
+#ifndef STRIPE_SEQ_MAX_FILE
+#define STRIPE_SEQ_MAX_FILE (64 << 20)
+#endif
+
+// 校验分片末尾的记录：8 字节的标记，8 字节网络字节序的文件大小
+#define STRIPE_MAGIC "SGWRS001"
+#define STRIPE_TRAILER_LEN (16)
+
+// 检查参数，初始化编码表，关闭和条带模式不兼容的功能，在创建工作线程之前调用
+int init_stripe(void);
+
+// 打开了 -o parity 时返回 1
+int stripe_enabled(void);
+
+// 数据分片的个数 k
+int stripe_data_shards(void);
+
+// 大小为 size 的文件，数据分片 j 的长度
+int64_t stripe_shard_len(int64_t size, int j);
+
+// 文件大小：从第一个可以读取的校验分片末尾读取，校验分片都不可用时是数据分片长度
+// 之和。fds 是各个后端目录中分片的文件描述符，没有打开的为 -1。失败返回 -1
+int64_t stripe_file_size(const int fds[]);
+
+// 按请求中的文件名取得文件大小，用于文件列表。文件不存在时返回 -1
+int64_t stripe_file_size_by_name(const char * name);
+
+// 读取文件中 offset 开始 len 字节需要的行：从 first_row 开始的 nr_rows 行
+void stripe_rows(int64_t offset, uint32_t len, int64_t * first_row, int64_t * nr_rows);
+
+// 数据分片 j 中从 first_row 开始 nr_rows 行实际存在的字节数
+uint32_t stripe_read_len(int64_t size, int j, int64_t first_row, int64_t nr_rows);
+
+// buf 中依次是 k 个数据分片从 first_row 开始的 nr_rows 行，每个分片 nr_rows 个单元，
+// 从中取出文件 offset 开始的 len 字节放到 out 中
+void stripe_gather(const uint8_t * buf, int64_t first_row, int64_t nr_rows,
+                   int64_t offset, uint32_t len, uint8_t * out);
+
+// 在 I/O 线程中调用：读取 offset 开始的 len 字节，数据分片缺少或者读取失败时读取校
+// 验分片恢复。size 是文件大小，offset + len 不能超过它。成功返回 0
+int stripe_read(const int fds[], int64_t size, int64_t offset, uint32_t len, uint8_t * out);
+
+// 上传时已经有 fill 字节的不满一行的数据，再追加 len 字节之后凑满的行数
+int64_t stripe_full_rows(uint32_t fill, uint32_t len);
+
+// 把上传的 len 字节追加到 x 的条带中，凑满的 nr_rows 行（由 stripe_full_rows 计算）
+// 按分片排列到 out 中并计算校验分片，out 中依次是所有分片的数据，每个分片 nr_rows
+// 个单元。不满一行的数据留在 x->stripe_row 中
+void stripe_append(transfer_t * x, const uint8_t * data, uint32_t len,
+                   uint8_t * out, int64_t nr_rows);
+
+// 在 I/O 线程中调用：上传结束时写入最后不满一行的数据和校验，截掉分片中以前的文件
+// 留下的内容，在校验分片末尾记录文件大小。成功返回 0
+int stripe_finish_upload(transfer_t * x);
+
+// 累计编码的数据量，需要恢复的读取次数，恢复的数据量（字节）
+void get_stripe_stats(uint64_t * encoded, uint64_t * degraded, uint64_t * reconstructed);
+
+#endif // STRIPE_H
@@ -1,11 +1,200 @@
 //
 // Created by Jaden Wu on 2020/5/27.
 //
+#include <pthread.h>
+#include <string.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#include "mt_log.h"
+#include "public.h"
+#include "timer_set.h"
+#include "options.h"
+#include "tls.h"
+
+extern timer_set_t * timer_sets[MAX_WORKERS+1];
 
 SSL_CTX *ssl_ctx;
 
+/*
+ * Session ticket keys. keys[0] encrypts new tickets, keys[1] is the one it
+ * replaced and is only used to decrypt (the ticket is then renewed with
+ * keys[0]). The main thread rotates them on a timer while the workers use
+ * them in handshakes, so they are guarded by a mutex; it is held only to
+ * copy a key out.
+ */
+struct ticket_key
+{
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+};
+
+static struct ticket_key ticket_keys[2];
+static pthread_mutex_t ticket_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int new_ticket_key(struct ticket_key *k)
+{
+    if (RAND_bytes(k->name, sizeof(k->name)) <= 0 ||
+        RAND_bytes(k->aes_key, sizeof(k->aes_key)) <= 0 ||
+        RAND_bytes(k->hmac_key, sizeof(k->hmac_key)) <= 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int on_rotate_ticket_key(void *timer)
+{
+    (void) timer;
+    struct ticket_key k;
+    if (new_ticket_key(&k) < 0)
+    {
+        log_error("generate tls ticket key failed, keep the current one");
+        return 0;
+    }
+    pthread_mutex_lock(&ticket_lock);
+    ticket_keys[1] = ticket_keys[0];
+    ticket_keys[0] = k;
+    pthread_mutex_unlock(&ticket_lock);
+    OPENSSL_cleanse(&k, sizeof(k));
+    log_info("tls ticket key rotated");
+    return 0;
+}
+
+/* returns 1: use the current key, 2: decrypted with the previous key, renew
+   the ticket, 0: unknown key, do a full handshake */
+static int find_ticket_key(const unsigned char *name, int enc,
+                           struct ticket_key *k)
+{
+    int ret = 0;
+    pthread_mutex_lock(&ticket_lock);
+    if (enc || memcmp(name, ticket_keys[0].name, 16) == 0)
+    {
+        *k = ticket_keys[0];
+        ret = 1;
+    }
+    else if (memcmp(name, ticket_keys[1].name, 16) == 0)
+    {
+        *k = ticket_keys[1];
+        ret = 2;
+    }
+    pthread_mutex_unlock(&ticket_lock);
+    return ret;
+}
+
+static int init_ticket_cipher(struct ticket_key *k, unsigned char key_name[16],
+                              unsigned char *iv, EVP_CIPHER_CTX *ctx, int enc)
+{
+    if (enc)
+    {
+        memcpy(key_name, k->name, 16);
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0 ||
+            EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, k->aes_key, iv) != 1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, k->aes_key, iv) != 1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_key_cb(SSL *s, unsigned char key_name[16], unsigned char *iv,
+                         EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+{
+    (void) s;
+    struct ticket_key k;
+    int ret = find_ticket_key(key_name, enc, &k);
+    if (ret > 0)
+    {
+        OSSL_PARAM params[3];
+        params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                      k.hmac_key, sizeof(k.hmac_key));
+        params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                     "sha256", 0);
+        params[2] = OSSL_PARAM_construct_end();
+        if (init_ticket_cipher(&k, key_name, iv, ctx, enc) < 0 ||
+            EVP_MAC_CTX_set_params(hctx, params) != 1)
+        {
+            ret = -1;
+        }
+    }
+    OPENSSL_cleanse(&k, sizeof(k));
+    return ret;
+}
+#else
+static int ticket_key_cb(SSL *s, unsigned char key_name[16], unsigned char *iv,
+                         EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+{
+    (void) s;
+    struct ticket_key k;
+    int ret = find_ticket_key(key_name, enc, &k);
+    if (ret > 0)
+    {
+        if (init_ticket_cipher(&k, key_name, iv, ctx, enc) < 0 ||
+            HMAC_Init_ex(hctx, k.hmac_key, sizeof(k.hmac_key), EVP_sha256(), NULL) != 1)
+        {
+            ret = -1;
+        }
+    }
+    OPENSSL_cleanse(&k, sizeof(k));
+    return ret;
+}
+#endif
+
+/*
+ * Let reconnecting agents resume their sessions instead of doing a full
+ * RSA handshake: stateless tickets with rotating keys, and for clients
+ * without ticket support (or TLS 1.2 session ids) the server side cache,
+ * which is shared by all workers through the single SSL_CTX.
+ */
+static void init_session_resumption(SSL_CTX *ctx)
+{
+    static const unsigned char sid_ctx[] = "medical_sgw";
+
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    /* one ticket is enough, agents reconnect one connection at a time */
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    if (new_ticket_key(&ticket_keys[0]) < 0 ||
+        new_ticket_key(&ticket_keys[1]) < 0)
+    {
+        ERR_print_errors_fp(stderr);
+        abort();
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+
+    user_timer_t t;
+    memset(&t, 0, sizeof(user_timer_t));
+    t.loop_cnt = 0xFFFFFFFF;
+    t.hold_time = TLS_TICKET_KEY_LIFETIME;
+    t.call_back = on_rotate_ticket_key;
+    if (create_one_timer(timer_sets[0], &t) <= 0)
+    {
+        log_error("create tls ticket key timer failed, keys will not rotate");
+    }
+}
+
 SSL_CTX *init_server_ctx(void)
 {
     const SSL_METHOD *method;
@@ -21,6 +210,29 @@ SSL_CTX *init_server_ctx(void)
         ERR_print_errors_fp(stderr);
         abort();
     }
+    /* non-blocking sockets: SSL_write() may write part of the send ring, and
+       is retried later with the same (possibly longer) ring data */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* treat a peer closing without close_notify as a normal close */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    /* hand the record layer to the kernel after the handshake when the cipher
+       and the kernel (tls module) allow it, so that sendfile() and splice()
+       keep working on TLS connections. OpenSSL silently stays in user space
+       otherwise; on_tls_handshake() checks which one we got */
+    if (sgw_options.ktls)
+    {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+#else
+    if (sgw_options.ktls)
+    {
+        log_info("kernel TLS is not supported by this OpenSSL, use user space TLS");
+    }
+#endif
     return ctx;
 }
 
@@ -52,4 +264,5 @@ void init_tls(void)
     SSL_library_init();
     ssl_ctx = init_server_ctx();        /* initialize SSL */
     load_certificates(ssl_ctx, "mycert.pem", "mykey.pem"); /* load certs */
+    init_session_resumption(ssl_ctx);
 }
\ No newline at end of file
@@ -4,6 +4,22 @@
 #ifndef MEDICAL_SGW_TLS_H
 #define MEDICAL_SGW_TLS_H
 
+// 服务端会话缓存最多保存的会话个数，所有工作线程共用
+#ifndef TLS_SESSION_CACHE_SIZE
+#define TLS_SESSION_CACHE_SIZE (20000)
+#endif
+
+// 会话票据密钥的更换间隔，单位是毫秒。上一个密钥在下一个间隔内仍然可以解密
+// 票据，所以票据最长有效两个间隔。
+#ifndef TLS_TICKET_KEY_LIFETIME
+#define TLS_TICKET_KEY_LIFETIME (3600 * 1000)
+#endif
+
+// 会话的有效时间，单位是秒，和票据的最长有效时间一致
+#ifndef TLS_SESSION_TIMEOUT
+#define TLS_SESSION_TIMEOUT (2 * TLS_TICKET_KEY_LIFETIME / 1000)
+#endif
+
 void init_tls(void);
 
 #endif //MEDICAL_SGW_TLS_H
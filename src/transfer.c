@@ -0,0 +1,152 @@
+// transfer.c
+
+#include <assert.h>
+#include "mt_log.h"
+#include "public.h"
+#include "transfer.h"
+#include "filecache.h"
+
+extern int get_thread_id(void);
+
+// 每个线程一个池，只由所属的线程访问，不需要加锁
+struct transfer_pool
+{
+    transfer_t * free_list;
+    int nr_free;
+};
+
+static struct transfer_pool transfer_pools[MAX_WORKERS+1];
+
+static void init_backend_files(transfer_t * x)
+{
+    int i;
+    for (i = 0; i < MAX_BACK_END; i++) {
+        struct backend_file * f = &x->befiles[i];
+        f->fd = -1;
+        f->dfd = -1;
+        f->rfd = -1;
+        f->backend = i;
+        f->failed = 0;
+        f->sndstate = -1;
+        f->filesize = 0;
+        f->fileleft = 0;
+        f->filedone = 0;
+        f->cache_drop = 0;
+        f->md5[0] = '\0';
+        f->abs_file_name[0] = '\0';
+    }
+}
+
+transfer_t * alloc_transfer(void)
+{
+    int tid = get_thread_id();
+    struct transfer_pool * pool = &transfer_pools[tid];
+    transfer_t * x = pool->free_list;
+    if (x) {
+        pool->free_list = x->next;
+        pool->nr_free = pool->nr_free - 1;
+    } else {
+        x = (transfer_t *)malloc(sizeof(transfer_t));
+        if (!x) {
+            log_error("malloc %d bytes for transfer failed",
+                      (int)sizeof(transfer_t));
+            return NULL;
+        }
+#ifdef MD5
+        x->md5ctx = EVP_MD_CTX_new();
+        if (!x->md5ctx) {
+            log_error("EVP_MD_CTX_new failed");
+            free(x);
+            return NULL;
+        }
+#endif
+    }
+    x->next = NULL;
+    x->thread_id = tid;
+    x->io_refs = 0;
+    x->cached = NULL;
+    x->fill = NULL;
+    x->fill_bytes = 0;
+    x->lost = 0;
+    x->deferred = 0;
+    x->created = 0;
+    x->stripe_row = NULL;
+    x->stripe_fill = 0;
+    x->stripe_size = 0;
+    x->stripe_rows = 0;
+    x->resume_committed = 0;
+    x->resume_recorded = 0;
+    x->routed = 0;
+    init_backend_files(x);
+    return x;
+}
+
+void reset_transfer(transfer_t * x)
+{
+    int i;
+    for (i = 0; i < MAX_BACK_END; i++) {
+        if (x->befiles[i].fd >= 3) {
+            close(x->befiles[i].fd);
+        }
+        if (x->befiles[i].dfd >= 3) {
+            close(x->befiles[i].dfd);
+        }
+        if (x->befiles[i].rfd >= 3) {
+            close(x->befiles[i].rfd);
+        }
+    }
+    if (x->cached) {
+        put_cached_file(x->cached);
+        x->cached = NULL;
+    }
+    if (x->fill) {
+        put_cached_file(x->fill);
+        x->fill = NULL;
+    }
+    free(x->stripe_row);
+    x->stripe_row = NULL;
+    x->stripe_fill = 0;
+    x->stripe_size = 0;
+    x->stripe_rows = 0;
+    x->resume_committed = 0;
+    x->resume_recorded = 0;
+    x->routed = 0;
+    x->fill_bytes = 0;
+    x->lost = 0;
+    x->deferred = 0;
+    x->created = 0;
+    init_backend_files(x);
+}
+
+void free_transfer(transfer_t * x)
+{
+    if (!x) {
+        return;
+    }
+    reset_transfer(x);
+
+    int tid = get_thread_id();
+    assert(tid == x->thread_id);
+    struct transfer_pool * pool = &transfer_pools[tid];
+    if (pool->nr_free < MAX_TRANSFER_CACHE) {
+        x->next = pool->free_list;
+        pool->free_list = x;
+        pool->nr_free = pool->nr_free + 1;
+    } else {
+#ifdef MD5
+        EVP_MD_CTX_free(x->md5ctx);
+#endif
+        free(x);
+    }
+}
+
+void md5_hex(EVP_MD_CTX * ctx, char * out)
+{
+    unsigned char c[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    unsigned int i;
+    EVP_DigestFinal_ex(ctx, c, &len);
+    for (i = 0; i < len && i * 2 < MD5_LEN; i++) {
+        sprintf(&out[i * 2], "%02x", (unsigned int)c[i]);
+    }
+}
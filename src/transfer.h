@@ -0,0 +1,73 @@
+// transfer.h
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "config.h"
+#include <openssl/evp.h>
+#include "public.h"
+
+// 每个工作线程最多缓存的空闲传输状态个数，超过的部分直接释放
+#ifndef MAX_TRANSFER_CACHE
+#define MAX_TRANSFER_CACHE (64)
+#endif
+
+struct backend_file
+{
+    int fd; // 文件描述符
+    int dfd; // 大文件用 O_DIRECT 另外打开的文件描述符，不使用时为 -1
+    int rfd; // 上传的续传进度记录，不使用时为 -1
+    int backend; // 文件所在的后端目录，顺序下载时不一定和下标相同
+    uint32_t failed; // 顺序下载时读取失败过的后端目录，按位表示
+    int sndstate; // 发送状态
+    // filesize, fileleft, filedone 主要用于 sendfile() 的文件顺序下载
+    int64_t filesize; // 文件大小
+    int64_t fileleft; // 文件需要传输的大小
+    int64_t filedone; // 文件已经传输的大小
+    int cache_drop; // 顺序下载发送完成后从页缓存中丢弃
+    char md5[MD5_LEN + 1]; // 经过 hash 处理后生成的散列值作为文件名
+    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+};
+
+struct cached_file_;
+
+// 一次文件传输（上传、下载、顺序下载）期间才需要的状态。后端文件的路径名占用了
+// 绝大部分空间，所以不放在 conn_info_t 中，而是在传输开始时从当前工作线程的池中
+// 分配，传输结束或者连接关闭时归还。
+typedef struct transfer_
+{
+    struct transfer_ * next; // 空闲链表
+    int thread_id;           // 分配这个传输状态的线程
+#ifdef MD5
+    EVP_MD_CTX * md5ctx;     // 上传时计算文件的 md5，随传输状态一起缓存复用
+#endif
+    int io_refs;             // 使用这个传输状态、还没有完成的流水线请求个数
+    struct cached_file_ * cached; // 下载的文件在内存缓存中时直接从内存发送，否则为 NULL
+    struct cached_file_ * fill;   // 上传的小文件同时复制一份，上传完成后放入内存缓存
+    int64_t fill_bytes;           // 已经复制到 fill 中的字节数
+    uint32_t lost;                // 上传时创建或者写入失败的后端目录，按位表示
+    uint32_t deferred;            // 异步复制，上传时不写入、由补写线程复制的后端目录
+    uint32_t created;             // 上传时新创建（原来不存在）的后端文件，按位表示
+    uint8_t * stripe_row;         // 条带模式上传时还没有凑满一行的数据
+    uint32_t stripe_fill;         // stripe_row 中的字节数
+    int64_t stripe_size;          // 条带模式上传已经收到的字节数
+    int64_t stripe_rows;          // 条带模式上传已经提交写入的整行数
+    int64_t resume_committed;     // 上传时已经应答的连续数据，续传从这里继续
+    int64_t resume_recorded;      // 上次写入进度记录的 resume_committed
+    int routed;                   // 下载的文件按分布表属于其它节点，本节点没有时再重定向或者转发
+    struct backend_file befiles[MAX_BACK_END];
+} transfer_t;
+
+// 从当前线程的池中分配传输状态，所有的后端文件描述符初始化为 -1
+transfer_t * alloc_transfer(void);
+
+// 关闭仍然打开的后端文件，复位传输状态，用于同一个连接开始下一次传输
+void reset_transfer(transfer_t * x);
+
+// 关闭仍然打开的后端文件，归还到当前线程的池中
+void free_transfer(transfer_t * x);
+
+// 结束 ctx 的 md5 计算，结果按小写十六进制写到 out 中，out 至少 MD5_LEN + 1 字节
+void md5_hex(EVP_MD_CTX * ctx, char * out);
+
+#endif // TRANSFER_H
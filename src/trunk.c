@@ -0,0 +1,630 @@
+// trunk.c
+
+#include <assert.h>
+#include "mt_log.h"
+#include "public.h"
+#include "ring.h"
+#include "conn_mgmt.h"
+#include "options.h"
+#include "stats.h"
+#include "iopool.h"
+#include "trunk.h"
+
+extern int get_thread_id(void);
+extern int send_response_message(events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg, int len);
+
+// 代理端到目标 sgw 的中继连接，fd 为 0 表示空闲
+struct trunk_peer
+{
+    uint32_t ip;   // 网络字节序
+    uint16_t port; // 主机字节序
+    int fd;
+};
+
+// 以下都是每个工作线程一份，只由所属的线程访问
+static struct trunk_peer trunk_peers[MAX_WORKERS+1][MAX_TRUNK_PEERS];
+static struct trunk_session * sessions[MAX_WORKERS+1][TRUNK_HASH_SIZE];
+static uint64_t last_sids[MAX_WORKERS+1];
+
+static uint32_t hash_session(int trunk_fd, uint64_t sid)
+{
+    uint64_t h = (sid ^ ((uint64_t)trunk_fd << 40)) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32) & (TRUNK_HASH_SIZE - 1);
+}
+
+static struct trunk_session * find_session(int trunk_fd, uint64_t sid)
+{
+    struct trunk_session * s = sessions[get_thread_id()][hash_session(trunk_fd, sid)];
+    while (s) {
+        if (s->sid == sid && s->trunk_fd == trunk_fd) {
+            return s;
+        }
+        s = s->next;
+    }
+    return NULL;
+}
+
+static struct trunk_session * create_session(int trunk_fd, uint64_t sid)
+{
+    void * p = NULL;
+    if (posix_memalign(&p, CACHE_LINE_SIZE, sizeof(struct trunk_session)) != 0) {
+        log_error("alloc trunk session failed");
+        return NULL;
+    }
+    struct trunk_session * s = (struct trunk_session *)p;
+    memset(s, 0, sizeof(struct trunk_session));
+    s->sid = sid;
+    s->trunk_fd = trunk_fd;
+    s->client_fd = -1;
+
+    struct trunk_session ** head = &sessions[get_thread_id()][hash_session(trunk_fd, sid)];
+    s->next = *head;
+    *head = s;
+    return s;
+}
+
+// 从哈希表中移除并释放会话，目标端同时结束会话上的传输
+static void free_session(struct trunk_session * s)
+{
+    struct trunk_session ** pp = &sessions[get_thread_id()][hash_session(s->trunk_fd, s->sid)];
+    while (*pp && *pp != s) {
+        pp = &(*pp)->next;
+    }
+    assert(*pp == s);
+    *pp = s->next;
+
+    conns_info[s->trunk_fd].reserved -= s->reserved;
+    if (s->conn.io) {
+        // I/O 线程还在使用会话接收缓冲区中的请求和传输状态，交给请求释放
+        cancel_io_job(&s->conn);
+    }
+    if (s->conn.pipeline) {
+        cancel_pipelined_io_jobs(&s->conn);
+    }
+    if (s->conn.recv) {
+        destroy_ring(s->conn.recv);
+    }
+    if (s->conn.xfer) {
+        free_transfer(s->conn.xfer);
+        s->conn.xfer = NULL;
+    }
+    free(s);
+}
+
+// 代理端：解除客户端和会话的关联，之后关闭客户端不会影响中继连接
+static void end_client_session(struct trunk_session * s, conn_info_t * c)
+{
+    c->sess = NULL;
+    c->use_proxy = 0;
+    c->next_sock_fd = -1;
+    free_session(s);
+}
+
+static void send_trunk_message(events_poll_t * e, conn_info_t * trunk,
+                               uint32_t command, uint64_t sid)
+{
+    msg_t m;
+    memset(&m, 0, sizeof(msg_t));
+    m.length = sizeof(msg_t);
+    m.src_type = NODE_TYPE_SGW;
+    m.src_id = local_id;
+    m.dst_type = trunk->peer_type;
+    m.dst_id = trunk->peer_id;
+    m.trans_id = sid;
+    m.command = command;
+    encode_msg(&m);
+    if (send_message(e, trunk, (uint8_t *)&m, sizeof(msg_t)) != sizeof(msg_t)) {
+        log_error("send %s for session %lu to %s:%u failed",
+                  command_string(command), sid, trunk->peer_ip, trunk->peer_port);
+    }
+}
+
+static int find_trunk(uint32_t ip, uint16_t port)
+{
+    struct trunk_peer * peers = trunk_peers[get_thread_id()];
+    int i;
+    for (i = 0; i < MAX_TRUNK_PEERS; i++) {
+        if (peers[i].fd > 0 && peers[i].ip == ip && peers[i].port == port) {
+            return peers[i].fd;
+        }
+    }
+    return -1;
+}
+
+static int open_trunk(events_poll_t * e, uint32_t ip, uint16_t port, uint32_t sgw_id)
+{
+    struct trunk_peer * peers = trunk_peers[get_thread_id()];
+    struct trunk_peer * slot = NULL;
+    int i;
+    for (i = 0; i < MAX_TRUNK_PEERS; i++) {
+        if (peers[i].fd <= 0) {
+            slot = &peers[i];
+            break;
+        }
+    }
+    if (!slot) {
+        log_warning("too many trunk peers: %d", MAX_TRUNK_PEERS);
+        return -1;
+    }
+
+    char ip_str[MAX_IP_LEN+1];
+    if (!inet_ntop(AF_INET, &ip, ip_str, sizeof(ip_str))) {
+        log_error("inet_ntop failed: convert 32 bit ip 0x%x failed", ip);
+        return -1;
+    }
+    int fd = open_tcp_conn(e, ip_str, port, NULL, 0, 1);
+    if (fd < 3 || fd >= MAX_CONNS_CNT) {
+        log_error("open trunk to sgw:{%s:%u} failed", ip_str, port);
+        return -1;
+    }
+
+    conn_info_t * t = &conns_info[fd];
+    t->flags |= CONN_FLAG_TRUNK | CONN_FLAG_NEXT_HOP;
+    t->peer_type = NODE_TYPE_SGW;
+    t->peer_id = sgw_id;
+
+    // 连接建立以后首先发送打开请求，之后的会话消息排在它后面
+    send_trunk_message(e, t, CMD_TRUNK_OPEN_REQ, 0);
+
+    slot->ip = ip;
+    slot->port = port;
+    slot->fd = fd;
+    log_info("open trunk sock_fd:%d to sgw:{%s:%u}", fd, ip_str, port);
+    return fd;
+}
+
+int open_trunk_session(events_poll_t * e, conn_info_t * c, msg_t * msg)
+{
+    if (c->sess) {
+        // 暂停接收以后重新处理同一个开始请求，会话已经建立
+        return c->next_sock_fd;
+    }
+
+    task_info_t * task_info = (task_info_t *)(msg->data);
+    int fd = find_trunk(task_info->sgw_ip, task_info->sgw_port);
+    if (fd < 0) {
+        fd = open_trunk(e, task_info->sgw_ip, task_info->sgw_port, task_info->sgw_id);
+        if (fd < 0) {
+            return -1;
+        }
+    }
+
+    int tid = get_thread_id();
+    last_sids[tid] = last_sids[tid] + 1;
+    struct trunk_session * s = create_session(fd, last_sids[tid]);
+    if (!s) {
+        return -1;
+    }
+    s->client_fd = c->sock_fd;
+    s->trans_id = msg->trans_id;
+
+    c->sess = s;
+    c->use_proxy = 1;
+    c->next_sock_fd = fd;
+    my_stats()->trunk_sessions += 1;
+    return fd;
+}
+
+int is_trunk_session_ready(conn_info_t * c)
+{
+    struct trunk_session * s = c->sess;
+    // 在途请求的应答到达时，一定能放进客户端的发送缓冲区
+    uint64_t room = (uint64_t)(s->inflight + 1) * MAX_MESSAGE_LEN;
+    return s->inflight < sgw_options.trunk_window &&
+           get_ring_free_size(c->send) >= room;
+}
+
+int trunk_check_forward(conn_info_t * c, msg_t * msg)
+{
+    struct trunk_session * s = c->sess;
+    conn_info_t * trunk = &conns_info[s->trunk_fd];
+
+    if (get_ring_free_size(trunk->send) < msg->length) {
+        // 中继连接的发送缓冲区有空间时再恢复
+        trunk->flags |= CONN_FLAG_WAITERS;
+        return MSG_PAUSED;
+    }
+    if (!is_trunk_session_ready(c)) {
+        // 收到这个会话的应答时再恢复
+        return MSG_PAUSED;
+    }
+
+    msg->trans_id = s->sid;
+    s->inflight = s->inflight + 1;
+    return 0;
+}
+
+int accept_trunk(events_poll_t * e, conn_info_t * c, msg_t * msg)
+{
+    c->flags |= CONN_FLAG_TRUNK;
+    log_info("accept trunk sock_fd:%d from %s:%u", c->sock_fd, c->peer_ip, c->peer_port);
+    msg->ack_code = 200;
+    return send_response_message(e, c, msg, sizeof(msg_t));
+}
+
+static int is_session_start(uint32_t command)
+{
+    return command == CMD_START_UPLOAD_REQ ||
+           command == CMD_START_DOWNLOAD_REQ ||
+           command == CMD_DELETE_REQ;
+}
+
+static int is_session_end(uint32_t command)
+{
+    return command == CMD_UPLOAD_FINISH_REQ || command == CMD_UPLOAD_FINISH_RSP ||
+           command == CMD_DOWNLOAD_FINISH_REQ || command == CMD_DOWNLOAD_FINISH_RSP ||
+           command == CMD_DELETE_REQ || command == CMD_DELETE_RSP;
+}
+
+// 代理端：把中继连接上收到的应答转发给会话的客户端
+static int deal_trunk_response(events_poll_t * e, conn_info_t * trunk, msg_t * msg)
+{
+    if (msg->command == CMD_TRUNK_OPEN_RSP) {
+        log_info("trunk sock_fd:%d to %s:%u opened", trunk->sock_fd,
+                 trunk->peer_ip, trunk->peer_port);
+        return 0;
+    }
+
+    struct trunk_session * s = find_session(trunk->sock_fd, msg->trans_id);
+    if (!s) {
+        // 客户端已经关闭，丢弃应答
+        return 0;
+    }
+    conn_info_t * c = &conns_info[s->client_fd];
+
+    if (msg->command == CMD_TRUNK_RESET_REQ) {
+        log_warning("session %lu of sock_fd:%d reset by %s:%u", s->sid,
+                    c->sock_fd, trunk->peer_ip, trunk->peer_port);
+        my_stats()->trunk_resets += 1;
+        end_client_session(s, c);
+        close_tcp_conn(e, c->sock_fd);
+        return 0;
+    }
+
+    if (s->inflight > 0) {
+        s->inflight = s->inflight - 1;
+    }
+
+    uint32_t command = msg->command;
+    int len = msg->length;
+    msg->trans_id = s->trans_id;
+    msg->src_type = NODE_TYPE_SGW;
+    msg->src_id = local_id;
+    msg->dst_type = c->peer_type;
+    msg->dst_id = c->peer_id;
+    encode_msg(msg);
+    if (send_message(e, c, (uint8_t *)msg, len) != len) {
+        log_error("forward %s to %s:%u failed", command_string(command),
+                  c->peer_ip, c->peer_port);
+        close_tcp_conn(e, c->sock_fd); // 同时通知目标端放弃会话
+        return 0;
+    }
+
+    if (is_session_end(command)) {
+        end_client_session(s, c);
+    }
+    if ((c->flags & CONN_FLAG_PAUSED) && (!c->sess || is_trunk_session_ready(c))) {
+        resume_recv(e, c);
+    }
+    return 0;
+}
+
+static int init_session_conn(conn_info_t * v, conn_info_t * trunk, uint64_t sid)
+{
+    clear_conn_info(v);
+    // 对端最多有 trunk_window 个在途的请求，都要能放进会话的接收缓冲区。malloc
+    // 的内存在写入之前不占用物理页，小的会话只用到开头一小部分
+    v->recv = create_ring((uint32_t)sgw_options.trunk_window * MAX_MESSAGE_LEN);
+    if (!v->recv) {
+        log_error("alloc receive buffer for session %lu failed", sid);
+        return -1;
+    }
+    v->sock_fd = trunk->sock_fd;
+    v->flags = CONN_FLAG_SESSION;
+    v->status = CONN_STATUS_CONNECTED;
+    v->thread_id = trunk->thread_id;
+    v->peer_type = trunk->peer_type;
+    v->send = trunk->send;
+#ifdef TLS
+    v->ssl = trunk->ssl;
+#endif
+    strcpy(v->peer_ip, trunk->peer_ip);
+    v->peer_port = trunk->peer_port;
+    v->trans_id = sid;
+    return 0;
+}
+
+// 目标端：会话在 I/O 线程中的请求完成后还要发送的应答。一般的请求最多是一个最大
+// 的消息，流水线中的上传数据请求各一个消息头，预读不发送应答
+static uint32_t pending_replies(conn_info_t * c)
+{
+    uint32_t len = c->io ? MAX_MESSAGE_LEN : 0;
+    io_job_t * job;
+    for (job = c->pipeline; job; job = job->pipe_next) {
+        if (job->done) {
+            len = len + sizeof(msg_t);
+        }
+    }
+    return len;
+}
+
+static void update_reserved(struct trunk_session * s)
+{
+    conn_info_t * trunk = &conns_info[s->trunk_fd];
+    uint32_t len = pending_replies(&s->conn);
+    trunk->reserved = trunk->reserved - s->reserved + len;
+    s->reserved = len;
+}
+
+// 除了各个会话已经预留的，中继连接的发送缓冲区还能放下一个最大的应答时，会话才
+// 处理下一个请求。这样大的下载不会占满发送缓冲区，让其它会话的请求也排在它后面
+static int has_reply_room(conn_info_t * trunk)
+{
+    return get_ring_free_size(trunk->send) >= trunk->reserved + MAX_MESSAGE_LEN;
+}
+
+static void reset_session(events_poll_t * e, struct trunk_session * s)
+{
+    conn_info_t * trunk = &conns_info[s->trunk_fd];
+    my_stats()->trunk_resets += 1;
+    send_trunk_message(e, trunk, CMD_TRUNK_RESET_REQ, s->sid);
+    free_session(s);
+}
+
+// 目标端：按顺序处理会话接收缓冲区中的请求，直到没有完整的请求、请求需要等待或者
+// 会话结束。会话可能被释放，之后不能再访问 s
+static void run_session(events_poll_t * e, struct trunk_session * s)
+{
+    conn_info_t * c = &s->conn;
+    conn_info_t * trunk = &conns_info[s->trunk_fd];
+    ring_t * ring = c->recv;
+    while (!(c->flags & (CONN_FLAG_PAUSED | CONN_FLAG_IO_WAIT)) && ring->write >= sizeof(msg_t)) {
+        // 复制进来的请求已经转换为主机字节序
+        msg_t * msg = (msg_t *)ring->data;
+        uint32_t msglen = msg->length;
+        if (!has_reply_room(trunk)) {
+            // 中继连接的发送缓冲区有空间时再处理，其它会话不受影响
+            c->flags |= CONN_FLAG_PAUSED;
+            s->waiting = 1;
+            trunk->flags |= CONN_FLAG_WAITERS;
+            my_stats()->trunk_waits += 1;
+            return;
+        }
+        s->command = msg->command;
+        int ret = deal_session_message(e, c, msg);
+        if (ret == MSG_IO_PENDING) {
+            // 请求留在接收缓冲区中，完成后由 consume_session_message() 删除
+            update_reserved(s);
+            return;
+        } else if (ret == MSG_PAUSED) {
+            // 等会话自己的流水线请求完成
+            c->flags |= CONN_FLAG_PAUSED;
+        } else if (ret < 0) {
+            log_warning("session %lu on trunk sock_fd:%d: %s failed, reset",
+                        s->sid, s->trunk_fd, command_string(s->command));
+            reset_session(e, s);
+            return;
+        } else {
+            memmove(ring->data, &ring->data[msglen], ring->write - msglen);
+            ring->write = ring->write - msglen;
+            ring->len = ring->write;
+            if (is_session_end(s->command)) {
+                free_session(s);
+                return;
+            }
+        }
+        update_reserved(s);
+    }
+}
+
+static struct trunk_session * session_of(conn_info_t * c)
+{
+    return (struct trunk_session *)((char *)c - offsetof(struct trunk_session, conn));
+}
+
+// 目标端：依次恢复等待中继连接发送缓冲区的会话，发送缓冲区又不够时留给下一次
+static void wake_waiting_sessions(events_poll_t * e, conn_info_t * trunk)
+{
+    int fd = trunk->sock_fd;
+    int i;
+    trunk->flags &= ~CONN_FLAG_WAITERS;
+    for (i = 0; i < TRUNK_HASH_SIZE; i++) {
+        struct trunk_session * s = sessions[get_thread_id()][i];
+        while (s) {
+            struct trunk_session * next = s->next;
+            if (s->trunk_fd == fd && s->waiting) {
+                if (!has_reply_room(trunk)) {
+                    trunk->flags |= CONN_FLAG_WAITERS;
+                    return;
+                }
+                s->waiting = 0;
+                s->conn.flags &= ~CONN_FLAG_PAUSED;
+                run_session(e, s);
+            }
+            s = next;
+        }
+    }
+}
+
+// 会话的请求完成，释放了预留的发送缓冲区，其它等待的会话也可能可以继续
+static void continue_sessions(events_poll_t * e, struct trunk_session * s)
+{
+    conn_info_t * trunk = &conns_info[s->trunk_fd];
+    update_reserved(s);
+    if (!s->waiting) {
+        run_session(e, s);
+    }
+    if ((trunk->flags & CONN_FLAG_WAITERS) && has_reply_room(trunk)) {
+        wake_waiting_sessions(e, trunk);
+    }
+}
+
+int consume_session_message(events_poll_t * e, conn_info_t * c, msg_t * msg, uint32_t msglen)
+{
+    struct trunk_session * s = session_of(c);
+    ring_t * ring = c->recv;
+    assert((uint8_t *)msg == ring->data);
+    memmove(ring->data, &ring->data[msglen], ring->write - msglen);
+    ring->write = ring->write - msglen;
+    ring->len = ring->write;
+    if (is_session_end(s->command)) {
+        conn_info_t * trunk = &conns_info[s->trunk_fd];
+        free_session(s);
+        if ((trunk->flags & CONN_FLAG_WAITERS) && has_reply_room(trunk)) {
+            wake_waiting_sessions(e, trunk);
+        }
+        return 0;
+    }
+    continue_sessions(e, s);
+    return 0;
+}
+
+void resume_session(events_poll_t * e, conn_info_t * c)
+{
+    struct trunk_session * s = session_of(c);
+    if (!s->waiting) {
+        c->flags &= ~CONN_FLAG_PAUSED;
+    }
+    continue_sessions(e, s);
+}
+
+void reset_trunk_session(events_poll_t * e, conn_info_t * c)
+{
+    struct trunk_session * s = session_of(c);
+    log_warning("session %lu on trunk sock_fd:%d: %s failed, reset",
+                s->sid, s->trunk_fd, command_string(s->command));
+    reset_session(e, s);
+}
+
+// 目标端：处理会话上的请求，应答写到中继连接的发送缓冲区中
+static int deal_trunk_request(events_poll_t * e, conn_info_t * trunk, msg_t * msg)
+{
+    uint32_t command = msg->command;
+    uint64_t sid = msg->trans_id;
+    struct trunk_session * s = find_session(trunk->sock_fd, sid);
+
+    if (command == CMD_TRUNK_RESET_REQ) {
+        if (s) {
+            free_session(s);
+        }
+        return 0;
+    }
+
+    if (!s) {
+        if (!is_session_start(command)) {
+            log_warning("%s for unknown session %lu on trunk sock_fd:%d",
+                        command_string(command), sid, trunk->sock_fd);
+            send_trunk_message(e, trunk, CMD_TRUNK_RESET_REQ, sid);
+            return 0;
+        }
+        s = create_session(trunk->sock_fd, sid);
+        if (!s) {
+            send_trunk_message(e, trunk, CMD_TRUNK_RESET_REQ, sid);
+            return 0;
+        }
+        if (init_session_conn(&s->conn, trunk, sid) < 0) {
+            reset_session(e, s);
+            return 0;
+        }
+        my_stats()->trunk_sessions += 1;
+    }
+
+    // 复制到会话自己的接收缓冲区，中继连接上的这个消息处理完毕
+    ring_t * ring = s->conn.recv;
+    if (ring->size - ring->write < msg->length) {
+        log_warning("session %lu on trunk sock_fd:%d: too many requests in flight, reset",
+                    sid, trunk->sock_fd);
+        reset_session(e, s);
+        return 0;
+    }
+    memcpy(&ring->data[ring->write], msg, msg->length);
+    ring->write = ring->write + msg->length;
+    ring->len = ring->write;
+    run_session(e, s);
+    return 0;
+}
+
+int deal_trunk_message(events_poll_t * e, conn_info_t * trunk, msg_t * msg)
+{
+    if (trunk->flags & CONN_FLAG_NEXT_HOP) {
+        return deal_trunk_response(e, trunk, msg);
+    } else {
+        return deal_trunk_request(e, trunk, msg);
+    }
+}
+
+void on_trunk_send_drained(events_poll_t * e, conn_info_t * trunk)
+{
+    if (!(trunk->flags & CONN_FLAG_NEXT_HOP)) {
+        if ((trunk->flags & CONN_FLAG_WAITERS) && has_reply_room(trunk)) {
+            wake_waiting_sessions(e, trunk);
+        }
+        return;
+    }
+
+    if (get_ring_data_size(trunk->send) >= SEND_LOW_WATER) {
+        return;
+    }
+
+    if (trunk->flags & CONN_FLAG_WAITERS) {
+        // 代理端等待中继连接发送缓冲区的客户端，这种情况很少，直接遍历
+        trunk->flags &= ~CONN_FLAG_WAITERS;
+        int fd = trunk->sock_fd;
+        int i;
+        for (i = 0; i < TRUNK_HASH_SIZE; i++) {
+            struct trunk_session * s = sessions[get_thread_id()][i];
+            while (s) {
+                // 恢复接收时可能结束会话，先取得下一个
+                struct trunk_session * next = s->next;
+                if (s->trunk_fd == fd) {
+                    conn_info_t * c = &conns_info[s->client_fd];
+                    if ((c->flags & CONN_FLAG_PAUSED) && is_trunk_session_ready(c)) {
+                        resume_recv(e, c);
+                    }
+                }
+                s = next;
+            }
+        }
+    }
+}
+
+void detach_trunk_session(events_poll_t * e, conn_info_t * c)
+{
+    struct trunk_session * s = c->sess;
+    conn_info_t * trunk = &conns_info[s->trunk_fd];
+    if (trunk->sock_fd == s->trunk_fd) {
+        send_trunk_message(e, trunk, CMD_TRUNK_RESET_REQ, s->sid);
+    }
+    end_client_session(s, c);
+}
+
+void close_trunk_sessions(events_poll_t * e, conn_info_t * trunk)
+{
+    int tid = get_thread_id();
+    int fd = trunk->sock_fd;
+    int i;
+
+    for (i = 0; i < TRUNK_HASH_SIZE; i++) {
+        struct trunk_session * s = sessions[tid][i];
+        while (s) {
+            struct trunk_session * next = s->next;
+            if (s->trunk_fd == fd) {
+                if (trunk->flags & CONN_FLAG_NEXT_HOP) {
+                    int client_fd = s->client_fd;
+                    end_client_session(s, &conns_info[client_fd]);
+                    close_tcp_conn(e, client_fd);
+                } else {
+                    free_session(s);
+                }
+            }
+            s = next;
+        }
+    }
+
+    struct trunk_peer * peers = trunk_peers[tid];
+    for (i = 0; i < MAX_TRUNK_PEERS; i++) {
+        if (peers[i].fd == fd) {
+            peers[i].fd = 0;
+        }
+    }
+}
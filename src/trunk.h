@@ -0,0 +1,81 @@
+// trunk.h
+
+#ifndef TRUNK_H
+#define TRUNK_H
+
+#include <stdint.h>
+#include "events_poll.h"
+#include "public.h"
+#include "conn_mgmt.h"
+
+// 每个工作线程最多同时使用中继连接的目标 sgw 个数
+#ifndef MAX_TRUNK_PEERS
+#define MAX_TRUNK_PEERS (16)
+#endif
+
+// 每个工作线程的会话哈希表的大小，必须是 2 的幂
+#ifndef TRUNK_HASH_SIZE
+#define TRUNK_HASH_SIZE (1024)
+#endif
+
+// 中继连接上的一个会话。代理端对应一个客户端连接；目标端用一个虚拟的连接对象处
+// 理这个会话的请求，它的 sock_fd 和发送缓冲区都是中继连接的，请求先复制到它自己
+// 的接收缓冲区中再按顺序处理，一个会话等待时中继连接继续接收其它会话的请求。
+struct trunk_session
+{
+    conn_info_t conn;            // 目标端：会话的虚拟连接
+    struct trunk_session * next; // 哈希链表
+    uint64_t sid;                // 会话号，即中继连接上消息的 trans_id
+    int trunk_fd;
+    // 以下只用于代理端
+    int client_fd;
+    uint64_t trans_id;           // 客户端原来的 trans_id
+    int inflight;                // 已经发出、尚未收到应答的请求个数
+    // 以下只用于目标端
+    uint32_t command;            // 正在处理的请求
+    uint32_t reserved;           // 为会话还没有发送的应答预留的中继连接发送缓冲区
+    int waiting;                 // 等待中继连接的发送缓冲区
+};
+
+// 代理端：为客户端连接上的开始请求建立会话，需要时建立到目标 sgw 的中继连接。
+// 成功返回中继连接，失败返回 -1。
+int open_trunk_session(events_poll_t * e, conn_info_t * c, msg_t * msg);
+
+// 代理端：转发客户端的请求之前调用。会话的在途请求已满，或者客户端的发送缓冲区
+// 放不下这些请求的应答时返回 MSG_PAUSED；否则把 trans_id 换成会话号，返回 0。
+int trunk_check_forward(conn_info_t * c, msg_t * msg);
+
+// 代理端：暂停接收的客户端是否可以恢复接收
+int is_trunk_session_ready(conn_info_t * c);
+
+// 目标端：对端请求把连接作为中继连接
+int accept_trunk(events_poll_t * e, conn_info_t * c, msg_t * msg);
+
+// 处理中继连接上收到的消息。单个会话出错只放弃这个会话，不影响中继连接。
+int deal_trunk_message(events_poll_t * e, conn_info_t * trunk, msg_t * msg);
+
+// 中继连接的发送缓冲区有数据发出以后调用，恢复因为它已满而暂停接收的连接，以及
+// 目标端等待发送缓冲区的会话
+void on_trunk_send_drained(events_poll_t * e, conn_info_t * trunk);
+
+// 代理端：客户端连接关闭，通知目标端放弃会话。由 close_tcp_conn() 调用。
+void detach_trunk_session(events_poll_t * e, conn_info_t * c);
+
+// 中继连接关闭，结束上面的所有会话。由 close_tcp_conn() 调用。
+void close_trunk_sessions(events_poll_t * e, conn_info_t * trunk);
+
+// 目标端：会话交给 I/O 线程的请求完成后调用，从会话的接收缓冲区中删除请求，继续
+// 处理后面的请求。由 consume_io_message() 调用
+int consume_session_message(events_poll_t * e, conn_info_t * c, msg_t * msg, uint32_t msglen);
+
+// 目标端：会话的流水线请求完成后调用，释放预留的发送缓冲区，恢复因为等待流水线
+// 而暂停的会话。由 resume_recv() 调用
+void resume_session(events_poll_t * e, conn_info_t * c);
+
+// 目标端：完成的请求处理失败，放弃这个会话
+void reset_trunk_session(events_poll_t * e, conn_info_t * c);
+
+// 目标端：处理会话上的请求，在 handler.c 中实现
+extern int deal_session_message(events_poll_t * e, conn_info_t * s, msg_t * msg);
+
+#endif // TRUNK_H
@@ -0,0 +1,348 @@
+// uring.c
+
+#include "mt_log.h"
+#include "public.h"
+#include "conn_mgmt.h"
+#include "stats.h"
+#include "options.h"
+#include "uring.h"
+
+extern int get_thread_id(void);
+
+#ifdef IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// 只由所属的工作线程访问，内核通过共享内存读取提交队列、写入完成队列
+struct io_uring_ctx
+{
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned cq_entries;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    unsigned to_submit; // 已经放入提交队列，还没有交给内核的操作个数
+    unsigned inflight;  // 已经放入提交队列，还没有完成的操作个数
+};
+
+static struct io_uring_ctx * io_urings[MAX_WORKERS+1];
+
+static uint64_t get_curr_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 检查内核是否支持请求中会用到的所有操作
+static int probe_io_uring_ops(int ring_fd)
+{
+    static const int needed[] = {
+        IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC,
+        IORING_OP_OPENAT, IORING_OP_UNLINKAT, IORING_OP_STATX,
+        IORING_OP_SYNC_FILE_RANGE,
+    };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe * probe = (struct io_uring_probe *)calloc(1, size);
+    if (!probe) {
+        return -1;
+    }
+    int ret = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256);
+    if (ret < 0) {
+        log_error("probe io_uring ops failed: %s", strerror(errno));
+        free(probe);
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        int op = needed[i];
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            log_error("io_uring op %d not supported by kernel", op);
+            free(probe);
+            return -1;
+        }
+    }
+    free(probe);
+    return 0;
+}
+
+static int setup_io_uring(struct io_uring_ctx * r)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->ring_fd < 0) {
+        log_error("io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+    if (probe_io_uring_ops(r->ring_fd) < 0) {
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char * sq = (char *)mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        log_error("mmap io_uring sq ring failed: %s", strerror(errno));
+        return -1;
+    }
+    char * cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = (char *)mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            log_error("mmap io_uring cq ring failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        log_error("mmap io_uring sqes failed: %s", strerror(errno));
+        return -1;
+    }
+
+    r->sq_entries = p.sq_entries;
+    r->cq_entries = p.cq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+int init_io_uring(events_poll_t * e, int thread_id)
+{
+    struct io_uring_ctx * r = (struct io_uring_ctx *)calloc(1, sizeof(struct io_uring_ctx));
+    if (!r) {
+        log_error("malloc io_uring for worker:%d failed", thread_id);
+        return -1;
+    }
+    // 映射的内存随 ring_fd 一直保留到进程退出，失败时只关闭 ring_fd
+    if (setup_io_uring(r) < 0) {
+        if (r->ring_fd >= 0) {
+            close(r->ring_fd);
+        }
+        free(r);
+        return -1;
+    }
+    if (r->ring_fd >= MAX_CONNS_CNT) {
+        log_error("worker:%d io_uring fd %d reach limits %d",
+                  thread_id, r->ring_fd, MAX_CONNS_CNT);
+        close(r->ring_fd);
+        free(r);
+        return -1;
+    }
+
+    // 完成队列不为空时 ring_fd 可读，用来唤醒 epoll_wait
+    conns_info[r->ring_fd].peer_type = NODE_TYPE_URING;
+    conns_info[r->ring_fd].sock_fd = r->ring_fd;
+    conns_info[r->ring_fd].thread_id = thread_id;
+    if (add_to_events_poll(e, r->ring_fd, EPOLLIN) != 1) {
+        log_error("worker:%d add io_uring fd %d to events poll failed",
+                  thread_id, r->ring_fd);
+        close(r->ring_fd);
+        free(r);
+        return -1;
+    }
+    io_urings[thread_id] = r;
+    log_info("worker:%d io_uring ready, %u sq entries, %u cq entries",
+             thread_id, r->sq_entries, r->cq_entries);
+    return 0;
+}
+
+static void prep_sqe(struct io_uring_sqe * sqe, io_op_t * op)
+{
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    if (op->link) {
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    switch (op->opcode) {
+    case IO_OP_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = op->fd;
+        sqe->addr = (uint64_t)(uintptr_t)op->buf;
+        sqe->len = op->len;
+        sqe->off = op->offset;
+        break;
+    case IO_OP_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = op->fd;
+        sqe->addr = (uint64_t)(uintptr_t)op->buf;
+        sqe->len = op->len;
+        sqe->off = op->offset;
+        break;
+    case IO_OP_FSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = op->fd;
+        sqe->fsync_flags = (op->flags & IO_OP_DATASYNC) ? IORING_FSYNC_DATASYNC : 0;
+        break;
+    case IO_OP_OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)op->path;
+        sqe->len = 0644;
+        sqe->open_flags = op->flags;
+        break;
+    case IO_OP_UNLINK:
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)op->path;
+        break;
+    case IO_OP_STATX:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)op->path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t)(uintptr_t)&op->stx;
+        break;
+    case IO_OP_SYNC_RANGE:
+        sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+        sqe->fd = op->fd;
+        sqe->off = op->offset;
+        sqe->len = op->len;
+        sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+        break;
+    default:
+        sqe->opcode = IORING_OP_NOP;
+        break;
+    }
+}
+
+static void flush_io_uring(struct io_uring_ctx * r)
+{
+    while (r->to_submit > 0) {
+        int ret = syscall(__NR_io_uring_enter, r->ring_fd, r->to_submit, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN、EBUSY 时内核暂时不能接收，留到下一轮事件循环
+            if (errno != EAGAIN && errno != EBUSY) {
+                log_error("io_uring_enter %u sqes failed: %s",
+                          r->to_submit, strerror(errno));
+            }
+            return;
+        }
+        my_stats()->uring_submits += 1;
+        r->to_submit = r->to_submit - ret;
+        if (ret == 0) {
+            return;
+        }
+    }
+}
+
+int submit_io_uring_job(io_job_t * job)
+{
+    struct io_uring_ctx * r = io_urings[job->thread_id];
+    if (!r || r->inflight + job->nr_ops > r->cq_entries) {
+        return -1;
+    }
+
+    // 同一个请求的操作（例如写入各个后端文件）放在一起提交
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail;
+    if (r->sq_entries - (tail - head) < (unsigned)job->nr_ops) {
+        flush_io_uring(r);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_entries - (tail - head) < (unsigned)job->nr_ops) {
+            return -1;
+        }
+    }
+    int i;
+    for (i = 0; i < job->nr_ops; i++) {
+        unsigned index = tail & *r->sq_mask;
+        prep_sqe(&r->sqes[index], &job->ops[i]);
+        r->sq_array[index] = index;
+        tail = tail + 1;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    job->nr_pending = job->nr_ops;
+    r->to_submit = r->to_submit + job->nr_ops;
+    r->inflight = r->inflight + job->nr_ops;
+    my_stats()->uring_ops += job->nr_ops;
+    return 0;
+}
+
+static void account_io_uring_job(io_job_t * job)
+{
+    sgw_stats_t * s = my_stats();
+    s->uring_jobs += 1;
+    s->uring_busy_us += job->end_us - job->submit_us;
+}
+
+void poll_io_uring(events_poll_t * e)
+{
+    int tid = get_thread_id();
+    if (tid > MAX_WORKERS) {
+        return;
+    }
+    struct io_uring_ctx * r = io_urings[tid];
+    if (!r) {
+        return;
+    }
+
+    flush_io_uring(r);
+
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe * cqe = &r->cqes[head & *r->cq_mask];
+        io_op_t * op = (io_op_t *)(uintptr_t)cqe->user_data;
+        op->res = cqe->res;
+        head = head + 1;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        r->inflight = r->inflight - 1;
+
+        io_job_t * job = op->job;
+        job->nr_pending = job->nr_pending - 1;
+        if (job->nr_pending == 0) {
+            job->start_us = job->submit_us;
+            job->end_us = get_curr_us();
+            account_io_uring_job(job);
+            // done 可能提交新的请求，在下一轮事件循环中提交
+            finish_io_job(e, job);
+        }
+    }
+
+    // 提交 done 中新产生的请求，不用等到下一轮事件循环
+    flush_io_uring(r);
+}
+
+#else // IO_URING
+
+int init_io_uring(events_poll_t * e, int thread_id)
+{
+    log_error("worker:%d io_uring is not supported by this build", thread_id);
+    return -1;
+}
+
+int submit_io_uring_job(io_job_t * job)
+{
+    return -1;
+}
+
+void poll_io_uring(events_poll_t * e)
+{
+}
+
+#endif // IO_URING
@@ -0,0 +1,26 @@
+// uring.h
+
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+#include "events_poll.h"
+#include "iopool.h"
+
+// 每个工作线程的 io_uring 提交队列长度，完成队列是它的两倍
+#ifndef URING_ENTRIES
+#define URING_ENTRIES (256)
+#endif
+
+// 创建工作线程的 io_uring，加入线程的事件循环。编译时没有 io_uring 或者内核不支
+// 持需要的操作时返回 -1，文件操作仍然由 I/O 线程或者工作线程执行
+int init_io_uring(events_poll_t * e, int thread_id);
+
+// 把请求的文件操作放入本线程的提交队列，在本轮事件循环结束时和其它请求一起提交。
+// 返回 -1 表示本线程没有 io_uring，或者在途的操作已经占满完成队列
+int submit_io_uring_job(io_job_t * job);
+
+// 提交等待的文件操作，处理已经完成的请求。每轮事件循环结束时调用
+void poll_io_uring(events_poll_t * e);
+
+#endif // URING_H